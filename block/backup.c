@@ -25,6 +25,7 @@
 #include "qemu/bitmap.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_MAX_BATCH_BYTES (1 << 20)
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct CowRequest {
@@ -48,6 +49,8 @@ typedef struct BackupBlockJob {
     unsigned long *done_bitmap;
     int64_t cluster_size;
     bool compress;
+    /* cleared once the nodes turn out not to support copy offloading */
+    bool use_copy_range;
     NotifierWithReturn before_write;
     QLIST_HEAD(, CowRequest) inflight_reqs;
 } BackupBlockJob;
@@ -58,6 +61,16 @@ static inline int64_t cluster_size_sectors(BackupBlockJob *job)
   return job->cluster_size / BDRV_SECTOR_SIZE;
 }
 
+/* Maximum number of adjacent clusters copied with a single request */
+static inline int64_t backup_batch_clusters(BackupBlockJob *job)
+{
+    if (job->compress) {
+        /* Compressed writes must cover exactly one cluster */
+        return 1;
+    }
+    return MAX(BACKUP_MAX_BATCH_BYTES / job->cluster_size, 1);
+}
+
 /* See if in-flight requests overlap and wait for them to complete */
 static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
                                                        int64_t start,
@@ -95,6 +108,120 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+/* Shrink the extent of *nb_clusters clusters at @start so that it is either
+ * known to read as zeroes (returns true) or may contain data (returns false).
+ * The source's block status is enough to tell, so zero clusters can be
+ * written to the target without reading them first. */
+static bool coroutine_fn backup_cow_is_zero(BackupBlockJob *job,
+                                            int64_t start,
+                                            int64_t *nb_clusters)
+{
+    BlockDriverState *bs = blk_bs(job->common.blk);
+    BlockDriverState *file;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int64_t sector_num = start * sectors_per_cluster;
+    int64_t total_sectors = job->common.len >> BDRV_SECTOR_BITS;
+    int64_t status;
+    int n;
+
+    status = bdrv_get_block_status_above(bs, NULL, sector_num,
+                                         MIN(*nb_clusters * sectors_per_cluster,
+                                             total_sectors - sector_num),
+                                         &n, &file);
+    if (status < 0 || n == 0) {
+        /* Let the actual copy report any error */
+        return false;
+    }
+
+    if (!(status & BDRV_BLOCK_ZERO)) {
+        *nb_clusters = DIV_ROUND_UP(n, sectors_per_cluster);
+        return false;
+    }
+
+    if (sector_num + n == total_sectors) {
+        *nb_clusters = DIV_ROUND_UP(n, sectors_per_cluster);
+        return true;
+    } else if (n >= sectors_per_cluster) {
+        *nb_clusters = n / sectors_per_cluster;
+        return true;
+    }
+
+    /* The first cluster is only partially zero */
+    *nb_clusters = 1;
+    return false;
+}
+
+/* Copy @bytes at @offset through a bounce buffer.  Runs of clusters that
+ * turn out to be zero are written as zeroes to keep the target sparse. */
+static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
+                                                      int64_t offset,
+                                                      int64_t bytes,
+                                                      void **bounce_buffer,
+                                                      bool *error_is_read,
+                                                      bool is_write_notifier)
+{
+    BlockBackend *blk = job->common.blk;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    uint8_t *buf;
+    int64_t pos, run;
+    bool zero;
+    int ret;
+
+    if (!*bounce_buffer) {
+        *bounce_buffer = blk_blockalign(blk, backup_batch_clusters(job) *
+                                             job->cluster_size);
+    }
+    buf = *bounce_buffer;
+
+    iov.iov_base = buf;
+    iov.iov_len = bytes;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = blk_co_preadv(blk, offset, bytes, &qiov,
+                        is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0);
+    if (ret < 0) {
+        trace_backup_do_cow_read_fail(job, offset / job->cluster_size, ret);
+        if (error_is_read) {
+            *error_is_read = true;
+        }
+        return ret;
+    }
+
+    for (pos = 0; pos < bytes; pos += run) {
+        run = MIN(job->cluster_size, bytes - pos);
+        zero = buffer_is_zero(buf + pos, run);
+        while (pos + run < bytes) {
+            int64_t next = MIN(job->cluster_size, bytes - pos - run);
+            if (buffer_is_zero(buf + pos + run, next) != zero) {
+                break;
+            }
+            run += next;
+        }
+
+        if (zero) {
+            ret = blk_co_pwrite_zeroes(job->target, offset + pos, run,
+                                       BDRV_REQ_MAY_UNMAP);
+        } else {
+            iov.iov_base = buf + pos;
+            iov.iov_len = run;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+            ret = blk_co_pwritev(job->target, offset + pos, run, &qiov,
+                                 job->compress ? BDRV_REQ_WRITE_COMPRESSED : 0);
+        }
+        if (ret < 0) {
+            trace_backup_do_cow_write_fail(job, (offset + pos) /
+                                                job->cluster_size, ret);
+            if (error_is_read) {
+                *error_is_read = false;
+            }
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                                       int64_t sector_num, int nb_sectors,
                                       bool *error_is_read,
@@ -102,13 +229,13 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
 {
     BlockBackend *blk = job->common.blk;
     CowRequest cow_request;
-    struct iovec iov;
-    QEMUIOVector bounce_qiov;
     void *bounce_buffer = NULL;
     int ret = 0;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
     int64_t start, end;
-    int n;
+    int64_t nb_clusters;
+    int64_t offset, bytes;
+    bool zero;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
 
@@ -120,59 +247,65 @@ static int coroutine_fn backup_do_cow(BackupBlockJob *job,
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start++) {
+    for (; start < end; start += nb_clusters) {
         if (test_bit(start, job->done_bitmap)) {
             trace_backup_do_cow_skip(job, start);
+            nb_clusters = 1;
             continue; /* already copied */
         }
 
         trace_backup_do_cow_process(job, start);
 
-        n = MIN(sectors_per_cluster,
-                job->common.len / BDRV_SECTOR_SIZE -
-                start * sectors_per_cluster);
+        /* Handle the whole run of clusters not copied yet at once */
+        nb_clusters = MIN(find_next_bit(job->done_bitmap, end, start),
+                          start + backup_batch_clusters(job)) - start;
+        offset = start * job->cluster_size;
 
-        if (!bounce_buffer) {
-            bounce_buffer = blk_blockalign(blk, job->cluster_size);
-        }
-        iov.iov_base = bounce_buffer;
-        iov.iov_len = n * BDRV_SECTOR_SIZE;
-        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+        zero = backup_cow_is_zero(job, start, &nb_clusters);
+        bytes = MIN(nb_clusters * job->cluster_size, job->common.len - offset);
 
-        ret = blk_co_preadv(blk, start * job->cluster_size,
-                            bounce_qiov.size, &bounce_qiov,
-                            is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0);
-        if (ret < 0) {
-            trace_backup_do_cow_read_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = true;
+        if (zero) {
+            trace_backup_do_cow_zero(job, start, nb_clusters);
+            ret = blk_co_pwrite_zeroes(job->target, offset, bytes,
+                                       BDRV_REQ_MAY_UNMAP);
+            if (ret < 0) {
+                trace_backup_do_cow_write_fail(job, start, ret);
+                if (error_is_read) {
+                    *error_is_read = false;
+                }
+                goto out;
             }
-            goto out;
-        }
-
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
-            ret = blk_co_pwrite_zeroes(job->target, start * job->cluster_size,
-                                       bounce_qiov.size, BDRV_REQ_MAY_UNMAP);
         } else {
-            ret = blk_co_pwritev(job->target, start * job->cluster_size,
-                                 bounce_qiov.size, &bounce_qiov,
-                                 job->compress ? BDRV_REQ_WRITE_COMPRESSED : 0);
-        }
-        if (ret < 0) {
-            trace_backup_do_cow_write_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = false;
+            ret = -ENOTSUP;
+            if (job->use_copy_range) {
+                ret = blk_co_copy_range(blk, offset, job->target, offset,
+                                        bytes, is_write_notifier ?
+                                               BDRV_REQ_NO_SERIALISING : 0);
+                trace_backup_do_cow_offload(job, start, nb_clusters, ret);
+                if (ret == -ENOTSUP) {
+                    job->use_copy_range = false;
+                }
             }
-            goto out;
+            if (ret < 0) {
+                /* Retry without offloading; this also attributes any real
+                 * I/O error to the right side */
+                ret = backup_cow_with_bounce_buffer(job, offset, bytes,
+                                                    &bounce_buffer,
+                                                    error_is_read,
+                                                    is_write_notifier);
+                if (ret < 0) {
+                    goto out;
+                }
+            }
+            job->sectors_read += bytes >> BDRV_SECTOR_BITS;
         }
 
-        set_bit(start, job->done_bitmap);
+        bitmap_set(job->done_bitmap, start, nb_clusters);
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
          * offset field is an opaque progress value, it is not a disk offset.
          */
-        job->sectors_read += n;
-        job->common.offset += n * BDRV_SECTOR_SIZE;
+        job->common.offset += bytes;
     }
 
 out:
@@ -408,54 +541,53 @@ static void coroutine_fn backup_run(void *opaque)
         ret = backup_run_incremental(job);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
+        int64_t total_sectors = job->common.len >> BDRV_SECTOR_BITS;
+        int64_t nb_clusters;
+
+        for (; start < end; start += nb_clusters) {
             bool error_is_read;
+
+            nb_clusters = MIN(backup_batch_clusters(job), end - start);
             if (yield_and_check(job)) {
                 break;
             }
 
             if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < sectors_per_cluster;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * sectors_per_cluster + i,
-                                sectors_per_cluster - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
-                    }
-                }
-
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
+                int64_t sector_num = start * sectors_per_cluster;
+                int n;
+                int alloced;
+
+                /* Skip whole clusters that are still in the backing file.
+                 * A cluster that is only partially allocated in the topmost
+                 * image is copied in full. */
+                alloced = bdrv_is_allocated(bs, sector_num,
+                                            nb_clusters * sectors_per_cluster,
+                                            &n);
+                if (alloced == 0 && sector_num + n >= total_sectors) {
+                    nb_clusters = end - start;
+                    continue;
+                } else if (alloced == 0 && n >= sectors_per_cluster) {
+                    nb_clusters = n / sectors_per_cluster;
                     continue;
+                } else if (alloced == 0) {
+                    nb_clusters = 1;
+                } else if (alloced > 0 && n > 0) {
+                    nb_clusters = DIV_ROUND_UP(n, sectors_per_cluster);
                 }
             }
             /* FULL sync mode we copy the whole drive. */
             ret = backup_do_cow(job, start * sectors_per_cluster,
-                                sectors_per_cluster, &error_is_read, false);
+                                nb_clusters * sectors_per_cluster,
+                                &error_is_read, false);
             if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
+                /* Depending on error action, fail now or retry the clusters
+                 * that have not been copied yet */
                 BlockErrorAction action =
                     backup_error_action(job, error_is_read, -ret);
                 if (action == BLOCK_ERROR_ACTION_REPORT) {
                     break;
                 } else {
-                    start--;
+                    nb_clusters = 0;
                     continue;
                 }
             }
@@ -565,6 +697,7 @@ void backup_start(const char *job_id, BlockDriverState *bs,
     job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_INCREMENTAL ?
                        sync_bitmap : NULL;
     job->compress = compress;
+    job->use_copy_range = !compress;
 
     /* If there is no backing file on the target, we cannot rely on COW if our
      * backup cluster size is smaller than the target cluster size. Even for
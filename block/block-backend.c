@@ -130,6 +130,7 @@ BlockBackend *blk_new(void)
 
     qemu_co_queue_init(&blk->public.throttled_reqs[0]);
     qemu_co_queue_init(&blk->public.throttled_reqs[1]);
+    blk->public.throttle_weight = THROTTLE_GROUP_WEIGHT_DEFAULT;
 
     notifier_list_init(&blk->remove_bs_notifiers);
     notifier_list_init(&blk->insert_bs_notifiers);
@@ -1485,6 +1486,33 @@ int coroutine_fn blk_co_pwrite_zeroes(BlockBackend *blk, int64_t offset,
                           flags | BDRV_REQ_ZERO_WRITE);
 }
 
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
+                                   BlockBackend *blk_out, int64_t off_out,
+                                   int bytes, BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = blk_check_byte_request(blk_in, off_in, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = blk_check_byte_request(blk_out, off_out, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The copy bypasses the throttling and write cache emulation that
+     * blk_co_pwritev() implements, so leave such backends to the caller's
+     * fallback path */
+    if (blk_in->public.throttle_state || blk_out->public.throttle_state ||
+        !blk_out->enable_write_cache) {
+        return -ENOTSUP;
+    }
+
+    return bdrv_co_copy_range(blk_in->root, off_in,
+                              blk_out->root, off_out, bytes, flags);
+}
+
 int blk_pwrite_compressed(BlockBackend *blk, int64_t offset, const void *buf,
                           int count)
 {
@@ -355,6 +355,96 @@ void bdrv_drain_all(void)
     }
 }
 
+/* Requests whose overlap range is at most this large are kept sorted in
+ * bs->tracked_index, so that an overlap lookup only needs to look at entries
+ * starting less than this many bytes before the range that is checked.
+ * Larger requests are rare and go to bs->tracked_large. */
+#define BDRV_TRACKED_INDEX_SPAN (1 * 1024 * 1024)
+
+static BdrvTrackedRequestIndex *tracked_index_for(BdrvTrackedRequest *req)
+{
+    return req->overlap_bytes <= BDRV_TRACKED_INDEX_SPAN
+           ? &req->bs->tracked_index : &req->bs->tracked_large;
+}
+
+/* Index of the first request in @idx with overlap_offset >= @offset */
+static unsigned int tracked_index_lower_bound(BdrvTrackedRequestIndex *idx,
+                                              int64_t offset)
+{
+    unsigned int lo = 0, hi = idx->len;
+
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        if (idx->reqs[mid]->overlap_offset < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void tracked_index_insert(BdrvTrackedRequest *req)
+{
+    BdrvTrackedRequestIndex *idx = tracked_index_for(req);
+    unsigned int i;
+
+    if (idx->len == idx->size) {
+        idx->size = MAX(16, idx->size * 2);
+        idx->reqs = g_renew(BdrvTrackedRequest *, idx->reqs, idx->size);
+    }
+
+    if (idx == &req->bs->tracked_large) {
+        i = idx->len;
+    } else {
+        i = tracked_index_lower_bound(idx, req->overlap_offset + 1);
+        memmove(&idx->reqs[i + 1], &idx->reqs[i],
+                (idx->len - i) * sizeof(idx->reqs[0]));
+    }
+    idx->reqs[i] = req;
+    idx->len++;
+}
+
+static void tracked_index_remove(BdrvTrackedRequest *req)
+{
+    BdrvTrackedRequestIndex *idx = tracked_index_for(req);
+    unsigned int i;
+
+    if (idx == &req->bs->tracked_large) {
+        i = 0;
+    } else {
+        i = tracked_index_lower_bound(idx, req->overlap_offset);
+    }
+    while (idx->reqs[i] != req) {
+        i++;
+        assert(i < idx->len);
+    }
+
+    idx->len--;
+    memmove(&idx->reqs[i], &idx->reqs[i + 1],
+            (idx->len - i) * sizeof(idx->reqs[0]));
+}
+
+/* Called when the first serialising request appears */
+static void tracked_index_build(BlockDriverState *bs)
+{
+    BdrvTrackedRequest *req;
+
+    assert(bs->tracked_index.len == 0 && bs->tracked_large.len == 0);
+    QLIST_FOREACH(req, &bs->tracked_requests, list) {
+        tracked_index_insert(req);
+    }
+}
+
+/* Called when the last serialising request completes */
+static void tracked_index_clear(BlockDriverState *bs)
+{
+    g_free(bs->tracked_index.reqs);
+    g_free(bs->tracked_large.reqs);
+    bs->tracked_index = (BdrvTrackedRequestIndex) {};
+    bs->tracked_large = (BdrvTrackedRequestIndex) {};
+}
+
 /**
  * Remove an active request from the tracked requests list
  *
@@ -362,8 +452,13 @@ void bdrv_drain_all(void)
  */
 static void tracked_request_end(BdrvTrackedRequest *req)
 {
-    if (req->serialising) {
-        req->bs->serialising_in_flight--;
+    BlockDriverState *bs = req->bs;
+
+    if (bs->serialising_in_flight) {
+        tracked_index_remove(req);
+    }
+    if (req->serialising && --bs->serialising_in_flight == 0) {
+        tracked_index_clear(bs);
     }
 
     QLIST_REMOVE(req, list);
@@ -393,21 +488,29 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
     qemu_co_queue_init(&req->wait_queue);
 
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    if (bs->serialising_in_flight) {
+        tracked_index_insert(req);
+    }
 }
 
 static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
 {
+    BlockDriverState *bs = req->bs;
     int64_t overlap_offset = req->offset & ~(align - 1);
     unsigned int overlap_bytes = ROUND_UP(req->offset + req->bytes, align)
                                - overlap_offset;
 
     if (!req->serialising) {
-        req->bs->serialising_in_flight++;
+        if (bs->serialising_in_flight++ == 0) {
+            tracked_index_build(bs);
+        }
         req->serialising = true;
     }
 
+    tracked_index_remove(req);
     req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
     req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+    tracked_index_insert(req);
 }
 
 /**
@@ -478,46 +581,73 @@ static bool tracked_request_overlaps(BdrvTrackedRequest *req,
     return true;
 }
 
+/* Whether @self has to wait for @req before it can proceed */
+static bool tracked_request_conflicts(BdrvTrackedRequest *self,
+                                      BdrvTrackedRequest *req)
+{
+    if (req == self || (!req->serialising && !self->serialising)) {
+        return false;
+    }
+    if (!tracked_request_overlaps(req, self->overlap_offset,
+                                  self->overlap_bytes)) {
+        return false;
+    }
+
+    /* Hitting this means there was a reentrant request, for
+     * example, a block driver issuing nested requests.  This must
+     * never happen since it means deadlock.
+     */
+    assert(qemu_coroutine_self() != req->co);
+
+    /* If the request is already (indirectly) waiting for us, or
+     * will wait for us as soon as it wakes up, then just go on
+     * (instead of producing a deadlock in the former case). */
+    return !req->waiting_for;
+}
+
+static BdrvTrackedRequest *find_conflicting_request(BdrvTrackedRequest *self)
+{
+    BlockDriverState *bs = self->bs;
+    BdrvTrackedRequestIndex *idx = &bs->tracked_index;
+    int64_t end = self->overlap_offset + self->overlap_bytes;
+    unsigned int i;
+
+    /* Nothing in tracked_index that starts BDRV_TRACKED_INDEX_SPAN bytes or
+     * more before us can reach into our range */
+    i = tracked_index_lower_bound(idx, self->overlap_offset -
+                                       BDRV_TRACKED_INDEX_SPAN + 1);
+    for (; i < idx->len && idx->reqs[i]->overlap_offset < end; i++) {
+        if (tracked_request_conflicts(self, idx->reqs[i])) {
+            return idx->reqs[i];
+        }
+    }
+
+    idx = &bs->tracked_large;
+    for (i = 0; i < idx->len; i++) {
+        if (tracked_request_conflicts(self, idx->reqs[i])) {
+            return idx->reqs[i];
+        }
+    }
+
+    return NULL;
+}
+
 static bool coroutine_fn wait_serialising_requests(BdrvTrackedRequest *self)
 {
     BlockDriverState *bs = self->bs;
     BdrvTrackedRequest *req;
-    bool retry;
     bool waited = false;
 
     if (!bs->serialising_in_flight) {
         return false;
     }
 
-    do {
-        retry = false;
-        QLIST_FOREACH(req, &bs->tracked_requests, list) {
-            if (req == self || (!req->serialising && !self->serialising)) {
-                continue;
-            }
-            if (tracked_request_overlaps(req, self->overlap_offset,
-                                         self->overlap_bytes))
-            {
-                /* Hitting this means there was a reentrant request, for
-                 * example, a block driver issuing nested requests.  This must
-                 * never happen since it means deadlock.
-                 */
-                assert(qemu_coroutine_self() != req->co);
-
-                /* If the request is already (indirectly) waiting for us, or
-                 * will wait for us as soon as it wakes up, then just go on
-                 * (instead of producing a deadlock in the former case). */
-                if (!req->waiting_for) {
-                    self->waiting_for = req;
-                    qemu_co_queue_wait(&req->wait_queue);
-                    self->waiting_for = NULL;
-                    retry = true;
-                    waited = true;
-                    break;
-                }
-            }
-        }
-    } while (retry);
+    while ((req = find_conflicting_request(self)) != NULL) {
+        self->waiting_for = req;
+        qemu_co_queue_wait(&req->wait_queue);
+        self->waiting_for = NULL;
+        waited = true;
+    }
 
     return waited;
 }
@@ -1301,6 +1431,10 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     assert(req->overlap_offset <= offset);
     assert(offset + bytes <= req->overlap_offset + req->overlap_bytes);
 
+    req->write_offset = offset;
+    req->write_bytes = bytes;
+    req->write_qiov = qiov;
+    req->write_flags = flags;
     ret = notifier_with_return_list_notify(&bs->before_write_notifiers, req);
 
     if (!ret && bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF &&
@@ -1619,6 +1753,125 @@ int coroutine_fn bdrv_co_pwrite_zeroes(BdrvChild *child, int64_t offset,
                            BDRV_REQ_ZERO_WRITE | flags);
 }
 
+static int coroutine_fn bdrv_co_copy_range_internal(BdrvChild *src,
+                                                    uint64_t src_offset,
+                                                    BdrvChild *dst,
+                                                    uint64_t dst_offset,
+                                                    uint64_t bytes,
+                                                    BdrvRequestFlags flags,
+                                                    bool recurse_src)
+{
+    BlockDriverState *src_bs, *dst_bs;
+    BdrvTrackedRequest req;
+    uint64_t align;
+    int ret;
+
+    if (!src || !src->bs || !src->bs->drv ||
+        !dst || !dst->bs || !dst->bs->drv) {
+        return -ENOMEDIUM;
+    }
+    src_bs = src->bs;
+    dst_bs = dst->bs;
+
+    if (bytes > INT_MAX) {
+        return -ENOTSUP;
+    }
+    ret = bdrv_check_byte_request(src_bs, src_offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = bdrv_check_byte_request(dst_bs, dst_offset, bytes);
+    if (ret < 0) {
+        return ret;
+    } else if (dst_bs->read_only) {
+        return -EPERM;
+    }
+    assert(!(dst_bs->open_flags & BDRV_O_INACTIVE));
+
+    if (!src_bs->drv->bdrv_co_copy_range_from ||
+        !dst_bs->drv->bdrv_co_copy_range_to ||
+        src_bs->encrypted || dst_bs->encrypted) {
+        return -ENOTSUP;
+    }
+
+    /* Unaligned requests would need read-modify-write on the destination,
+     * and before-write notifiers expect to see the data that is written */
+    align = MAX(src_bs->bl.request_alignment, dst_bs->bl.request_alignment);
+    if ((src_offset | dst_offset | bytes) & (align - 1) ||
+        !QLIST_EMPTY(&dst_bs->before_write_notifiers.notifiers)) {
+        return -ENOTSUP;
+    }
+
+    if (recurse_src) {
+        tracked_request_begin(&req, src_bs, src_offset, bytes,
+                              BDRV_TRACKED_READ);
+        if (!(flags & BDRV_REQ_NO_SERIALISING)) {
+            wait_serialising_requests(&req);
+        }
+        ret = src_bs->drv->bdrv_co_copy_range_from(src_bs, src, src_offset,
+                                                   dst, dst_offset, bytes,
+                                                   flags);
+        tracked_request_end(&req);
+    } else {
+        tracked_request_begin(&req, dst_bs, dst_offset, bytes,
+                              BDRV_TRACKED_WRITE);
+        wait_serialising_requests(&req);
+        ret = dst_bs->drv->bdrv_co_copy_range_to(dst_bs, src, src_offset,
+                                                 dst, dst_offset, bytes,
+                                                 flags);
+
+        ++dst_bs->write_gen;
+        bdrv_set_dirty(dst_bs, dst_offset >> BDRV_SECTOR_BITS,
+                       bytes >> BDRV_SECTOR_BITS);
+        if (dst_bs->wr_highest_offset < dst_offset + bytes) {
+            dst_bs->wr_highest_offset = dst_offset + bytes;
+        }
+        if (ret >= 0) {
+            dst_bs->total_sectors = MAX(dst_bs->total_sectors,
+                                        DIV_ROUND_UP(dst_offset + bytes,
+                                                     BDRV_SECTOR_SIZE));
+            ret = 0;
+        }
+        tracked_request_end(&req);
+    }
+
+    return ret;
+}
+
+/* Copy range from @src to @dst.  Called by the source node's driver (or the
+ * generic layer) to hand the request down the source side of the graph. */
+int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, uint64_t src_offset,
+                                         BdrvChild *dst, uint64_t dst_offset,
+                                         uint64_t bytes,
+                                         BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_from(src, src_offset, dst, dst_offset,
+                                  bytes, flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, true);
+}
+
+/* Copy range from @src to @dst.  Called by the source node's driver once it
+ * has resolved the source, to hand the request down the destination side. */
+int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, uint64_t src_offset,
+                                       BdrvChild *dst, uint64_t dst_offset,
+                                       uint64_t bytes,
+                                       BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_to(src, src_offset, dst, dst_offset,
+                                bytes, flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, false);
+}
+
+int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
+                                    BdrvChild *dst, uint64_t dst_offset,
+                                    uint64_t bytes, BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_from(src, src_offset, dst, dst_offset,
+                                   bytes, flags);
+}
+
 typedef struct BdrvCoGetBlockStatusData {
     BlockDriverState *bs;
     BlockDriverState *base;
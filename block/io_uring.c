@@ -0,0 +1,506 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+#include "qemu/coroutine.h"
+#include "qemu/atomic.h"
+
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* C libraries older than the kernel headers may lack the syscall numbers.
+ * They are the same on all architectures using the common syscall table,
+ * which configure checks for.
+ */
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup     425
+#define __NR_io_uring_enter     426
+#define __NR_io_uring_register  427
+#endif
+
+/*
+ * Number of submission queue entries (per-AioContext).  The kernel sizes the
+ * completion queue at twice this, and we never have more than MAX_ENTRIES
+ * requests in flight, so completions cannot overflow.
+ */
+#define MAX_ENTRIES 128
+
+typedef struct LuringAIOCB {
+    Coroutine *co;
+    LuringState *ctx;
+    struct io_uring_sqe sqeq;
+    ssize_t ret;
+    QEMUIOVector *qiov;
+    bool is_read;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+
+    /* Short reads are resubmitted for the remaining part of the request.
+     * total_read is the number of bytes read so far, resubmit_qiov the
+     * part of qiov that is still to be filled.
+     */
+    size_t total_read;
+    QEMUIOVector resubmit_qiov;
+} LuringAIOCB;
+
+typedef struct {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+} LuringQueue;
+
+/* The submission and completion rings that the kernel shares with us */
+typedef struct {
+    int fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+} LuringRing;
+
+struct LuringState {
+    AioContext *aio_context;
+
+    LuringRing ring;
+    EventNotifier e;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* I/O completion processing */
+    QEMUBH *completion_bh;
+};
+
+static void ioq_submit(LuringState *s);
+
+static void luring_ring_cleanup(LuringRing *r)
+{
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ptr) {
+        munmap(r->cq_ptr, r->cq_size);
+    }
+    if (r->sq_ptr) {
+        munmap(r->sq_ptr, r->sq_size);
+    }
+    close(r->fd);
+}
+
+static int luring_ring_init(LuringRing *r, unsigned entries)
+{
+    struct io_uring_params p;
+    unsigned i;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        return -errno;
+    }
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        goto fail;
+    }
+    r->sq_head = r->sq_ptr + p.sq_off.head;
+    r->sq_tail = r->sq_ptr + p.sq_off.tail;
+    r->sq_mask = r->sq_ptr + p.sq_off.ring_mask;
+    r->sq_array = r->sq_ptr + p.sq_off.array;
+    r->sq_entries = p.sq_entries;
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ptr == MAP_FAILED) {
+        r->cq_ptr = NULL;
+        goto fail;
+    }
+    r->cq_head = r->cq_ptr + p.cq_off.head;
+    r->cq_tail = r->cq_ptr + p.cq_off.tail;
+    r->cq_mask = r->cq_ptr + p.cq_off.ring_mask;
+    r->cqes = r->cq_ptr + p.cq_off.cqes;
+
+    /* Submission queue entry i always lives in slot i */
+    for (i = 0; i < r->sq_entries; i++) {
+        r->sq_array[i] = i;
+    }
+    return 0;
+
+fail:
+    i = errno;
+    luring_ring_cleanup(r);
+    return -i;
+}
+
+static void luring_prep(struct io_uring_sqe *sqe, int op, int fd,
+                        uint64_t addr, uint32_t len, uint64_t offset)
+{
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = addr;
+    sqe->len = len;
+    sqe->off = offset;
+}
+
+/*
+ * Queue the rest of a short read again.  The kernel may return fewer bytes
+ * than requested even before EOF, for example if the read was interrupted
+ * or the page cache was only partially populated.
+ */
+static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
+                                       int nread)
+{
+    QEMUIOVector *resubmit_qiov = &luringcb->resubmit_qiov;
+    size_t remaining;
+
+    luringcb->total_read += nread;
+    remaining = luringcb->qiov->size - luringcb->total_read;
+
+    if (resubmit_qiov->iov == NULL) {
+        qemu_iovec_init(resubmit_qiov, luringcb->qiov->niov);
+    } else {
+        qemu_iovec_reset(resubmit_qiov);
+    }
+    qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
+                      remaining);
+
+    luringcb->sqeq.addr = (uintptr_t)resubmit_qiov->iov;
+    luringcb->sqeq.len = resubmit_qiov->niov;
+    luringcb->sqeq.off += nread;
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+/*
+ * Completes an io_uring request (re-enters the coroutine), unless it was
+ * a short read that needs to be queued again.
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *luringcb,
+                                      int ret)
+{
+    QEMUIOVector *qiov = luringcb->qiov;
+
+    if (qiov && ret >= 0) {
+        size_t done = luringcb->total_read + ret;
+
+        if (done == qiov->size) {
+            ret = 0;
+        } else if (!luringcb->is_read) {
+            ret = -ENOSPC;
+        } else if (ret > 0) {
+            luring_resubmit_short_read(s, luringcb, ret);
+            return;
+        } else {
+            /* Short reads mean EOF, pad with zeros. */
+            qemu_iovec_memset(qiov, done, 0, qiov->size - done);
+        }
+    }
+
+    if (luringcb->resubmit_qiov.iov) {
+        qemu_iovec_destroy(&luringcb->resubmit_qiov);
+    }
+    luringcb->ret = ret;
+    qemu_coroutine_enter(luringcb->co);
+}
+
+/* The completion BH reaps completed requests from the completion ring and
+ * re-enters their coroutines.
+ *
+ * Like the one in linux-aio.c, it supports nested event loops, for example
+ * when a request callback invokes aio_poll().  Each completion is consumed
+ * from the ring before its coroutine runs, and the BH reschedules itself so
+ * that a nested event loop also sees the remaining completions.
+ */
+static void luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+    LuringRing *r = &s->ring;
+
+    /* Reschedule so nested event loops see currently pending completions */
+    qemu_bh_schedule(s->completion_bh);
+
+    for (;;) {
+        unsigned head = *r->cq_head;
+        struct io_uring_cqe *cqe;
+        LuringAIOCB *luringcb;
+        int ret;
+
+        if (head == atomic_read(r->cq_tail)) {
+            break;
+        }
+        /* Read the CQE only after seeing the tail that covers it */
+        smp_rmb();
+        cqe = &r->cqes[head & *r->cq_mask];
+        luringcb = (LuringAIOCB *)(uintptr_t)cqe->user_data;
+        ret = cqe->res;
+
+        /* Hand the slot back to the kernel once the entry has been read */
+        smp_mb();
+        atomic_set(r->cq_head, head + 1);
+        s->io_q.in_flight--;
+
+        luring_process_completion(s, luringcb, ret);
+    }
+
+    if (!s->io_q.plugged && s->io_q.in_queue) {
+        ioq_submit(s);
+    }
+
+    qemu_bh_cancel(s->completion_bh);
+}
+
+static void luring_completion_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (event_notifier_test_and_clear(&s->e)) {
+        luring_completion_bh(s);
+    }
+}
+
+static bool luring_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LuringState *s = container_of(e, LuringState, e);
+    LuringRing *r = &s->ring;
+
+    /* Peek at the completion ring instead of making a syscall */
+    if (!s->io_q.in_flight ||
+        atomic_read(r->cq_head) == atomic_read(r->cq_tail)) {
+        return false;
+    }
+
+    luring_completion_bh(s);
+    return true;
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->submit_queue);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+static void ioq_submit(LuringState *s)
+{
+    LuringRing *r = &s->ring;
+    LuringAIOCB *luringcb;
+    unsigned head, tail, to_submit;
+    int ret;
+
+    while (s->io_q.in_queue) {
+        /* Move queued requests to the submission ring, but never have more
+         * than MAX_ENTRIES requests either there or in flight.
+         */
+        head = atomic_read(r->sq_head);
+        tail = *r->sq_tail;
+        while (!QSIMPLEQ_EMPTY(&s->io_q.submit_queue) &&
+               s->io_q.in_flight + (tail - head) < MAX_ENTRIES) {
+            luringcb = QSIMPLEQ_FIRST(&s->io_q.submit_queue);
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+            r->sqes[tail & *r->sq_mask] = luringcb->sqeq;
+            tail++;
+        }
+        /* The SQEs must be visible before the kernel sees the new tail */
+        smp_wmb();
+        atomic_set(r->sq_tail, tail);
+
+        to_submit = tail - head;
+        if (!to_submit) {
+            break;
+        }
+        ret = syscall(__NR_io_uring_enter, r->fd, to_submit, 0, 0, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* -EAGAIN or -EBUSY: the entries stay in the submission ring
+             * and are submitted again once some requests have completed.
+             */
+            break;
+        }
+
+        s->io_q.in_flight += ret;
+        s->io_q.in_queue -= ret;
+        if (ret < to_submit) {
+            break;
+        }
+    }
+    s->io_q.blocked = (s->io_q.in_queue > 0);
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s)
+{
+    assert(s->io_q.plugged);
+    if (--s->io_q.plugged == 0 &&
+        !s->io_q.blocked && s->io_q.in_queue) {
+        ioq_submit(s);
+    }
+}
+
+static int coroutine_fn luring_do_submit(LuringState *s,
+                                         LuringAIOCB *luringcb)
+{
+    luringcb->sqeq.user_data = (uintptr_t)luringcb;
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+
+    qemu_coroutine_yield();
+    return luringcb->ret;
+}
+
+int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
+                                  uint64_t offset, QEMUIOVector *qiov,
+                                  int type)
+{
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ctx        = s,
+        .ret        = -EINPROGRESS,
+        .qiov       = qiov,
+        .is_read    = (type == QEMU_AIO_READ),
+    };
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        luring_prep(&luringcb.sqeq, IORING_OP_WRITEV, fd,
+                    (uintptr_t)qiov->iov, qiov->niov, offset);
+        break;
+    case QEMU_AIO_READ:
+        luring_prep(&luringcb.sqeq, IORING_OP_READV, fd,
+                    (uintptr_t)qiov->iov, qiov->niov, offset);
+        break;
+    case QEMU_AIO_FLUSH:
+        luring_prep(&luringcb.sqeq, IORING_OP_FSYNC, fd, 0, 0, 0);
+        luringcb.sqeq.fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        return -EIO;
+    }
+
+    return luring_do_submit(s, &luringcb);
+}
+
+int coroutine_fn luring_co_fallocate(BlockDriverState *bs, LuringState *s,
+                                     int fd, int mode, uint64_t offset,
+                                     uint64_t bytes)
+{
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ctx        = s,
+        .ret        = -EINPROGRESS,
+    };
+
+    /* IORING_OP_FALLOCATE passes the length in addr and the mode in len */
+    luring_prep(&luringcb.sqeq, IORING_OP_FALLOCATE, fd, bytes, mode, offset);
+    return luring_do_submit(s, &luringcb);
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_event_notifier(old_context, &s->e, false, NULL, NULL);
+    qemu_bh_delete(s->completion_bh);
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->aio_context = new_context;
+    s->completion_bh = aio_bh_new(new_context, luring_completion_bh, s);
+    aio_set_event_notifier(new_context, &s->e, false,
+                           luring_completion_cb,
+                           luring_poll_cb);
+}
+
+LuringState *luring_init(void)
+{
+    LuringState *s;
+    int fd;
+
+    s = g_malloc0(sizeof(*s));
+    if (event_notifier_init(&s->e, false) < 0) {
+        goto out_free_state;
+    }
+
+    if (luring_ring_init(&s->ring, MAX_ENTRIES) < 0) {
+        goto out_close_efd;
+    }
+
+    /* Completions are signalled through the event notifier */
+    fd = event_notifier_get_fd(&s->e);
+    if (syscall(__NR_io_uring_register, s->ring.fd, IORING_REGISTER_EVENTFD,
+                &fd, 1) < 0) {
+        goto out_cleanup_ring;
+    }
+
+    ioq_init(&s->io_q);
+
+    return s;
+
+out_cleanup_ring:
+    luring_ring_cleanup(&s->ring);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    event_notifier_cleanup(&s->e);
+    luring_ring_cleanup(&s->ring);
+    g_free(s);
+}
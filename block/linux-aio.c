@@ -164,6 +164,40 @@ static void qemu_laio_completion_cb(EventNotifier *e)
     }
 }
 
+/* The kernel maps the completion ring into userspace at the address that
+ * io_setup() returned as the io_context_t.  Its layout is the kernel's
+ * struct aio_ring (fs/aio.c), of which only the header is needed here.
+ */
+struct aio_ring {
+    unsigned id;    /* kernel internal index number */
+    unsigned nr;    /* number of io_events */
+    unsigned head;  /* written to by userland or by kernel */
+    unsigned tail;
+
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;  /* size of aio_ring */
+};
+
+#define AIO_RING_MAGIC 0xa10a10a1
+
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LinuxAioState *s = container_of(e, LinuxAioState, e);
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+
+    /* Peek at the completion ring instead of making a syscall */
+    if (!s->io_q.in_flight || ring->magic != AIO_RING_MAGIC ||
+        atomic_read(&ring->head) == atomic_read(&ring->tail)) {
+        return false;
+    }
+
+    qemu_laio_completion_bh(s);
+    return true;
+}
+
 static void laio_cancel(BlockAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
@@ -332,7 +366,7 @@ BlockAIOCB *laio_submit(BlockDriverState *bs, LinuxAioState *s, int fd,
 
 void laio_detach_aio_context(LinuxAioState *s, AioContext *old_context)
 {
-    aio_set_event_notifier(old_context, &s->e, false, NULL);
+    aio_set_event_notifier(old_context, &s->e, false, NULL, NULL);
     qemu_bh_delete(s->completion_bh);
 }
 
@@ -341,7 +375,8 @@ void laio_attach_aio_context(LinuxAioState *s, AioContext *new_context)
     s->aio_context = new_context;
     s->completion_bh = aio_bh_new(new_context, qemu_laio_completion_bh, s);
     aio_set_event_notifier(new_context, &s->e, false,
-                           qemu_laio_completion_cb);
+                           qemu_laio_completion_cb,
+                           qemu_laio_poll_cb);
 }
 
 LinuxAioState *laio_init(void)
@@ -22,10 +22,17 @@
 #include "qemu/bitmap.h"
 
 #define SLICE_TIME    100000000ULL /* ns */
-#define MAX_IN_FLIGHT 16
 #define MAX_IO_SECTORS ((1 << 20) >> BDRV_SECTOR_BITS) /* 1 Mb */
+#define MIN_IO_SECTORS ((64 << 10) >> BDRV_SECTOR_BITS) /* 64 Kb */
+
+/* The number of concurrent requests to the target is adjusted between these
+ * bounds depending on the target latency, see mirror_update_window() */
+#define MIN_IN_FLIGHT     4
+#define DEFAULT_IN_FLIGHT 16
+#define MAX_IN_FLIGHT     256
+
 #define DEFAULT_MIRROR_BUF_SIZE \
-    (MAX_IN_FLIGHT * MAX_IO_SECTORS * BDRV_SECTOR_SIZE)
+    (DEFAULT_IN_FLIGHT * MAX_IO_SECTORS * BDRV_SECTOR_SIZE)
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -34,6 +41,14 @@ typedef struct MirrorBuffer {
     QSIMPLEQ_ENTRY(MirrorBuffer) next;
 } MirrorBuffer;
 
+typedef struct MirrorPhaseStats {
+    uint64_t bytes;
+    int64_t start_ns;
+    int64_t end_ns;     /* 0 while the phase is running */
+} MirrorPhaseStats;
+
+typedef struct MirrorOp MirrorOp;
+
 typedef struct MirrorBlockJob {
     BlockJob common;
     RateLimit limit;
@@ -62,6 +77,7 @@ typedef struct MirrorBlockJob {
 
     uint64_t last_pause_ns;
     unsigned long *in_flight_bitmap;
+    QTAILQ_HEAD(, MirrorOp) ops_in_flight;
     int in_flight;
     int64_t sectors_in_flight;
     int ret;
@@ -69,14 +85,44 @@ typedef struct MirrorBlockJob {
     bool waiting_for_io;
     int target_cluster_sectors;
     int max_iov;
+
+    /* Adaptive window: limits for s->in_flight and for the size of a single
+     * copy request, and the target latency they are derived from */
+    int max_in_flight;
+    int max_io_sectors;
+    bool window_limited;
+    int64_t window_start_ns;
+    int64_t latency_sum_ns;
+    int64_t latency_count;
+    int64_t latency_ns;
+    int64_t base_latency_ns;
+
+    MirrorCopyMode copy_mode;
+    /* Set once guest writes are mirrored by mirror_before_write_notify() */
+    bool active_mirroring;
+    NotifierWithReturn before_write;
+    int active_writes;
+    uint64_t active_bytes;
+
+    MirrorPhaseStats bulk_stats;
+    MirrorPhaseStats ready_stats;
 } MirrorBlockJob;
 
-typedef struct MirrorOp {
+struct MirrorOp {
     MirrorBlockJob *s;
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
-} MirrorOp;
+    int64_t start_ns;
+
+    /* For guest writes mirrored in write-blocking mode, the request on the
+     * source; the op covers whole chunks and lasts until @req completes */
+    BdrvTrackedRequest *req;
+
+    /* Guest writes in write-blocking mode waiting for this op */
+    CoQueue waiting_requests;
+    QTAILQ_ENTRY(MirrorOp) next;
+};
 
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
                                             int error)
@@ -91,6 +137,33 @@ static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
     }
 }
 
+static MirrorPhaseStats *mirror_phase_stats(MirrorBlockJob *s)
+{
+    return s->ready_stats.start_ns ? &s->ready_stats : &s->bulk_stats;
+}
+
+static MirrorOp *mirror_op_new(MirrorBlockJob *s, int64_t sector_num,
+                               int nb_sectors)
+{
+    MirrorOp *op = g_new0(MirrorOp, 1);
+
+    op->s = s;
+    op->sector_num = sector_num;
+    op->nb_sectors = nb_sectors;
+    qemu_co_queue_init(&op->waiting_requests);
+    QTAILQ_INSERT_TAIL(&s->ops_in_flight, op, next);
+    return op;
+}
+
+static void mirror_op_free(MirrorOp *op)
+{
+    QTAILQ_REMOVE(&op->s->ops_in_flight, op, next);
+    while (qemu_co_enter_next(&op->waiting_requests)) {
+        /* Woken requests look for other conflicting ops, never for this one */
+    }
+    g_free(op);
+}
+
 static void mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -118,10 +191,12 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
             bitmap_set(s->cow_bitmap, chunk_num, nb_chunks);
         }
         s->common.offset += (uint64_t)op->nb_sectors * BDRV_SECTOR_SIZE;
+        mirror_phase_stats(s)->bytes +=
+            (uint64_t)op->nb_sectors * BDRV_SECTOR_SIZE;
     }
 
     qemu_iovec_destroy(&op->qiov);
-    g_free(op);
+    mirror_op_free(op);
 
     if (s->waiting_for_io) {
         qemu_coroutine_enter(s->common.co);
@@ -132,6 +207,10 @@ static void mirror_write_complete(void *opaque, int ret)
 {
     MirrorOp *op = opaque;
     MirrorBlockJob *s = op->s;
+
+    s->latency_sum_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - op->start_ns;
+    s->latency_count++;
+
     if (ret < 0) {
         BlockErrorAction action;
 
@@ -160,6 +239,7 @@ static void mirror_read_complete(void *opaque, int ret)
         mirror_iteration_done(op, ret);
         return;
     }
+    op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     blk_aio_pwritev(s->target, op->sector_num * BDRV_SECTOR_SIZE, &op->qiov,
                     0, mirror_write_complete, op);
 }
@@ -261,10 +341,7 @@ static int mirror_do_read(MirrorBlockJob *s, int64_t sector_num,
     }
 
     /* Allocate a MirrorOp that is used as an AIO callback.  */
-    op = g_new(MirrorOp, 1);
-    op->s = s;
-    op->sector_num = sector_num;
-    op->nb_sectors = nb_sectors;
+    op = mirror_op_new(s, sector_num, nb_sectors);
 
     /* Now make a QEMUIOVector taking enough granularity-sized chunks
      * from s->buf_free.
@@ -298,10 +375,8 @@ static void mirror_do_zero_or_discard(MirrorBlockJob *s,
 
     /* Allocate a MirrorOp that is used as an AIO callback. The qiov is zeroed
      * so the freeing in mirror_iteration_done is nop. */
-    op = g_new0(MirrorOp, 1);
-    op->s = s;
-    op->sector_num = sector_num;
-    op->nb_sectors = nb_sectors;
+    op = mirror_op_new(s, sector_num, nb_sectors);
+    op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     s->in_flight++;
     s->sectors_in_flight += nb_sectors;
@@ -327,8 +402,8 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     int64_t end = s->bdev_length / BDRV_SECTOR_SIZE;
     int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_sectors = MAX((s->buf_size >> BDRV_SECTOR_BITS) / MAX_IN_FLIGHT,
-                             MAX_IO_SECTORS);
+    int max_io_sectors = s->max_io_sectors;
+    int max_chunks = s->buf_size / s->granularity;
 
     sector_num = hbitmap_iter_next(&s->hbi);
     if (sector_num < 0) {
@@ -346,28 +421,25 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 
     block_job_pause_point(&s->common);
 
-    /* Find the number of consective dirty chunks following the first dirty
-     * one, and wait for in flight requests in them. */
-    while (nb_chunks * sectors_per_chunk < (s->buf_size >> BDRV_SECTOR_BITS)) {
-        int64_t hbitmap_next;
-        int64_t next_sector = sector_num + nb_chunks * sectors_per_chunk;
-        int64_t next_chunk = next_sector / sectors_per_chunk;
-        if (next_sector >= end ||
-            !bdrv_get_dirty(source, s->dirty_bitmap, next_sector)) {
-            break;
+    /* Find the number of consecutive dirty chunks following the first dirty
+     * one that are not in flight, and move the iterator past them. */
+    if (nb_chunks < max_chunks &&
+        sector_num + sectors_per_chunk < end) {
+        int64_t next_sector = sector_num + sectors_per_chunk;
+        int64_t run, run_end;
+        bool dirty;
+
+        run = bdrv_dirty_bitmap_extent(s->dirty_bitmap, next_sector,
+                                       (int64_t)(max_chunks - 1) *
+                                       sectors_per_chunk, &dirty);
+        if (dirty) {
+            run_end = first_chunk + 1 + DIV_ROUND_UP(run, sectors_per_chunk);
+            nb_chunks = find_next_bit(s->in_flight_bitmap, run_end,
+                                      first_chunk + 1) - first_chunk;
+
+            next_sector = sector_num + nb_chunks * sectors_per_chunk;
+            bdrv_set_dirty_iter(&s->hbi, next_sector < end ? next_sector : 0);
         }
-        if (test_bit(next_chunk, s->in_flight_bitmap)) {
-            break;
-        }
-
-        hbitmap_next = hbitmap_iter_next(&s->hbi);
-        if (hbitmap_next > next_sector || hbitmap_next < 0) {
-            /* The bitmap iterator's cache is stale, refresh it */
-            bdrv_set_dirty_iter(&s->hbi, next_sector);
-            hbitmap_next = hbitmap_iter_next(&s->hbi);
-        }
-        assert(hbitmap_next == next_sector);
-        nb_chunks++;
     }
 
     /* Clear dirty bits before querying the block status, because
@@ -414,8 +486,9 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
+            s->window_limited = true;
             mirror_wait_for_io(s);
         }
 
@@ -452,6 +525,214 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     return delay_ns;
 }
 
+static void mirror_update_io_size(MirrorBlockJob *s)
+{
+    /* Spread the buffer over the window; requests get larger when the
+     * target cannot take many of them at the same time */
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int io_sectors = MAX((s->buf_size >> BDRV_SECTOR_BITS) / s->max_in_flight,
+                         MIN_IO_SECTORS);
+
+    s->max_io_sectors = MAX(QEMU_ALIGN_DOWN(io_sectors, sectors_per_chunk),
+                            sectors_per_chunk);
+}
+
+/* Adjust the in-flight window once per SLICE_TIME from the average latency of
+ * target requests.  The lowest latency seen approximates the latency of an
+ * idle target; while we stay close to it and the window is what limits us,
+ * the window grows, and when requests start to queue up in the target, it
+ * is halved. */
+static void mirror_update_window(MirrorBlockJob *s, int64_t now)
+{
+    int64_t latency;
+
+    if (now - s->window_start_ns < SLICE_TIME) {
+        return;
+    }
+    if (s->latency_count == 0) {
+        s->window_start_ns = now;
+        return;
+    }
+
+    latency = s->latency_sum_ns / s->latency_count;
+    if (!s->base_latency_ns) {
+        s->base_latency_ns = latency;
+    } else {
+        /* Let the baseline drift up slowly so that a single fast slice
+         * does not keep the window small forever */
+        s->base_latency_ns = MIN(latency, s->base_latency_ns +
+                                          s->base_latency_ns / 64 + 1);
+    }
+
+    if (latency > 3 * s->base_latency_ns) {
+        s->max_in_flight = MAX(s->max_in_flight / 2, MIN_IN_FLIGHT);
+    } else if (s->window_limited && latency < 2 * s->base_latency_ns) {
+        s->max_in_flight = MIN(s->max_in_flight + s->max_in_flight / 4,
+                               MAX_IN_FLIGHT);
+    }
+    mirror_update_io_size(s);
+    trace_mirror_update_window(s, latency, s->max_in_flight,
+                               s->max_io_sectors);
+
+    s->latency_ns = latency;
+    s->latency_sum_ns = 0;
+    s->latency_count = 0;
+    s->window_limited = false;
+    s->window_start_ns = now;
+}
+
+static void mirror_active_write_done(MirrorBlockJob *s)
+{
+    s->active_writes--;
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co);
+    }
+}
+
+/* Keeps the chunks of a write-blocking op in flight until the guest request
+ * has completed on the source too, so that the background copy cannot read
+ * them before the new data has been written there. */
+static void coroutine_fn mirror_active_op_co(void *opaque)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+
+    qemu_co_queue_wait(&op->req->wait_queue);
+
+    bitmap_clear(s->in_flight_bitmap, op->sector_num / sectors_per_chunk,
+                 op->nb_sectors / sectors_per_chunk);
+    mirror_op_free(op);
+    mirror_active_write_done(s);
+}
+
+static int coroutine_fn mirror_before_write_notify(
+        NotifierWithReturn *notifier,
+        void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, before_write);
+    BdrvTrackedRequest *req = opaque;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t offset, bytes, first_chunk, end_chunk;
+    MirrorOp *op, *own_op = NULL;
+    bool new_op;
+    int ret;
+
+    if (req->type == BDRV_TRACKED_DISCARD) {
+        offset = req->offset;
+        bytes = req->bytes;
+    } else {
+        offset = req->write_offset;
+        bytes = req->write_bytes;
+    }
+    if (offset >= s->bdev_length) {
+        return 0;
+    }
+    bytes = MIN(bytes, s->bdev_length - offset);
+    first_chunk = offset / s->granularity;
+    end_chunk = DIV_ROUND_UP(offset + bytes, s->granularity);
+
+    s->active_writes++;
+
+    /* Wait until no other op works on the chunks.  Requests that write zeroes
+     * with an unaligned head or tail get here more than once; they extend
+     * their existing op. */
+retry:
+    QTAILQ_FOREACH(op, &s->ops_in_flight, next) {
+        int64_t op_first = op->sector_num / sectors_per_chunk;
+        int64_t op_end = DIV_ROUND_UP(op->sector_num + op->nb_sectors,
+                                      sectors_per_chunk);
+        if (op->req == req) {
+            own_op = op;
+        } else if (op_first < end_chunk && first_chunk < op_end) {
+            qemu_co_queue_wait(&op->waiting_requests);
+            own_op = NULL;
+            goto retry;
+        }
+    }
+
+    bitmap_set(s->in_flight_bitmap, first_chunk, end_chunk - first_chunk);
+
+    new_op = !own_op;
+    if (own_op) {
+        int64_t own_first = own_op->sector_num / sectors_per_chunk;
+        int64_t own_end = own_first + own_op->nb_sectors / sectors_per_chunk;
+
+        first_chunk = MIN(first_chunk, own_first);
+        end_chunk = MAX(end_chunk, own_end);
+        own_op->sector_num = first_chunk * sectors_per_chunk;
+        own_op->nb_sectors = (end_chunk - first_chunk) * sectors_per_chunk;
+    } else {
+        own_op = mirror_op_new(s, first_chunk * sectors_per_chunk,
+                               (end_chunk - first_chunk) * sectors_per_chunk);
+        own_op->req = req;
+    }
+
+    if (req->type == BDRV_TRACKED_DISCARD) {
+        /* Copy whatever the source reads as after the discard */
+        bdrv_set_dirty_bitmap(s->dirty_bitmap, offset >> BDRV_SECTOR_BITS,
+                              DIV_ROUND_UP(bytes, BDRV_SECTOR_SIZE));
+        ret = 0;
+    } else {
+        int64_t clean_first = DIV_ROUND_UP(offset, s->granularity);
+        int64_t clean_end = (offset + bytes) / s->granularity;
+
+        /* Chunks that are completely overwritten are clean afterwards */
+        if (clean_first < clean_end) {
+            bdrv_reset_dirty_bitmap(s->dirty_bitmap,
+                                    clean_first * sectors_per_chunk,
+                                    (clean_end - clean_first) *
+                                    sectors_per_chunk);
+        }
+
+        if (req->write_flags & BDRV_REQ_ZERO_WRITE) {
+            ret = blk_co_pwrite_zeroes(s->target, offset, bytes,
+                                       req->write_flags & BDRV_REQ_MAY_UNMAP);
+        } else {
+            ret = blk_co_pwritev(s->target, offset, bytes, req->write_qiov,
+                                 req->write_flags & BDRV_REQ_FUA);
+        }
+        trace_mirror_active_write(s, offset, bytes, ret);
+
+        if (ret < 0) {
+            BlockErrorAction action;
+
+            bdrv_set_dirty_bitmap(s->dirty_bitmap, offset >> BDRV_SECTOR_BITS,
+                                  DIV_ROUND_UP(bytes, BDRV_SECTOR_SIZE));
+            action = mirror_error_action(s, false, -ret);
+            if (action == BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
+                s->ret = ret;
+            }
+        } else {
+            s->active_bytes += bytes;
+        }
+    }
+
+    if (new_op) {
+        qemu_coroutine_enter(qemu_coroutine_create(mirror_active_op_co,
+                                                   own_op));
+    } else {
+        mirror_active_write_done(s);
+    }
+    return 0;
+}
+
+/* Switch to write-blocking mode once the bulk copy is done */
+static void coroutine_fn mirror_start_active_mirroring(MirrorBlockJob *s)
+{
+    BlockDriverState *bs = blk_bs(s->common.blk);
+
+    /* Guest writes that are in flight now complete while the dirty bitmap
+     * still records them; all later ones go through the notifier, and the
+     * job updates the bitmap itself from then on. */
+    bdrv_drained_begin(bs);
+    bdrv_disable_dirty_bitmap(s->dirty_bitmap);
+    s->before_write.notify = mirror_before_write_notify;
+    bdrv_add_before_write_notifier(bs, &s->before_write);
+    s->active_mirroring = true;
+    bdrv_drained_end(bs);
+}
+
 static void mirror_free_init(MirrorBlockJob *s)
 {
     int granularity = s->granularity;
@@ -572,7 +853,7 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, -1);
                 mirror_wait_for_io(s);
                 continue;
@@ -670,8 +951,10 @@ static void coroutine_fn mirror_run(void *opaque)
     }
 
     mirror_free_init(s);
+    mirror_update_io_size(s);
 
     s->last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s->window_start_ns = s->last_pause_ns;
     if (!s->is_none_mode) {
         ret = mirror_dirty_init(s);
         if (ret < 0 || block_job_is_cancelled(&s->common)) {
@@ -691,6 +974,7 @@ static void coroutine_fn mirror_run(void *opaque)
         }
 
         block_job_pause_point(&s->common);
+        mirror_update_window(s, qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
 
         cnt = bdrv_get_dirty_count(s->dirty_bitmap);
         /* s->common.offset contains the number of bytes already processed so
@@ -708,7 +992,10 @@ static void coroutine_fn mirror_run(void *opaque)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight) {
+                s->window_limited = true;
+            }
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
                 mirror_wait_for_io(s);
@@ -734,6 +1021,15 @@ static void coroutine_fn mirror_run(void *opaque)
                  * the target in a consistent state.
                  */
                 if (!s->synced) {
+                    if (!s->ready_stats.start_ns) {
+                        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+                        s->bulk_stats.end_ns = now;
+                        s->ready_stats.start_ns = now;
+                    }
+                    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING &&
+                        !s->active_mirroring) {
+                        mirror_start_active_mirroring(s);
+                    }
                     block_job_event_ready(&s->common);
                     s->synced = true;
                 }
@@ -788,8 +1084,20 @@ immediate_exit:
         assert(ret < 0 || (!s->synced && block_job_is_cancelled(&s->common)));
         mirror_drain(s);
     }
-
     assert(s->in_flight == 0);
+
+    /* Before we switch to target in mirror_exit, make sure data doesn't
+     * change. */
+    bdrv_drained_begin(bs);
+
+    if (s->active_mirroring) {
+        /* Draining completed the guest writes; their ops go away with them */
+        while (s->active_writes > 0) {
+            mirror_wait_for_io(s);
+        }
+        notifier_with_return_remove(&s->before_write);
+    }
+
     qemu_vfree(s->buf);
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
@@ -797,9 +1105,6 @@ immediate_exit:
 
     data = g_malloc(sizeof(*data));
     data->ret = ret;
-    /* Before we switch to target in mirror_exit, make sure data doesn't
-     * change. */
-    bdrv_drained_begin(bs);
     block_job_defer_to_main_loop(&s->common, mirror_exit, data);
 }
 
@@ -887,10 +1192,46 @@ static void mirror_attached_aio_context(BlockJob *job, AioContext *new_context)
     blk_set_aio_context(s->target, new_context);
 }
 
+static MirrorPhaseInfo *mirror_phase_info(MirrorPhaseStats *stats,
+                                          int64_t now)
+{
+    MirrorPhaseInfo *info = g_new0(MirrorPhaseInfo, 1);
+    int64_t end = stats->end_ns ? stats->end_ns : now;
+
+    info->bytes = stats->bytes;
+    info->duration_ms = (end - stats->start_ns) / SCALE_MS;
+    if (info->duration_ms > 0) {
+        info->throughput = stats->bytes * 1000 / info->duration_ms;
+    }
+    return info;
+}
+
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+    MirrorJobInfo *mirror = g_new0(MirrorJobInfo, 1);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    mirror->copy_mode = s->copy_mode;
+    mirror->in_flight_window = s->max_in_flight;
+    mirror->io_size = (int64_t)s->max_io_sectors * BDRV_SECTOR_SIZE;
+    mirror->target_latency_us = s->latency_ns / SCALE_US;
+    mirror->bulk = mirror_phase_info(&s->bulk_stats, now);
+    if (s->ready_stats.start_ns) {
+        mirror->has_ready = true;
+        mirror->ready = mirror_phase_info(&s->ready_stats, now);
+    }
+    mirror->active_bytes = s->active_bytes;
+
+    info->has_mirror = true;
+    info->mirror = mirror;
+}
+
 static const BlockJobDriver mirror_job_driver = {
     .instance_size          = sizeof(MirrorBlockJob),
     .job_type               = BLOCK_JOB_TYPE_MIRROR,
     .set_speed              = mirror_set_speed,
+    .query                  = mirror_query,
     .complete               = mirror_complete,
     .pause                  = mirror_pause,
     .attached_aio_context   = mirror_attached_aio_context,
@@ -900,6 +1241,7 @@ static const BlockJobDriver commit_active_job_driver = {
     .instance_size          = sizeof(MirrorBlockJob),
     .job_type               = BLOCK_JOB_TYPE_COMMIT,
     .set_speed              = mirror_set_speed,
+    .query                  = mirror_query,
     .complete               = mirror_complete,
     .pause                  = mirror_pause,
     .attached_aio_context   = mirror_attached_aio_context,
@@ -912,7 +1254,7 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
                              BlockMirrorBackingMode backing_mode,
                              BlockdevOnError on_source_error,
                              BlockdevOnError on_target_error,
-                             bool unmap,
+                             bool unmap, MirrorCopyMode copy_mode,
                              BlockCompletionFunc *cb,
                              void *opaque, Error **errp,
                              const BlockJobDriver *driver,
@@ -952,6 +1294,10 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->copy_mode = copy_mode;
+    s->max_in_flight = DEFAULT_IN_FLIGHT;
+    QTAILQ_INIT(&s->ops_in_flight);
+    s->bulk_stats.start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
     if (!s->dirty_bitmap) {
@@ -974,7 +1320,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   MirrorSyncMode mode, BlockMirrorBackingMode backing_mode,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
-                  bool unmap,
+                  bool unmap, MirrorCopyMode copy_mode,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp)
 {
@@ -989,8 +1335,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
     base = mode == MIRROR_SYNC_MODE_TOP ? backing_bs(bs) : NULL;
     mirror_start_job(job_id, bs, target, replaces,
                      speed, granularity, buf_size, backing_mode,
-                     on_source_error, on_target_error, unmap, cb, opaque, errp,
-                     &mirror_job_driver, is_none_mode, base);
+                     on_source_error, on_target_error, unmap, copy_mode,
+                     cb, opaque, errp, &mirror_job_driver, is_none_mode, base);
 }
 
 void commit_active_start(const char *job_id, BlockDriverState *bs,
@@ -1037,8 +1383,9 @@ void commit_active_start(const char *job_id, BlockDriverState *bs,
 
     mirror_start_job(job_id, bs, base, NULL, speed, 0, 0,
                      MIRROR_LEAVE_BACKING_CHAIN,
-                     on_error, on_error, false, cb, opaque, &local_err,
-                     &commit_active_job_driver, false, base);
+                     on_error, on_error, false, MIRROR_COPY_MODE_BACKGROUND,
+                     cb, opaque, &local_err, &commit_active_job_driver, false,
+                     base);
     if (local_err) {
         error_propagate(errp, local_err);
         goto error_restore_flags;
@@ -27,6 +27,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qapi/error.h"
 #include "nbd-client.h"
 
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ ((uint64_t)(intptr_t)bs))
@@ -144,7 +145,7 @@ static int nbd_co_send_request(BlockDriverState *bs,
     aio_context = bdrv_get_aio_context(bs);
 
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, nbd_restart_write, bs);
+                       nbd_reply_ready, nbd_restart_write, NULL, bs);
     if (qiov) {
         qio_channel_set_cork(s->ioc, true);
         rc = nbd_send_request(s->ioc, request);
@@ -160,16 +161,195 @@ static int nbd_co_send_request(BlockDriverState *bs,
         rc = nbd_send_request(s->ioc, request);
     }
     aio_set_fd_handler(aio_context, s->sioc->fd, false,
-                       nbd_reply_ready, NULL, bs);
+                       nbd_reply_ready, NULL, NULL, bs);
     s->send_coroutine = NULL;
     qemu_co_mutex_unlock(&s->send_mutex);
     return rc;
 }
 
+static ssize_t nbd_co_read_payload(NbdClientSession *s, void *buf,
+                                   size_t size)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+
+    return nbd_wr_syncv(s->ioc, &iov, 1, size, true);
+}
+
+static int nbd_co_drop_payload(NbdClientSession *s, uint32_t length)
+{
+    uint8_t buf[4096];
+
+    while (length > 0) {
+        uint32_t n = MIN(length, sizeof(buf));
+
+        if (nbd_co_read_payload(s, buf, n) != n) {
+            return -EIO;
+        }
+        length -= n;
+    }
+    return 0;
+}
+
+/* Process the payload of one structured reply chunk.  Read data goes to
+ * @qiov, the first extent of a block status reply to @extent.  Return 0 on
+ * success, a positive errno if the server sent an error chunk, or a
+ * negative errno if the server violated the protocol or the connection
+ * failed.
+ */
+static int nbd_co_receive_chunk(NbdClientSession *s,
+                                struct nbd_request *request,
+                                struct nbd_reply *chunk,
+                                QEMUIOVector *qiov, NBDExtent *extent)
+{
+    uint8_t buf[8 + 4];
+    uint64_t offset;
+    uint32_t len;
+    int error;
+
+    switch (chunk->type) {
+    case NBD_REPLY_TYPE_NONE:
+        if (chunk->length || !(chunk->flags & NBD_REPLY_FLAG_DONE)) {
+            return -EINVAL;
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_OFFSET_DATA:
+    case NBD_REPLY_TYPE_OFFSET_HOLE:
+        if (!qiov || chunk->length < 8 + 1) {
+            return -EINVAL;
+        }
+        if (nbd_co_read_payload(s, buf, 8) != 8) {
+            return -EIO;
+        }
+        offset = ldq_be_p(buf);
+
+        if (chunk->type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+            if (chunk->length != 8 + 4 ||
+                nbd_co_read_payload(s, buf + 8, 4) != 4) {
+                return -EINVAL;
+            }
+            len = ldl_be_p(buf + 8);
+        } else {
+            len = chunk->length - 8;
+        }
+
+        if (offset < request->from || len > request->len ||
+            offset - request->from > request->len - len) {
+            return -EINVAL;
+        }
+        offset -= request->from;
+
+        if (chunk->type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+            qemu_iovec_memset(qiov, offset, 0, len);
+        } else {
+            QEMUIOVector sub;
+            ssize_t ret;
+
+            qemu_iovec_init(&sub, qiov->niov);
+            qemu_iovec_concat(&sub, qiov, offset, len);
+            ret = nbd_wr_syncv(s->ioc, sub.iov, sub.niov, len, true);
+            qemu_iovec_destroy(&sub);
+            if (ret != len) {
+                return -EIO;
+            }
+        }
+        return 0;
+
+    case NBD_REPLY_TYPE_BLOCK_STATUS:
+        /* Block status payload
+           [ 0 ..  3]    metadata context id
+           [ 4 ..  7]    extent length
+           [ 8 .. 11]    extent flags
+           ...           further extents
+         */
+        if (!extent || extent->length ||
+            chunk->length < 4 + 8 || (chunk->length - 4) % 8) {
+            return -EINVAL;
+        }
+        if (nbd_co_read_payload(s, buf, 4 + 8) != 4 + 8) {
+            return -EIO;
+        }
+        if (ldl_be_p(buf) != s->info.meta_context_id) {
+            return -EINVAL;
+        }
+        extent->length = ldl_be_p(buf + 4);
+        extent->flags = ldl_be_p(buf + 8);
+        if (extent->length == 0 || extent->length > request->len) {
+            return -EINVAL;
+        }
+        /* We asked for a single extent; ignore any extra ones.  */
+        if (nbd_co_drop_payload(s, chunk->length - 4 - 8) < 0) {
+            return -EIO;
+        }
+        return 0;
+
+    default:
+        if (!NBD_REPLY_IS_ERR(chunk->type)) {
+            return -EINVAL;
+        }
+
+        /* Error chunk payload
+           [ 0 ..  3]    error
+           [ 4 ..  5]    message length
+           ...           message (and an offset for ERROR_OFFSET)
+         */
+        if (chunk->length < 4 + 2 ||
+            nbd_co_read_payload(s, buf, 4 + 2) != 4 + 2) {
+            return -EINVAL;
+        }
+        error = nbd_errno_to_system_errno(ldl_be_p(buf));
+        if (!error || nbd_co_drop_payload(s, chunk->length - 4 - 2) < 0) {
+            return -EINVAL;
+        }
+        return error;
+    }
+}
+
+/* Collect all chunks of a structured reply.  The header of the first
+ * chunk is already in s->reply.  */
+static void nbd_co_receive_chunks(NbdClientSession *s,
+                                  struct nbd_request *request,
+                                  struct nbd_reply *reply,
+                                  QEMUIOVector *qiov, NBDExtent *extent)
+{
+    int error = 0;
+    int ret;
+
+    for (;;) {
+        bool done = s->reply.flags & NBD_REPLY_FLAG_DONE;
+
+        ret = nbd_co_receive_chunk(s, request, &s->reply, qiov, extent);
+        if (ret < 0) {
+            /* The stream is out of sync and cannot be trusted anymore */
+            qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+            reply->error = EIO;
+            return;
+        }
+        if (ret > 0 && !error) {
+            error = ret;
+        }
+
+        /* Tell the read handler to read another header.  */
+        s->reply.handle = 0;
+        if (done) {
+            break;
+        }
+
+        qemu_coroutine_yield();
+        if (s->reply.handle != request->handle || !s->reply.structured ||
+            !s->ioc) {
+            reply->error = EIO;
+            return;
+        }
+    }
+
+    reply->error = error;
+}
+
 static void nbd_co_receive_reply(NbdClientSession *s,
                                  struct nbd_request *request,
                                  struct nbd_reply *reply,
-                                 QEMUIOVector *qiov)
+                                 QEMUIOVector *qiov, NBDExtent *extent)
 {
     int ret;
 
@@ -180,6 +360,8 @@ static void nbd_co_receive_reply(NbdClientSession *s,
     if (reply->handle != request->handle ||
         !s->ioc) {
         reply->error = EIO;
+    } else if (reply->structured) {
+        nbd_co_receive_chunks(s, request, reply, qiov, extent);
     } else {
         if (qiov && reply->error == 0) {
             ret = nbd_wr_syncv(s->ioc, qiov->iov, qiov->niov, request->len,
@@ -238,7 +420,7 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, qiov);
+        nbd_co_receive_reply(client, &request, &reply, qiov, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
@@ -257,7 +439,7 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     ssize_t ret;
 
     if (flags & BDRV_REQ_FUA) {
-        assert(client->nbdflags & NBD_FLAG_SEND_FUA);
+        assert(client->info.flags & NBD_FLAG_SEND_FUA);
         request.type |= NBD_CMD_FLAG_FUA;
     }
 
@@ -268,7 +450,7 @@ int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        nbd_co_receive_reply(client, &request, &reply, NULL, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
@@ -281,7 +463,7 @@ int nbd_client_co_flush(BlockDriverState *bs)
     struct nbd_reply reply;
     ssize_t ret;
 
-    if (!(client->nbdflags & NBD_FLAG_SEND_FLUSH)) {
+    if (!(client->info.flags & NBD_FLAG_SEND_FLUSH)) {
         return 0;
     }
 
@@ -293,7 +475,7 @@ int nbd_client_co_flush(BlockDriverState *bs)
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        nbd_co_receive_reply(client, &request, &reply, NULL, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
@@ -310,7 +492,7 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count)
     struct nbd_reply reply;
     ssize_t ret;
 
-    if (!(client->nbdflags & NBD_FLAG_SEND_TRIM)) {
+    if (!(client->info.flags & NBD_FLAG_SEND_TRIM)) {
         return 0;
     }
 
@@ -319,25 +501,84 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int count)
     if (ret < 0) {
         reply.error = -ret;
     } else {
-        nbd_co_receive_reply(client, &request, &reply, NULL);
+        nbd_co_receive_reply(client, &request, &reply, NULL, NULL);
     }
     nbd_coroutine_end(client, &request);
     return -reply.error;
 
 }
 
+int64_t coroutine_fn nbd_client_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum,
+                                                    BlockDriverState **file)
+{
+    NbdClientSession *client = nbd_get_client_session(bs);
+    uint64_t offset = sector_num << BDRV_SECTOR_BITS;
+    uint64_t bytes = (uint64_t)nb_sectors << BDRV_SECTOR_BITS;
+    struct nbd_request request = {
+        .type = NBD_CMD_BLOCK_STATUS | NBD_CMD_FLAG_REQ_ONE,
+        .from = offset,
+    };
+    struct nbd_reply reply;
+    NBDExtent extent = { 0 };
+    int64_t ret;
+
+    if (!client->info.has_meta_context) {
+        *pnum = nb_sectors;
+        *file = bs;
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID | offset;
+    }
+
+    request.len = MIN(MIN(bytes, client->info.size - offset),
+                      QEMU_ALIGN_DOWN(UINT32_MAX, BDRV_SECTOR_SIZE));
+
+    nbd_coroutine_start(client, &request);
+    ret = nbd_co_send_request(bs, &request, NULL);
+    if (ret < 0) {
+        reply.error = -ret;
+    } else {
+        nbd_co_receive_reply(client, &request, &reply, NULL, &extent);
+        if (!reply.error && !extent.length) {
+            reply.error = EIO;
+        }
+    }
+    nbd_coroutine_end(client, &request);
+    if (reply.error) {
+        return -reply.error;
+    }
+
+    /* Extents are byte granular, but block status works in sectors.  Round
+     * a short final extent up so that the caller always makes progress.  */
+    *pnum = DIV_ROUND_UP(extent.length, BDRV_SECTOR_SIZE);
+    *file = bs;
+
+    if (client->dirty_bitmap_context) {
+        /* Dirty areas are reported as data, clean ones as unallocated.  */
+        return extent.flags & NBD_STATE_DIRTY ? BDRV_BLOCK_DATA : 0;
+    }
+    if (extent.flags & NBD_STATE_HOLE) {
+        return extent.flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0;
+    }
+    ret = BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID | offset;
+    if (extent.flags & NBD_STATE_ZERO) {
+        ret |= BDRV_BLOCK_ZERO;
+    }
+    return ret;
+}
+
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
     aio_set_fd_handler(bdrv_get_aio_context(bs),
                        nbd_get_client_session(bs)->sioc->fd,
-                       false, NULL, NULL, NULL);
+                       false, NULL, NULL, NULL, NULL);
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
     aio_set_fd_handler(new_context, nbd_get_client_session(bs)->sioc->fd,
-                       false, nbd_reply_ready, NULL, bs);
+                       false, nbd_reply_ready, NULL, NULL, bs);
 }
 
 void nbd_client_close(BlockDriverState *bs)
@@ -363,25 +604,48 @@ int nbd_client_init(BlockDriverState *bs,
                     const char *export,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
+                    const char *x_dirty_bitmap,
                     Error **errp)
 {
     NbdClientSession *client = nbd_get_client_session(bs);
+    char *meta_context;
     int ret;
 
     /* NBD handshake */
     logout("session init %s\n", export);
     qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
 
+    client->info.request_structured = true;
+    if (x_dirty_bitmap) {
+        meta_context = g_strdup_printf("%s%s", NBD_META_QEMU_DIRTY_BITMAP,
+                                       x_dirty_bitmap);
+    } else {
+        meta_context = g_strdup(NBD_META_BASE_ALLOCATION);
+    }
+    client->info.meta_context = meta_context;
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
-                                &client->nbdflags,
                                 tlscreds, hostname,
-                                &client->ioc,
-                                &client->size, errp);
+                                &client->ioc, &client->info, errp);
+    client->info.meta_context = NULL;
+    g_free(meta_context);
     if (ret < 0) {
         logout("Failed to negotiate with the NBD server\n");
         return ret;
     }
-    if (client->nbdflags & NBD_FLAG_SEND_FUA) {
+    if (x_dirty_bitmap && !client->info.has_meta_context) {
+        struct nbd_request request = { .type = NBD_CMD_DISC };
+
+        error_setg(errp, "requested x-dirty-bitmap %s not found",
+                   x_dirty_bitmap);
+        nbd_send_request(client->ioc ?: QIO_CHANNEL(sioc), &request);
+        if (client->ioc) {
+            object_unref(OBJECT(client->ioc));
+            client->ioc = NULL;
+        }
+        return -EINVAL;
+    }
+    client->dirty_bitmap_context = x_dirty_bitmap != NULL;
+    if (client->info.flags & NBD_FLAG_SEND_FUA) {
         bs->supported_write_flags = BDRV_REQ_FUA;
     }
 
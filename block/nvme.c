@@ -0,0 +1,1224 @@
+/*
+ * NVMe block driver based on vfio
+ *
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <linux/vfio.h>
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+#include "qemu/error-report.h"
+#include "qemu/cutils.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
+#include "qemu/vfio-helpers.h"
+#include "block/block_int.h"
+#include "block/nvme.h"
+#include "trace.h"
+
+#define NVME_SQ_ENTRY_BYTES 64
+#define NVME_CQ_ENTRY_BYTES 16
+#define NVME_QUEUE_SIZE 128
+
+/* Offset of the doorbell registers in BAR 0 */
+#define NVME_DOORBELL_OFFSET 0x1000
+
+#define NVME_BLOCK_OPT_DEVICE "device"
+#define NVME_BLOCK_OPT_NAMESPACE "namespace"
+
+typedef struct {
+    int32_t  head, tail;
+    uint8_t  *queue;
+    uint64_t iova;
+    /* Hardware MMIO register */
+    volatile uint32_t *doorbell;
+} NVMeQueue;
+
+typedef void NVMeCompletionFunc(void *opaque, int ret);
+
+typedef struct {
+    NVMeCompletionFunc *cb;
+    void *opaque;
+    int cid;
+    void *prp_list_page;
+    uint64_t prp_list_iova;
+    int free_req_next; /* q->reqs[] index of next free req */
+} NVMeRequest;
+
+typedef struct {
+    int         index;
+    NVMeQueue   sq, cq;
+    int         cq_phase;
+    uint8_t     *prp_list_pages;
+    NVMeRequest reqs[NVME_QUEUE_SIZE];
+    int         free_req_head;
+    CoQueue     free_req_queue;
+    bool        busy;
+    int         need_kick;
+    int         inflight;
+} NVMeQueuePair;
+
+typedef struct {
+    AioContext *aio_context;
+    QEMUVFIOState *vfio;
+    volatile NvmeBar *regs;
+    volatile uint32_t *doorbells;
+    /* How many uint32_t elements does each doorbell entry take. */
+    int doorbell_scale;
+    /* The submission/completion queue pairs.
+     * [0]: admin queue.
+     * [1..]: io queues.
+     */
+    NVMeQueuePair **queues;
+    int nr_queues;
+    size_t page_size;
+    uint64_t nsze; /* Namespace size reported by identify command */
+    int nsid;      /* The namespace id to read/write data. */
+    int blkshift;
+    uint64_t max_transfer;
+    int plugged;
+
+    bool supports_write_zeroes;
+    bool supports_discard;
+
+    /* Requests currently holding temporary DMA mappings */
+    int dma_map_count;
+    /* Coroutines waiting for dma_map_count to drop to zero */
+    CoQueue dma_flush_queue;
+
+    EventNotifier irq_notifier;
+
+    /* Total size of the mmap'ed register area of BAR 0 */
+    size_t bar_size;
+    char *device;
+} BDRVNVMeState;
+
+static QemuOptsList runtime_opts = {
+    .name = "nvme",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = NVME_BLOCK_OPT_DEVICE,
+            .type = QEMU_OPT_STRING,
+            .help = "NVMe PCI device address",
+        },
+        {
+            .name = NVME_BLOCK_OPT_NAMESPACE,
+            .type = QEMU_OPT_NUMBER,
+            .help = "NVMe namespace",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void nvme_init_queue(BlockDriverState *bs, NVMeQueue *q,
+                            int nentries, int entry_bytes, Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    size_t bytes;
+    int r;
+
+    bytes = ROUND_UP(nentries * entry_bytes, getpagesize());
+    q->head = q->tail = 0;
+    q->queue = qemu_try_memalign(getpagesize(), bytes);
+    if (!q->queue) {
+        error_setg(errp, "Cannot allocate queue");
+        return;
+    }
+    memset(q->queue, 0, bytes);
+    r = qemu_vfio_dma_map(s->vfio, q->queue, bytes, false, &q->iova);
+    if (r) {
+        error_setg(errp, "Cannot map queue");
+    }
+}
+
+/* Remove the queue memory from the IOMMU before freeing it, so that the
+ * controller can no longer DMA into it. */
+static void nvme_free_queue_pair(BlockDriverState *bs, NVMeQueuePair *q)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    qemu_vfio_dma_unmap(s->vfio, q->prp_list_pages);
+    qemu_vfio_dma_unmap(s->vfio, q->sq.queue);
+    qemu_vfio_dma_unmap(s->vfio, q->cq.queue);
+    qemu_vfree(q->prp_list_pages);
+    qemu_vfree(q->sq.queue);
+    qemu_vfree(q->cq.queue);
+    g_free(q);
+}
+
+static NVMeQueuePair *nvme_create_queue_pair(BlockDriverState *bs,
+                                             int idx, int size,
+                                             Error **errp)
+{
+    int i, r;
+    BDRVNVMeState *s = bs->opaque;
+    Error *local_err = NULL;
+    NVMeQueuePair *q = g_new0(NVMeQueuePair, 1);
+    uint64_t prp_list_iova;
+
+    q->index = idx;
+    qemu_co_queue_init(&q->free_req_queue);
+    q->prp_list_pages = qemu_try_memalign(getpagesize(),
+                                          s->page_size * NVME_QUEUE_SIZE);
+    if (!q->prp_list_pages) {
+        error_setg(errp, "Cannot allocate PRP page list");
+        goto fail;
+    }
+    memset(q->prp_list_pages, 0, s->page_size * NVME_QUEUE_SIZE);
+    r = qemu_vfio_dma_map(s->vfio, q->prp_list_pages,
+                          s->page_size * NVME_QUEUE_SIZE,
+                          false, &prp_list_iova);
+    if (r) {
+        error_setg(errp, "Cannot map PRP page list");
+        goto fail;
+    }
+    /* Only size - 1 slots may be in flight, otherwise a full submission
+     * queue would be indistinguishable from an empty one. */
+    q->free_req_head = -1;
+    for (i = 0; i < NVME_QUEUE_SIZE; i++) {
+        NVMeRequest *req = &q->reqs[i];
+        req->cid = i;
+        req->prp_list_page = q->prp_list_pages + i * s->page_size;
+        req->prp_list_iova = prp_list_iova + i * s->page_size;
+        if (i < size - 1) {
+            req->free_req_next = q->free_req_head;
+            q->free_req_head = i;
+        }
+    }
+
+    nvme_init_queue(bs, &q->sq, size, NVME_SQ_ENTRY_BYTES, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+    q->sq.doorbell = &s->doorbells[idx * 2 * s->doorbell_scale];
+
+    nvme_init_queue(bs, &q->cq, size, NVME_CQ_ENTRY_BYTES, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto fail;
+    }
+    q->cq.doorbell = &s->doorbells[(idx * 2 + 1) * s->doorbell_scale];
+
+    /* Entries posted by the controller in its first pass have phase 1 */
+    q->cq_phase = 1;
+    return q;
+fail:
+    nvme_free_queue_pair(bs, q);
+    return NULL;
+}
+
+static void nvme_kick(BDRVNVMeState *s, NVMeQueuePair *q)
+{
+    if (s->plugged || !q->need_kick) {
+        return;
+    }
+    trace_nvme_kick(s, q->index);
+    /* Fence the submission queue entry write before ringing the doorbell */
+    smp_wmb();
+    *q->sq.doorbell = cpu_to_le32(q->sq.tail);
+    q->inflight += q->need_kick;
+    q->need_kick = 0;
+}
+
+/* Find a free request element if any, otherwise wait in a coroutine for one
+ * to be released by the completion path. */
+static NVMeRequest *nvme_get_free_req(NVMeQueuePair *q)
+{
+    NVMeRequest *req;
+
+    while (q->free_req_head == -1) {
+        trace_nvme_free_req_queue_wait(q);
+        qemu_co_queue_wait(&q->free_req_queue);
+    }
+
+    req = &q->reqs[q->free_req_head];
+    q->free_req_head = req->free_req_next;
+    req->free_req_next = -1;
+    return req;
+}
+
+static void nvme_put_free_req(NVMeQueuePair *q, NVMeRequest *req)
+{
+    req->cb = req->opaque = NULL;
+    req->free_req_next = q->free_req_head;
+    q->free_req_head = req - q->reqs;
+}
+
+static inline int nvme_translate_error(const NvmeCqe *c)
+{
+    /* Status code type and status code, without phase tag, M and DNR */
+    uint16_t status = (le16_to_cpu(c->status) >> 1) & 0x7FF;
+
+    if (status) {
+        trace_nvme_error(le32_to_cpu(c->result),
+                         le16_to_cpu(c->sq_head),
+                         le16_to_cpu(c->sq_id),
+                         le16_to_cpu(c->cid),
+                         status);
+    }
+    switch (status) {
+    case NVME_SUCCESS:
+        return 0;
+    case NVME_INVALID_OPCODE:
+        return -ENOTSUP;
+    default:
+        return -EIO;
+    }
+}
+
+/* Reap all completed commands of @q and invoke their callbacks.
+ * Returns true if any progress was made. */
+static bool nvme_process_completion(BDRVNVMeState *s, NVMeQueuePair *q)
+{
+    bool progress = false;
+    NVMeRequest *preq;
+    NVMeRequest req;
+    NvmeCqe *c;
+
+    trace_nvme_process_completion(s, q->index, q->inflight);
+    if (q->busy || s->plugged) {
+        trace_nvme_process_completion_queue_busy(s, q->index);
+        return false;
+    }
+    q->busy = true;
+    assert(q->inflight >= 0);
+    while (q->inflight) {
+        int cid;
+
+        c = (NvmeCqe *)&q->cq.queue[q->cq.head * NVME_CQ_ENTRY_BYTES];
+        if ((le16_to_cpu(c->status) & 0x1) != q->cq_phase) {
+            break;
+        }
+        /* Don't read the rest of the entry before the phase tag */
+        smp_rmb();
+        q->cq.head = (q->cq.head + 1) % NVME_QUEUE_SIZE;
+        if (!q->cq.head) {
+            q->cq_phase = !q->cq_phase;
+        }
+        cid = le16_to_cpu(c->cid);
+        if (cid < 0 || cid >= NVME_QUEUE_SIZE) {
+            error_report("NVMe: Unexpected CID in completion queue: %d", cid);
+            continue;
+        }
+        trace_nvme_complete_command(s, q->index, cid);
+        preq = &q->reqs[cid];
+        req = *preq;
+        assert(req.cid == cid);
+        assert(req.cb);
+        nvme_put_free_req(q, preq);
+        q->inflight--;
+        progress = true;
+
+        /* The callback may submit new requests, which is fine: it only
+         * touches the submission side while q->busy keeps us from
+         * recursing here. */
+        req.cb(req.opaque, nvme_translate_error(c));
+        qemu_co_enter_next(&q->free_req_queue);
+    }
+    if (progress) {
+        /* Notify the device so it can post more completions. */
+        smp_mb();
+        *q->cq.doorbell = cpu_to_le32(q->cq.head);
+    }
+    q->busy = false;
+    return progress;
+}
+
+static void nvme_submit_command(BDRVNVMeState *s, NVMeQueuePair *q,
+                                NVMeRequest *req,
+                                NvmeCmd *cmd, NVMeCompletionFunc cb,
+                                void *opaque)
+{
+    assert(!req->cb);
+    req->cb = cb;
+    req->opaque = opaque;
+    cmd->cid = cpu_to_le16(req->cid);
+
+    trace_nvme_submit_command(s, q->index, req->cid);
+    memcpy((uint8_t *)q->sq.queue +
+           q->sq.tail * NVME_SQ_ENTRY_BYTES, cmd, sizeof(*cmd));
+    q->sq.tail = (q->sq.tail + 1) % NVME_QUEUE_SIZE;
+    q->need_kick++;
+    nvme_kick(s, q);
+}
+
+static void nvme_cmd_sync_cb(void *opaque, int ret)
+{
+    int *pret = opaque;
+    *pret = ret;
+}
+
+/* Synchronously run an admin command; only used while opening the device,
+ * before any guest I/O can be outstanding. */
+static int nvme_cmd_sync(BlockDriverState *bs, NVMeQueuePair *q,
+                         NvmeCmd *cmd)
+{
+    NVMeRequest *req;
+    BDRVNVMeState *s = bs->opaque;
+    int ret = -EINPROGRESS;
+
+    req = nvme_get_free_req(q);
+    nvme_submit_command(s, q, req, cmd, nvme_cmd_sync_cb, &ret);
+    while (ret == -EINPROGRESS) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+    }
+    return ret;
+}
+
+static void nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NvmeIdCtrl *idctrl;
+    NvmeIdNs *idns;
+    NvmeLBAF *lbaf;
+    uint8_t *resp;
+    size_t resp_size;
+    uint16_t oncs;
+    int r;
+    uint64_t iova;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_IDENTIFY,
+        .cdw10 = cpu_to_le32(0x1),
+    };
+
+    resp_size = ROUND_UP(sizeof(NvmeIdCtrl), getpagesize());
+    resp = qemu_try_memalign(getpagesize(), resp_size);
+    if (!resp) {
+        error_setg(errp, "Cannot allocate buffer for identify response");
+        goto out;
+    }
+    idctrl = (NvmeIdCtrl *)resp;
+    idns = (NvmeIdNs *)resp;
+    r = qemu_vfio_dma_map(s->vfio, resp, resp_size, true, &iova);
+    if (r) {
+        error_setg(errp, "Cannot map buffer for DMA");
+        goto out;
+    }
+    cmd.prp1 = cpu_to_le64(iova);
+
+    if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
+        error_setg(errp, "Failed to identify controller");
+        goto out;
+    }
+
+    if (le32_to_cpu(idctrl->nn) < namespace) {
+        error_setg(errp, "Invalid namespace");
+        goto out;
+    }
+    /* MDTS is in units of the minimum page size, 0 means unlimited */
+    s->max_transfer = idctrl->mdts ? (1ULL << idctrl->mdts) * s->page_size
+                                   : 0;
+    /* For now the page list buffer per command is one page, to hold at most
+     * s->page_size / sizeof(uint64_t) entries. */
+    s->max_transfer = MIN_NON_ZERO(s->max_transfer,
+                          s->page_size / sizeof(uint64_t) * s->page_size);
+
+    oncs = le16_to_cpu(idctrl->oncs);
+    s->supports_write_zeroes = !!(oncs & NVME_ONCS_WRITE_ZEROS);
+    s->supports_discard = !!(oncs & NVME_ONCS_DSM);
+
+    memset(resp, 0, sizeof(NvmeIdCtrl));
+    cmd.cdw10 = 0;
+    cmd.nsid = cpu_to_le32(namespace);
+    if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
+        error_setg(errp, "Failed to identify namespace");
+        goto out;
+    }
+
+    s->nsze = le64_to_cpu(idns->nsze);
+    lbaf = &idns->lbaf[NVME_ID_NS_FLBAS_INDEX(idns->flbas)];
+
+    if (lbaf->ms) {
+        error_setg(errp, "Namespaces with metadata are not yet supported");
+        goto out;
+    }
+
+    if (lbaf->ds < BDRV_SECTOR_BITS || lbaf->ds > 12 ||
+        (1 << lbaf->ds) > s->page_size) {
+        error_setg(errp, "Namespace has unsupported block size (2^%d)",
+                   lbaf->ds);
+        goto out;
+    }
+
+    s->blkshift = lbaf->ds;
+out:
+    qemu_vfio_dma_reset_temporary(s->vfio);
+    qemu_vfree(resp);
+}
+
+static bool nvme_poll_queues(BDRVNVMeState *s)
+{
+    bool progress = false;
+    int i;
+
+    for (i = 0; i < s->nr_queues; i++) {
+        NVMeQueuePair *q = s->queues[i];
+        while (nvme_process_completion(s, q)) {
+            /* Keep polling */
+            progress = true;
+        }
+    }
+    return progress;
+}
+
+static void nvme_handle_event(EventNotifier *n)
+{
+    BDRVNVMeState *s = container_of(n, BDRVNVMeState, irq_notifier);
+
+    trace_nvme_handle_event(s);
+    event_notifier_test_and_clear(n);
+    nvme_poll_queues(s);
+}
+
+static bool nvme_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    BDRVNVMeState *s = container_of(e, BDRVNVMeState, irq_notifier);
+
+    trace_nvme_poll_cb(s);
+    return nvme_poll_queues(s);
+}
+
+static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    int n = s->nr_queues;
+    NVMeQueuePair *q;
+    NvmeCmd cmd;
+    int queue_size = NVME_QUEUE_SIZE;
+
+    q = nvme_create_queue_pair(bs, n, queue_size, errp);
+    if (!q) {
+        return false;
+    }
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_CREATE_CQ,
+        .prp1 = cpu_to_le64(q->cq.iova),
+        .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | (n & 0xFFFF)),
+        /* Physically contiguous, interrupts enabled on vector 0 */
+        .cdw11 = cpu_to_le32(0x3),
+    };
+    if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
+        error_setg(errp, "Failed to create io queue [%d]", n);
+        nvme_free_queue_pair(bs, q);
+        return false;
+    }
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_CREATE_SQ,
+        .prp1 = cpu_to_le64(q->sq.iova),
+        .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | (n & 0xFFFF)),
+        /* Physically contiguous, completions go to CQ n */
+        .cdw11 = cpu_to_le32(0x1 | (n << 16)),
+    };
+    if (nvme_cmd_sync(bs, s->queues[0], &cmd)) {
+        error_setg(errp, "Failed to create io queue [%d]", n);
+        /* The CQ already exists, drop it before its memory goes away */
+        cmd = (NvmeCmd) {
+            .opcode = NVME_ADM_CMD_DELETE_CQ,
+            .cdw10 = cpu_to_le32(n & 0xFFFF),
+        };
+        nvme_cmd_sync(bs, s->queues[0], &cmd);
+        nvme_free_queue_pair(bs, q);
+        return false;
+    }
+    s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
+    s->queues[n] = q;
+    s->nr_queues++;
+    return true;
+}
+
+static int nvme_wait_ready(BDRVNVMeState *s, bool ready, uint64_t timeout_ms,
+                           Error **errp)
+{
+    uint32_t csts;
+    int64_t deadline = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                       timeout_ms * SCALE_MS;
+
+    for (;;) {
+        csts = le32_to_cpu(s->regs->csts);
+        if ((csts & NVME_CSTS_FAILED) && ready) {
+            error_setg(errp, "Controller fatal status while enabling");
+            return -EIO;
+        }
+        if (!!NVME_CSTS_RDY(csts) == ready) {
+            return 0;
+        }
+        if (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) > deadline) {
+            error_setg(errp, "Timeout while waiting for device to %s (%"
+                       PRIu64 " ms)", ready ? "start" : "reset", timeout_ms);
+            return -ETIMEDOUT;
+        }
+        g_usleep(1000);
+    }
+}
+
+static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
+                     Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    int ret;
+    uint64_t cap;
+    uint64_t timeout_ms;
+    size_t doorbells_size;
+    Error *local_err = NULL;
+
+    qemu_co_queue_init(&s->dma_flush_queue);
+    s->device = g_strdup(device);
+    s->nsid = namespace;
+    s->aio_context = bdrv_get_aio_context(bs);
+    ret = event_notifier_init(&s->irq_notifier, 0);
+    if (ret) {
+        error_setg(errp, "Failed to init event notifier");
+        return ret;
+    }
+
+    s->vfio = qemu_vfio_open_pci(device, errp);
+    if (!s->vfio) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->bar_size = ROUND_UP(sizeof(NvmeBar), getpagesize());
+    s->regs = qemu_vfio_pci_map_bar(s->vfio, 0, 0, s->bar_size, errp);
+    if (!s->regs) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* Perform initialize sequence as described in NVMe spec "7.6.1
+     * Initialization". */
+
+    cap = le64_to_cpu(s->regs->cap);
+    if (!(NVME_CAP_CSS(cap) & 1)) {
+        error_setg(errp, "Device doesn't support NVMe command set");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->page_size = MAX(4096, 1 << (12 + NVME_CAP_MPSMIN(cap)));
+    if (s->page_size > getpagesize() ||
+        !QEMU_IS_ALIGNED(getpagesize(), s->page_size)) {
+        error_setg(errp, "Unsupported device page size %zu", s->page_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->doorbell_scale = (4 << NVME_CAP_DSTRD(cap)) / sizeof(uint32_t);
+    timeout_ms = MIN(500 * NVME_CAP_TO(cap), 30000);
+
+    /* Now that the doorbell stride is known, remap BAR 0 to cover the
+     * doorbells of the admin queue and one I/O queue pair. */
+    doorbells_size = 4 * (4 << NVME_CAP_DSTRD(cap));
+    qemu_vfio_pci_unmap_bar(s->vfio, 0, (void *)s->regs, 0, s->bar_size);
+    s->bar_size = ROUND_UP(NVME_DOORBELL_OFFSET + doorbells_size,
+                           getpagesize());
+    s->regs = qemu_vfio_pci_map_bar(s->vfio, 0, 0, s->bar_size, errp);
+    if (!s->regs) {
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->doorbells = (volatile uint32_t *)((uint8_t *)s->regs +
+                                         NVME_DOORBELL_OFFSET);
+
+    /* Reset device to get a clean state. */
+    s->regs->cc = cpu_to_le32(le32_to_cpu(s->regs->cc) & 0xFE);
+    /* Wait for CSTS.RDY = 0. */
+    ret = nvme_wait_ready(s, false, timeout_ms, errp);
+    if (ret) {
+        goto fail;
+    }
+
+    /* Set up admin queue. */
+    s->queues = g_new(NVMeQueuePair *, 1);
+    s->queues[0] = nvme_create_queue_pair(bs, 0, NVME_QUEUE_SIZE, errp);
+    if (!s->queues[0]) {
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->nr_queues = 1;
+    /* Queue sizes in AQA are zero based */
+    s->regs->aqa = cpu_to_le32(((NVME_QUEUE_SIZE - 1) << 16) |
+                               (NVME_QUEUE_SIZE - 1));
+    s->regs->asq = cpu_to_le64(s->queues[0]->sq.iova);
+    s->regs->acq = cpu_to_le64(s->queues[0]->cq.iova);
+
+    /* After setting up all control registers we can enable device now. */
+    s->regs->cc = cpu_to_le32((ctz32(NVME_CQ_ENTRY_BYTES) << CC_IOCQES_SHIFT) |
+                              (ctz32(NVME_SQ_ENTRY_BYTES) << CC_IOSQES_SHIFT) |
+                              ((ctz32(s->page_size) - 12) << CC_MPS_SHIFT) |
+                              CC_EN_MASK);
+    /* Wait for CSTS.RDY = 1. */
+    ret = nvme_wait_ready(s, true, timeout_ms, errp);
+    if (ret) {
+        goto fail;
+    }
+
+    ret = qemu_vfio_pci_init_irq(s->vfio, &s->irq_notifier,
+                                 VFIO_PCI_MSIX_IRQ_INDEX, errp);
+    if (ret) {
+        goto fail;
+    }
+    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
+                           false, nvme_handle_event, nvme_poll_cb);
+
+    nvme_identify(bs, namespace, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EIO;
+        goto fail_handler;
+    }
+
+    /* Set up command queues. */
+    if (!nvme_add_io_queue(bs, errp)) {
+        ret = -EIO;
+        goto fail_handler;
+    }
+    bs->supported_write_flags = BDRV_REQ_FUA;
+    bs->supported_zero_flags = BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP;
+    return 0;
+
+fail_handler:
+    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
+                           false, NULL, NULL);
+fail:
+    if (s->regs) {
+        qemu_vfio_pci_unmap_bar(s->vfio, 0, (void *)s->regs, 0, s->bar_size);
+    }
+    /* Queue memory is unmapped before it is freed, so this can happen
+     * before the device is reset by qemu_vfio_close() */
+    if (s->queues) {
+        int i;
+
+        for (i = 0; i < s->nr_queues; i++) {
+            nvme_free_queue_pair(bs, s->queues[i]);
+        }
+        g_free(s->queues);
+        s->queues = NULL;
+    }
+    qemu_vfio_close(s->vfio);
+    event_notifier_cleanup(&s->irq_notifier);
+    g_free(s->device);
+    return ret;
+}
+
+/* Parse a filename in the format of nvme://XXXX:XX:XX.X/X. Example:
+ *
+ *     nvme://0000:44:00.0/1
+ *
+ * where the "nvme://" is a fixed form of the protocol prefix, the middle part
+ * is the PCI address, and the last part is the namespace number starting from
+ * 1 according to the NVMe spec. */
+static void nvme_parse_filename(const char *filename, QDict *options,
+                                Error **errp)
+{
+    int pref = strlen("nvme://");
+
+    if (strlen(filename) > pref && !strncmp(filename, "nvme://", pref)) {
+        const char *tmp = filename + pref;
+        char *device;
+        const char *namespace;
+        unsigned long ns;
+        const char *slash = strchr(tmp, '/');
+        if (!slash) {
+            qdict_put(options, NVME_BLOCK_OPT_DEVICE,
+                      qstring_from_str(tmp));
+            return;
+        }
+        device = g_strndup(tmp, slash - tmp);
+        qdict_put(options, NVME_BLOCK_OPT_DEVICE, qstring_from_str(device));
+        g_free(device);
+        namespace = slash + 1;
+        if (*namespace && (qemu_strtoul(namespace, NULL, 10, &ns) || !ns)) {
+            error_setg(errp, "Invalid namespace '%s', positive number expected",
+                       namespace);
+            return;
+        }
+        qdict_put(options, NVME_BLOCK_OPT_NAMESPACE,
+                  qstring_from_str(*namespace ? namespace : "1"));
+    }
+}
+
+static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
+                          Error **errp)
+{
+    const char *device;
+    QemuOpts *opts;
+    int namespace;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &error_abort);
+    device = qemu_opt_get(opts, NVME_BLOCK_OPT_DEVICE);
+    if (!device) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_DEVICE "' option is required");
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+
+    namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
+    if (namespace < 1) {
+        error_setg(errp, "Invalid namespace %d", namespace);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    ret = nvme_init(bs, device, namespace, errp);
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void nvme_close(BlockDriverState *bs)
+{
+    int i;
+    BDRVNVMeState *s = bs->opaque;
+
+    aio_set_event_notifier(bdrv_get_aio_context(bs), &s->irq_notifier,
+                           false, NULL, NULL);
+    event_notifier_cleanup(&s->irq_notifier);
+    qemu_vfio_pci_unmap_bar(s->vfio, 0, (void *)s->regs, 0, s->bar_size);
+    /* nvme_free_queue_pair() needs the VFIO state to unmap the queues */
+    for (i = 0; i < s->nr_queues; ++i) {
+        nvme_free_queue_pair(bs, s->queues[i]);
+    }
+    g_free(s->queues);
+    qemu_vfio_close(s->vfio);
+    g_free(s->device);
+}
+
+static int64_t nvme_getlength(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    return s->nsze << s->blkshift;
+}
+
+/* Map the whole @qiov for DMA and fill the PRP entries of @cmd.  Each
+ * element of @qiov must be page aligned, and all but the last one a whole
+ * number of pages long; the caller bounces anything else. */
+static coroutine_fn int nvme_cmd_map_qiov(BlockDriverState *bs, NvmeCmd *cmd,
+                                          NVMeRequest *req, QEMUIOVector *qiov)
+{
+    BDRVNVMeState *s = bs->opaque;
+    uint64_t *pagelist = req->prp_list_page;
+    int i, j, r;
+    int entries;
+    bool flushed = false;
+
+    assert(qiov->size);
+
+retry:
+    entries = 0;
+    for (i = 0; i < qiov->niov; ++i) {
+        uint64_t iova;
+        size_t len = ROUND_UP(qiov->iov[i].iov_len, getpagesize());
+
+        r = qemu_vfio_dma_map(s->vfio, qiov->iov[i].iov_base, len, true,
+                              &iova);
+        if (r == -ENOMEM && !flushed) {
+            /* The temporary IOVA space is exhausted.  Wait until no request
+             * uses a temporary mapping, recycle them all and start over. */
+            flushed = true;
+            trace_nvme_dma_flush_queue_wait(s);
+            while (s->dma_map_count) {
+                qemu_co_queue_wait(&s->dma_flush_queue);
+            }
+            r = qemu_vfio_dma_reset_temporary(s->vfio);
+            if (r) {
+                return r;
+            }
+            goto retry;
+        } else if (r) {
+            return r;
+        }
+
+        for (j = 0; j < qiov->iov[i].iov_len / s->page_size; j++) {
+            pagelist[entries++] = cpu_to_le64(iova + j * s->page_size);
+        }
+        if (!QEMU_IS_ALIGNED(qiov->iov[i].iov_len, s->page_size)) {
+            pagelist[entries++] = cpu_to_le64(iova + j * s->page_size);
+        }
+        trace_nvme_cmd_map_qiov_iov(s, i, qiov->iov[i].iov_base,
+                                    qiov->iov[i].iov_len / s->page_size);
+    }
+
+    assert(entries <= s->page_size / sizeof(uint64_t));
+    switch (entries) {
+    case 0:
+        abort();
+    case 1:
+        cmd->prp1 = pagelist[0];
+        cmd->prp2 = 0;
+        break;
+    case 2:
+        cmd->prp1 = pagelist[0];
+        cmd->prp2 = pagelist[1];
+        break;
+    default:
+        cmd->prp1 = pagelist[0];
+        cmd->prp2 = cpu_to_le64(req->prp_list_iova + sizeof(uint64_t));
+        break;
+    }
+    s->dma_map_count++;
+    trace_nvme_cmd_map_qiov(s, cmd, req, qiov, entries);
+    for (i = 0; i < entries; ++i) {
+        trace_nvme_cmd_map_qiov_pages(s, i, pagelist[i]);
+    }
+    return 0;
+}
+
+static coroutine_fn void nvme_dma_unmap_done(BDRVNVMeState *s)
+{
+    assert(s->dma_map_count > 0);
+    if (!--s->dma_map_count) {
+        qemu_co_queue_restart_all(&s->dma_flush_queue);
+    }
+}
+
+typedef struct {
+    Coroutine *co;
+    int ret;
+} NVMeCoData;
+
+static void nvme_rw_cb(void *opaque, int ret)
+{
+    NVMeCoData *data = opaque;
+
+    data->ret = ret;
+    if (data->co) {
+        qemu_coroutine_enter(data->co);
+    }
+}
+
+/* Submit @cmd on the I/O queue and yield until it completes. */
+static coroutine_fn int nvme_co_submit(BlockDriverState *bs, NVMeRequest *req,
+                                       NvmeCmd *cmd)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NVMeQueuePair *ioq = s->queues[1];
+    NVMeCoData data = {
+        .co = qemu_coroutine_self(),
+        .ret = -EINPROGRESS,
+    };
+
+    nvme_submit_command(s, ioq, req, cmd, nvme_rw_cb, &data);
+    while (data.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return data.ret;
+}
+
+static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
+                                            uint64_t offset, uint64_t bytes,
+                                            QEMUIOVector *qiov,
+                                            bool is_write,
+                                            int flags)
+{
+    int r;
+    BDRVNVMeState *s = bs->opaque;
+    NVMeQueuePair *ioq = s->queues[1];
+    NVMeRequest *req;
+    uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
+                     (flags & BDRV_REQ_FUA ? 1 << 30 : 0);
+    NvmeCmd cmd = {
+        .opcode = is_write ? NVME_CMD_WRITE : NVME_CMD_READ,
+        .nsid = cpu_to_le32(s->nsid),
+        .cdw10 = cpu_to_le32((offset >> s->blkshift) & 0xFFFFFFFF),
+        .cdw11 = cpu_to_le32(((offset >> s->blkshift) >> 32) & 0xFFFFFFFF),
+        .cdw12 = cpu_to_le32(cdw12),
+    };
+
+    trace_nvme_prw_aligned(s, is_write, offset, bytes, flags, qiov->niov);
+    assert(s->nr_queues > 1);
+    req = nvme_get_free_req(ioq);
+    r = nvme_cmd_map_qiov(bs, &cmd, req, qiov);
+    if (r) {
+        nvme_put_free_req(ioq, req);
+        qemu_co_queue_next(&ioq->free_req_queue);
+        return r;
+    }
+    r = nvme_co_submit(bs, req, &cmd);
+    nvme_dma_unmap_done(s);
+
+    trace_nvme_rw_done(s, is_write, offset, bytes, r);
+    return r;
+}
+
+static inline bool nvme_qiov_aligned(BlockDriverState *bs,
+                                     const QEMUIOVector *qiov)
+{
+    int i;
+    BDRVNVMeState *s = bs->opaque;
+
+    for (i = 0; i < qiov->niov; ++i) {
+        if (!QEMU_PTR_IS_ALIGNED(qiov->iov[i].iov_base, getpagesize()) ||
+            (i < qiov->niov - 1 &&
+             !QEMU_IS_ALIGNED(qiov->iov[i].iov_len, s->page_size))) {
+            trace_nvme_qiov_unaligned(qiov, i, qiov->iov[i].iov_base,
+                                      qiov->iov[i].iov_len, s->page_size);
+            return false;
+        }
+    }
+    return true;
+}
+
+static coroutine_fn int nvme_co_prw(BlockDriverState *bs, uint64_t offset,
+                                    uint64_t bytes, QEMUIOVector *qiov,
+                                    bool is_write, int flags)
+{
+    BDRVNVMeState *s = bs->opaque;
+    int r;
+    uint8_t *buf = NULL;
+    QEMUIOVector local_qiov;
+
+    assert(QEMU_IS_ALIGNED(offset, 1 << s->blkshift));
+    assert(QEMU_IS_ALIGNED(bytes, 1 << s->blkshift));
+    assert(bytes <= s->max_transfer);
+    if (nvme_qiov_aligned(bs, qiov)) {
+        return nvme_co_prw_aligned(bs, offset, bytes, qiov, is_write, flags);
+    }
+    trace_nvme_prw_buffered(s, offset, bytes, qiov->niov, is_write);
+    buf = qemu_try_memalign(getpagesize(), ROUND_UP(bytes, getpagesize()));
+    if (!buf) {
+        return -ENOMEM;
+    }
+    qemu_iovec_init(&local_qiov, 1);
+    if (is_write) {
+        qemu_iovec_to_buf(qiov, 0, buf, bytes);
+    }
+    qemu_iovec_add(&local_qiov, buf, bytes);
+    r = nvme_co_prw_aligned(bs, offset, bytes, &local_qiov, is_write, flags);
+    qemu_iovec_destroy(&local_qiov);
+    if (!r && !is_write) {
+        qemu_iovec_from_buf(qiov, 0, buf, bytes);
+    }
+    qemu_vfree(buf);
+    return r;
+}
+
+static coroutine_fn int nvme_co_preadv(BlockDriverState *bs,
+                                       uint64_t offset, uint64_t bytes,
+                                       QEMUIOVector *qiov, int flags)
+{
+    return nvme_co_prw(bs, offset, bytes, qiov, false, flags);
+}
+
+static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
+                                        uint64_t offset, uint64_t bytes,
+                                        QEMUIOVector *qiov, int flags)
+{
+    return nvme_co_prw(bs, offset, bytes, qiov, true, flags);
+}
+
+static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NVMeQueuePair *ioq = s->queues[1];
+    NVMeRequest *req;
+    NvmeCmd cmd = {
+        .opcode = NVME_CMD_FLUSH,
+        .nsid = cpu_to_le32(s->nsid),
+    };
+
+    assert(s->nr_queues > 1);
+    req = nvme_get_free_req(ioq);
+    return nvme_co_submit(bs, req, &cmd);
+}
+
+static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
+                                              int64_t offset, int count,
+                                              BdrvRequestFlags flags)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NVMeQueuePair *ioq = s->queues[1];
+    NVMeRequest *req;
+    uint32_t cdw12 = ((count >> s->blkshift) - 1) & 0xFFFF;
+    NvmeCmd cmd = {
+        .opcode = NVME_CMD_WRITE_ZEROS,
+        .nsid = cpu_to_le32(s->nsid),
+        .cdw10 = cpu_to_le32((offset >> s->blkshift) & 0xFFFFFFFF),
+        .cdw11 = cpu_to_le32(((offset >> s->blkshift) >> 32) & 0xFFFFFFFF),
+    };
+
+    if (!s->supports_write_zeroes) {
+        return -ENOTSUP;
+    }
+
+    if (flags & BDRV_REQ_MAY_UNMAP) {
+        /* Deallocate the blocks if the device can do so and still read
+         * back zeroes. */
+        cdw12 |= 1 << 25;
+    }
+    if (flags & BDRV_REQ_FUA) {
+        cdw12 |= 1 << 30;
+    }
+    cmd.cdw12 = cpu_to_le32(cdw12);
+
+    trace_nvme_write_zeroes(s, offset, count, flags);
+    assert(s->nr_queues > 1);
+    req = nvme_get_free_req(ioq);
+    return nvme_co_submit(bs, req, &cmd);
+}
+
+static coroutine_fn int nvme_co_pdiscard(BlockDriverState *bs,
+                                         int64_t offset, int count)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NVMeQueuePair *ioq = s->queues[1];
+    NVMeRequest *req;
+    NvmeDsmRange *buf;
+    QEMUIOVector local_qiov;
+    int r;
+    NvmeCmd cmd = {
+        .opcode = NVME_CMD_DSM,
+        .nsid = cpu_to_le32(s->nsid),
+        .cdw10 = cpu_to_le32(0), /* number of ranges - 1 */
+        .cdw11 = cpu_to_le32(NVME_DSMGMT_AD),
+    };
+
+    if (!s->supports_discard) {
+        return -ENOTSUP;
+    }
+
+    assert(s->nr_queues > 1);
+
+    buf = qemu_try_memalign(getpagesize(), getpagesize());
+    if (!buf) {
+        return -ENOMEM;
+    }
+    memset(buf, 0, getpagesize());
+    buf->nlb = cpu_to_le32(count >> s->blkshift);
+    buf->slba = cpu_to_le64(offset >> s->blkshift);
+    buf->cattr = 0;
+
+    qemu_iovec_init(&local_qiov, 1);
+    qemu_iovec_add(&local_qiov, buf, sizeof(*buf));
+
+    trace_nvme_dsm(s, offset, count);
+    req = nvme_get_free_req(ioq);
+    r = nvme_cmd_map_qiov(bs, &cmd, req, &local_qiov);
+    if (r) {
+        nvme_put_free_req(ioq, req);
+        qemu_co_queue_next(&ioq->free_req_queue);
+        goto out;
+    }
+    r = nvme_co_submit(bs, req, &cmd);
+    nvme_dma_unmap_done(s);
+    trace_nvme_dsm_done(s, offset, count, r);
+out:
+    qemu_iovec_destroy(&local_qiov);
+    qemu_vfree(buf);
+    return r;
+}
+
+static int nvme_reopen_prepare(BDRVReopenState *reopen_state,
+                               BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static void nvme_refresh_filename(BlockDriverState *bs, QDict *opts)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    QINCREF(opts);
+    qdict_del(opts, "filename");
+
+    snprintf(bs->exact_filename, sizeof(bs->exact_filename), "nvme://%s/%i",
+             s->device, s->nsid);
+
+    qdict_put(opts, "driver", qstring_from_str(bs->drv->format_name));
+    bs->full_open_options = opts;
+}
+
+static void nvme_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    bs->bl.opt_mem_alignment = getpagesize();
+    bs->bl.request_alignment = 1 << s->blkshift;
+    bs->bl.max_transfer = s->max_transfer;
+    /* The block count of a write zeroes command is 16 bits wide */
+    bs->bl.max_pwrite_zeroes = MIN((uint64_t)0x10000 << s->blkshift,
+                                   INT_MAX & ~((1 << s->blkshift) - 1));
+    bs->bl.max_pdiscard = INT_MAX & ~((1 << s->blkshift) - 1);
+}
+
+static void nvme_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    aio_set_event_notifier(s->aio_context, &s->irq_notifier,
+                           false, NULL, NULL);
+}
+
+static void nvme_attach_aio_context(BlockDriverState *bs,
+                                    AioContext *new_context)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    s->aio_context = new_context;
+    aio_set_event_notifier(new_context, &s->irq_notifier,
+                           false, nvme_handle_event, nvme_poll_cb);
+}
+
+static void nvme_aio_plug(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+
+    s->plugged++;
+}
+
+static void nvme_aio_unplug(BlockDriverState *bs)
+{
+    int i;
+    BDRVNVMeState *s = bs->opaque;
+
+    assert(s->plugged);
+    if (!--s->plugged) {
+        for (i = 0; i < s->nr_queues; i++) {
+            NVMeQueuePair *q = s->queues[i];
+            nvme_kick(s, q);
+            /* Completions are not reaped while plugged, catch up now */
+            nvme_process_completion(s, q);
+        }
+    }
+}
+
+static BlockDriver bdrv_nvme = {
+    .format_name              = "nvme",
+    .protocol_name            = "nvme",
+    .instance_size            = sizeof(BDRVNVMeState),
+
+    .bdrv_parse_filename      = nvme_parse_filename,
+    .bdrv_file_open           = nvme_file_open,
+    .bdrv_close               = nvme_close,
+    .bdrv_getlength           = nvme_getlength,
+
+    .bdrv_co_preadv           = nvme_co_preadv,
+    .bdrv_co_pwritev          = nvme_co_pwritev,
+    .bdrv_co_pwrite_zeroes    = nvme_co_pwrite_zeroes,
+    .bdrv_co_pdiscard         = nvme_co_pdiscard,
+    .bdrv_co_flush_to_disk    = nvme_co_flush,
+    .bdrv_reopen_prepare      = nvme_reopen_prepare,
+
+    .bdrv_refresh_filename    = nvme_refresh_filename,
+    .bdrv_refresh_limits      = nvme_refresh_limits,
+
+    .bdrv_detach_aio_context  = nvme_detach_aio_context,
+    .bdrv_attach_aio_context  = nvme_attach_aio_context,
+
+    .bdrv_io_plug             = nvme_aio_plug,
+    .bdrv_io_unplug           = nvme_aio_unplug,
+};
+
+static void bdrv_nvme_init(void)
+{
+    bdrv_register(&bdrv_nvme);
+}
+
+block_init(bdrv_nvme_init);
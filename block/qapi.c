@@ -119,6 +119,8 @@ BlockDeviceInfo *bdrv_block_device_info(BlockBackend *blk,
 
         info->has_group = true;
         info->group = g_strdup(throttle_group_get_name(blk));
+        info->has_group_weight = true;
+        info->group_weight = throttle_group_get_weight(blk);
     }
 
     info->write_threshold = bdrv_write_threshold_get(bs);
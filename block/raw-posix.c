@@ -61,6 +61,7 @@
 #include <linux/fs.h>
 #include <linux/hdreg.h>
 #include <scsi/sg.h>
+#include <sys/syscall.h>
 #ifdef __s390__
 #include <asm/dasd.h>
 #endif
@@ -143,6 +144,9 @@ typedef struct BDRVRawState {
     bool has_discard:1;
     bool has_write_zeroes:1;
     bool discard_zeroes:1;
+#ifdef CONFIG_LINUX_IO_URING
+    bool io_uring_no_fallocate:1;
+#endif
     bool has_fallocate;
     bool needs_alignment;
 } BDRVRawState;
@@ -167,6 +171,8 @@ typedef struct RawPosixAIOData {
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
     off_t aio_offset;
     int aio_type;
+    int aio_fd2;            /* for QEMU_AIO_COPY_RANGE */
+    off_t aio_offset2;      /* for QEMU_AIO_COPY_RANGE */
 } RawPosixAIOData;
 
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -459,6 +465,23 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
+#ifdef CONFIG_LINUX_IO_URING
+    if ((bdrv_flags & BDRV_O_IO_URING) &&
+        !aio_get_linux_io_uring(bdrv_get_aio_context(bs))) {
+        error_setg(errp, "aio=io_uring was specified, but io_uring could "
+                         "not be initialized.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#else
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        error_setg(errp, "aio=io_uring was specified, but is not supported "
+                         "in this build.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#endif /* !defined(CONFIG_LINUX_IO_URING) */
+
     s->has_discard = true;
     s->has_write_zeroes = true;
     bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
@@ -1138,6 +1161,57 @@ static ssize_t handle_aiocb_discard(RawPosixAIOData *aiocb)
     return ret;
 }
 
+#ifndef CONFIG_COPY_FILE_RANGE
+static off_t copy_file_range(int in_fd, off_t *in_off, int out_fd,
+                             off_t *out_off, size_t len, unsigned int flags)
+{
+#ifdef __NR_copy_file_range
+    return syscall(__NR_copy_file_range, in_fd, in_off, out_fd,
+                   out_off, len, flags);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+#endif
+
+/* The kernel decides how to implement the copy: file systems that support
+ * reflinks share the extents, NFS and CIFS copy on the server, and anything
+ * else at least avoids the round trip through user space. */
+static ssize_t handle_aiocb_copy_range(RawPosixAIOData *aiocb)
+{
+    uint64_t bytes = aiocb->aio_nbytes;
+    off_t in_off = aiocb->aio_offset;
+    off_t out_off = aiocb->aio_offset2;
+
+    while (bytes) {
+        ssize_t ret = copy_file_range(aiocb->aio_fildes, &in_off,
+                                      aiocb->aio_fd2, &out_off,
+                                      bytes, 0);
+        if (ret == 0) {
+            /* The source ends early; regular reads past EOF return zeroes,
+             * so let the caller take that path */
+            return -ENOTSUP;
+        }
+        if (ret < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case ENOSYS:
+            case EXDEV:
+            case EINVAL:
+            case EBADF:
+            case EOPNOTSUPP:
+                return -ENOTSUP;
+            default:
+                return -errno;
+            }
+        }
+        bytes -= ret;
+    }
+    return 0;
+}
+
 static int aio_worker(void *arg)
 {
     RawPosixAIOData *aiocb = arg;
@@ -1178,6 +1252,9 @@ static int aio_worker(void *arg)
     case QEMU_AIO_WRITE_ZEROES:
         ret = handle_aiocb_write_zeroes(aiocb);
         break;
+    case QEMU_AIO_COPY_RANGE:
+        ret = handle_aiocb_copy_range(aiocb);
+        break;
     default:
         fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
         ret = -EINVAL;
@@ -1213,6 +1290,27 @@ static int paio_submit_co(BlockDriverState *bs, int fd,
     return thread_pool_submit_co(pool, aio_worker, acb);
 }
 
+static int paio_submit_copy_range_co(BlockDriverState *bs,
+                                     int src_fd, int64_t src_offset,
+                                     int dst_fd, int64_t dst_offset,
+                                     uint64_t bytes)
+{
+    RawPosixAIOData *acb = g_new0(RawPosixAIOData, 1);
+    ThreadPool *pool;
+
+    acb->bs = bs;
+    acb->aio_type = QEMU_AIO_COPY_RANGE;
+    acb->aio_fildes = src_fd;
+    acb->aio_offset = src_offset;
+    acb->aio_fd2 = dst_fd;
+    acb->aio_offset2 = dst_offset;
+    acb->aio_nbytes = bytes;
+
+    trace_paio_submit_copy_range_co(src_offset, dst_offset, bytes);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_co(pool, aio_worker, acb);
+}
+
 static BlockAIOCB *paio_submit(BlockDriverState *bs, int fd,
         int64_t offset, QEMUIOVector *qiov, int count,
         BlockCompletionFunc *cb, void *opaque, int type)
@@ -1238,6 +1336,49 @@ static BlockAIOCB *paio_submit(BlockDriverState *bs, int fd,
     return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+/* Return the io_uring instance to use for @bs, or NULL if requests must go
+ * through the thread pool.  */
+static LuringState *raw_get_io_uring(BlockDriverState *bs)
+{
+    if (!(bs->open_flags & BDRV_O_IO_URING)) {
+        return NULL;
+    }
+    return aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+}
+
+/* Run fallocate() with the given mode through io_uring.  Returns -ENOTSUP
+ * if the request has to take the thread pool path instead.  */
+static int coroutine_fn raw_co_io_uring_fallocate(BlockDriverState *bs,
+                                                  int mode, int64_t offset,
+                                                  int count)
+{
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio = raw_get_io_uring(bs);
+    int ret;
+
+#ifdef CONFIG_XFS
+    if (s->is_xfs) {
+        /* Let the thread pool use the XFS ioctls */
+        return -ENOTSUP;
+    }
+#endif
+    if (!aio || s->io_uring_no_fallocate) {
+        return -ENOTSUP;
+    }
+    ret = luring_co_fallocate(bs, aio, s->fd, mode, offset, count);
+    if (ret == -EINVAL) {
+        /* Kernels before 5.6 reject IORING_OP_FALLOCATE with -EINVAL.
+         * Stop using io_uring for fallocate on this file and let the
+         * thread pool retry, which also reports genuine -EINVAL errors.
+         */
+        s->io_uring_no_fallocate = true;
+        return -ENOTSUP;
+    }
+    return translate_err(ret);
+}
+#endif
+
 static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
                                    uint64_t bytes, QEMUIOVector *qiov, int type)
 {
@@ -1252,16 +1393,23 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
      * If this is the case tell the low-level driver that it needs
      * to copy the buffer.
      */
-    if (s->needs_alignment) {
-        if (!bdrv_qiov_is_aligned(bs, qiov)) {
-            type |= QEMU_AIO_MISALIGNED;
+    if (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov)) {
+        type |= QEMU_AIO_MISALIGNED;
+    } else {
+#ifdef CONFIG_LINUX_IO_URING
+        LuringState *aio = raw_get_io_uring(bs);
+        if (aio) {
+            assert(qiov->size == bytes);
+            return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+        }
+#endif
 #ifdef CONFIG_LINUX_AIO
-        } else if (bs->open_flags & BDRV_O_NATIVE_AIO) {
+        if (s->needs_alignment && (bs->open_flags & BDRV_O_NATIVE_AIO)) {
             LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
             assert(qiov->size == bytes);
             return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
-#endif
         }
+#endif
     }
 
     return paio_submit_co(bs, s->fd, offset, qiov, bytes, type);
@@ -1290,6 +1438,11 @@ static void raw_aio_plug(BlockDriverState *bs)
         laio_io_plug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (raw_get_io_uring(bs)) {
+        luring_io_plug(bs, raw_get_io_uring(bs));
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
@@ -1300,17 +1453,30 @@ static void raw_aio_unplug(BlockDriverState *bs)
         laio_io_unplug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (raw_get_io_uring(bs)) {
+        luring_io_unplug(bs, raw_get_io_uring(bs));
+    }
+#endif
 }
 
-static BlockAIOCB *raw_aio_flush(BlockDriverState *bs,
-        BlockCompletionFunc *cb, void *opaque)
+static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+    int ret;
 
-    if (fd_open(bs) < 0)
-        return NULL;
+    ret = fd_open(bs);
+    if (ret < 0) {
+        return ret;
+    }
 
-    return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
+#ifdef CONFIG_LINUX_IO_URING
+    if (raw_get_io_uring(bs)) {
+        return luring_co_submit(bs, raw_get_io_uring(bs), s->fd, 0, NULL,
+                                QEMU_AIO_FLUSH);
+    }
+#endif
+    return paio_submit_co(bs, s->fd, 0, NULL, 0, QEMU_AIO_FLUSH);
 }
 
 static void raw_close(BlockDriverState *bs)
@@ -1786,14 +1952,58 @@ static int64_t coroutine_fn raw_co_get_block_status(BlockDriverState *bs,
     return ret | BDRV_BLOCK_OFFSET_VALID | start;
 }
 
-static coroutine_fn BlockAIOCB *raw_aio_pdiscard(BlockDriverState *bs,
-    int64_t offset, int count,
-    BlockCompletionFunc *cb, void *opaque)
+static int coroutine_fn raw_co_pdiscard(BlockDriverState *bs,
+                                        int64_t offset, int count)
 {
     BDRVRawState *s = bs->opaque;
 
-    return paio_submit(bs, s->fd, offset, NULL, count,
-                       cb, opaque, QEMU_AIO_DISCARD);
+#if defined(CONFIG_LINUX_IO_URING) && defined(CONFIG_FALLOCATE_PUNCH_HOLE)
+    if (s->has_discard) {
+        int ret = raw_co_io_uring_fallocate(bs, FALLOC_FL_PUNCH_HOLE |
+                                                FALLOC_FL_KEEP_SIZE,
+                                            offset, count);
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+#endif
+    return paio_submit_co(bs, s->fd, offset, NULL, count, QEMU_AIO_DISCARD);
+}
+
+static int coroutine_fn raw_co_copy_range_from(BlockDriverState *bs,
+                                               BdrvChild *src,
+                                               uint64_t src_offset,
+                                               BdrvChild *dst,
+                                               uint64_t dst_offset,
+                                               uint64_t bytes,
+                                               BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_to(src, src_offset, dst, dst_offset,
+                                 bytes, flags);
+}
+
+static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
+                                             BdrvChild *src,
+                                             uint64_t src_offset,
+                                             BdrvChild *dst,
+                                             uint64_t dst_offset,
+                                             uint64_t bytes,
+                                             BdrvRequestFlags flags)
+{
+    BDRVRawState *s = bs->opaque;
+    BDRVRawState *src_s;
+
+    assert(dst->bs == bs);
+    if (src->bs->drv->bdrv_co_copy_range_to != raw_co_copy_range_to) {
+        return -ENOTSUP;
+    }
+
+    src_s = src->bs->opaque;
+    if (fd_open(bs) < 0 || fd_open(src->bs) < 0) {
+        return -EIO;
+    }
+    return paio_submit_copy_range_co(bs, src_s->fd, src_offset,
+                                     s->fd, dst_offset, bytes);
 }
 
 static int coroutine_fn raw_co_pwrite_zeroes(
@@ -1803,11 +2013,19 @@ static int coroutine_fn raw_co_pwrite_zeroes(
     BDRVRawState *s = bs->opaque;
 
     if (!(flags & BDRV_REQ_MAY_UNMAP)) {
+#if defined(CONFIG_LINUX_IO_URING) && defined(CONFIG_FALLOCATE_ZERO_RANGE)
+        if (s->has_write_zeroes) {
+            int ret = raw_co_io_uring_fallocate(bs, FALLOC_FL_ZERO_RANGE,
+                                                offset, count);
+            if (ret != -ENOTSUP) {
+                return ret;
+            }
+        }
+#endif
         return paio_submit_co(bs, s->fd, offset, NULL, count,
                               QEMU_AIO_WRITE_ZEROES);
     } else if (s->discard_zeroes) {
-        return paio_submit_co(bs, s->fd, offset, NULL, count,
-                              QEMU_AIO_DISCARD);
+        return raw_co_pdiscard(bs, offset, count);
     }
     return -ENOTSUP;
 }
@@ -1863,8 +2081,10 @@ BlockDriver bdrv_file = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
-    .bdrv_aio_flush = raw_aio_flush,
-    .bdrv_aio_pdiscard = raw_aio_pdiscard,
+    .bdrv_co_flush_to_disk = raw_co_flush_to_disk,
+    .bdrv_co_pdiscard = raw_co_pdiscard,
+    .bdrv_co_copy_range_from = raw_co_copy_range_from,
+    .bdrv_co_copy_range_to = raw_co_copy_range_to,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
@@ -2306,7 +2526,7 @@ static BlockDriver bdrv_host_device = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
-    .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_co_flush_to_disk = raw_co_flush_to_disk,
     .bdrv_aio_pdiscard   = hdev_aio_pdiscard,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
@@ -2428,7 +2648,7 @@ static BlockDriver bdrv_host_cdrom = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
-    .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_co_flush_to_disk = raw_co_flush_to_disk,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
@@ -2558,7 +2778,7 @@ static BlockDriver bdrv_host_cdrom = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
-    .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_co_flush_to_disk = raw_co_flush_to_disk,
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
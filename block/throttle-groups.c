@@ -52,14 +52,21 @@
  * bdrv_set_aio_context()). Therefore in this file a thread will
  * access some other BlockBackend's timers only after verifying that
  * that BlockBackend has throttled requests in the queue.
+ *
+ * Members take turns in round-robin order, but a member holding the
+ * token may issue up to 'throttle_weight' requests in a row before the
+ * token moves on, so that members get shares proportional to their
+ * weight while the group is saturated.
  */
 typedef struct ThrottleGroup {
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following six fields */
     ThrottleState ts;
     QLIST_HEAD(, BlockBackendPublic) head;
     BlockBackend *tokens[2];
+    unsigned credit[2];       /* requests left to the current token */
+    unsigned pending_reqs[2]; /* sum of the members' pending_reqs */
     bool any_timer_armed[2];
 
     /* These two are protected by the global throttle_groups_lock */
@@ -184,11 +191,23 @@ static BlockBackend *next_throttle_token(BlockBackend *blk, bool is_write)
     ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
     BlockBackend *token, *start;
 
+    /* Nothing is queued anywhere in the group, so there is no need to
+     * walk the list of members */
+    if (!tg->pending_reqs[is_write]) {
+        return blk;
+    }
+
     start = token = tg->tokens[is_write];
 
+    /* The current token keeps its turn until it has used up its share */
+    if (tg->credit[is_write] &&
+        blk_get_public(start)->pending_reqs[is_write]) {
+        return start;
+    }
+
     /* get next bs round in round robin style */
     token = throttle_group_next_blk(token);
-    while (token != start && !blkp->pending_reqs[is_write]) {
+    while (token != start && !blk_get_public(token)->pending_reqs[is_write]) {
         token = throttle_group_next_blk(token);
     }
 
@@ -196,13 +215,27 @@ static BlockBackend *next_throttle_token(BlockBackend *blk, bool is_write)
      * then decide the token is the current bs because chances are
      * the current bs get the current request queued.
      */
-    if (token == start && !blkp->pending_reqs[is_write]) {
+    if (token == start && !blk_get_public(token)->pending_reqs[is_write]) {
         token = blk;
     }
 
     return token;
 }
 
+/* Hand the token to @token, refilling its share of requests if the token
+ * changes hands or the share has been used up.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_set_token(ThrottleGroup *tg, BlockBackend *token,
+                                     bool is_write)
+{
+    if (tg->tokens[is_write] != token || !tg->credit[is_write]) {
+        tg->tokens[is_write] = token;
+        tg->credit[is_write] = blk_get_public(token)->throttle_weight;
+    }
+}
+
 /* Check if the next I/O request for a BlockBackend needs to be throttled or
  * not. If there's no timer set in this group, set one and update the token
  * accordingly.
@@ -234,7 +267,7 @@ static bool throttle_group_schedule_timer(BlockBackend *blk, bool is_write)
 
     /* If a timer just got armed, set blk as the current token */
     if (must_wait) {
-        tg->tokens[is_write] = blk;
+        throttle_group_set_token(tg, blk, is_write);
         tg->any_timer_armed[is_write] = true;
     }
 
@@ -252,12 +285,14 @@ static void schedule_next_request(BlockBackend *blk, bool is_write)
 {
     BlockBackendPublic *blkp = blk_get_public(blk);
     ThrottleGroup *tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+    BlockBackendPublic *tokenp;
     bool must_wait;
     BlockBackend *token;
 
     /* Check if there's any pending request to schedule next */
     token = next_throttle_token(blk, is_write);
-    if (!blkp->pending_reqs[is_write]) {
+    tokenp = blk_get_public(token);
+    if (!tokenp->pending_reqs[is_write]) {
         return;
     }
 
@@ -266,17 +301,16 @@ static void schedule_next_request(BlockBackend *blk, bool is_write)
 
     /* If it doesn't have to wait, queue it for immediate execution */
     if (!must_wait) {
-        /* Give preference to requests from the current blk */
-        if (qemu_in_coroutine() &&
-            qemu_co_queue_next(&blkp->throttled_reqs[is_write])) {
-            token = blk;
-        } else {
-            ThrottleTimers *tt = &blkp->throttle_timers;
+        /* Requests from the current blk can be restarted directly,
+         * anything else goes through the token's timer */
+        if (token != blk || !qemu_in_coroutine() ||
+            !qemu_co_queue_next(&blkp->throttled_reqs[is_write])) {
+            ThrottleTimers *tt = &tokenp->throttle_timers;
             int64_t now = qemu_clock_get_ns(tt->clock_type);
             timer_mod(tt->timers[is_write], now + 1);
             tg->any_timer_armed[is_write] = true;
         }
-        tg->tokens[is_write] = token;
+        throttle_group_set_token(tg, token, is_write);
     }
 }
 
@@ -306,14 +340,19 @@ void coroutine_fn throttle_group_co_io_limits_intercept(BlockBackend *blk,
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || blkp->pending_reqs[is_write]) {
         blkp->pending_reqs[is_write]++;
+        tg->pending_reqs[is_write]++;
         qemu_mutex_unlock(&tg->lock);
         qemu_co_queue_wait(&blkp->throttled_reqs[is_write]);
         qemu_mutex_lock(&tg->lock);
         blkp->pending_reqs[is_write]--;
+        tg->pending_reqs[is_write]--;
     }
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(blkp->throttle_state, is_write, bytes);
+    if (tg->tokens[is_write] == blk && tg->credit[is_write]) {
+        tg->credit[is_write]--;
+    }
 
     /* Schedule the next request */
     schedule_next_request(blk, is_write);
@@ -378,6 +417,36 @@ void throttle_group_get_config(BlockBackend *blk, ThrottleConfig *cfg)
     qemu_mutex_unlock(&tg->lock);
 }
 
+/* Set the weight of a BlockBackend within its throttling group. This can be
+ * called whether or not the BlockBackend is currently in a group; the weight
+ * is kept across group changes.
+ *
+ * @blk:    a BlockBackend
+ * @weight: the new weight, between 1 and THROTTLE_GROUP_WEIGHT_MAX
+ */
+void throttle_group_set_weight(BlockBackend *blk, unsigned weight)
+{
+    BlockBackendPublic *blkp = blk_get_public(blk);
+    ThrottleGroup *tg;
+
+    assert(weight >= 1 && weight <= THROTTLE_GROUP_WEIGHT_MAX);
+
+    if (!blkp->throttle_state) {
+        blkp->throttle_weight = weight;
+        return;
+    }
+
+    tg = container_of(blkp->throttle_state, ThrottleGroup, ts);
+    qemu_mutex_lock(&tg->lock);
+    blkp->throttle_weight = weight;
+    qemu_mutex_unlock(&tg->lock);
+}
+
+unsigned throttle_group_get_weight(BlockBackend *blk)
+{
+    return blk_get_public(blk)->throttle_weight;
+}
+
 /* ThrottleTimers callback. This wakes up a request that was waiting
  * because it had been throttled.
  *
@@ -444,7 +513,7 @@ void throttle_group_register_blk(BlockBackend *blk, const char *groupname)
     /* If the ThrottleGroup is new set this BlockBackend as the token */
     for (i = 0; i < 2; i++) {
         if (!tg->tokens[i]) {
-            tg->tokens[i] = blk;
+            throttle_group_set_token(tg, blk, i);
         }
     }
 
@@ -486,9 +555,11 @@ void throttle_group_unregister_blk(BlockBackend *blk)
             BlockBackend *token = throttle_group_next_blk(blk);
             /* Take care of the case where this is the last blk in the group */
             if (token == blk) {
-                token = NULL;
+                tg->tokens[i] = NULL;
+                tg->credit[i] = 0;
+            } else {
+                throttle_group_set_token(tg, token, i);
             }
-            tg->tokens[i] = token;
         }
     }
 
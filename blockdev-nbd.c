@@ -143,7 +143,7 @@ void qmp_nbd_server_start(SocketAddress *addr,
 }
 
 void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
-                        Error **errp)
+                        bool has_bitmap, const char *bitmap, Error **errp)
 {
     BlockDriverState *bs = NULL;
     BlockBackend *on_eject_blk;
@@ -174,7 +174,8 @@ void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
     }
 
     exp = nbd_export_new(bs, 0, -1, writable ? 0 : NBD_FLAG_READ_ONLY,
-                         NULL, false, on_eject_blk, errp);
+                         NULL, false, on_eject_blk,
+                         has_bitmap ? bitmap : NULL, errp);
     if (!exp) {
         return;
     }
@@ -506,6 +506,9 @@ BlockJobInfo *block_job_query(BlockJob *job)
     info->speed     = job->speed;
     info->io_status = job->iostatus;
     info->ready     = job->ready;
+    if (job->driver->query) {
+        job->driver->query(job, info);
+    }
     return info;
 }
 
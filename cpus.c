@@ -36,6 +36,7 @@
 #include "sysemu/kvm.h"
 #include "qmp-commands.h"
 #include "exec/exec-all.h"
+#include "tcg.h"
 
 #include "qemu/thread.h"
 #include "sysemu/cpus.h"
@@ -687,6 +688,57 @@ void configure_icount(QemuOpts *opts, Error **errp)
                    NANOSECONDS_PER_SECOND / 10);
 }
 
+/***********************************************************/
+/* TCG vCPU threading */
+
+/* The guest memory model may be weaker than (or equal to) the host's,
+ * but not stronger: TCG does not emit barriers for the difference yet.
+ */
+static bool check_tcg_memory_orders_compatible(void)
+{
+#if defined(TCG_GUEST_DEFAULT_MO) && defined(TCG_TARGET_DEFAULT_MO)
+    return (TCG_GUEST_DEFAULT_MO & ~TCG_TARGET_DEFAULT_MO) == 0;
+#else
+    return false;
+#endif
+}
+
+void qemu_tcg_configure(QemuOpts *opts, Error **errp)
+{
+    const char *t = qemu_opt_get(opts, "thread");
+
+    if (!t || strcmp(t, "single") == 0) {
+        mttcg_enabled = false;
+        return;
+    }
+    if (strcmp(t, "multi") != 0) {
+        error_setg(errp, "Invalid 'thread' setting %s", t);
+        return;
+    }
+    if (!tcg_enabled()) {
+        error_setg(errp, "thread=multi requires the TCG accelerator");
+        return;
+    }
+    if (TCG_OVERSIZED_GUEST) {
+        error_setg(errp, "No MTTCG when guest word size > hosts");
+        return;
+    }
+    if (use_icount) {
+        error_setg(errp, "No MTTCG when icount is enabled");
+        return;
+    }
+#ifndef TARGET_SUPPORTS_MTTCG
+    error_setg(errp, "Guest not yet converted to MTTCG");
+    return;
+#endif
+    if (!check_tcg_memory_orders_compatible()) {
+        error_report("Guest expects a stronger memory ordering "
+                     "than the host provides");
+        error_printf("This may cause strange/hard to debug errors\n");
+    }
+    mttcg_enabled = true;
+}
+
 /***********************************************************/
 void hw_error(const char *fmt, ...)
 {
@@ -898,6 +950,11 @@ static QemuCond qemu_cpu_cond;
 /* system init */
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
+/* exclusive execution, see start_exclusive */
+static QemuMutex exclusive_lock;
+static QemuCond exclusive_cond;
+static QemuCond exclusive_resume;
+static int pending_cpus;
 
 void qemu_init_cpu_loop(void)
 {
@@ -907,13 +964,34 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
     qemu_mutex_init(&qemu_global_mutex);
+    qemu_mutex_init(&exclusive_lock);
+    qemu_cond_init(&exclusive_cond);
+    qemu_cond_init(&exclusive_resume);
 
     qemu_thread_get_self(&io_thread);
 }
 
+static void queue_work_on_cpu(CPUState *cpu, struct qemu_work_item *wi)
+{
+    qemu_mutex_lock(&cpu->work_mutex);
+    if (cpu->queued_work_first == NULL) {
+        cpu->queued_work_first = wi;
+    } else {
+        cpu->queued_work_last->next = wi;
+    }
+    cpu->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+    qemu_mutex_unlock(&cpu->work_mutex);
+
+    qemu_cpu_kick(cpu);
+}
+
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 {
     struct qemu_work_item wi;
+    CPUState *self_cpu = current_cpu;
+    bool exec_end;
 
     if (qemu_cpu_is_self(cpu)) {
         func(data);
@@ -923,25 +1001,27 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     wi.func = func;
     wi.data = data;
     wi.free = false;
+    wi.exclusive = false;
 
-    qemu_mutex_lock(&cpu->work_mutex);
-    if (cpu->queued_work_first == NULL) {
-        cpu->queued_work_first = &wi;
-    } else {
-        cpu->queued_work_last->next = &wi;
-    }
-    cpu->queued_work_last = &wi;
-    wi.next = NULL;
-    wi.done = false;
-    qemu_mutex_unlock(&cpu->work_mutex);
+    queue_work_on_cpu(cpu, &wi);
 
-    qemu_cpu_kick(cpu);
+    /* A vCPU waiting from inside cpu_exec would block anybody trying
+     * to start an exclusive section, possibly the very vCPU we are
+     * waiting for.
+     */
+    exec_end = qemu_tcg_mttcg_enabled() && self_cpu && self_cpu->running;
+    if (exec_end) {
+        cpu_exec_end(self_cpu);
+    }
     while (!atomic_mb_read(&wi.done)) {
-        CPUState *self_cpu = current_cpu;
-
         qemu_cond_wait(&qemu_work_cond, &qemu_global_mutex);
         current_cpu = self_cpu;
     }
+    if (exec_end) {
+        qemu_mutex_unlock_iothread();
+        cpu_exec_start(self_cpu);
+        qemu_mutex_lock_iothread();
+    }
 }
 
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
@@ -958,18 +1038,91 @@ void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     wi->data = data;
     wi->free = true;
 
-    qemu_mutex_lock(&cpu->work_mutex);
-    if (cpu->queued_work_first == NULL) {
-        cpu->queued_work_first = wi;
-    } else {
-        cpu->queued_work_last->next = wi;
+    queue_work_on_cpu(cpu, wi);
+}
+
+void async_safe_run_on_cpu(CPUState *cpu, void (*func)(void *data),
+                           void *data)
+{
+    struct qemu_work_item *wi;
+
+    /* Always queued, even for the calling vCPU: the work must wait
+     * until this thread has left cpu_exec.
+     */
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    wi->exclusive = true;
+
+    queue_work_on_cpu(cpu, wi);
+}
+
+/* Exclusive execution.  A vCPU thread brackets guest code execution
+ * with cpu_exec_start/cpu_exec_end; start_exclusive kicks every vCPU
+ * that is inside such a section and waits for it to leave.  All of
+ * this is only relevant in MTTCG mode: the round-robin thread never
+ * marks its vCPUs as running.
+ */
+
+/* Wait for pending exclusive operations to complete.  The exclusive lock
+ * must be held.
+ */
+static void exclusive_idle(void)
+{
+    while (pending_cpus) {
+        qemu_cond_wait(&exclusive_resume, &exclusive_lock);
     }
-    cpu->queued_work_last = wi;
-    wi->next = NULL;
-    wi->done = false;
-    qemu_mutex_unlock(&cpu->work_mutex);
+}
 
-    qemu_cpu_kick(cpu);
+void start_exclusive(void)
+{
+    CPUState *other_cpu;
+
+    qemu_mutex_lock(&exclusive_lock);
+    exclusive_idle();
+
+    pending_cpus = 1;
+    /* Make all other cpus stop executing.  */
+    CPU_FOREACH(other_cpu) {
+        if (other_cpu->running) {
+            pending_cpus++;
+            qemu_cpu_kick(other_cpu);
+        }
+    }
+    while (pending_cpus > 1) {
+        qemu_cond_wait(&exclusive_cond, &exclusive_lock);
+    }
+    qemu_mutex_unlock(&exclusive_lock);
+}
+
+void end_exclusive(void)
+{
+    qemu_mutex_lock(&exclusive_lock);
+    pending_cpus = 0;
+    qemu_cond_broadcast(&exclusive_resume);
+    qemu_mutex_unlock(&exclusive_lock);
+}
+
+void cpu_exec_start(CPUState *cpu)
+{
+    qemu_mutex_lock(&exclusive_lock);
+    exclusive_idle();
+    cpu->running = true;
+    qemu_mutex_unlock(&exclusive_lock);
+}
+
+void cpu_exec_end(CPUState *cpu)
+{
+    qemu_mutex_lock(&exclusive_lock);
+    cpu->running = false;
+    if (pending_cpus > 1) {
+        pending_cpus--;
+        if (pending_cpus == 1) {
+            qemu_cond_signal(&exclusive_cond);
+        }
+    }
+    qemu_mutex_unlock(&exclusive_lock);
 }
 
 static void qemu_kvm_destroy_vcpu(CPUState *cpu)
@@ -1000,7 +1153,18 @@ static void flush_queued_work(CPUState *cpu)
             cpu->queued_work_last = NULL;
         }
         qemu_mutex_unlock(&cpu->work_mutex);
-        wi->func(wi->data);
+        if (wi->exclusive) {
+            /* Other vCPUs may be waiting for the BQL inside cpu_exec;
+             * they could never reach cpu_exec_end if we kept it.
+             */
+            qemu_mutex_unlock_iothread();
+            start_exclusive();
+            wi->func(wi->data);
+            end_exclusive();
+            qemu_mutex_lock_iothread();
+        } else {
+            wi->func(wi->data);
+        }
         qemu_mutex_lock(&cpu->work_mutex);
         if (wi->free) {
             g_free(wi);
@@ -1023,7 +1187,7 @@ static void qemu_wait_io_event_common(CPUState *cpu)
     cpu->thread_kicked = false;
 }
 
-static void qemu_tcg_wait_io_event(CPUState *cpu)
+static void qemu_tcg_rr_wait_io_event(CPUState *cpu)
 {
     while (all_cpu_threads_idle()) {
         qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
@@ -1038,6 +1202,15 @@ static void qemu_tcg_wait_io_event(CPUState *cpu)
     }
 }
 
+static void qemu_tcg_wait_io_event(CPUState *cpu)
+{
+    while (cpu_thread_is_idle(cpu)) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
 static void qemu_kvm_wait_io_event(CPUState *cpu)
 {
     while (cpu_thread_is_idle(cpu)) {
@@ -1137,7 +1310,13 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 
 static void tcg_exec_all(void);
 
-static void *qemu_tcg_cpu_thread_fn(void *arg)
+/* Single-threaded TCG
+ *
+ * In the single-threaded case each vCPU is simulated in turn.  The
+ * BQL is held for the whole time guest code runs and it is only
+ * released while waiting for I/O events.
+ */
+static void *qemu_tcg_rr_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
     CPUState *remove_cpu = NULL;
@@ -1177,7 +1356,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
                 qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
             }
         }
-        qemu_tcg_wait_io_event(QTAILQ_FIRST(&cpus));
+        qemu_tcg_rr_wait_io_event(QTAILQ_FIRST(&cpus));
         CPU_FOREACH(cpu) {
             if (cpu->unplug && !cpu_can_run(cpu)) {
                 remove_cpu = cpu;
@@ -1195,6 +1374,67 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+static int tcg_cpu_exec(CPUState *cpu);
+
+/* Multi-threaded TCG
+ *
+ * In the multi-threaded case each vCPU has its own thread.  The BQL is
+ * dropped while guest code runs and taken again, as needed, for device
+ * emulation, interrupt delivery and queued work.
+ */
+static void *qemu_tcg_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+
+    cpu->thread_id = qemu_get_thread_id();
+    cpu->created = true;
+    cpu->can_do_io = 1;
+    current_cpu = cpu;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    /* process any pending work */
+    cpu->exit_request = 1;
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            int r;
+
+            r = tcg_cpu_exec(cpu);
+            switch (r) {
+            case EXCP_DEBUG:
+                cpu_handle_guest_debug(cpu);
+                break;
+            case EXCP_ATOMIC:
+                qemu_mutex_unlock_iothread();
+                cpu_exec_step_atomic(cpu);
+                qemu_mutex_lock_iothread();
+                break;
+            default:
+                break;
+            }
+        }
+
+        atomic_mb_set(&cpu->exit_request, 0);
+        qemu_tcg_wait_io_event(cpu);
+
+        if (cpu->unplug && !cpu_can_run(cpu)) {
+            break;
+        }
+    }
+
+    qemu_tcg_destroy_vcpu(cpu);
+    cpu->created = false;
+    qemu_cond_signal(&qemu_cpu_cond);
+    qemu_mutex_unlock_iothread();
+    rcu_unregister_thread();
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -1231,7 +1471,11 @@ void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
     if (tcg_enabled()) {
-        qemu_cpu_kick_no_halt();
+        if (qemu_tcg_mttcg_enabled()) {
+            cpu_exit(cpu);
+        } else {
+            qemu_cpu_kick_no_halt();
+        }
     } else {
         qemu_cpu_kick_thread(cpu);
     }
@@ -1264,9 +1508,10 @@ void qemu_mutex_lock_iothread(void)
 {
     atomic_inc(&iothread_requesting_mutex);
     /* In the simple case there is no need to bump the VCPU thread out of
-     * TCG code execution.
+     * TCG code execution.  MTTCG vCPUs do not hold the BQL while they
+     * run guest code.
      */
-    if (!tcg_enabled() || qemu_in_vcpu_thread() ||
+    if (!tcg_enabled() || qemu_tcg_mttcg_enabled() || qemu_in_vcpu_thread() ||
         !first_cpu || !first_cpu->created) {
         qemu_mutex_lock(&qemu_global_mutex);
         atomic_dec(&iothread_requesting_mutex);
@@ -1312,7 +1557,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !qemu_tcg_mttcg_enabled()) {
             CPU_FOREACH(cpu) {
                 cpu->stop = false;
                 cpu->stopped = true;
@@ -1370,18 +1615,34 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
     static QemuCond *tcg_halt_cond;
     static QemuThread *tcg_cpu_thread;
 
-    /* share a single thread for all cpus with TCG */
-    if (!tcg_cpu_thread) {
+    if (qemu_tcg_mttcg_enabled()) {
+        /* create a thread per vCPU with TCG (MTTCG) */
+        parallel_cpus = max_cpus > 1;
         cpu->thread = g_malloc0(sizeof(QemuThread));
         cpu->halt_cond = g_malloc0(sizeof(QemuCond));
         qemu_cond_init(cpu->halt_cond);
-        tcg_halt_cond = cpu->halt_cond;
         snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/TCG",
                  cpu->cpu_index);
         qemu_thread_create(cpu->thread, thread_name, qemu_tcg_cpu_thread_fn,
                            cpu, QEMU_THREAD_JOINABLE);
 #ifdef _WIN32
         cpu->hThread = qemu_thread_get_handle(cpu->thread);
+#endif
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+    } else if (!tcg_cpu_thread) {
+        /* share a single thread for all cpus with TCG */
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        tcg_halt_cond = cpu->halt_cond;
+        snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "ALL CPUs/TCG");
+        qemu_thread_create(cpu->thread, thread_name,
+                           qemu_tcg_rr_cpu_thread_fn,
+                           cpu, QEMU_THREAD_JOINABLE);
+#ifdef _WIN32
+        cpu->hThread = qemu_thread_get_handle(cpu->thread);
 #endif
         while (!cpu->created) {
             qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
@@ -1538,7 +1799,15 @@ static int tcg_cpu_exec(CPUState *cpu)
         cpu->icount_decr.u16.low = decr;
         cpu->icount_extra = count;
     }
+    if (qemu_tcg_mttcg_enabled()) {
+        qemu_mutex_unlock_iothread();
+        cpu_exec_start(cpu);
+    }
     ret = cpu_exec(cpu);
+    if (qemu_tcg_mttcg_enabled()) {
+        cpu_exec_end(cpu);
+        qemu_mutex_lock_iothread();
+    }
 #ifdef CONFIG_PROFILER
     tcg_time += profile_getclock() - ti;
 #endif
@@ -31,6 +31,7 @@
 #include "exec/exec-all.h"
 #include "tcg/tcg.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 #include "exec/log.h"
 
 /* DEBUG defines, enable DEBUG_TLB_LOG to log to the CPU_LOG_MMU target */
@@ -61,6 +62,57 @@
 /* statistics */
 int tlb_flush_count;
 
+/* In MTTCG mode a vCPU's TLB is only ever modified from its own thread.
+ * Flushes requested by other threads are queued with async_run_on_cpu
+ * and carried out the next time the target vCPU leaves cpu_exec.
+ */
+static bool tlb_flush_is_deferred(CPUState *cpu)
+{
+    return qemu_tcg_mttcg_enabled() && cpu->created &&
+           !qemu_cpu_is_self(cpu);
+}
+
+typedef struct TLBFlushWork {
+    CPUState *cpu;
+    target_ulong addr;
+    uint32_t idxmap;
+} TLBFlushWork;
+
+static TLBFlushWork *tlb_flush_work_new(CPUState *cpu, target_ulong addr,
+                                        uint32_t idxmap)
+{
+    TLBFlushWork *work = g_new(TLBFlushWork, 1);
+
+    work->cpu = cpu;
+    work->addr = addr;
+    work->idxmap = idxmap;
+    return work;
+}
+
+static void tlb_flush_queue_work(CPUState *cpu, void (*func)(void *data),
+                                 target_ulong addr, uint32_t idxmap)
+{
+    async_run_on_cpu(cpu, func, tlb_flush_work_new(cpu, addr, idxmap));
+}
+
+/* The *_all_cpus_synced variants queue the flush on every other vCPU and
+ * then run the source vCPU's own flush as safe work.  Safe work only
+ * starts once all other vCPUs have left cpu_exec, and a vCPU drains its
+ * queued work before it executes guest code again; so by the time the
+ * source vCPU resumes, no vCPU can still use the stale entries.  The
+ * caller must end the TB after requesting the flush, so that the source
+ * vCPU gets back to its thread loop and runs the safe work.
+ */
+static void tlb_flush_synced(CPUState *src_cpu, void (*func)(void *data),
+                             void *data)
+{
+    if (qemu_tcg_mttcg_enabled() && src_cpu->created) {
+        async_safe_run_on_cpu(src_cpu, func, data);
+    } else {
+        func(data);
+    }
+}
+
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
  * If flush_global is false, flush (at least) all tlb entries not
@@ -73,7 +125,7 @@ int tlb_flush_count;
  * entries from the TLB at any time, so flushing more entries than
  * required is only an efficiency issue, not a correctness issue.
  */
-void tlb_flush(CPUState *cpu, int flush_global)
+static void tlb_flush_nocheck(CPUState *cpu, int flush_global)
 {
     CPUArchState *env = cpu->env_ptr;
 
@@ -86,14 +138,42 @@ void tlb_flush(CPUState *cpu, int flush_global)
     env->vtlb_index = 0;
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
-    tlb_flush_count++;
+    atomic_inc(&tlb_flush_count);
 }
 
-static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
+static void tlb_flush_async_work(void *data)
 {
-    CPUArchState *env = cpu->env_ptr;
+    CPUState *cpu = data;
 
-    tlb_debug("start\n");
+    tlb_flush_nocheck(cpu, 1);
+}
+
+void tlb_flush(CPUState *cpu, int flush_global)
+{
+    if (tlb_flush_is_deferred(cpu)) {
+        /* flush_global makes no difference, see above */
+        async_run_on_cpu(cpu, tlb_flush_async_work, cpu);
+    } else {
+        tlb_flush_nocheck(cpu, flush_global);
+    }
+}
+
+void tlb_flush_all_cpus_synced(CPUState *src_cpu, int flush_global)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (cpu != src_cpu) {
+            tlb_flush(cpu, flush_global);
+        }
+    }
+    tlb_flush_synced(src_cpu, tlb_flush_async_work, src_cpu);
+}
+
+/* Collect a -1 terminated list of MMU indexes into a bitmap */
+static uint32_t tlb_mmuidx_bitmap(va_list argp)
+{
+    uint32_t idxmap = 0;
 
     for (;;) {
         int mmu_idx = va_arg(argp, int);
@@ -101,6 +181,22 @@ static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
         if (mmu_idx < 0) {
             break;
         }
+        idxmap |= 1u << mmu_idx;
+    }
+    return idxmap;
+}
+
+static void tlb_flush_by_mmuidx_nocheck(CPUState *cpu, uint32_t idxmap)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
+
+    tlb_debug("start\n");
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (!(idxmap & (1u << mmu_idx))) {
+            continue;
+        }
 
         tlb_debug("%d\n", mmu_idx);
 
@@ -111,12 +207,53 @@ static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
 }
 
+static void tlb_flush_by_mmuidx_async_work(void *data)
+{
+    TLBFlushWork *work = data;
+
+    tlb_flush_by_mmuidx_nocheck(work->cpu, work->idxmap);
+    g_free(work);
+}
+
 void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 {
     va_list argp;
+    uint32_t idxmap;
+
     va_start(argp, cpu);
-    v_tlb_flush_by_mmuidx(cpu, argp);
+    idxmap = tlb_mmuidx_bitmap(argp);
     va_end(argp);
+
+    if (tlb_flush_is_deferred(cpu)) {
+        tlb_flush_queue_work(cpu, tlb_flush_by_mmuidx_async_work, 0, idxmap);
+    } else {
+        tlb_flush_by_mmuidx_nocheck(cpu, idxmap);
+    }
+}
+
+void tlb_flush_by_mmuidx_all_cpus_synced(CPUState *src_cpu, ...)
+{
+    CPUState *cpu;
+    va_list argp;
+    uint32_t idxmap;
+
+    va_start(argp, src_cpu);
+    idxmap = tlb_mmuidx_bitmap(argp);
+    va_end(argp);
+
+    CPU_FOREACH(cpu) {
+        if (cpu == src_cpu) {
+            continue;
+        }
+        if (tlb_flush_is_deferred(cpu)) {
+            tlb_flush_queue_work(cpu, tlb_flush_by_mmuidx_async_work,
+                                 0, idxmap);
+        } else {
+            tlb_flush_by_mmuidx_nocheck(cpu, idxmap);
+        }
+    }
+    tlb_flush_synced(src_cpu, tlb_flush_by_mmuidx_async_work,
+                     tlb_flush_work_new(src_cpu, 0, idxmap));
 }
 
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
@@ -131,7 +268,7 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
     }
 }
 
-void tlb_flush_page(CPUState *cpu, target_ulong addr)
+static void tlb_flush_page_nocheck(CPUState *cpu, target_ulong addr)
 {
     CPUArchState *env = cpu->env_ptr;
     int i;
@@ -145,7 +282,7 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
                   TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                   env->tlb_flush_addr, env->tlb_flush_mask);
 
-        tlb_flush(cpu, 1);
+        tlb_flush_nocheck(cpu, 1);
         return;
     }
 
@@ -166,13 +303,41 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     tb_flush_jmp_cache(cpu, addr);
 }
 
-void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
+static void tlb_flush_page_async_work(void *data)
 {
-    CPUArchState *env = cpu->env_ptr;
-    int i, k;
-    va_list argp;
+    TLBFlushWork *work = data;
 
-    va_start(argp, addr);
+    tlb_flush_page_nocheck(work->cpu, work->addr);
+    g_free(work);
+}
+
+void tlb_flush_page(CPUState *cpu, target_ulong addr)
+{
+    if (tlb_flush_is_deferred(cpu)) {
+        tlb_flush_queue_work(cpu, tlb_flush_page_async_work, addr, 0);
+    } else {
+        tlb_flush_page_nocheck(cpu, addr);
+    }
+}
+
+void tlb_flush_page_all_cpus_synced(CPUState *src_cpu, target_ulong addr)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (cpu != src_cpu) {
+            tlb_flush_page(cpu, addr);
+        }
+    }
+    tlb_flush_synced(src_cpu, tlb_flush_page_async_work,
+                     tlb_flush_work_new(src_cpu, addr, 0));
+}
+
+static void tlb_flush_page_by_mmuidx_nocheck(CPUState *cpu, target_ulong addr,
+                                             uint32_t idxmap)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int i, k, mmu_idx;
 
     tlb_debug("addr "TARGET_FMT_lx"\n", addr);
 
@@ -182,19 +347,16 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
                   TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                   env->tlb_flush_addr, env->tlb_flush_mask);
 
-        v_tlb_flush_by_mmuidx(cpu, argp);
-        va_end(argp);
+        tlb_flush_by_mmuidx_nocheck(cpu, idxmap);
         return;
     }
 
     addr &= TARGET_PAGE_MASK;
     i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
 
-    for (;;) {
-        int mmu_idx = va_arg(argp, int);
-
-        if (mmu_idx < 0) {
-            break;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (!(idxmap & (1u << mmu_idx))) {
+            continue;
         }
 
         tlb_debug("idx %d\n", mmu_idx);
@@ -206,11 +368,61 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
             tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
         }
     }
-    va_end(argp);
 
     tb_flush_jmp_cache(cpu, addr);
 }
 
+static void tlb_flush_page_by_mmuidx_async_work(void *data)
+{
+    TLBFlushWork *work = data;
+
+    tlb_flush_page_by_mmuidx_nocheck(work->cpu, work->addr, work->idxmap);
+    g_free(work);
+}
+
+void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
+{
+    va_list argp;
+    uint32_t idxmap;
+
+    va_start(argp, addr);
+    idxmap = tlb_mmuidx_bitmap(argp);
+    va_end(argp);
+
+    if (tlb_flush_is_deferred(cpu)) {
+        tlb_flush_queue_work(cpu, tlb_flush_page_by_mmuidx_async_work,
+                             addr, idxmap);
+    } else {
+        tlb_flush_page_by_mmuidx_nocheck(cpu, addr, idxmap);
+    }
+}
+
+void tlb_flush_page_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
+                                              target_ulong addr, ...)
+{
+    CPUState *cpu;
+    va_list argp;
+    uint32_t idxmap;
+
+    va_start(argp, addr);
+    idxmap = tlb_mmuidx_bitmap(argp);
+    va_end(argp);
+
+    CPU_FOREACH(cpu) {
+        if (cpu == src_cpu) {
+            continue;
+        }
+        if (tlb_flush_is_deferred(cpu)) {
+            tlb_flush_queue_work(cpu, tlb_flush_page_by_mmuidx_async_work,
+                                 addr, idxmap);
+        } else {
+            tlb_flush_page_by_mmuidx_nocheck(cpu, addr, idxmap);
+        }
+    }
+    tlb_flush_synced(src_cpu, tlb_flush_page_by_mmuidx_async_work,
+                     tlb_flush_work_new(src_cpu, addr, idxmap));
+}
+
 /* update the TLBs so that writes to code in the virtual page 'addr'
    can be detected */
 void tlb_protect_code(ram_addr_t ram_addr)
@@ -226,22 +438,40 @@ void tlb_unprotect_code(ram_addr_t ram_addr)
     cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_CODE);
 }
 
-static bool tlb_is_dirty_ram(CPUTLBEntry *tlbe)
+static bool tlb_is_dirty_ram(target_ulong addr_write)
 {
-    return (tlbe->addr_write & (TLB_INVALID_MASK|TLB_MMIO|TLB_NOTDIRTY)) == 0;
+    return (addr_write & (TLB_INVALID_MASK|TLB_MMIO|TLB_NOTDIRTY)) == 0;
 }
 
+/* This may be called from any thread while the owning vCPU is running,
+ * hence the cmpxchg: we must not lose a concurrent refill of the entry.
+ * Without atomics wide enough for the guest word we fall back to the
+ * plain update and rely on the guest not running in parallel.
+ */
 void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
                            uintptr_t length)
 {
+#if TCG_OVERSIZED_GUEST
     uintptr_t addr;
 
-    if (tlb_is_dirty_ram(tlb_entry)) {
+    if (tlb_is_dirty_ram(tlb_entry->addr_write)) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
             tlb_entry->addr_write |= TLB_NOTDIRTY;
         }
     }
+#else
+    target_ulong orig_addr = atomic_read(&tlb_entry->addr_write);
+    uintptr_t addr;
+
+    if (tlb_is_dirty_ram(orig_addr)) {
+        addr = (orig_addr & TARGET_PAGE_MASK) + atomic_read(&tlb_entry->addend);
+        if ((addr - start) < length) {
+            atomic_cmpxchg(&tlb_entry->addr_write, orig_addr,
+                           orig_addr | TLB_NOTDIRTY);
+        }
+    }
+#endif
 }
 
 static inline ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
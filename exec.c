@@ -1981,7 +1981,9 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
                                uint64_t val, unsigned size)
 {
     if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
+        tb_lock();
         tb_invalidate_phys_page_fast(ram_addr, size);
+        tb_unlock();
     }
     switch (size) {
     case 1:
@@ -2056,6 +2058,12 @@ static void check_watchpoint(int offset, int len, MemTxAttrs attrs, int flags)
                     continue;
                 }
                 cpu->watchpoint_hit = wp;
+
+                /* The tb_lock will be reset when cpu_loop_exit or
+                 * cpu_loop_exit_noexc longjmp back into the cpu_exec
+                 * main loop.
+                 */
+                tb_lock();
                 tb_check_watchpoint(cpu);
                 if (wp->flags & BP_STOP_BEFORE_ACCESS) {
                     cpu->exception_index = EXCP_DEBUG;
@@ -2464,7 +2472,9 @@ static void invalidate_and_set_dirty(MemoryRegion *mr, hwaddr addr,
             cpu_physical_memory_range_includes_clean(addr, length, dirty_log_mask);
     }
     if (dirty_log_mask & (1 << DIRTY_MEMORY_CODE)) {
+        tb_lock();
         tb_invalidate_phys_range(addr, addr + length);
+        tb_unlock();
         dirty_log_mask &= ~(1 << DIRTY_MEMORY_CODE);
     }
     cpu_physical_memory_set_dirty_range(addr, length, dirty_log_mask);
@@ -3597,6 +3607,111 @@ void stq_be_phys(AddressSpace *as, hwaddr addr, uint64_t val)
     address_space_stq_be(as, addr, val, MEMTXATTRS_UNSPECIFIED, NULL);
 }
 
+int64_t address_space_cache_init(MemoryRegionCache *cache, AddressSpace *as,
+                                 hwaddr addr, hwaddr len, bool is_write)
+{
+    hwaddr l, xlat;
+    MemoryRegion *mr;
+
+    *cache = MEMORY_REGION_CACHE_INVALID;
+    cache->as = as;
+    cache->addr = addr;
+    cache->is_write = is_write;
+
+    /* The Xen map cache may unmap the pointer behind our back.  */
+    if (len == 0 || xen_enabled()) {
+        return 0;
+    }
+
+    rcu_read_lock();
+    l = len;
+    mr = address_space_translate(as, addr, &xlat, &l, is_write);
+    if (l == len && memory_access_is_direct(mr, is_write)) {
+        cache->ptr = qemu_ram_ptr_length(mr->ram_block, xlat, &l);
+        cache->xlat = xlat;
+        cache->len = l;
+        cache->mr = mr;
+        memory_region_ref(mr);
+    }
+    rcu_read_unlock();
+
+    return cache->len;
+}
+
+void address_space_cache_destroy(MemoryRegionCache *cache)
+{
+    if (cache->mr) {
+        memory_region_unref(cache->mr);
+    }
+    *cache = MEMORY_REGION_CACHE_INVALID;
+}
+
+static inline bool address_space_cache_hit(MemoryRegionCache *cache,
+                                           hwaddr addr, hwaddr len)
+{
+    return likely(cache->ptr && addr <= cache->len &&
+                  len <= cache->len - addr);
+}
+
+void address_space_read_cached(MemoryRegionCache *cache, hwaddr addr,
+                               void *buf, int len)
+{
+    if (address_space_cache_hit(cache, addr, len)) {
+        memcpy(buf, cache->ptr + addr, len);
+    } else {
+        address_space_read(cache->as, cache->addr + addr,
+                           MEMTXATTRS_UNSPECIFIED, buf, len);
+    }
+}
+
+void address_space_write_cached(MemoryRegionCache *cache, hwaddr addr,
+                                const void *buf, int len)
+{
+    if (cache->is_write && address_space_cache_hit(cache, addr, len)) {
+        memcpy(cache->ptr + addr, buf, len);
+        invalidate_and_set_dirty(cache->mr, cache->xlat + addr, len);
+    } else {
+        address_space_write(cache->as, cache->addr + addr,
+                            MEMTXATTRS_UNSPECIFIED, buf, len);
+    }
+}
+
+uint32_t lduw_le_phys_cached(MemoryRegionCache *cache, hwaddr addr)
+{
+    if (address_space_cache_hit(cache, addr, 2)) {
+        return lduw_le_p(cache->ptr + addr);
+    }
+    return lduw_le_phys(cache->as, cache->addr + addr);
+}
+
+uint32_t lduw_be_phys_cached(MemoryRegionCache *cache, hwaddr addr)
+{
+    if (address_space_cache_hit(cache, addr, 2)) {
+        return lduw_be_p(cache->ptr + addr);
+    }
+    return lduw_be_phys(cache->as, cache->addr + addr);
+}
+
+void stw_le_phys_cached(MemoryRegionCache *cache, hwaddr addr, uint32_t val)
+{
+    if (cache->is_write && address_space_cache_hit(cache, addr, 2)) {
+        stw_le_p(cache->ptr + addr, val);
+        invalidate_and_set_dirty(cache->mr, cache->xlat + addr, 2);
+    } else {
+        stw_le_phys(cache->as, cache->addr + addr, val);
+    }
+}
+
+void stw_be_phys_cached(MemoryRegionCache *cache, hwaddr addr, uint32_t val)
+{
+    if (cache->is_write && address_space_cache_hit(cache, addr, 2)) {
+        stw_be_p(cache->ptr + addr, val);
+        invalidate_and_set_dirty(cache->mr, cache->xlat + addr, 2);
+    } else {
+        stw_be_phys(cache->as, cache->addr + addr, val);
+    }
+}
+
 /* virtual memory access for debug (includes writing to ROM) */
 int cpu_memory_rw_debug(CPUState *cpu, target_ulong addr,
                         uint8_t *buf, int len, int is_write)
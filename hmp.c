@@ -213,6 +213,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync time: %" PRIu64 " microseconds\n",
+                       info->ram->dirty_sync_time);
         if (info->ram->dirty_pages_rate) {
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
@@ -245,6 +247,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache evictions: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_evictions);
     }
 
     if (info->has_cpu_throttle_percentage) {
@@ -252,6 +258,21 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->cpu_throttle_percentage);
     }
 
+    if (info->has_postcopy_fault_latency) {
+        PostcopyFaultLatency *lat = info->postcopy_fault_latency;
+        intList *bucket;
+
+        monitor_printf(mon, "postcopy faults: %" PRIu64 "\n", lat->faults);
+        monitor_printf(mon, "postcopy fault latency: %" PRIu64
+                       " us average, %" PRIu64 " us max\n",
+                       lat->average, lat->max);
+        monitor_printf(mon, "postcopy fault latency histogram:");
+        for (bucket = lat->histogram; bucket; bucket = bucket->next) {
+            monitor_printf(mon, " %" PRIu64, bucket->value);
+        }
+        monitor_printf(mon, "\n");
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -304,6 +325,15 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: '%s'",
             MigrationParameter_lookup[MIGRATION_PARAMETER_TLS_HOSTNAME],
             params->tls_hostname ? : "");
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_PAGE_COUNT],
+            params->x_multifd_page_count);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_POSTCOPY_PREFETCH_WINDOW],
+            params->postcopy_prefetch_window);
         monitor_printf(mon, "\n");
     }
 
@@ -1262,6 +1292,9 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
     bool has_cpu_throttle_increment = false;
     bool has_tls_creds = false;
     bool has_tls_hostname = false;
+    bool has_x_multifd_channels = false;
+    bool has_x_multifd_page_count = false;
+    bool has_postcopy_prefetch_window = false;
     bool use_int_value = false;
     int i;
 
@@ -1293,6 +1326,18 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_TLS_HOSTNAME:
                 has_tls_hostname = true;
                 break;
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                has_x_multifd_channels = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_X_MULTIFD_PAGE_COUNT:
+                has_x_multifd_page_count = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_POSTCOPY_PREFETCH_WINDOW:
+                has_postcopy_prefetch_window = true;
+                use_int_value = true;
+                break;
             }
 
             if (use_int_value) {
@@ -1310,6 +1355,9 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                                        has_cpu_throttle_increment, valueint,
                                        has_tls_creds, valuestr,
                                        has_tls_hostname, valuestr,
+                                       has_x_multifd_channels, valueint,
+                                       has_x_multifd_page_count, valueint,
+                                       has_postcopy_prefetch_window, valueint,
                                        &err);
             break;
         }
@@ -1852,7 +1900,8 @@ void hmp_nbd_server_start(Monitor *mon, const QDict *qdict)
             continue;
         }
 
-        qmp_nbd_server_add(info->value->device, true, writable, &local_err);
+        qmp_nbd_server_add(info->value->device, true, writable, false, NULL,
+                           &local_err);
 
         if (local_err != NULL) {
             qmp_nbd_server_stop(NULL);
@@ -1872,7 +1921,7 @@ void hmp_nbd_server_add(Monitor *mon, const QDict *qdict)
     bool writable = qdict_get_try_bool(qdict, "writable", false);
     Error *local_err = NULL;
 
-    qmp_nbd_server_add(device, true, writable, &local_err);
+    qmp_nbd_server_add(device, true, writable, false, NULL, &local_err);
 
     if (local_err != NULL) {
         hmp_handle_error(mon, &local_err);
@@ -2046,8 +2095,13 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     IOThreadInfoList *info;
 
     for (info = info_list; info; info = info->next) {
-        monitor_printf(mon, "%s: thread_id=%" PRId64 "\n",
-                       info->value->id, info->value->thread_id);
+        IOThreadInfo *value = info->value;
+
+        monitor_printf(mon, "%s:\n", value->id);
+        monitor_printf(mon, "  thread_id=%" PRId64 "\n", value->thread_id);
+        monitor_printf(mon, "  poll-max-ns=%" PRId64 "\n", value->poll_max_ns);
+        monitor_printf(mon, "  poll-grow=%" PRId64 "\n", value->poll_grow);
+        monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
     }
 
     qapi_free_IOThreadInfoList(info_list);
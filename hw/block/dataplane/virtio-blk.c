@@ -26,6 +26,29 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
+/* A virtqueue can be serviced by another IOThread than the one that owns the
+ * BlockBackend.  The block layer can only be used from a single AioContext,
+ * so such a queue's thread pops requests and hands them to the BlockBackend's
+ * AioContext through the submit list; completed requests come back through
+ * the complete list so that the ring is only ever touched by the queue's
+ * own thread, which also signals the queue's interrupt (MSI-X vector).
+ */
+typedef struct VirtIOBlockDataPlaneQueue {
+    VirtIOBlockDataPlane *s;
+    VirtQueue *vq;
+    IOThread *iothread;
+    AioContext *ctx;
+
+    /* Only used if ctx is not the BlockBackend's AioContext */
+    QemuMutex lock;
+    VirtIOBlockReq *submit_head;    /* protected by lock */
+    VirtIOBlockReq **submit_tail;
+    VirtIOBlockReq *complete_head;  /* protected by lock */
+    VirtIOBlockReq **complete_tail;
+    QEMUBH *submit_bh;              /* runs in the BlockBackend's AioContext */
+    QEMUBH *complete_bh;            /* runs in ctx */
+} VirtIOBlockDataPlaneQueue;
+
 struct VirtIOBlockDataPlane {
     bool starting;
     bool stopping;
@@ -41,16 +64,95 @@ struct VirtIOBlockDataPlane {
      * use it).
      */
     IOThread *iothread;
-    AioContext *ctx;
+    AioContext *ctx;                /* the BlockBackend's AioContext */
+
+    VirtIOBlockDataPlaneQueue *queues;
 };
 
+static inline bool queue_is_remote(VirtIOBlockDataPlaneQueue *q)
+{
+    return q->ctx != q->s->ctx;
+}
+
 /* Raise an interrupt to signal guest, if necessary */
-void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
+static void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s,
+                                         VirtQueue *vq)
 {
     set_bit(virtio_get_queue_index(vq), s->batch_notify_vqs);
     qemu_bh_schedule(s->bh);
 }
 
+/* Context: BlockBackend AioContext */
+static void virtio_blk_data_plane_submit_bh(void *opaque)
+{
+    VirtIOBlockDataPlaneQueue *q = opaque;
+    VirtIOBlockReq *req;
+
+    qemu_mutex_lock(&q->lock);
+    req = q->submit_head;
+    q->submit_head = NULL;
+    q->submit_tail = &q->submit_head;
+    qemu_mutex_unlock(&q->lock);
+
+    if (req) {
+        virtio_blk_handle_req_list(VIRTIO_BLK(q->s->vdev), req);
+    }
+}
+
+/* Context: the queue's AioContext */
+static void virtio_blk_data_plane_complete_bh(void *opaque)
+{
+    VirtIOBlockDataPlaneQueue *q = opaque;
+    VirtIOBlockReq *req;
+
+    qemu_mutex_lock(&q->lock);
+    req = q->complete_head;
+    q->complete_head = NULL;
+    q->complete_tail = &q->complete_head;
+    qemu_mutex_unlock(&q->lock);
+
+    if (!req) {
+        return;
+    }
+
+    while (req) {
+        VirtIOBlockReq *next = req->next;
+
+        virtqueue_push(q->vq, &req->elem, req->in_len);
+        virtio_blk_free_request(req);
+        req = next;
+    }
+
+    if (virtio_should_notify(q->s->vdev, q->vq)) {
+        event_notifier_set(virtio_queue_get_guest_notifier(q->vq));
+    }
+}
+
+/* Return @req, whose status has been filled in, to the guest and free it.
+ *
+ * Context: BlockBackend AioContext
+ */
+void virtio_blk_data_plane_complete(VirtIOBlockDataPlane *s,
+                                    VirtIOBlockReq *req)
+{
+    VirtIOBlockDataPlaneQueue *q =
+        &s->queues[virtio_get_queue_index(req->vq)];
+
+    if (!queue_is_remote(q)) {
+        virtqueue_push(req->vq, &req->elem, req->in_len);
+        virtio_blk_data_plane_notify(s, req->vq);
+        virtio_blk_free_request(req);
+        return;
+    }
+
+    req->next = NULL;
+    qemu_mutex_lock(&q->lock);
+    *q->complete_tail = req;
+    q->complete_tail = &req->next;
+    qemu_mutex_unlock(&q->lock);
+    qemu_bh_schedule(q->complete_bh);
+}
+
 static void notify_guest_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
@@ -77,6 +179,47 @@ static void notify_guest_bh(void *opaque)
     }
 }
 
+/* Resolve the colon-separated list of IOThread ids in
+ * conf->queue_iothreads.  Returns the number of IOThreads, or -1 on error.
+ */
+static int virtio_blk_parse_queue_iothreads(VirtIOBlkConf *conf,
+                                            IOThread ***iothreads,
+                                            Error **errp)
+{
+    gchar **ids;
+    int i, n;
+
+    *iothreads = NULL;
+    if (!conf->queue_iothreads) {
+        return 0;
+    }
+
+    ids = g_strsplit(conf->queue_iothreads, ":", 0);
+    n = g_strv_length(ids);
+    if (n == 0) {
+        error_setg(errp, "queue-iothreads must list at least one IOThread");
+        goto fail;
+    }
+
+    *iothreads = g_new0(IOThread *, n);
+    for (i = 0; i < n; i++) {
+        (*iothreads)[i] = iothread_find(ids[i]);
+        if (!(*iothreads)[i]) {
+            error_setg(errp, "IOThread '%s' not found", ids[i]);
+            goto fail;
+        }
+    }
+
+    g_strfreev(ids);
+    return n;
+
+fail:
+    g_strfreev(ids);
+    g_free(*iothreads);
+    *iothreads = NULL;
+    return -1;
+}
+
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -85,10 +228,13 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    IOThread **iothreads;
+    int n_iothreads;
+    unsigned i;
 
     *dataplane = NULL;
 
-    if (!conf->iothread) {
+    if (!conf->iothread && !conf->queue_iothreads) {
         return;
     }
 
@@ -108,27 +254,69 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
         return;
     }
 
+    n_iothreads = virtio_blk_parse_queue_iothreads(conf, &iothreads, errp);
+    if (n_iothreads < 0) {
+        return;
+    }
+
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
 
-    s->iothread = conf->iothread;
+    /* The BlockBackend lives in the "iothread" IOThread, or in the first
+     * queue IOThread if that is not set */
+    s->iothread = conf->iothread ? conf->iothread : iothreads[0];
     object_ref(OBJECT(s->iothread));
     s->ctx = iothread_get_aio_context(s->iothread);
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
 
+    s->queues = g_new0(VirtIOBlockDataPlaneQueue, conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+
+        q->s = s;
+        q->vq = virtio_get_queue(vdev, i);
+        q->iothread = n_iothreads ? iothreads[i % n_iothreads] : s->iothread;
+        object_ref(OBJECT(q->iothread));
+        q->ctx = iothread_get_aio_context(q->iothread);
+
+        if (queue_is_remote(q)) {
+            qemu_mutex_init(&q->lock);
+            q->submit_tail = &q->submit_head;
+            q->complete_tail = &q->complete_head;
+            q->submit_bh = aio_bh_new(s->ctx, virtio_blk_data_plane_submit_bh,
+                                      q);
+            q->complete_bh = aio_bh_new(q->ctx,
+                                        virtio_blk_data_plane_complete_bh, q);
+        }
+    }
+    g_free(iothreads);
+
     *dataplane = s;
 }
 
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
+    unsigned i;
+
     if (!s) {
         return;
     }
 
     virtio_blk_data_plane_stop(s);
+    for (i = 0; i < s->conf->num_queues; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+
+        if (queue_is_remote(q)) {
+            qemu_bh_delete(q->submit_bh);
+            qemu_bh_delete(q->complete_bh);
+            qemu_mutex_destroy(&q->lock);
+        }
+        object_unref(OBJECT(q->iothread));
+    }
+    g_free(s->queues);
     g_free(s->batch_notify_vqs);
     qemu_bh_delete(s->bh);
     object_unref(OBJECT(s->iothread));
@@ -139,11 +327,36 @@ static void virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
                                                 VirtQueue *vq)
 {
     VirtIOBlock *s = (VirtIOBlock *)vdev;
+    VirtIOBlockDataPlaneQueue *q;
+    VirtIOBlockReq *head = NULL;
+    VirtIOBlockReq **tail = &head;
+    VirtIOBlockReq *req;
 
     assert(s->dataplane);
     assert(s->dataplane_started);
 
-    virtio_blk_handle_vq(s, vq);
+    q = &s->dataplane->queues[virtio_get_queue_index(vq)];
+    if (!queue_is_remote(q)) {
+        virtio_blk_handle_vq(s, vq);
+        return;
+    }
+
+    /* Pop the requests here and let the BlockBackend's AioContext submit
+     * them in one batch */
+    while ((req = virtqueue_pop(vq, sizeof(VirtIOBlockReq)))) {
+        virtio_blk_init_request(s, vq, req);
+        *tail = req;
+        tail = &req->next;
+    }
+    if (!head) {
+        return;
+    }
+
+    qemu_mutex_lock(&q->lock);
+    *q->submit_tail = head;
+    q->submit_tail = tail;
+    qemu_mutex_unlock(&q->lock);
+    qemu_bh_schedule(q->submit_bh);
 }
 
 /* Context: QEMU global mutex held */
@@ -196,14 +409,14 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
-        VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(q->ctx);
+        virtio_queue_aio_set_host_notifier_handler(q->vq, q->ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(q->ctx);
     }
-    aio_context_release(s->ctx);
     return;
 
   fail_guest_notifiers:
@@ -234,13 +447,22 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    aio_context_acquire(s->ctx);
-
     /* Stop notifications for new requests from guest */
     for (i = 0; i < nvqs; i++) {
-        VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        aio_context_acquire(q->ctx);
+        virtio_queue_aio_set_host_notifier_handler(q->vq, q->ctx, NULL);
+        aio_context_release(q->ctx);
+    }
+
+    aio_context_acquire(s->ctx);
+
+    /* Submit what other IOThreads popped but did not hand over yet */
+    for (i = 0; i < nvqs; i++) {
+        if (queue_is_remote(&s->queues[i])) {
+            virtio_blk_data_plane_submit_bh(&s->queues[i]);
+        }
     }
 
     /* Drain and switch bs back to the QEMU main loop */
@@ -248,6 +470,17 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
 
     aio_context_release(s->ctx);
 
+    /* Return the requests completed by the drain to the guest */
+    for (i = 0; i < nvqs; i++) {
+        VirtIOBlockDataPlaneQueue *q = &s->queues[i];
+
+        if (queue_is_remote(q)) {
+            aio_context_acquire(q->ctx);
+            virtio_blk_data_plane_complete_bh(q);
+            aio_context_release(q->ctx);
+        }
+    }
+
     for (i = 0; i < nvqs; i++) {
         virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
     }
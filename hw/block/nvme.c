@@ -18,6 +18,27 @@
  * Usage: add options:
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>
+ *
+ * Optional properties:
+ *      num_queues=<N>      number of queue pairs including the admin queue
+ *      iothread=<id>       process I/O queues in an IOThread
+ *      queue-iothreads=<id>[:<id>...]
+ *                          spread I/O queues over several IOThreads
+ *      ioeventfd=on|off    kick I/O queues through eventfds (default on)
+ *      cmb_size_mb=<N>     expose an N MB controller memory buffer in BAR 2
+ *
+ * The admin queue is always processed in the main loop, because the commands
+ * it carries reconfigure the device.  The I/O queues run in the AioContext of
+ * the drive, or round-robin in the queue-iothreads IOThreads; the drive
+ * stays in the first of those unless iothread is given.
+ *
+ * Shadow doorbells (Doorbell Buffer Config) let the guest skip most doorbell
+ * writes; the remaining submission queue doorbells are turned into
+ * ioeventfds.  Without KVM the doorbell write still reaches the MMIO
+ * handler, which then signals the eventfd itself.
+ *
+ * The controller memory buffer may hold submission queues, PRP lists, SGL
+ * segments and data; completion queues stay in host memory.
  */
 
 #include "qemu/osdep.h"
@@ -29,9 +50,15 @@
 #include "qapi/error.h"
 #include "qapi/visitor.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/dma.h"
+#include "sysemu/kvm.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 
 #include "nvme.h"
 
+#define NVME_MAX_QUEUES 2048
+
 static void nvme_process_sq(void *opaque);
 
 static int nvme_check_sqid(NvmeCtrl *n, uint16_t sqid)
@@ -71,6 +98,12 @@ static uint8_t nvme_sq_empty(NvmeSQueue *sq)
 static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
 {
     if (cq->irq_enabled) {
+        if (!qemu_mutex_iothread_locked()) {
+            /* Interrupts can only be injected under the BQL */
+            atomic_set(&cq->irq_pending, true);
+            qemu_bh_schedule(n->irq_bh);
+            return;
+        }
         if (msix_enabled(&(n->parent_obj))) {
             msix_notify(&(n->parent_obj), cq->vector);
         } else {
@@ -79,6 +112,148 @@ static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+static void nvme_irq_bh(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    int i;
+
+    aio_context_acquire(n->ctx);
+    for (i = 1; i < n->num_queues; i++) {
+        NvmeCQueue *cq = n->cq[i];
+
+        if (cq && atomic_xchg(&cq->irq_pending, false)) {
+            nvme_isr_notify(n, cq);
+        }
+    }
+    aio_context_release(n->ctx);
+}
+
+static bool nvme_addr_is_cmb(NvmeCtrl *n, hwaddr addr, int size)
+{
+    pcibus_t base;
+
+    if (!n->cmbuf) {
+        return false;
+    }
+    base = pci_get_bar_addr(&n->parent_obj, NVME_CMBLOC_BIR(n->bar.cmbloc));
+    return base != PCI_BAR_UNMAPPED && addr >= base &&
+           addr - base + size <= NVME_CMBSZ_GETSIZE(n->bar.cmbsz);
+}
+
+/* Read controller input (commands, PRP lists, SGL segments) that the guest
+ * may have placed in the controller memory buffer. */
+static void nvme_addr_read(NvmeCtrl *n, hwaddr addr, void *buf, int size)
+{
+    if (nvme_addr_is_cmb(n, addr, size)) {
+        pcibus_t base = pci_get_bar_addr(&n->parent_obj,
+                                         NVME_CMBLOC_BIR(n->bar.cmbloc));
+
+        memcpy(buf, n->cmbuf + (addr - base), size);
+        return;
+    }
+    pci_dma_read(&n->parent_obj, addr, buf, size);
+}
+
+static AioContext *nvme_queue_ctx(NvmeCtrl *n, uint16_t qid)
+{
+    if (!qid) {
+        return qemu_get_aio_context();
+    }
+    if (n->num_iothreads) {
+        return iothread_get_aio_context(
+            n->iothreads[(qid - 1) % n->num_iothreads]);
+    }
+    return n->ctx;
+}
+
+/* Queue handlers run with their own AioContext held and then take n->ctx.
+ * Creating and deleting queues must keep those handlers out as well, so
+ * take every queue context, always before n->ctx. */
+static void nvme_ctrl_acquire(NvmeCtrl *n)
+{
+    int i;
+
+    for (i = 0; i < n->num_iothreads; i++) {
+        AioContext *ctx = iothread_get_aio_context(n->iothreads[i]);
+
+        if (ctx != n->ctx) {
+            aio_context_acquire(ctx);
+        }
+    }
+    aio_context_acquire(n->ctx);
+}
+
+static void nvme_ctrl_release(NvmeCtrl *n)
+{
+    int i;
+
+    aio_context_release(n->ctx);
+    for (i = n->num_iothreads - 1; i >= 0; i--) {
+        AioContext *ctx = iothread_get_aio_context(n->iothreads[i]);
+
+        if (ctx != n->ctx) {
+            aio_context_release(ctx);
+        }
+    }
+}
+
+/* Shadow doorbells: the guest stores new tail/head values in the shadow
+ * doorbell page and only writes the MMIO doorbell when it moves past the
+ * EventIdx the controller published for that queue. */
+
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t v;
+
+    if (!sq->db_addr) {
+        return;
+    }
+    pci_dma_read(&sq->ctrl->parent_obj, sq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (v < sq->size) {
+        sq->tail = v;
+    }
+}
+
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    pci_dma_write(&sq->ctrl->parent_obj, sq->ei_addr, &v, sizeof(v));
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    uint32_t v;
+
+    if (!cq->db_addr) {
+        return;
+    }
+    pci_dma_read(&cq->ctrl->parent_obj, cq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (v < cq->size) {
+        cq->head = v;
+    }
+}
+
+/* Called with a full completion queue.  Ask the guest to ring the head
+ * doorbell on its next update and return true if the queue drained in the
+ * meantime. */
+static bool nvme_cq_wait_head(NvmeCQueue *cq)
+{
+    uint32_t v;
+
+    if (!cq->ei_addr) {
+        return false;
+    }
+    v = cpu_to_le32(cq->head);
+    pci_dma_write(&cq->ctrl->parent_obj, cq->ei_addr, &v, sizeof(v));
+    /* Order the EventIdx update before re-reading the shadow head */
+    smp_mb();
+    nvme_update_cq_head(cq);
+    return !nvme_cq_full(cq);
+}
+
 static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
     uint32_t len, NvmeCtrl *n)
 {
@@ -104,7 +279,7 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
 
             nents = (len + n->page_size - 1) >> n->page_bits;
             prp_trans = MIN(n->max_prp_ents, nents) * sizeof(uint64_t);
-            pci_dma_read(&n->parent_obj, prp2, (void *)prp_list, prp_trans);
+            nvme_addr_read(n, prp2, (void *)prp_list, prp_trans);
             while (len != 0) {
                 uint64_t prp_ent = le64_to_cpu(prp_list[i]);
 
@@ -116,8 +291,7 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
                     i = 0;
                     nents = (len + n->page_size - 1) >> n->page_bits;
                     prp_trans = MIN(n->max_prp_ents, nents) * sizeof(uint64_t);
-                    pci_dma_read(&n->parent_obj, prp_ent, (void *)prp_list,
-                        prp_trans);
+                    nvme_addr_read(n, prp_ent, (void *)prp_list, prp_trans);
                     prp_ent = le64_to_cpu(prp_list[i]);
                 }
 
@@ -144,6 +318,130 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
     return NVME_INVALID_FIELD | NVME_DNR;
 }
 
+static uint16_t nvme_map_sgl_data(NvmeCtrl *n, QEMUSGList *qsg,
+                                  NvmeSglDescriptor *segment, int nsgld,
+                                  uint64_t *remaining)
+{
+    int i;
+
+    for (i = 0; i < nsgld; i++) {
+        uint32_t len = le32_to_cpu(segment[i].len);
+
+        if (NVME_SGL_TYPE(segment[i].type) != NVME_SGL_DESCR_TYPE_DATA_BLOCK) {
+            return NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+        }
+        if (len > *remaining) {
+            return NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+        }
+        if (len) {
+            qemu_sglist_add(qsg, le64_to_cpu(segment[i].addr), len);
+            *remaining -= len;
+        }
+    }
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_map_sgl(NvmeCtrl *n, QEMUSGList *qsg,
+                             NvmeSglDescriptor sgl, uint64_t len)
+{
+    NvmeSglDescriptor segment[256];
+    uint64_t remaining = len;
+    uint16_t status = NVME_SUCCESS;
+
+    pci_dma_sglist_init(qsg, &n->parent_obj, 1);
+
+    for (;;) {
+        uint64_t addr = le64_to_cpu(sgl.addr);
+        uint32_t seg_len = le32_to_cpu(sgl.len);
+        uint64_t before = remaining;
+        bool last;
+        int nsgld;
+
+        switch (NVME_SGL_TYPE(sgl.type)) {
+        case NVME_SGL_DESCR_TYPE_DATA_BLOCK:
+            /* A single data block straight in the command */
+            status = nvme_map_sgl_data(n, qsg, &sgl, 1, &remaining);
+            goto out;
+        case NVME_SGL_DESCR_TYPE_SEGMENT:
+        case NVME_SGL_DESCR_TYPE_LAST_SEGMENT:
+            break;
+        default:
+            status = NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+            goto out;
+        }
+
+        if (!seg_len || seg_len % sizeof(NvmeSglDescriptor)) {
+            status = NVME_INVALID_SGL_SEG_DESCR | NVME_DNR;
+            goto out;
+        }
+        last = NVME_SGL_TYPE(sgl.type) == NVME_SGL_DESCR_TYPE_LAST_SEGMENT;
+        nsgld = seg_len / sizeof(NvmeSglDescriptor);
+
+        /* All but the final descriptor of a segment describe data */
+        while (nsgld > ARRAY_SIZE(segment)) {
+            nvme_addr_read(n, addr, segment, sizeof(segment));
+            status = nvme_map_sgl_data(n, qsg, segment, ARRAY_SIZE(segment),
+                                       &remaining);
+            if (status) {
+                goto out;
+            }
+            nsgld -= ARRAY_SIZE(segment);
+            addr += sizeof(segment);
+        }
+
+        nvme_addr_read(n, addr, segment, nsgld * sizeof(NvmeSglDescriptor));
+        if (!last) {
+            uint8_t type = NVME_SGL_TYPE(segment[nsgld - 1].type);
+
+            if (type != NVME_SGL_DESCR_TYPE_SEGMENT &&
+                type != NVME_SGL_DESCR_TYPE_LAST_SEGMENT) {
+                status = NVME_INVALID_SGL_SEG_DESCR | NVME_DNR;
+                goto out;
+            }
+            nsgld--;
+        }
+        status = nvme_map_sgl_data(n, qsg, segment, nsgld, &remaining);
+        if (status || last) {
+            goto out;
+        }
+        if (remaining == before) {
+            /* A segment that maps nothing could chain forever */
+            status = NVME_INVALID_SGL_SEG_DESCR | NVME_DNR;
+            goto out;
+        }
+        sgl = segment[nsgld];
+    }
+
+out:
+    if (!status && remaining) {
+        status = NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+    }
+    if (status) {
+        qemu_sglist_destroy(qsg);
+    }
+    return status;
+}
+
+/* Map the data pointer of an I/O command, described by PRPs or an SGL */
+static uint16_t nvme_map_dptr(NvmeCtrl *n, QEMUSGList *qsg, NvmeCmd *cmd,
+                              uint64_t len)
+{
+    NvmeSglDescriptor sgl;
+
+    switch (NVME_CMD_FLAGS_PSDT(cmd->fuse)) {
+    case NVME_PSDT_PRP:
+        return nvme_map_prp(qsg, le64_to_cpu(cmd->prp1),
+                            le64_to_cpu(cmd->prp2), len, n);
+    case NVME_PSDT_SGL_MPTR_CONTIG:
+        QEMU_BUILD_BUG_ON(sizeof(sgl) !=
+                          sizeof(cmd->prp1) + sizeof(cmd->prp2));
+        memcpy(&sgl, &cmd->prp1, sizeof(sgl));
+        return nvme_map_sgl(n, qsg, sgl, len);
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+}
+
 static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     uint64_t prp1, uint64_t prp2)
 {
@@ -164,13 +462,16 @@ static void nvme_post_cqes(void *opaque)
 {
     NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
-    NvmeRequest *req, *next;
+    NvmeRequest *req;
+    bool posted = false;
 
-    QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
+    aio_context_acquire(n->ctx);
+    nvme_update_cq_head(cq);
+    while ((req = QTAILQ_FIRST(&cq->req_list))) {
         NvmeSQueue *sq;
         hwaddr addr;
 
-        if (nvme_cq_full(cq)) {
+        if (nvme_cq_full(cq) && !nvme_cq_wait_head(cq)) {
             break;
         }
 
@@ -184,8 +485,16 @@ static void nvme_post_cqes(void *opaque)
         pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
             sizeof(req->cqe));
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+        posted = true;
+        if (!nvme_sq_empty(sq)) {
+            /* Commands were left behind for lack of a free request */
+            qemu_bh_schedule(sq->bh);
+        }
     }
-    nvme_isr_notify(n, cq);
+    if (posted) {
+        nvme_isr_notify(n, cq);
+    }
+    aio_context_release(n->ctx);
 }
 
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
@@ -193,7 +502,7 @@ static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
     assert(cq->cqid == req->sq->cqid);
     QTAILQ_REMOVE(&req->sq->out_req_list, req, entry);
     QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
-    timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    qemu_bh_schedule(cq->bh);
 }
 
 static void nvme_rw_cb(void *opaque, int ret)
@@ -233,8 +542,7 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
     uint32_t nlb  = le32_to_cpu(rw->nlb) + 1;
     uint64_t slba = le64_to_cpu(rw->slba);
-    uint64_t prp1 = le64_to_cpu(rw->prp1);
-    uint64_t prp2 = le64_to_cpu(rw->prp2);
+    uint16_t status;
 
     uint8_t lba_index  = NVME_ID_NS_FLBAS_INDEX(ns->id_ns.flbas);
     uint8_t data_shift = ns->id_ns.lbaf[lba_index].ds;
@@ -248,9 +556,10 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
         return NVME_LBA_RANGE | NVME_DNR;
     }
 
-    if (nvme_map_prp(&req->qsg, prp1, prp2, data_size, n)) {
+    status = nvme_map_dptr(n, &req->qsg, cmd, data_size);
+    if (status) {
         block_acct_invalid(blk_get_stats(n->conf.blk), acct);
-        return NVME_INVALID_FIELD | NVME_DNR;
+        return status;
     }
 
     assert((nlb << data_shift) == req->qsg.size);
@@ -288,8 +597,15 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     n->sq[sq->sqid] = NULL;
-    timer_del(sq->timer);
-    timer_free(sq->timer);
+    if (sq->ioeventfd_enabled) {
+        memory_region_del_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4,
+                                  false, 0, &sq->notifier);
+        aio_set_event_notifier(nvme_queue_ctx(n, sq->sqid), &sq->notifier,
+                               true, NULL, NULL);
+        event_notifier_cleanup(&sq->notifier);
+        sq->ioeventfd_enabled = false;
+    }
+    qemu_bh_delete(sq->bh);
     g_free(sq->io_req);
     if (sq->sqid) {
         g_free(sq);
@@ -331,6 +647,53 @@ static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeCmd *cmd)
     return NVME_SUCCESS;
 }
 
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_process_sq(sq);
+    }
+}
+
+/* Point an I/O queue at its slots in the shadow doorbell and EventIdx
+ * buffers.  Without ioeventfd, every doorbell write would still exit to
+ * QEMU, so this is also where the submission queue doorbell moves to an
+ * eventfd: with shadow doorbells the value written no longer matters. */
+static void nvme_init_sq_dbbuf(NvmeSQueue *sq, NvmeCtrl *n)
+{
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    /* The queue may already be in use, start from the tail seen so far */
+    pci_dma_write(&n->parent_obj, sq->db_addr, &v, sizeof(v));
+    pci_dma_write(&n->parent_obj, sq->ei_addr, &v, sizeof(v));
+
+    if (!n->ioeventfd || sq->ioeventfd_enabled ||
+        (kvm_enabled() && !kvm_has_many_ioeventfds())) {
+        return;
+    }
+    if (event_notifier_init(&sq->notifier, 0) < 0) {
+        return;
+    }
+    aio_set_event_notifier(nvme_queue_ctx(n, sq->sqid), &sq->notifier, true,
+                           nvme_sq_notifier, NULL);
+    memory_region_add_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4,
+                              false, 0, &sq->notifier);
+    sq->ioeventfd_enabled = true;
+}
+
+static void nvme_init_cq_dbbuf(NvmeCQueue *cq, NvmeCtrl *n)
+{
+    uint32_t v = cpu_to_le32(cq->head);
+
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+    pci_dma_write(&n->parent_obj, cq->db_addr, &v, sizeof(v));
+    pci_dma_write(&n->parent_obj, cq->ei_addr, &v, sizeof(v));
+}
+
 static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     uint16_t sqid, uint16_t cqid, uint16_t size)
 {
@@ -351,12 +714,15 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    sq->bh = aio_bh_new(nvme_queue_ctx(n, sqid), nvme_process_sq, sq);
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+    if (sqid && n->dbbuf_enabled && sqid < n->page_size >> 3) {
+        nvme_init_sq_dbbuf(sq, n);
+    }
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -393,8 +759,7 @@ static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     n->cq[cq->cqid] = NULL;
-    timer_del(cq->timer);
-    timer_free(cq->timer);
+    qemu_bh_delete(cq->bh);
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
@@ -434,7 +799,10 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    cq->bh = aio_bh_new(nvme_queue_ctx(n, cqid), nvme_post_cqes, cq);
+    if (cqid && n->dbbuf_enabled && cqid < n->page_size >> 3) {
+        nvme_init_cq_dbbuf(cq, n);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -546,7 +914,7 @@ static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         result = blk_enable_write_cache(n->conf.blk);
         break;
     case NVME_NUMBER_OF_QUEUES:
-        result = cpu_to_le32((n->num_queues - 1) | ((n->num_queues - 1) << 16));
+        result = cpu_to_le32((n->num_queues - 2) | ((n->num_queues - 2) << 16));
         break;
     default:
         return NVME_INVALID_FIELD | NVME_DNR;
@@ -567,7 +935,7 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         break;
     case NVME_NUMBER_OF_QUEUES:
         req->cqe.result =
-            cpu_to_le32((n->num_queues - 1) | ((n->num_queues - 1) << 16));
+            cpu_to_le32((n->num_queues - 2) | ((n->num_queues - 2) << 16));
         break;
     default:
         return NVME_INVALID_FIELD | NVME_DNR;
@@ -575,6 +943,33 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     return NVME_SUCCESS;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    if (!dbs_addr || dbs_addr & (n->page_size - 1) ||
+        !eis_addr || eis_addr & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+
+    /* Both buffers are a single page, which bounds the usable queue IDs */
+    for (i = 1; i < MIN(n->num_queues, n->page_size >> 3); i++) {
+        if (n->sq[i]) {
+            nvme_init_sq_dbbuf(n->sq[i], n);
+        }
+        if (n->cq[i]) {
+            nvme_init_cq_dbbuf(n->cq[i], n);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -592,6 +987,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
@@ -608,9 +1005,17 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
+    if (sq->sqid) {
+        aio_context_acquire(n->ctx);
+    } else {
+        /* Admin commands create and delete queues */
+        nvme_ctrl_acquire(n);
+    }
+    nvme_update_sq_tail(sq);
+again:
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
-        pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
+        nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd));
         nvme_inc_sq_head(sq);
 
         req = QTAILQ_FIRST(&sq->req_list);
@@ -626,12 +1031,29 @@ static void nvme_process_sq(void *opaque)
             nvme_enqueue_req_completion(cq, req);
         }
     }
+    if (sq->ei_addr) {
+        /* Publish the tail we stopped at, then catch racing submissions */
+        nvme_update_sq_eventidx(sq);
+        /* Pairs with the guest's barrier between tail update and check */
+        smp_mb();
+        nvme_update_sq_tail(sq);
+        if (!nvme_sq_empty(sq) && !QTAILQ_EMPTY(&sq->req_list)) {
+            goto again;
+        }
+    }
+    if (sq->sqid) {
+        aio_context_release(n->ctx);
+    } else {
+        nvme_ctrl_release(n);
+    }
 }
 
 static void nvme_clear_ctrl(NvmeCtrl *n)
 {
     int i;
 
+    blk_drain(n->conf.blk);
+
     for (i = 0; i < n->num_queues; i++) {
         if (n->sq[i] != NULL) {
             nvme_free_sq(n->sq[i], n);
@@ -644,6 +1066,8 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
     }
 
     blk_flush(n->conf.blk);
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
+    n->dbbuf_enabled = false;
     n->bar.cc = 0;
 }
 
@@ -777,9 +1201,9 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         if (start_sqs) {
             NvmeSQueue *sq;
             QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+                qemu_bh_schedule(sq->bh);
             }
-            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+            qemu_bh_schedule(cq->bh);
         }
 
         if (cq->tail != cq->head) {
@@ -800,7 +1224,12 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         }
 
         sq->tail = new_tail;
-        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        if (sq->ioeventfd_enabled) {
+            /* The write was not caught as an ioeventfd, forward it */
+            event_notifier_set(&sq->notifier);
+        } else {
+            qemu_bh_schedule(sq->bh);
+        }
     }
 }
 
@@ -808,10 +1237,16 @@ static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
     unsigned size)
 {
     NvmeCtrl *n = (NvmeCtrl *)opaque;
+
     if (addr < sizeof(n->bar)) {
+        /* Disabling the controller deletes all queues */
+        nvme_ctrl_acquire(n);
         nvme_write_bar(n, addr, data, size);
+        nvme_ctrl_release(n);
     } else if (addr >= 0x1000) {
+        aio_context_acquire(n->ctx);
         nvme_process_db(n, addr, data);
+        aio_context_release(n->ctx);
     }
 }
 
@@ -825,6 +1260,47 @@ static const MemoryRegionOps nvme_mmio_ops = {
     },
 };
 
+/* Resolve the colon-separated list of IOThread ids in n->queue_iothreads */
+static int nvme_init_queue_iothreads(NvmeCtrl *n)
+{
+    gchar **ids;
+    int i;
+
+    if (!n->queue_iothreads) {
+        return 0;
+    }
+
+    ids = g_strsplit(n->queue_iothreads, ":", 0);
+    n->num_iothreads = g_strv_length(ids);
+    if (!n->num_iothreads) {
+        error_report("nvme: queue-iothreads must list at least one IOThread");
+        g_strfreev(ids);
+        return -1;
+    }
+
+    n->iothreads = g_new0(IOThread *, n->num_iothreads);
+    for (i = 0; i < n->num_iothreads; i++) {
+        n->iothreads[i] = iothread_find(ids[i]);
+        if (!n->iothreads[i]) {
+            error_report("nvme: IOThread '%s' not found", ids[i]);
+            goto fail;
+        }
+    }
+    for (i = 0; i < n->num_iothreads; i++) {
+        object_ref(OBJECT(n->iothreads[i]));
+    }
+
+    g_strfreev(ids);
+    return 0;
+
+fail:
+    g_strfreev(ids);
+    g_free(n->iothreads);
+    n->iothreads = NULL;
+    n->num_iothreads = 0;
+    return -1;
+}
+
 static int nvme_init(PCIDevice *pci_dev)
 {
     NvmeCtrl *n = NVME(pci_dev);
@@ -850,6 +1326,38 @@ static int nvme_init(PCIDevice *pci_dev)
     blkconf_blocksizes(&n->conf);
     blkconf_apply_backend_options(&n->conf);
 
+    if (n->num_queues < 2 || n->num_queues > NVME_MAX_QUEUES) {
+        error_report("nvme: num_queues must be between 2 and %d",
+                     NVME_MAX_QUEUES);
+        return -1;
+    }
+
+    if (n->cmb_size_mb && (n->cmb_size_mb > CMBSZ_SZ_MASK ||
+                           !is_power_of_2(n->cmb_size_mb))) {
+        error_report("nvme: cmb_size_mb must be a power of 2 up to %d",
+                     CMBSZ_SZ_MASK);
+        return -1;
+    }
+
+    if (nvme_init_queue_iothreads(n) < 0) {
+        return -1;
+    }
+
+    if (n->iothread) {
+        n->ctx = iothread_get_aio_context(n->iothread);
+        object_ref(OBJECT(n->iothread));
+    } else if (n->num_iothreads) {
+        n->ctx = iothread_get_aio_context(n->iothreads[0]);
+    } else {
+        n->ctx = qemu_get_aio_context();
+    }
+    if (n->ctx != qemu_get_aio_context()) {
+        aio_context_acquire(n->ctx);
+        blk_set_aio_context(n->conf.blk, n->ctx);
+        aio_context_release(n->ctx);
+    }
+    n->irq_bh = qemu_bh_new(nvme_irq_bh, n);
+
     pci_conf = pci_dev->config;
     pci_conf[PCI_INTERRUPT_PIN] = 1;
     pci_config_set_prog_interface(pci_dev->config, 0x2);
@@ -857,7 +1365,6 @@ static int nvme_init(PCIDevice *pci_dev)
     pcie_endpoint_cap_init(&n->parent_obj, 0x80);
 
     n->num_namespaces = 1;
-    n->num_queues = 64;
     n->reg_size = pow2ceil(0x1004 + 2 * (n->num_queues + 1) * 4);
     n->ns_size = bs_size / (uint64_t)n->num_namespaces;
 
@@ -872,6 +1379,32 @@ static int nvme_init(PCIDevice *pci_dev)
         &n->iomem);
     msix_init_exclusive_bar(&n->parent_obj, n->num_queues, 4);
 
+    if (n->cmb_size_mb) {
+        Error *local_err = NULL;
+
+        NVME_CMBLOC_SET_BIR(n->bar.cmbloc, 2);
+        NVME_CMBLOC_SET_OFST(n->bar.cmbloc, 0);
+
+        NVME_CMBSZ_SET_SQS(n->bar.cmbsz, 1);
+        NVME_CMBSZ_SET_CQS(n->bar.cmbsz, 0);
+        NVME_CMBSZ_SET_LISTS(n->bar.cmbsz, 1);
+        NVME_CMBSZ_SET_RDS(n->bar.cmbsz, 1);
+        NVME_CMBSZ_SET_WDS(n->bar.cmbsz, 1);
+        NVME_CMBSZ_SET_SZU(n->bar.cmbsz, 2); /* MBs */
+        NVME_CMBSZ_SET_SZ(n->bar.cmbsz, n->cmb_size_mb);
+
+        memory_region_init_ram(&n->ctrl_mem, OBJECT(n), "nvme-cmb",
+                               NVME_CMBSZ_GETSIZE(n->bar.cmbsz), &local_err);
+        if (local_err) {
+            error_report_err(local_err);
+            return -1;
+        }
+        n->cmbuf = memory_region_get_ram_ptr(&n->ctrl_mem);
+        pci_register_bar(&n->parent_obj, NVME_CMBLOC_BIR(n->bar.cmbloc),
+            PCI_BASE_ADDRESS_SPACE_MEMORY | PCI_BASE_ADDRESS_MEM_TYPE_64 |
+            PCI_BASE_ADDRESS_MEM_PREFETCH, &n->ctrl_mem);
+    }
+
     id->vid = cpu_to_le16(pci_get_word(pci_conf + PCI_VENDOR_ID));
     id->ssvid = cpu_to_le16(pci_get_word(pci_conf + PCI_SUBSYSTEM_VENDOR_ID));
     strpadcpy((char *)id->mn, sizeof(id->mn), "QEMU NVMe Ctrl", ' ');
@@ -881,12 +1414,13 @@ static int nvme_init(PCIDevice *pci_dev)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
     id->cqes = (0x4 << 4) | 0x4;
     id->nn = cpu_to_le32(n->num_namespaces);
+    id->sgls = cpu_to_le32(NVME_SGLS_SUPPORTED);
     id->psd[0].mp = cpu_to_le16(0x9c4);
     id->psd[0].enlat = cpu_to_le32(0x10);
     id->psd[0].exlat = cpu_to_le32(0x4);
@@ -925,8 +1459,22 @@ static int nvme_init(PCIDevice *pci_dev)
 static void nvme_exit(PCIDevice *pci_dev)
 {
     NvmeCtrl *n = NVME(pci_dev);
+    int i;
 
+    nvme_ctrl_acquire(n);
     nvme_clear_ctrl(n);
+    if (n->ctx != qemu_get_aio_context()) {
+        blk_set_aio_context(n->conf.blk, qemu_get_aio_context());
+    }
+    nvme_ctrl_release(n);
+    if (n->iothread) {
+        object_unref(OBJECT(n->iothread));
+    }
+    for (i = 0; i < n->num_iothreads; i++) {
+        object_unref(OBJECT(n->iothreads[i]));
+    }
+    g_free(n->iothreads);
+    qemu_bh_delete(n->irq_bh);
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
@@ -936,6 +1484,10 @@ static void nvme_exit(PCIDevice *pci_dev)
 static Property nvme_props[] = {
     DEFINE_BLOCK_PROPERTIES(NvmeCtrl, conf),
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
+    DEFINE_PROP_UINT32("num_queues", NvmeCtrl, num_queues, 64),
+    DEFINE_PROP_BOOL("ioeventfd", NvmeCtrl, ioeventfd, true),
+    DEFINE_PROP_STRING("queue-iothreads", NvmeCtrl, queue_iothreads),
+    DEFINE_PROP_UINT32("cmb_size_mb", NvmeCtrl, cmb_size_mb, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -970,6 +1522,10 @@ static void nvme_instance_init(Object *obj)
     device_add_bootindex_property(obj, &s->conf.bootindex,
                                   "bootindex", "/namespace@1,0",
                                   DEVICE(obj), &error_abort);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&s->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
 }
 
 static const TypeInfo nvme_info = {
@@ -47,6 +47,7 @@ void virtio_blk_free_request(VirtIOBlockReq *req)
     }
 }
 
+/* Return @req to the guest and free it */
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
 {
     VirtIOBlock *s = req->dev;
@@ -55,12 +56,14 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(req->vq, &req->elem, req->in_len);
     if (s->dataplane_started && !s->dataplane_disabled) {
-        virtio_blk_data_plane_notify(s->dataplane, req->vq);
-    } else {
-        virtio_notify(vdev, req->vq);
+        virtio_blk_data_plane_complete(s->dataplane, req);
+        return;
     }
+
+    virtqueue_push(req->vq, &req->elem, req->in_len);
+    virtio_notify(vdev, req->vq);
+    virtio_blk_free_request(req);
 }
 
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
@@ -77,9 +80,8 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
         req->next = s->rq;
         s->rq = req;
     } else if (action == BLOCK_ERROR_ACTION_REPORT) {
-        virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
         block_acct_failed(blk_get_stats(s->blk), &req->acct);
-        virtio_blk_free_request(req);
+        virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
     }
 
     blk_error_action(s->blk, action, is_read, error);
@@ -118,9 +120,8 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
             }
         }
 
-        virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
         block_acct_done(blk_get_stats(req->dev->blk), &req->acct);
-        virtio_blk_free_request(req);
+        virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
     }
 }
 
@@ -134,9 +135,8 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
         }
     }
 
-    virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
     block_acct_done(blk_get_stats(req->dev->blk), &req->acct);
-    virtio_blk_free_request(req);
+    virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
 }
 
 #ifdef __linux__
@@ -183,7 +183,6 @@ static void virtio_blk_ioctl_complete(void *opaque, int status)
 
 out:
     virtio_blk_req_complete(req, status);
-    virtio_blk_free_request(req);
     g_free(ioctl_req);
 }
 
@@ -315,7 +314,6 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
     status = virtio_blk_handle_scsi_req(req);
     if (status != -EINPROGRESS) {
         virtio_blk_req_complete(req, status);
-        virtio_blk_free_request(req);
     }
 }
 
@@ -525,10 +523,9 @@ void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 
         if (!virtio_blk_sect_range_ok(req->dev, req->sector_num,
                                       req->qiov.size)) {
-            virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
             block_acct_invalid(blk_get_stats(req->dev->blk),
                                is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ);
-            virtio_blk_free_request(req);
+            virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
             return;
         }
 
@@ -569,12 +566,10 @@ void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
                               VIRTIO_BLK_ID_BYTES));
         iov_from_buf(in_iov, in_num, 0, serial, size);
         virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
-        virtio_blk_free_request(req);
         break;
     }
     default:
         virtio_blk_req_complete(req, VIRTIO_BLK_S_UNSUPP);
-        virtio_blk_free_request(req);
     }
 }
 
@@ -596,6 +591,28 @@ void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
     blk_io_unplug(s->blk);
 }
 
+/* Process requests linked through req->next that were already popped from
+ * their virtqueue */
+void virtio_blk_handle_req_list(VirtIOBlock *s, VirtIOBlockReq *req)
+{
+    MultiReqBuffer mrb = {};
+
+    blk_io_plug(s->blk);
+
+    while (req) {
+        VirtIOBlockReq *next = req->next;
+        req->next = NULL;
+        virtio_blk_handle_request(req, &mrb);
+        req = next;
+    }
+
+    if (mrb.num_reqs) {
+        virtio_blk_submit_multireq(s->blk, &mrb);
+    }
+
+    blk_io_unplug(s->blk);
+}
+
 static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBlock *s = (VirtIOBlock *)vdev;
@@ -616,22 +633,13 @@ static void virtio_blk_dma_restart_bh(void *opaque)
 {
     VirtIOBlock *s = opaque;
     VirtIOBlockReq *req = s->rq;
-    MultiReqBuffer mrb = {};
 
     qemu_bh_delete(s->bh);
     s->bh = NULL;
 
     s->rq = NULL;
 
-    while (req) {
-        VirtIOBlockReq *next = req->next;
-        virtio_blk_handle_request(req, &mrb);
-        req = next;
-    }
-
-    if (mrb.num_reqs) {
-        virtio_blk_submit_multireq(s->blk, &mrb);
-    }
+    virtio_blk_handle_req_list(s, req);
 }
 
 static void virtio_blk_dma_restart_cb(void *opaque, int running,
@@ -970,6 +978,7 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BIT("request-merging", VirtIOBlock, conf.request_merging, 0,
                     true),
     DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
+    DEFINE_PROP_STRING("queue-iothreads", VirtIOBlock, conf.queue_iothreads),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -82,8 +82,23 @@ typedef struct BdrvTrackedRequest {
     CoQueue wait_queue; /* coroutines blocked on this request */
 
     struct BdrvTrackedRequest *waiting_for;
+
+    /* For write requests, the aligned range and data that are about to be
+     * written while before_write_notifiers are running.  write_qiov is NULL
+     * for zero writes. */
+    int64_t write_offset;
+    unsigned int write_bytes;
+    QEMUIOVector *write_qiov;
+    int write_flags;
 } BdrvTrackedRequest;
 
+/* Array of tracked requests, see BlockDriverState.tracked_index */
+typedef struct BdrvTrackedRequestIndex {
+    BdrvTrackedRequest **reqs;
+    unsigned int len;
+    unsigned int size;
+} BdrvTrackedRequestIndex;
+
 struct BlockDriver {
     const char *format_name;
     int instance_size;
@@ -167,6 +182,24 @@ struct BlockDriver {
         int64_t offset, int count, BdrvRequestFlags flags);
     int coroutine_fn (*bdrv_co_pdiscard)(BlockDriverState *bs,
         int64_t offset, int count);
+
+    /*
+     * Copy a range of data from @src to @dst without passing it through a
+     * bounce buffer.  bdrv_co_copy_range_from is called on the source node
+     * (src->bs == bs) and either forwards the request to a child or calls
+     * bdrv_co_copy_range_to() to let the destination side finish it;
+     * bdrv_co_copy_range_to is called on the destination node
+     * (dst->bs == bs).  Both may be NULL or return -ENOTSUP, in which case
+     * the caller has to copy the data itself.
+     */
+    int coroutine_fn (*bdrv_co_copy_range_from)(BlockDriverState *bs,
+        BdrvChild *src, uint64_t src_offset,
+        BdrvChild *dst, uint64_t dst_offset,
+        uint64_t bytes, BdrvRequestFlags flags);
+    int coroutine_fn (*bdrv_co_copy_range_to)(BlockDriverState *bs,
+        BdrvChild *src, uint64_t src_offset,
+        BdrvChild *dst, uint64_t dst_offset,
+        uint64_t bytes, BdrvRequestFlags flags);
     int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum,
         BlockDriverState **file);
@@ -320,6 +353,23 @@ struct BlockDriver {
     void (*bdrv_del_child)(BlockDriverState *parent, BdrvChild *child,
                            Error **errp);
 
+    /**
+     * Persistent dirty bitmaps.  Drivers that can store bitmaps load them
+     * when the image is opened and store the persistent ones in
+     * bdrv_inactivate.
+     *
+     * bdrv_can_store_new_dirty_bitmap checks whether a bitmap with the given
+     * name and granularity could be stored; bdrv_remove_persistent_dirty_bitmap
+     * deletes the stored copy of a bitmap from the image.
+     */
+    bool (*bdrv_can_store_new_dirty_bitmap)(BlockDriverState *bs,
+                                            const char *name,
+                                            uint32_t granularity,
+                                            Error **errp);
+    void (*bdrv_remove_persistent_dirty_bitmap)(BlockDriverState *bs,
+                                                const char *name,
+                                                Error **errp);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -499,6 +549,13 @@ struct BlockDriverState {
 
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
 
+    /* Lookup structure for overlap checks against tracked_requests.  It is
+     * only maintained while serialising_in_flight is non-zero; requests are
+     * sorted by overlap_offset in tracked_index, except for those with a
+     * large overlap range, which are kept in tracked_large. */
+    BdrvTrackedRequestIndex tracked_index;
+    BdrvTrackedRequestIndex tracked_large;
+
     /* operation blockers */
     QLIST_HEAD(, BdrvOpBlocker) op_blockers[BLOCK_OP_TYPE_MAX];
 
@@ -577,6 +634,14 @@ int coroutine_fn bdrv_co_preadv(BdrvChild *child,
 int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
     int64_t offset, unsigned int bytes, QEMUIOVector *qiov,
     BdrvRequestFlags flags);
+int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, uint64_t src_offset,
+                                         BdrvChild *dst, uint64_t dst_offset,
+                                         uint64_t bytes,
+                                         BdrvRequestFlags flags);
+int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, uint64_t src_offset,
+                                       BdrvChild *dst, uint64_t dst_offset,
+                                       uint64_t bytes,
+                                       BdrvRequestFlags flags);
 
 int get_tmp_filename(char *filename, int size);
 BlockDriver *bdrv_probe_all(const uint8_t *buf, int buf_size,
@@ -725,6 +790,7 @@ void commit_active_start(const char *job_id, BlockDriverState *bs,
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @unmap: Whether to unmap target where source sectors only contain zeroes.
+ * @copy_mode: When to write data to @target.
  * @cb: Completion function for the job.
  * @opaque: Opaque pointer value passed to @cb.
  * @errp: Error object.
@@ -740,7 +806,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   MirrorSyncMode mode, BlockMirrorBackingMode backing_mode,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
-                  bool unmap,
+                  bool unmap, MirrorCopyMode copy_mode,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp);
 
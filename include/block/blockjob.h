@@ -46,6 +46,12 @@ typedef struct BlockJobDriver {
     /** Optional callback for job types that need to forward I/O status reset */
     void (*iostatus_reset)(BlockJob *job);
 
+    /**
+     * Optional callback for job types that report additional information in
+     * query-block-jobs.
+     */
+    void (*query)(BlockJob *job, BlockJobInfo *info);
+
     /**
      * Optional callback for job types whose completion must be triggered
      * manually.
@@ -35,9 +35,22 @@ struct nbd_request {
     uint32_t type;
 };
 
+/* One extent of a NBD_REPLY_TYPE_BLOCK_STATUS chunk, in host order */
+typedef struct NBDExtent {
+    uint32_t length;
+    uint32_t flags;
+} NBDExtent;
+
 struct nbd_reply {
     uint64_t handle;
     uint32_t error;
+    /* The fields below are only valid for structured reply chunks; the
+     * chunk payload (length bytes) has not been read from the channel yet.
+     */
+    bool structured;
+    uint16_t flags;
+    uint16_t type;
+    uint32_t length;
 };
 
 #define NBD_FLAG_HAS_FLAGS      (1 << 0)        /* Flags are there */
@@ -46,6 +59,7 @@ struct nbd_reply {
 #define NBD_FLAG_SEND_FUA       (1 << 3)        /* Send FUA (Force Unit Access) */
 #define NBD_FLAG_ROTATIONAL     (1 << 4)        /* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM      (1 << 5)        /* Send TRIM (discard) */
+#define NBD_FLAG_SEND_DF        (1 << 7)        /* Send DF (Do not Fragment) */
 
 /* New-style global flags. */
 #define NBD_FLAG_FIXED_NEWSTYLE     (1 << 0)    /* Fixed newstyle protocol. */
@@ -56,23 +70,55 @@ struct nbd_reply {
 /* Reply types. */
 #define NBD_REP_ACK             (1)             /* Data sending finished. */
 #define NBD_REP_SERVER          (2)             /* Export description. */
+#define NBD_REP_META_CONTEXT    (4)             /* Metadata context. */
 #define NBD_REP_ERR_UNSUP       ((UINT32_C(1) << 31) | 1) /* Unknown option. */
 #define NBD_REP_ERR_POLICY      ((UINT32_C(1) << 31) | 2) /* Server denied */
 #define NBD_REP_ERR_INVALID     ((UINT32_C(1) << 31) | 3) /* Invalid length. */
 #define NBD_REP_ERR_TLS_REQD    ((UINT32_C(1) << 31) | 5) /* TLS required */
+#define NBD_REP_ERR_UNKNOWN     ((UINT32_C(1) << 31) | 6) /* Export unknown */
+
+/* Structured reply flags. */
+#define NBD_REPLY_FLAG_DONE     (1 << 0)        /* Final chunk of the reply */
+
+/* Structured reply chunk types. */
+#define NBD_REPLY_ERR(value)         ((1 << 15) | (value))
+#define NBD_REPLY_IS_ERR(type)       (!!((type) & (1 << 15)))
 
+#define NBD_REPLY_TYPE_NONE          0
+#define NBD_REPLY_TYPE_OFFSET_DATA   1
+#define NBD_REPLY_TYPE_OFFSET_HOLE   2
+#define NBD_REPLY_TYPE_BLOCK_STATUS  5
+#define NBD_REPLY_TYPE_ERROR         NBD_REPLY_ERR(1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET  NBD_REPLY_ERR(2)
 
 #define NBD_CMD_MASK_COMMAND	0x0000ffff
 #define NBD_CMD_FLAG_FUA	(1 << 16)
+#define NBD_CMD_FLAG_DF (1 << 18)
+#define NBD_CMD_FLAG_REQ_ONE (1 << 19)
 
 enum {
     NBD_CMD_READ = 0,
     NBD_CMD_WRITE = 1,
     NBD_CMD_DISC = 2,
     NBD_CMD_FLUSH = 3,
-    NBD_CMD_TRIM = 4
+    NBD_CMD_TRIM = 4,
+    NBD_CMD_BLOCK_STATUS = 7,
 };
 
+/* Metadata contexts for NBD_CMD_BLOCK_STATUS.  "base:allocation" describes
+ * how the export is allocated; "qemu:dirty-bitmap:NAME" exposes the dirty
+ * bitmap NAME of the exported node.
+ */
+#define NBD_META_BASE_ALLOCATION    "base:allocation"
+#define NBD_META_QEMU_DIRTY_BITMAP  "qemu:dirty-bitmap:"
+
+/* Extent flags for "base:allocation" */
+#define NBD_STATE_HOLE          (1 << 0)        /* Not allocated */
+#define NBD_STATE_ZERO          (1 << 1)        /* Reads as zeroes */
+
+/* Extent flags for "qemu:dirty-bitmap:NAME" */
+#define NBD_STATE_DIRTY         (1 << 0)        /* Modified since last reset */
+
 #define NBD_DEFAULT_PORT	10809
 
 /* Maximum size of a single READ/WRITE data buffer */
@@ -90,13 +136,28 @@ ssize_t nbd_wr_syncv(QIOChannel *ioc,
                      size_t niov,
                      size_t length,
                      bool do_read);
-int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
+/* Negotiation parameters and results for nbd_receive_negotiate() */
+typedef struct NBDExportInfo {
+    /* Set by the caller */
+    bool request_structured;    /* ask for structured replies */
+    const char *meta_context;   /* metadata context to select, or NULL */
+
+    /* Set by nbd_receive_negotiate() */
+    uint16_t flags;
+    off_t size;
+    bool structured_reply;
+    bool has_meta_context;
+    uint32_t meta_context_id;
+} NBDExportInfo;
+
+int nbd_receive_negotiate(QIOChannel *ioc, const char *name,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
-                          QIOChannel **outioc,
-                          off_t *size, Error **errp);
+                          QIOChannel **outioc, NBDExportInfo *info,
+                          Error **errp);
 int nbd_init(int fd, QIOChannelSocket *sioc, uint16_t flags, off_t size);
 ssize_t nbd_send_request(QIOChannel *ioc, struct nbd_request *request);
 ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply);
+int nbd_errno_to_system_errno(int err);
 int nbd_client(int fd);
 int nbd_disconnect(int fd);
 
@@ -106,7 +167,7 @@ typedef struct NBDClient NBDClient;
 NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset, off_t size,
                           uint16_t nbdflags, void (*close)(NBDExport *),
                           bool writethrough, BlockBackend *on_eject_blk,
-                          Error **errp);
+                          const char *bitmap, Error **errp);
 void nbd_export_close(NBDExport *exp);
 void nbd_export_get(NBDExport *exp);
 void nbd_export_put(NBDExport *exp);
@@ -28,6 +28,11 @@
 #include "qemu/throttle.h"
 #include "block/block_int.h"
 
+/* Number of consecutive requests a member of a group may issue while it
+ * holds the round-robin token, relative to the other members */
+#define THROTTLE_GROUP_WEIGHT_DEFAULT 1
+#define THROTTLE_GROUP_WEIGHT_MAX     1000
+
 const char *throttle_group_get_name(BlockBackend *blk);
 
 ThrottleState *throttle_group_incref(const char *name);
@@ -35,6 +40,8 @@ void throttle_group_unref(ThrottleState *ts);
 
 void throttle_group_config(BlockBackend *blk, ThrottleConfig *cfg);
 void throttle_group_get_config(BlockBackend *blk, ThrottleConfig *cfg);
+void throttle_group_set_weight(BlockBackend *blk, unsigned weight);
+unsigned throttle_group_get_weight(BlockBackend *blk);
 
 void throttle_group_register_blk(BlockBackend *blk, const char *groupname);
 void throttle_group_unregister_blk(BlockBackend *blk);
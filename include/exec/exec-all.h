@@ -71,6 +71,7 @@ static inline void cpu_list_lock(void)
 void cpu_exec_init(CPUState *cpu, Error **errp);
 void QEMU_NORETURN cpu_loop_exit(CPUState *cpu);
 void QEMU_NORETURN cpu_loop_exit_restore(CPUState *cpu, uintptr_t pc);
+void QEMU_NORETURN cpu_loop_exit_atomic(CPUState *cpu, uintptr_t pc);
 
 #if !defined(CONFIG_USER_ONLY)
 void cpu_reloading_memory_map(void);
@@ -134,6 +135,46 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...);
  * MMU indexes.
  */
 void tlb_flush_by_mmuidx(CPUState *cpu, ...);
+/**
+ * tlb_flush_all_cpus_synced:
+ * @src_cpu: CPU requesting the flush
+ * @flush_global: ignored
+ *
+ * Flush the entire TLB of every CPU.  The other CPUs' flushes are
+ * queued; @src_cpu's own flush runs as safe work once they have all
+ * stopped, so every flush is complete before @src_cpu executes any
+ * further guest code.  The caller must end the TB.
+ */
+void tlb_flush_all_cpus_synced(CPUState *src_cpu, int flush_global);
+/**
+ * tlb_flush_page_all_cpus_synced:
+ * @src_cpu: CPU requesting the flush
+ * @addr: virtual address of page to be flushed
+ *
+ * Like tlb_flush_all_cpus_synced(), but flush only one page, for all
+ * MMU indexes.
+ */
+void tlb_flush_page_all_cpus_synced(CPUState *src_cpu, target_ulong addr);
+/**
+ * tlb_flush_by_mmuidx_all_cpus_synced:
+ * @src_cpu: CPU requesting the flush
+ * @...: list of MMU indexes to flush, terminated by a negative value
+ *
+ * Like tlb_flush_all_cpus_synced(), but only for the specified MMU
+ * indexes.
+ */
+void tlb_flush_by_mmuidx_all_cpus_synced(CPUState *src_cpu, ...);
+/**
+ * tlb_flush_page_by_mmuidx_all_cpus_synced:
+ * @src_cpu: CPU requesting the flush
+ * @addr: virtual address of page to be flushed
+ * @...: list of MMU indexes to flush, terminated by a negative value
+ *
+ * Like tlb_flush_all_cpus_synced(), but flush only one page, for the
+ * specified MMU indexes.
+ */
+void tlb_flush_page_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
+                                              target_ulong addr, ...);
 /**
  * tlb_set_page_with_attrs:
  * @cpu: CPU to add this TLB entry for
@@ -188,6 +229,26 @@ static inline void tlb_flush_page_by_mmuidx(CPUState *cpu,
 static inline void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 {
 }
+
+static inline void tlb_flush_all_cpus_synced(CPUState *src_cpu,
+                                             int flush_global)
+{
+}
+
+static inline void tlb_flush_page_all_cpus_synced(CPUState *src_cpu,
+                                                  target_ulong addr)
+{
+}
+
+static inline void tlb_flush_by_mmuidx_all_cpus_synced(CPUState *src_cpu, ...)
+{
+}
+
+static inline void tlb_flush_page_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
+                                                            target_ulong addr,
+                                                            ...)
+{
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
@@ -225,6 +286,11 @@ struct TranslationBlock {
 #define CF_USE_ICOUNT  0x20000
 #define CF_IGNORE_ICOUNT 0x40000 /* Do not generate icount code */
 
+    /* Set once the TB has been removed from the lookup structures; a TB
+     * found by a lock-free lookup must not be chained to once invalid.
+     */
+    bool invalid;
+
     void *tc_ptr;    /* pointer to the translated code */
     uint8_t *tc_search;  /* pointer to search data */
     /* original tb when cflags has CF_NOCACHE */
@@ -419,4 +485,7 @@ extern int singlestep;
 extern CPUState *tcg_current_cpu;
 extern bool exit_request;
 
+/* cpu-exec.c */
+void cpu_exec_step_atomic(CPUState *cpu);
+
 #endif
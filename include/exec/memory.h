@@ -221,6 +221,7 @@ struct MemoryListener {
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section,
                      int old, int new);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
+    void (*log_clear)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_global_start)(MemoryListener *listener);
     void (*log_global_stop)(MemoryListener *listener);
     void (*eventfd_add)(MemoryListener *listener, MemoryRegionSection *section,
@@ -827,6 +828,23 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
  */
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr);
 
+/**
+ * memory_region_clear_dirty_bitmap: Re-arm dirty tracking in accelerators
+ *                                   for part of a region
+ *
+ * Accelerators that leave dirty information set after it has been
+ * synchronized (e.g. kvm with manual dirty log protection) start tracking
+ * writes to [@start, @start + @len) again.  Call this before reading the
+ * contents of pages whose dirty bits were consumed, so that later writes
+ * are not missed.
+ *
+ * @mr: the region being cleared.
+ * @start: the start address (relative to the start of the region).
+ * @len: the length of the range.
+ */
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len);
+
 /**
  * memory_region_reset_dirty: Mark a range of pages as clean, for a specified
  *                            client.
@@ -1418,6 +1436,69 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len);
 
+/* MemoryRegionCache: cached translation of a range of an #AddressSpace
+ *
+ * Devices that repeatedly access the same small area of guest memory (for
+ * example a ring of descriptors) can keep the result of the translation
+ * instead of walking the memory map on every access.  When the range is
+ * backed by RAM, the *_cached accessors below load and store through a
+ * host pointer; otherwise, or for accesses outside the cached range, they
+ * fall back to the normal #AddressSpace accessors.
+ *
+ * A cache holds a reference to the #MemoryRegion it points to.  It must be
+ * reinitialized when the memory map changes, typically from the commit
+ * callback of a #MemoryListener, and destroyed after use.
+ */
+typedef struct MemoryRegionCache {
+    void *ptr;
+    hwaddr xlat;
+    hwaddr len;
+    MemoryRegion *mr;
+    AddressSpace *as;
+    hwaddr addr;
+    bool is_write;
+} MemoryRegionCache;
+
+#define MEMORY_REGION_CACHE_INVALID ((MemoryRegionCache) { .mr = NULL })
+
+/* address_space_cache_init: prepare for repeated access to a physical
+ * memory region
+ *
+ * Returns the number of bytes, starting at @addr, that can be accessed
+ * through the host pointer; this is 0 if the range is not RAM.
+ *
+ * @cache: #MemoryRegionCache to be filled
+ * @as: #AddressSpace to be accessed
+ * @addr: address within that address space
+ * @len: length of the area to be accessed
+ * @is_write: indicates whether the cache will be used for writes
+ */
+int64_t address_space_cache_init(MemoryRegionCache *cache, AddressSpace *as,
+                                 hwaddr addr, hwaddr len, bool is_write);
+
+/* address_space_cache_destroy: free a #MemoryRegionCache
+ *
+ * @cache: The #MemoryRegionCache to be freed.
+ */
+void address_space_cache_destroy(MemoryRegionCache *cache);
+
+/* address_space_read_cached/address_space_write_cached: transfer @len bytes
+ * at offset @addr of the cached range, like address_space_read() and
+ * address_space_write().
+ */
+void address_space_read_cached(MemoryRegionCache *cache, hwaddr addr,
+                               void *buf, int len);
+void address_space_write_cached(MemoryRegionCache *cache, hwaddr addr,
+                                const void *buf, int len);
+
+/* lduw_*_phys_cached/stw_*_phys_cached: like lduw_*_phys and stw_*_phys,
+ * but @addr is an offset within the cached range.
+ */
+uint32_t lduw_le_phys_cached(MemoryRegionCache *cache, hwaddr addr);
+uint32_t lduw_be_phys_cached(MemoryRegionCache *cache, hwaddr addr);
+void stw_le_phys_cached(MemoryRegionCache *cache, hwaddr addr, uint32_t val);
+void stw_be_phys_cached(MemoryRegionCache *cache, hwaddr addr, uint32_t val);
+
 
 /* Internal functions, part of the implementation of address_space_read.  */
 MemTxResult address_space_read_continue(AddressSpace *as, hwaddr addr,
@@ -392,6 +392,10 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
 }
 
 
+/* Several ranges may be synced concurrently.  Words of @dest that are only
+ * partially covered by [@start, @start + @length) are updated atomically,
+ * since they may be shared with a neighbouring range.
+ */
 static inline
 uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
                                                ram_addr_t start,
@@ -405,6 +409,8 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
     if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
         int k;
         int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
+        int shared = (length >> TARGET_PAGE_BITS) % BITS_PER_LONG ?
+                     page + nr - 1 : -1;
         unsigned long * const *src;
         unsigned long idx = (page * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
         unsigned long offset = BIT_WORD((page * BITS_PER_LONG) %
@@ -419,8 +425,12 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
             if (src[idx][offset]) {
                 unsigned long bits = atomic_xchg(&src[idx][offset], 0);
                 unsigned long new_dirty;
-                new_dirty = ~dest[k];
-                dest[k] |= bits;
+                if (k == shared) {
+                    new_dirty = ~atomic_fetch_or(&dest[k], bits);
+                } else {
+                    new_dirty = ~dest[k];
+                    dest[k] |= bits;
+                }
                 new_dirty &= bits;
                 num_dirty += ctpopl(new_dirty);
             }
@@ -439,7 +449,8 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
                         TARGET_PAGE_SIZE,
                         DIRTY_MEMORY_MIGRATION)) {
                 long k = (start + addr) >> TARGET_PAGE_BITS;
-                if (!test_and_set_bit(k, dest)) {
+                if (!(atomic_fetch_or(&dest[BIT_WORD(k)], BIT_MASK(k)) &
+                      BIT_MASK(k))) {
                     num_dirty++;
                 }
             }
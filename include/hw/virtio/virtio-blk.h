@@ -34,6 +34,7 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    char *queue_iothreads;
     char *serial;
     uint32_t scsi;
     uint32_t config_wce;
@@ -90,4 +91,6 @@ void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb);
 
 void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq);
 
+void virtio_blk_handle_req_list(VirtIOBlock *s, VirtIOBlockReq *req);
+
 #endif
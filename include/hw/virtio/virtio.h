@@ -92,6 +92,7 @@ struct VirtIODevice
     uint8_t device_endian;
     bool use_guest_notifier_mask;
     QLIST_HEAD(, VirtQueue) *vector_queues;
+    MemoryListener listener;
 };
 
 typedef struct VirtioDeviceClass {
@@ -160,6 +160,8 @@ struct MigrationState
     int64_t xbzrle_cache_size;
     int64_t setup_time;
     int64_t dirty_sync_count;
+    /* Duration of the last dirty bitmap sync, in microseconds */
+    int64_t dirty_sync_time;
     /* Count of requests incoming from destination */
     int64_t postcopy_requests;
 
@@ -174,6 +176,8 @@ struct MigrationState
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(src_page_requests, MigrationSrcPageRequest) src_page_requests;
+    /* Pages around the requested ones, sent once src_page_requests is empty */
+    QSIMPLEQ_HEAD(, MigrationSrcPageRequest) src_page_prefetch;
     /* The RAMBlock used in the last src_page_request */
     RAMBlock *last_req_rb;
 
@@ -194,6 +198,12 @@ void migration_tls_channel_process_incoming(MigrationState *s,
                                             QIOChannel *ioc,
                                             Error **errp);
 
+/*
+ * Handle a connection accepted by a tcp: or unix: listener; returns
+ * true once all the channels of the migration have been accepted.
+ */
+bool migration_socket_channel_incoming(QIOChannel *ioc);
+
 void migration_channel_connect(MigrationState *s,
                                QIOChannel *ioc,
                                const char *hostname);
@@ -217,6 +227,9 @@ void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
 
+/* Open another connection to the destination of the current socket migration */
+QIOChannel *socket_send_channel_create(Error **errp);
+
 void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
@@ -248,6 +261,13 @@ void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
+void multifd_save_setup(void);
+void multifd_save_shutdown(void);
+void multifd_save_cleanup(void);
+void multifd_load_setup(void);
+void multifd_load_cleanup(void);
+int multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
+bool multifd_recv_all_channels_created(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
@@ -266,6 +286,8 @@ uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
+uint64_t xbzrle_mig_cache_evictions(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 void ram_debug_dump_bitmap(unsigned long *todump, bool expected);
@@ -309,6 +331,10 @@ int migrate_compress_level(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+int migrate_multifd_page_count(void);
+int migrate_postcopy_prefetch_window(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_message(MigrationIncomingState *mis,
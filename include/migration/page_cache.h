@@ -18,6 +18,12 @@
 /* Page cache for storing guest pages */
 typedef struct PageCache PageCache;
 
+typedef struct PageCacheStats {
+    uint64_t hits;          /* lookups that found the page */
+    uint64_t misses;        /* lookups that did not */
+    uint64_t evictions;     /* cached pages replaced by another page */
+} PageCacheStats;
+
 /**
  * cache_init: Initialize the page cache
  *
@@ -45,8 +51,7 @@ void cache_fini(PageCache *cache);
  * @addr: page addr
  * @current_age: current bitmap generation
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age);
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age);
 
 /**
  * get_cached_data: Get the data cached for an addr
@@ -83,4 +88,13 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
  */
 int64_t cache_resize(PageCache *cache, int64_t num_pages);
 
+/**
+ * cache_get_stats: get the hit, miss and eviction counts of the cache
+ *
+ * @cache pointer to the PageCache struct
+ * @stats: filled in with the counts
+ * @reset: clear the counts after reading them
+ */
+void cache_get_stats(PageCache *cache, PageCacheStats *stats, bool reset);
+
 #endif
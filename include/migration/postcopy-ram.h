@@ -89,6 +89,12 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from);
  */
 int postcopy_place_page_zero(MigrationIncomingState *mis, void *host);
 
+/*
+ * Latency of the faults resolved so far by the last incoming postcopy
+ * migration, or NULL if there were none
+ */
+PostcopyFaultLatency *postcopy_fault_latency_get(void);
+
 /*
  * Allocate a page of memory that can be mapped at a later point in time
  * using postcopy_place_page
@@ -153,4 +153,6 @@ bool throttle_schedule_timer(ThrottleState *ts,
 
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
 
+int64_t throttle_coalesce_deadline(int64_t now, int64_t deadline);
+
 #endif
@@ -0,0 +1,44 @@
+/*
+ * VFIO utility
+ *
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_VFIO_HELPERS_H
+#define QEMU_VFIO_HELPERS_H
+
+#include "qemu/event_notifier.h"
+
+typedef struct QEMUVFIOState QEMUVFIOState;
+
+/*
+ * Open the PCI device at @device (e.g. "0000:44:00.0") for userspace access.
+ * The device must already be bound to the vfio-pci kernel driver.
+ */
+QEMUVFIOState *qemu_vfio_open_pci(const char *device, Error **errp);
+void qemu_vfio_close(QEMUVFIOState *s);
+
+/*
+ * Map [@host, @host + @size) for DMA and return its bus address in @iova.
+ * Both @host and @size must be host page aligned.  Temporary mappings are
+ * not recorded; they are all released at once by
+ * qemu_vfio_dma_reset_temporary() once the caller knows no DMA is in flight.
+ * Returns -ENOMEM when the IOVA space for the requested kind is exhausted.
+ */
+int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
+                      bool temporary, uint64_t *iova);
+int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s);
+void qemu_vfio_dma_unmap(QEMUVFIOState *s, void *host);
+
+void *qemu_vfio_pci_map_bar(QEMUVFIOState *s, int index,
+                            uint64_t offset, uint64_t size,
+                            Error **errp);
+void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
+                             uint64_t offset, uint64_t size);
+int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
+                           int irq_type, Error **errp);
+
+#endif
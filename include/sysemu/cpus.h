@@ -10,6 +10,7 @@ void cpu_stop_current(void);
 void cpu_ticks_init(void);
 
 void configure_icount(QemuOpts *opts, Error **errp);
+void qemu_tcg_configure(QemuOpts *opts, Error **errp);
 extern int use_icount;
 extern int icount_align_option;
 
@@ -28,6 +29,15 @@ void cpu_synchronize_all_post_init(void);
 void qtest_clock_warp(int64_t dest);
 
 #ifndef CONFIG_USER_ONLY
+/* Exclusive execution for multi-threaded TCG.  start_exclusive waits
+ * until no other vCPU is inside cpu_exec_start/cpu_exec_end; it must
+ * be called without the BQL and outside cpu_exec.
+ */
+void start_exclusive(void);
+void end_exclusive(void);
+void cpu_exec_start(CPUState *cpu);
+void cpu_exec_end(CPUState *cpu);
+
 /* vl.c */
 extern int smp_cores;
 extern int smp_threads;
@@ -20,6 +20,9 @@ typedef struct KVMSlot
     void *ram;
     int slot;
     int flags;
+    /* Last dirty log fetched with manual dirty log protection, minus the
+     * pages that have been write-protected again since */
+    unsigned long *dirty_bmap;
 } KVMSlot;
 
 typedef struct KVMMemoryListener {
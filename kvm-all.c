@@ -101,6 +101,11 @@ struct KVMState
 #endif
     KVMMemoryListener memory_listener;
     QLIST_HEAD(, KVMParkedVcpu) kvm_parked_vcpus;
+    /* KVM_GET_DIRTY_LOG does not write-protect pages; log_clear does */
+    bool manual_dirty_log_protect;
+    /* Protects the memory slots against log_clear, which can be called
+     * without the BQL */
+    QemuMutex slots_lock;
 };
 
 KVMState *kvm_state;
@@ -372,6 +377,10 @@ static int kvm_slot_update_flags(KVMMemoryListener *kml, KVMSlot *mem,
         return 0;
     }
 
+    /* KVM drops its dirty log when logging is toggled */
+    g_free(mem->dirty_bmap);
+    mem->dirty_bmap = NULL;
+
     return kvm_set_user_memory_region(kml, mem);
 }
 
@@ -400,7 +409,9 @@ static void kvm_log_start(MemoryListener *listener,
         return;
     }
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_section_update_flags(kml, section);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     if (r < 0) {
         abort();
     }
@@ -417,7 +428,9 @@ static void kvm_log_stop(MemoryListener *listener,
         return;
     }
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_section_update_flags(kml, section);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     if (r < 0) {
         abort();
     }
@@ -437,12 +450,76 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
 
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
+/**
+ * kvm_log_clear_slot - Write-protect dirty pages again
+ * With manual dirty log protection, pages reported by KVM_GET_DIRTY_LOG stay
+ * writable and dirty until they are passed to KVM_CLEAR_DIRTY_LOG.  Do that
+ * for the pages of @mem in [@start, @end) that the last KVM_GET_DIRTY_LOG
+ * returned.  KVM wants the bitmap to start on a multiple of 64 pages, so
+ * the range is widened and the extra pages are masked out.
+ */
+static int kvm_log_clear_slot(KVMMemoryListener *kml, KVMSlot *mem,
+                              hwaddr start, hwaddr end)
+{
+    KVMState *s = kvm_state;
+    struct kvm_clear_dirty_log d = {};
+    uint64_t psize = getpagesize();
+    uint64_t slot_pages = mem->memory_size / psize;
+    uint64_t first, last, bmap_first, bmap_pages, bmap_bits;
+    unsigned long *bmap;
+    int ret;
+
+    start = MAX(start, mem->start_addr);
+    end = MIN(end, mem->start_addr + mem->memory_size);
+    if (!mem->dirty_bmap || start >= end) {
+        return 0;
+    }
+
+    first = (start - mem->start_addr) / psize;
+    last = DIV_ROUND_UP(end - mem->start_addr, psize);
+    first = find_next_bit(mem->dirty_bmap, last, first);
+    if (first >= last) {
+        /* Nothing was reported dirty, so nothing to protect */
+        return 0;
+    }
+
+    bmap_first = first & ~63ULL;
+    bmap_bits = last - bmap_first;
+    bmap_pages = MIN(ALIGN(bmap_bits, 64), slot_pages - bmap_first);
+    bmap = bitmap_new(bmap_pages);
+    bitmap_copy(bmap, mem->dirty_bmap + bmap_first / BITS_PER_LONG, bmap_bits);
+    bitmap_clear(bmap, 0, first - bmap_first);
+    bitmap_clear(bmap, bmap_bits,
+                 BITS_TO_LONGS(bmap_bits) * BITS_PER_LONG - bmap_bits);
+    bitmap_andnot(mem->dirty_bmap + bmap_first / BITS_PER_LONG,
+                  mem->dirty_bmap + bmap_first / BITS_PER_LONG, bmap,
+                  bmap_bits);
+
+    d.slot = mem->slot | (kml->as_id << 16);
+    d.first_page = bmap_first;
+    d.num_pages = bmap_pages;
+    d.dirty_bitmap = bmap;
+    ret = kvm_vm_ioctl(s, KVM_CLEAR_DIRTY_LOG, &d);
+    if (ret < 0) {
+        error_report("%s: KVM_CLEAR_DIRTY_LOG failed: %s", __func__,
+                     strerror(-ret));
+    }
+    g_free(bmap);
+
+    return ret;
+}
+
 /**
  * kvm_physical_sync_dirty_bitmap - Grab dirty bitmap from kernel space
  * This function updates qemu's dirty bitmap using
  * memory_region_set_dirty().  This means all bits are set
  * to dirty.
  *
+ * With manual dirty log protection, the dirty pages are only write-protected
+ * again here if migration does not track @section.  Migration does that
+ * itself through memory_region_clear_dirty_bitmap(), right before it sends
+ * the pages.
+ *
  * @start_add: start of logged region.
  * @end_addr: end of logged region.
  */
@@ -451,13 +528,16 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
 {
     KVMState *s = kvm_state;
     unsigned long size, allocated_size = 0;
+    unsigned long *bitmap = NULL;
     struct kvm_dirty_log d = {};
     KVMSlot *mem;
     int ret = 0;
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + int128_get64(section->size);
+    bool defer_clear = s->manual_dirty_log_protect &&
+        (memory_region_get_dirty_log_mask(section->mr) &
+         (1 << DIRTY_MEMORY_MIGRATION));
 
-    d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(kml, start_addr, end_addr);
         if (mem == NULL) {
@@ -478,13 +558,22 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
          */
         size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
                      /*HOST_LONG_BITS*/ 64) / 8;
-        if (!d.dirty_bitmap) {
-            d.dirty_bitmap = g_malloc(size);
-        } else if (size > allocated_size) {
-            d.dirty_bitmap = g_realloc(d.dirty_bitmap, size);
+        if (s->manual_dirty_log_protect) {
+            /* Keep what was fetched for kvm_log_clear_slot() */
+            if (!mem->dirty_bmap) {
+                mem->dirty_bmap = g_malloc0(size);
+            }
+            d.dirty_bitmap = mem->dirty_bmap;
+        } else {
+            if (!bitmap) {
+                bitmap = g_malloc(size);
+            } else if (size > allocated_size) {
+                bitmap = g_realloc(bitmap, size);
+            }
+            allocated_size = size;
+            memset(bitmap, 0, allocated_size);
+            d.dirty_bitmap = bitmap;
         }
-        allocated_size = size;
-        memset(d.dirty_bitmap, 0, allocated_size);
 
         d.slot = mem->slot | (kml->as_id << 16);
         if (kvm_vm_ioctl(s, KVM_GET_DIRTY_LOG, &d) == -1) {
@@ -494,9 +583,12 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
         }
 
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
+        if (s->manual_dirty_log_protect && !defer_clear) {
+            kvm_log_clear_slot(kml, mem, start_addr, end_addr);
+        }
         start_addr = mem->start_addr + mem->memory_size;
     }
-    g_free(d.dirty_bitmap);
+    g_free(bitmap);
 
     return ret;
 }
@@ -752,6 +844,8 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
 
         /* unregister the overlapping slot */
         mem->memory_size = 0;
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
         err = kvm_set_user_memory_region(kml, mem);
         if (err) {
             fprintf(stderr, "%s: error unregistering overlapping slot: %s\n",
@@ -856,7 +950,9 @@ static void kvm_region_add(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
     memory_region_ref(section->mr);
+    qemu_mutex_lock(&kvm_state->slots_lock);
     kvm_set_phys_mem(kml, section, true);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
 }
 
 static void kvm_region_del(MemoryListener *listener,
@@ -864,7 +960,9 @@ static void kvm_region_del(MemoryListener *listener,
 {
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     kvm_set_phys_mem(kml, section, false);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     memory_region_unref(section->mr);
 }
 
@@ -874,12 +972,35 @@ static void kvm_log_sync(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
     int r;
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_physical_sync_dirty_bitmap(kml, section);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     if (r < 0) {
         abort();
     }
 }
 
+static void kvm_log_clear(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
+    KVMState *s = kvm_state;
+    hwaddr start = section->offset_within_address_space;
+    hwaddr end = start + int128_get64(section->size);
+    KVMSlot *mem;
+    int i;
+
+    qemu_mutex_lock(&s->slots_lock);
+    for (i = 0; i < s->nr_slots; i++) {
+        mem = &kml->slots[i];
+        if (mem->memory_size && start < mem->start_addr + mem->memory_size &&
+            end > mem->start_addr) {
+            kvm_log_clear_slot(kml, mem, start, end);
+        }
+    }
+    qemu_mutex_unlock(&s->slots_lock);
+}
+
 static void kvm_mem_ioeventfd_add(MemoryListener *listener,
                                   MemoryRegionSection *section,
                                   bool match_data, uint64_t data,
@@ -966,6 +1087,9 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
     kml->listener.log_sync = kvm_log_sync;
+    if (s->manual_dirty_log_protect) {
+        kml->listener.log_clear = kvm_log_clear;
+    }
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -1582,6 +1706,7 @@ static int kvm_init(MachineState *ms)
     assert(TARGET_PAGE_SIZE <= getpagesize());
 
     s->sigmask_len = 8;
+    qemu_mutex_init(&s->slots_lock);
 
 #ifdef KVM_CAP_SET_GUEST_DEBUG
     QTAILQ_INIT(&s->kvm_sw_breakpoints);
@@ -1743,6 +1868,15 @@ static int kvm_init(MachineState *ms)
         kvm_irqchip_create(ms, s);
     }
 
+#ifndef HOST_WORDS_BIGENDIAN
+    /* kvm_log_clear_slot() uses KVM's little-endian dirty bitmaps as arrays
+     * of unsigned long */
+    if (kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2) > 0) {
+        s->manual_dirty_log_protect =
+            !kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0, 1);
+    }
+#endif
+
     kvm_state = s;
 
     if (kvm_eventfds_allowed) {
@@ -1628,6 +1628,43 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len)
+{
+    AddrRange range = addrrange_make(int128_make64(start), int128_make64(len));
+    AddressSpace *as;
+    FlatRange *fr;
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        FlatView *view = address_space_get_flatview(as);
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            AddrRange fr_range, tmp;
+            Int128 offset;
+
+            if (fr->mr != mr) {
+                continue;
+            }
+            fr_range = addrrange_make(int128_make64(fr->offset_in_region),
+                                      fr->addr.size);
+            if (!addrrange_intersects(fr_range, range)) {
+                continue;
+            }
+            tmp = addrrange_intersection(fr_range, range);
+            offset = int128_sub(tmp.start, fr_range.start);
+            MEMORY_LISTENER_CALL(log_clear, Forward, (&(MemoryRegionSection) {
+                .mr = mr,
+                .address_space = as,
+                .offset_within_region = int128_get64(tmp.start),
+                .size = tmp.size,
+                .offset_within_address_space =
+                    int128_get64(int128_add(fr->addr.start, offset)),
+                .readonly = fr->readonly,
+            }));
+        }
+        flatview_unref(view);
+    }
+}
+
 void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
 {
     if (mr->readonly != readonly) {
@@ -54,6 +54,11 @@
 /* Define default autoconverge cpu throttle migration parameters */
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT 10
+/* Default number of multifd channels and pages per multifd packet */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+#define DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT 16
+/* Default number of pages sent around each postcopy page request */
+#define DEFAULT_MIGRATE_POSTCOPY_PREFETCH_WINDOW 64
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -89,6 +94,10 @@ MigrationState *migrate_get_current(void)
             .decompress_threads = DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
             .cpu_throttle_initial = DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL,
             .cpu_throttle_increment = DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT,
+            .x_multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+            .x_multifd_page_count = DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT,
+            .postcopy_prefetch_window =
+                DEFAULT_MIGRATE_POSTCOPY_PREFETCH_WINDOW,
         },
     };
 
@@ -332,6 +341,7 @@ static void process_incoming_migration_bh(void *opaque)
                           MIGRATION_STATUS_FAILED);
         error_report_err(local_err);
         migrate_decompress_threads_join();
+        multifd_load_cleanup();
         exit(EXIT_FAILURE);
     }
 
@@ -356,6 +366,7 @@ static void process_incoming_migration_bh(void *opaque)
         runstate_set(global_state_get_runstate());
     }
     migrate_decompress_threads_join();
+    multifd_load_cleanup();
     /*
      * This must happen after any state changes since as soon as an external
      * observer sees this event they might start to prod at the VM assuming
@@ -409,6 +420,7 @@ static void process_incoming_migration_co(void *opaque)
                           MIGRATION_STATUS_FAILED);
         error_report("load of migration failed: %s", strerror(-ret));
         migrate_decompress_threads_join();
+        multifd_load_cleanup();
         exit(EXIT_FAILURE);
     }
 
@@ -446,6 +458,49 @@ void migration_channel_process_incoming(MigrationState *s,
     }
 }
 
+/* Main channel of a multifd migration, waiting for the other channels */
+static QIOChannel *multifd_main_ioc;
+
+bool migration_socket_channel_incoming(QIOChannel *ioc)
+{
+    MigrationState *s = migrate_get_current();
+    Error *local_err = NULL;
+    QIOChannel *main_ioc;
+
+    if (!migrate_use_multifd()) {
+        migration_channel_process_incoming(s, ioc);
+        return true;
+    }
+
+    /* The source only opens the multifd channels once the main channel
+     * is connected, so the first connection is always the main one.
+     */
+    if (!multifd_main_ioc) {
+        if (s->parameters.tls_creds) {
+            error_report("Multifd migration does not support TLS");
+            return true;
+        }
+        multifd_load_setup();
+        object_ref(OBJECT(ioc));
+        multifd_main_ioc = ioc;
+    } else if (multifd_recv_new_channel(ioc, &local_err) < 0) {
+        error_report_err(local_err);
+        return false;
+    }
+
+    if (!multifd_recv_all_channels_created()) {
+        return false;
+    }
+
+    /* ram_load() waits for the multifd threads, so only start loading once
+     * every channel is there.
+     */
+    main_ioc = multifd_main_ioc;
+    multifd_main_ioc = NULL;
+    migration_channel_process_incoming(s, main_ioc);
+    object_unref(OBJECT(main_ioc));
+    return true;
+}
 
 void migration_channel_connect(MigrationState *s,
                                QIOChannel *ioc,
@@ -566,6 +621,9 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->cpu_throttle_increment = s->parameters.cpu_throttle_increment;
     params->tls_creds = g_strdup(s->parameters.tls_creds);
     params->tls_hostname = g_strdup(s->parameters.tls_hostname);
+    params->x_multifd_channels = s->parameters.x_multifd_channels;
+    params->x_multifd_page_count = s->parameters.x_multifd_page_count;
+    params->postcopy_prefetch_window = s->parameters.postcopy_prefetch_window;
 
     return params;
 }
@@ -599,6 +657,8 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
+        info->xbzrle_cache->cache_evictions = xbzrle_mig_cache_evictions();
     }
 }
 
@@ -614,6 +674,7 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->normal_bytes = norm_mig_bytes_transferred();
     info->ram->mbps = s->mbps;
     info->ram->dirty_sync_count = s->dirty_sync_count;
+    info->ram->dirty_sync_time = s->dirty_sync_time;
     info->ram->postcopy_requests = s->postcopy_requests;
 
     if (s->state != MIGRATION_STATUS_COMPLETED) {
@@ -712,6 +773,9 @@ MigrationInfo *qmp_query_migrate(Error **errp)
     }
     info->status = s->state;
 
+    info->postcopy_fault_latency = postcopy_fault_latency_get();
+    info->has_postcopy_fault_latency = !!info->postcopy_fault_latency;
+
     return info;
 }
 
@@ -757,6 +821,19 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_use_multifd()) {
+        /* Pages sent over the multifd channels bypass the compression
+         * threads, the XBZRLE cache and the atomic placement that postcopy
+         * needs on the destination.
+         */
+        if (migrate_use_compression() || migrate_use_xbzrle() ||
+            migrate_postcopy_ram()) {
+            error_report("Multifd is not currently compatible with "
+                         "compression, xbzrle or postcopy");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD] = false;
+        }
+    }
 }
 
 void qmp_migrate_set_parameters(bool has_compress_level,
@@ -773,6 +850,12 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 const char *tls_creds,
                                 bool has_tls_hostname,
                                 const char *tls_hostname,
+                                bool has_x_multifd_channels,
+                                int64_t x_multifd_channels,
+                                bool has_x_multifd_page_count,
+                                int64_t x_multifd_page_count,
+                                bool has_postcopy_prefetch_window,
+                                int64_t postcopy_prefetch_window,
                                 Error **errp)
 {
     MigrationState *s = migrate_get_current();
@@ -808,6 +891,28 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                    "cpu_throttle_increment",
                    "an integer in the range of 1 to 99");
     }
+    if (has_x_multifd_channels &&
+            (x_multifd_channels < 1 || x_multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_x_multifd_page_count &&
+            (x_multifd_page_count < 1 || x_multifd_page_count > 10000)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_page_count",
+                   "is invalid, it should be in the range of 1 to 10000");
+        return;
+    }
+    if (has_postcopy_prefetch_window &&
+            (postcopy_prefetch_window < 0 ||
+             postcopy_prefetch_window > 65536)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_prefetch_window",
+                   "is invalid, it should be in the range of 0 to 65536");
+        return;
+    }
 
     if (has_compress_level) {
         s->parameters.compress_level = compress_level;
@@ -832,6 +937,15 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         g_free(s->parameters.tls_hostname);
         s->parameters.tls_hostname = g_strdup(tls_hostname);
     }
+    if (has_x_multifd_channels) {
+        s->parameters.x_multifd_channels = x_multifd_channels;
+    }
+    if (has_x_multifd_page_count) {
+        s->parameters.x_multifd_page_count = x_multifd_page_count;
+    }
+    if (has_postcopy_prefetch_window) {
+        s->parameters.postcopy_prefetch_window = postcopy_prefetch_window;
+    }
 }
 
 
@@ -886,6 +1000,7 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_mutex_lock_iothread();
 
         migrate_compress_threads_join();
+        multifd_save_cleanup();
         qemu_fclose(s->to_dst_file);
         s->to_dst_file = NULL;
     }
@@ -941,6 +1056,7 @@ static void migrate_fd_cancel(MigrationState *s)
      */
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
+        multifd_save_shutdown();
     }
 }
 
@@ -1004,6 +1120,7 @@ MigrationState *migrate_init(const MigrationParams *params)
     s->dirty_bytes_rate = 0;
     s->setup_time = 0;
     s->dirty_sync_count = 0;
+    s->dirty_sync_time = 0;
     s->start_postcopy = false;
     s->postcopy_after_devices = false;
     s->postcopy_requests = 0;
@@ -1015,6 +1132,7 @@ MigrationState *migrate_init(const MigrationParams *params)
     migrate_set_state(&s->state, MIGRATION_STATUS_NONE, MIGRATION_STATUS_SETUP);
 
     QSIMPLEQ_INIT(&s->src_page_requests);
+    QSIMPLEQ_INIT(&s->src_page_prefetch);
 
     s->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     return s;
@@ -1095,6 +1213,16 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_multifd() &&
+        !strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+        error_setg(errp, "Multifd migration requires a tcp: or unix: URI");
+        return;
+    }
+    if (migrate_use_multifd() && s->parameters.tls_creds) {
+        error_setg(errp, "Multifd migration does not support TLS");
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -1252,6 +1380,42 @@ int migrate_decompress_threads(void)
     return s->parameters.decompress_threads;
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_channels;
+}
+
+int migrate_multifd_page_count(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_page_count;
+}
+
+int migrate_postcopy_prefetch_window(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_prefetch_window;
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
@@ -1878,6 +2042,7 @@ void migrate_fd_connect(MigrationState *s)
     }
 
     migrate_compress_threads_create();
+    multifd_save_setup();
     qemu_thread_create(&s->thread, "migration", migration_thread, s,
                        QEMU_THREAD_JOINABLE);
     s->migration_thread_running = true;
@@ -24,6 +24,8 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
 #include "trace.h"
 
 /* Arbitrary limit on size of each discard command,
@@ -44,6 +46,56 @@ struct PostcopyDiscardState {
     unsigned int nsentcmds;
 };
 
+/*
+ * Latency of the faults that the destination resolves with pages from the
+ * source, from the fault thread reading the fault until the page is placed.
+ * Bucket 0 counts faults resolved in under a microsecond, bucket i those
+ * that took [2^(i-1), 2^i) microseconds and the last bucket all the others.
+ * Kept after the incoming migration ends so that it can still be queried.
+ */
+#define POSTCOPY_LATENCY_BUCKETS 20
+
+static struct PostcopyLatencyState {
+    bool initialized;
+    QemuMutex lock;
+    /* host page -> QEMU_CLOCK_REALTIME in ns when it first faulted */
+    GHashTable *pending;
+    /* Number of entries in pending, checked without the lock */
+    int nr_pending;
+    uint64_t faults;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t histogram[POSTCOPY_LATENCY_BUCKETS];
+} postcopy_latency;
+
+PostcopyFaultLatency *postcopy_fault_latency_get(void)
+{
+    PostcopyFaultLatency *info = NULL;
+    intList **next;
+    int i;
+
+    if (!postcopy_latency.initialized) {
+        return NULL;
+    }
+
+    qemu_mutex_lock(&postcopy_latency.lock);
+    if (postcopy_latency.faults) {
+        info = g_new0(PostcopyFaultLatency, 1);
+        info->faults = postcopy_latency.faults;
+        info->average = postcopy_latency.total_us / postcopy_latency.faults;
+        info->max = postcopy_latency.max_us;
+        next = &info->histogram;
+        for (i = 0; i < POSTCOPY_LATENCY_BUCKETS; i++) {
+            *next = g_new0(intList, 1);
+            (*next)->value = postcopy_latency.histogram[i];
+            next = &(*next)->next;
+        }
+    }
+    qemu_mutex_unlock(&postcopy_latency.lock);
+
+    return info;
+}
+
 /* Postcopy needs to detect accesses to pages that haven't yet been copied
  * across, and efficiently map new pages in, the techniques for doing this
  * are target OS specific.
@@ -60,6 +112,84 @@ struct PostcopyDiscardState {
 #include <sys/eventfd.h>
 #include <linux/userfaultfd.h>
 
+static void postcopy_latency_start(void)
+{
+    if (!postcopy_latency.initialized) {
+        qemu_mutex_init(&postcopy_latency.lock);
+        postcopy_latency.initialized = true;
+    }
+
+    qemu_mutex_lock(&postcopy_latency.lock);
+    if (postcopy_latency.pending) {
+        g_hash_table_destroy(postcopy_latency.pending);
+    }
+    postcopy_latency.pending = g_hash_table_new_full(g_direct_hash,
+                                                     g_direct_equal,
+                                                     NULL, g_free);
+    postcopy_latency.nr_pending = 0;
+    postcopy_latency.faults = 0;
+    postcopy_latency.total_us = 0;
+    postcopy_latency.max_us = 0;
+    memset(postcopy_latency.histogram, 0,
+           sizeof(postcopy_latency.histogram));
+    qemu_mutex_unlock(&postcopy_latency.lock);
+}
+
+static void postcopy_latency_stop(void)
+{
+    qemu_mutex_lock(&postcopy_latency.lock);
+    g_hash_table_destroy(postcopy_latency.pending);
+    postcopy_latency.pending = NULL;
+    atomic_set(&postcopy_latency.nr_pending, 0);
+    qemu_mutex_unlock(&postcopy_latency.lock);
+}
+
+/* Called from the fault thread for each fault on @host */
+static void postcopy_latency_fault(void *host)
+{
+    int64_t *start;
+
+    qemu_mutex_lock(&postcopy_latency.lock);
+    if (postcopy_latency.pending &&
+        !g_hash_table_lookup(postcopy_latency.pending, host)) {
+        start = g_new(int64_t, 1);
+        *start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        g_hash_table_insert(postcopy_latency.pending, host, start);
+        atomic_inc(&postcopy_latency.nr_pending);
+    }
+    qemu_mutex_unlock(&postcopy_latency.lock);
+}
+
+/* Called once @host has been placed */
+static void postcopy_latency_placed(void *host)
+{
+    int64_t *start;
+    uint64_t us;
+    int bucket;
+
+    /* Most pages are placed without anybody waiting for them */
+    if (!atomic_read(&postcopy_latency.nr_pending)) {
+        return;
+    }
+
+    qemu_mutex_lock(&postcopy_latency.lock);
+    start = postcopy_latency.pending ?
+            g_hash_table_lookup(postcopy_latency.pending, host) : NULL;
+    if (start) {
+        us = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - *start) / SCALE_US;
+        g_hash_table_remove(postcopy_latency.pending, host);
+        atomic_dec(&postcopy_latency.nr_pending);
+        trace_postcopy_fault_latency(host, us);
+
+        bucket = us ? MIN(64 - clz64(us), POSTCOPY_LATENCY_BUCKETS - 1) : 0;
+        postcopy_latency.histogram[bucket]++;
+        postcopy_latency.faults++;
+        postcopy_latency.total_us += us;
+        postcopy_latency.max_us = MAX(postcopy_latency.max_us, us);
+    }
+    qemu_mutex_unlock(&postcopy_latency.lock);
+}
+
 static bool ufd_version_check(int ufd)
 {
     struct uffdio_api api_struct;
@@ -300,6 +430,7 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         close(mis->userfault_fd);
         close(mis->userfault_quit_fd);
         mis->have_fault_thread = false;
+        postcopy_latency_stop();
     }
 
     qemu_balloon_inhibit(false);
@@ -467,6 +598,9 @@ static void *postcopy_ram_fault_thread(void *opaque)
         trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
                                                 qemu_ram_get_idstr(rb),
                                                 rb_offset);
+        postcopy_latency_fault((void *)(uintptr_t)
+                               (msg.arg.pagefault.address &
+                                ~(uint64_t)(hostpagesize - 1)));
 
         /*
          * Send the request to the source - we want to request one
@@ -513,6 +647,7 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
         return -1;
     }
 
+    postcopy_latency_start();
     qemu_sem_init(&mis->fault_thread_sem, 0);
     qemu_thread_create(&mis->fault_thread, "postcopy/fault",
                        postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
@@ -563,6 +698,7 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
     }
 
     trace_postcopy_place_page(host);
+    postcopy_latency_placed(host);
     return 0;
 }
 
@@ -587,6 +723,7 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
     }
 
     trace_postcopy_place_page_zero(host);
+    postcopy_latency_placed(host);
     return 0;
 }
 
@@ -273,6 +273,16 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Account for data sent on another channel on behalf of this file, so
+ * that rate limiting and the bandwidth estimate take it into account.
+ */
+void qemu_file_credit_transfer(QEMUFile *f, size_t size)
+{
+    f->pos += size;
+    f->bytes_xfer += size;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -43,6 +43,7 @@
 #include "trace.h"
 #include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
+#include "io/channel.h"
 
 #ifdef DEBUG_MIGRATION_RAM
 #define DPRINTF(fmt, ...) \
@@ -68,6 +69,7 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
@@ -103,6 +105,8 @@ static void XBZRLE_cache_unlock(void)
         qemu_mutex_unlock(&XBZRLE.lock);
 }
 
+static void xbzrle_cache_collect_stats(void);
+
 /*
  * called from qmp_migrate_set_cache_size in main thread, possibly while
  * a migration is in progress.
@@ -132,6 +136,7 @@ int64_t xbzrle_cache_resize(int64_t new_size)
             goto out;
         }
 
+        xbzrle_cache_collect_stats();
         cache_fini(XBZRLE.cache);
         XBZRLE.cache = new_cache;
     }
@@ -154,6 +159,8 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
+    uint64_t xbzrle_cache_hit;
+    uint64_t xbzrle_cache_evictions;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -163,6 +170,19 @@ static void acct_clear(void)
     memset(&acct_info, 0, sizeof(acct_info));
 }
 
+/* Fold the hit and eviction counts of the XBZRLE cache into acct_info.
+ * Called with XBZRLE.lock held. */
+static void xbzrle_cache_collect_stats(void)
+{
+    PageCacheStats stats;
+
+    if (XBZRLE.cache) {
+        cache_get_stats(XBZRLE.cache, &stats, true);
+        acct_info.xbzrle_cache_hit += stats.hits;
+        acct_info.xbzrle_cache_evictions += stats.evictions;
+    }
+}
+
 uint64_t dup_mig_bytes_transferred(void)
 {
     return acct_info.dup_pages * TARGET_PAGE_SIZE;
@@ -213,6 +233,16 @@ double xbzrle_mig_cache_miss_rate(void)
     return acct_info.xbzrle_cache_miss_rate;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
+uint64_t xbzrle_mig_cache_evictions(void)
+{
+    return acct_info.xbzrle_cache_evictions;
+}
+
 uint64_t xbzrle_mig_pages_overflow(void)
 {
     return acct_info.xbzrle_overflows;
@@ -250,8 +280,25 @@ static struct BitmapRcu {
      * of the postcopy phase
      */
     unsigned long *unsentmap;
+    /* one bit per CLEAR_BITMAP_SHIFT chunk of ram_addr_t space, set when the
+     * chunk was synced and the accelerator may still have to write-protect
+     * the pages it reported dirty
+     */
+    unsigned long *clearmap;
 } *migration_bitmap_rcu;
 
+/* Accelerators re-arm dirty logging 1 << CLEAR_BITMAP_SHIFT target pages
+ * at a time (1GB with 4k pages), right before the first page of the chunk
+ * is sent.
+ */
+#define CLEAR_BITMAP_SHIFT 18
+#define CLEAR_BITMAP_BITS (TARGET_PAGE_BITS + CLEAR_BITMAP_SHIFT)
+
+static unsigned long clear_bitmap_chunks(unsigned long pages)
+{
+    return DIV_ROUND_UP(pages, 1UL << CLEAR_BITMAP_SHIFT);
+}
+
 struct CompressParam {
     bool done;
     bool quit;
@@ -389,6 +436,756 @@ void migrate_compress_threads_create(void)
     }
 }
 
+/* Multiple fd's */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* Sent once on each channel, straight after connecting */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t id;
+    uint32_t page_count;
+} QEMU_PACKED MultiFDInit_t;
+
+/* Header of each packet; it is followed by the data of pages_used pages */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t pages_used;
+    uint64_t packet_num;
+    char ramblock[256];
+    uint64_t offset[];
+} QEMU_PACKED MultiFDPacket_t;
+
+typedef struct {
+    /* number of used pages */
+    uint32_t used;
+    /* number of allocated pages */
+    uint32_t allocated;
+    /* all the pages belong to this block */
+    RAMBlock *block;
+    /* offset of each page inside the block */
+    ram_addr_t *offset;
+    /* host address and length of each page */
+    struct iovec *iov;
+} MultiFDPages_t;
+
+typedef struct {
+    /* channel number */
+    uint8_t id;
+    /* thread name */
+    char *name;
+    QemuThread thread;
+    /* channel to the destination, set up by the thread itself */
+    QIOChannel *c;
+    /* posted when there is work to do or the thread should quit */
+    QemuSemaphore sem;
+    /* protects the fields below */
+    QemuMutex mutex;
+    /* the thread should finish */
+    bool quit;
+    /* @pages holds a batch that has to be sent */
+    bool pending_job;
+    /* a sync packet has to be sent */
+    bool sync_requested;
+    /* pages to send; swapped with the migration thread's batch */
+    MultiFDPages_t *pages;
+    /* size of the packet header, including the offsets */
+    uint32_t packet_len;
+    MultiFDPacket_t *packet;
+    /* number of the next packet */
+    uint64_t packet_num;
+    /* statistics */
+    uint64_t num_packets;
+    uint64_t num_pages;
+} MultiFDSendParams;
+
+typedef struct {
+    /* channel number */
+    uint8_t id;
+    /* thread name */
+    char *name;
+    QemuThread thread;
+    QIOChannel *c;
+    /* posted by the main thread once a sync point has been reached */
+    QemuSemaphore sem_sync;
+    /* the thread should finish */
+    bool quit;
+    /* size of the packet header, including the offsets */
+    uint32_t packet_len;
+    MultiFDPacket_t *packet;
+    /* where the pages of the current packet go */
+    struct iovec *iov;
+    /* statistics */
+    uint64_t num_packets;
+    uint64_t num_pages;
+} MultiFDRecvParams;
+
+static struct {
+    MultiFDSendParams *params;
+    int count;
+    int page_count;
+    /* batch that the migration thread is filling */
+    MultiFDPages_t *pages;
+    /* posted by each channel when it has sent a sync packet */
+    QemuSemaphore sem_sync;
+    /* posted by each channel when it can take a new batch */
+    QemuSemaphore channels_ready;
+    /* where to start looking for an idle channel */
+    int next_channel;
+    uint64_t packet_num;
+    /* set when a channel fails; the whole migration fails then */
+    int failed;
+} *multifd_send_state;
+
+static struct {
+    MultiFDRecvParams *params;
+    int count;
+    int page_count;
+    /* number of channels that have connected */
+    int connected;
+    /* posted by each channel when it has received a sync packet */
+    QemuSemaphore sem_sync;
+    int failed;
+} *multifd_recv_state;
+
+static MultiFDPages_t *multifd_pages_new(int page_count)
+{
+    MultiFDPages_t *pages = g_new0(MultiFDPages_t, 1);
+
+    pages->allocated = page_count;
+    pages->offset = g_new0(ram_addr_t, page_count);
+    pages->iov = g_new0(struct iovec, page_count);
+
+    return pages;
+}
+
+static void multifd_pages_free(MultiFDPages_t *pages)
+{
+    g_free(pages->offset);
+    g_free(pages->iov);
+    g_free(pages);
+}
+
+static uint32_t multifd_packet_len(int page_count)
+{
+    return sizeof(MultiFDPacket_t) + page_count * sizeof(uint64_t);
+}
+
+static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDInit_t msg;
+
+    msg.magic = cpu_to_be32(MULTIFD_MAGIC);
+    msg.version = cpu_to_be32(MULTIFD_VERSION);
+    msg.id = cpu_to_be32(p->id);
+    msg.page_count = cpu_to_be32(multifd_send_state->page_count);
+
+    return qio_channel_write_all(p->c, (char *)&msg, sizeof(msg), errp);
+}
+
+static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
+{
+    MultiFDInit_t msg;
+
+    if (qio_channel_read_all(c, (char *)&msg, sizeof(msg), errp) < 0) {
+        return -1;
+    }
+
+    msg.magic = be32_to_cpu(msg.magic);
+    msg.version = be32_to_cpu(msg.version);
+    msg.id = be32_to_cpu(msg.id);
+    msg.page_count = be32_to_cpu(msg.page_count);
+
+    if (msg.magic != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x "
+                   "expected %x", msg.magic, MULTIFD_MAGIC);
+        return -1;
+    }
+    if (msg.version != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received packet version %d "
+                   "expected %d", msg.version, MULTIFD_VERSION);
+        return -1;
+    }
+    if (msg.page_count != multifd_recv_state->page_count) {
+        error_setg(errp, "multifd: source uses %d pages per packet, "
+                   "expected %d", msg.page_count,
+                   multifd_recv_state->page_count);
+        return -1;
+    }
+    if (msg.id >= multifd_recv_state->count) {
+        error_setg(errp, "multifd: received channel id %d, expected at "
+                   "most %d", msg.id, multifd_recv_state->count - 1);
+        return -1;
+    }
+
+    return msg.id;
+}
+
+/* Called with p->mutex held */
+static void multifd_send_fill_packet(MultiFDSendParams *p, uint32_t flags)
+{
+    MultiFDPacket_t *packet = p->packet;
+    MultiFDPages_t *pages = p->pages;
+    uint32_t i;
+
+    packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+    packet->version = cpu_to_be32(MULTIFD_VERSION);
+    packet->flags = cpu_to_be32(flags);
+    packet->pages_used = cpu_to_be32(pages->used);
+    packet->packet_num = cpu_to_be64(p->packet_num);
+    if (pages->block) {
+        pstrcpy(packet->ramblock, sizeof(packet->ramblock),
+                pages->block->idstr);
+    } else {
+        memset(packet->ramblock, 0, sizeof(packet->ramblock));
+    }
+
+    for (i = 0; i < pages->used; i++) {
+        packet->offset[i] = cpu_to_be64(pages->offset[i]);
+    }
+}
+
+/*
+ * Check the header of a received packet and point p->iov at the guest
+ * memory that the page data has to be read into.
+ *
+ * Called within an RCU critical section.
+ */
+static int multifd_recv_unfill_packet(MultiFDRecvParams *p, uint32_t *flags,
+                                      uint32_t *used, Error **errp)
+{
+    MultiFDPacket_t *packet = p->packet;
+    RAMBlock *block;
+    uint32_t i;
+
+    if (be32_to_cpu(packet->magic) != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x expected %x",
+                   be32_to_cpu(packet->magic), MULTIFD_MAGIC);
+        return -1;
+    }
+    if (be32_to_cpu(packet->version) != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received packet version %d expected %d",
+                   be32_to_cpu(packet->version), MULTIFD_VERSION);
+        return -1;
+    }
+
+    *flags = be32_to_cpu(packet->flags);
+    *used = be32_to_cpu(packet->pages_used);
+    if (*used > multifd_recv_state->page_count) {
+        error_setg(errp, "multifd: received packet with %d pages, "
+                   "expected at most %d", *used,
+                   multifd_recv_state->page_count);
+        return -1;
+    }
+    if (!*used) {
+        return 0;
+    }
+
+    packet->ramblock[sizeof(packet->ramblock) - 1] = 0;
+    block = qemu_ram_block_by_name(packet->ramblock);
+    if (!block) {
+        error_setg(errp, "multifd: unknown ram block %s", packet->ramblock);
+        return -1;
+    }
+
+    for (i = 0; i < *used; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[i]);
+
+        if ((offset & ~TARGET_PAGE_MASK) ||
+            offset + TARGET_PAGE_SIZE > block->used_length) {
+            error_setg(errp, "multifd: offset %" PRIx64 " outside of "
+                       "ram block %s", offset, block->idstr);
+            return -1;
+        }
+        p->iov[i].iov_base = block->host + offset;
+        p->iov[i].iov_len = TARGET_PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+/* Make sure nothing waits for a channel that has stopped working */
+static void multifd_send_set_failed(Error *err)
+{
+    if (err) {
+        error_report_err(err);
+    }
+    atomic_set(&multifd_send_state->failed, 1);
+    qemu_sem_post(&multifd_send_state->channels_ready);
+    qemu_sem_post(&multifd_send_state->sem_sync);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    Error *local_err = NULL;
+    QIOChannel *c;
+
+    trace_multifd_send_thread_start(p->id);
+
+    c = socket_send_channel_create(&local_err);
+    if (!c) {
+        goto out;
+    }
+    qemu_mutex_lock(&p->mutex);
+    p->c = c;
+    qemu_mutex_unlock(&p->mutex);
+
+    if (multifd_send_initial_packet(p, &local_err) < 0) {
+        goto out;
+    }
+    /* Ready for the first batch */
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        } else if (p->pending_job) {
+            uint32_t used = p->pages->used;
+
+            multifd_send_fill_packet(p, 0);
+            qemu_mutex_unlock(&p->mutex);
+
+            /* The migration thread leaves p->pages alone until
+             * pending_job is cleared, so no lock is needed here.
+             */
+            if (qio_channel_write_all(p->c, (char *)p->packet,
+                                      p->packet_len, &local_err) < 0 ||
+                qio_channel_writev_all(p->c, p->pages->iov, used,
+                                       &local_err) < 0) {
+                break;
+            }
+
+            qemu_mutex_lock(&p->mutex);
+            p->num_packets++;
+            p->num_pages += used;
+            p->pages->used = 0;
+            p->pages->block = NULL;
+            p->pending_job = false;
+            qemu_mutex_unlock(&p->mutex);
+
+            qemu_sem_post(&multifd_send_state->channels_ready);
+        } else if (p->sync_requested) {
+            p->sync_requested = false;
+            multifd_send_fill_packet(p, MULTIFD_FLAG_SYNC);
+            qemu_mutex_unlock(&p->mutex);
+
+            if (qio_channel_write_all(p->c, (char *)p->packet,
+                                      p->packet_len, &local_err) < 0) {
+                break;
+            }
+            qemu_sem_post(&multifd_send_state->sem_sync);
+        } else {
+            qemu_mutex_unlock(&p->mutex);
+        }
+    }
+
+out:
+    if (local_err) {
+        multifd_send_set_failed(local_err);
+    }
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages);
+
+    return NULL;
+}
+
+/*
+ * Hand the batch of pages that the migration thread has been filling over
+ * to an idle channel, waiting for one if they are all busy.
+ */
+static int multifd_send_pages(QEMUFile *f)
+{
+    MultiFDPages_t *pages = multifd_send_state->pages;
+    MultiFDSendParams *p;
+    uint64_t transferred;
+    int i;
+
+    if (atomic_read(&multifd_send_state->failed)) {
+        return -1;
+    }
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    if (atomic_read(&multifd_send_state->failed)) {
+        return -1;
+    }
+
+    for (i = multifd_send_state->next_channel;;
+         i = (i + 1) % multifd_send_state->count) {
+        p = &multifd_send_state->params[i];
+        qemu_mutex_lock(&p->mutex);
+        if (!p->pending_job) {
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    multifd_send_state->next_channel = (i + 1) % multifd_send_state->count;
+
+    multifd_send_state->pages = p->pages;
+    p->pages = pages;
+    p->packet_num = multifd_send_state->packet_num++;
+    p->pending_job = true;
+    transferred = p->packet_len + (uint64_t)pages->used * TARGET_PAGE_SIZE;
+    qemu_mutex_unlock(&p->mutex);
+
+    /* Let rate limiting and bandwidth estimates see the pages */
+    qemu_file_credit_transfer(f, transferred);
+    qemu_sem_post(&p->sem);
+
+    return 0;
+}
+
+/*
+ * Add a page to the current batch; a batch only ever holds pages from
+ * a single RAMBlock, and it is sent as soon as it is full.
+ */
+static int multifd_queue_page(QEMUFile *f, RAMBlock *block,
+                              ram_addr_t offset)
+{
+    MultiFDPages_t *pages = multifd_send_state->pages;
+
+    if (pages->block && pages->block != block) {
+        if (multifd_send_pages(f) < 0) {
+            return -1;
+        }
+        pages = multifd_send_state->pages;
+    }
+
+    pages->block = block;
+    pages->offset[pages->used] = offset;
+    pages->iov[pages->used].iov_base = block->host + offset;
+    pages->iov[pages->used].iov_len = TARGET_PAGE_SIZE;
+    pages->used++;
+
+    if (pages->used == pages->allocated) {
+        return multifd_send_pages(f);
+    }
+
+    return 0;
+}
+
+/*
+ * Wait until everything queued so far has been written to the multifd
+ * channels, and mark that point in the main stream.  The destination
+ * stops each channel at the matching sync packet until it has read up
+ * to the mark, so pages sent before and after it can never be reordered
+ * with respect to the main stream.
+ *
+ * Called from the migration thread within an RCU critical section, which
+ * also keeps the RAMBlocks of the pages in flight alive.
+ */
+static int multifd_send_sync_main(QEMUFile *f)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return 0;
+    }
+
+    if (multifd_send_state->pages->used && multifd_send_pages(f) < 0) {
+        goto err;
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->sync_requested = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_wait(&multifd_send_state->sem_sync);
+    }
+    if (atomic_read(&multifd_send_state->failed)) {
+        goto err;
+    }
+
+    trace_multifd_send_sync_main(multifd_send_state->packet_num);
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    return 0;
+
+err:
+    error_report("multifd: sending RAM pages failed");
+    qemu_file_set_error(f, -EIO);
+    return -1;
+}
+
+void multifd_save_setup(void)
+{
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+
+    multifd_send_state = g_new0(typeof(*multifd_send_state), 1);
+    multifd_send_state->count = migrate_multifd_channels();
+    multifd_send_state->page_count = migrate_multifd_page_count();
+    multifd_send_state->params = g_new0(MultiFDSendParams,
+                                        multifd_send_state->count);
+    multifd_send_state->pages =
+        multifd_pages_new(multifd_send_state->page_count);
+    qemu_sem_init(&multifd_send_state->sem_sync, 0);
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        p->id = i;
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
+        p->pages = multifd_pages_new(multifd_send_state->page_count);
+        p->packet_len = multifd_packet_len(multifd_send_state->page_count);
+        p->packet = g_malloc0(p->packet_len);
+        p->name = g_strdup_printf("multifdsend_%d", i);
+        qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Unblock any channel that is stuck writing to the destination */
+void multifd_save_shutdown(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->c) {
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+}
+
+void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+
+    multifd_save_shutdown();
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_thread_join(&p->thread);
+        if (p->c) {
+            object_unref(OBJECT(p->c));
+        }
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
+        multifd_pages_free(p->pages);
+        g_free(p->packet);
+        g_free(p->name);
+    }
+    qemu_sem_destroy(&multifd_send_state->sem_sync);
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    multifd_pages_free(multifd_send_state->pages);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    Error *local_err = NULL;
+    struct iovec header = {
+        .iov_base = p->packet,
+        .iov_len = p->packet_len,
+    };
+
+    rcu_register_thread();
+    trace_multifd_recv_thread_start(p->id);
+
+    while (!atomic_read(&p->quit)) {
+        uint32_t flags = 0, used = 0;
+        int ret;
+
+        ret = qio_channel_readv_all_eof(p->c, &header, 1, &local_err);
+        if (ret <= 0) {
+            /* end-of-file is how the source closes the channel */
+            break;
+        }
+
+        rcu_read_lock();
+        ret = multifd_recv_unfill_packet(p, &flags, &used, &local_err);
+        if (!ret && used) {
+            ret = qio_channel_readv_all(p->c, p->iov, used, &local_err);
+        }
+        rcu_read_unlock();
+        if (ret < 0) {
+            break;
+        }
+
+        p->num_packets++;
+        p->num_pages += used;
+
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+        }
+    }
+
+    if (local_err && !atomic_read(&p->quit)) {
+        error_report_err(local_err);
+        /* Make the source notice as well */
+        qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+    } else {
+        error_free(local_err);
+    }
+    /* Whatever happened, ram_load() must not wait for this channel */
+    atomic_set(&multifd_recv_state->failed, 1);
+    qemu_sem_post(&multifd_recv_state->sem_sync);
+
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/*
+ * Wait until every channel has received everything up to the sync packet
+ * that matches a RAM_SAVE_FLAG_MULTIFD_SYNC in the main stream, then let
+ * them carry on.
+ */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        error_report("multifd: sync point without multifd channels; "
+                     "is the x-multifd capability enabled?");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+    }
+    if (atomic_read(&multifd_recv_state->failed)) {
+        error_report("multifd: receiving RAM pages failed");
+        return -EIO;
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
+    }
+    trace_multifd_recv_sync_main();
+
+    return 0;
+}
+
+void multifd_load_setup(void)
+{
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+
+    multifd_recv_state = g_new0(typeof(*multifd_recv_state), 1);
+    multifd_recv_state->count = migrate_multifd_channels();
+    multifd_recv_state->page_count = migrate_multifd_page_count();
+    multifd_recv_state->params = g_new0(MultiFDRecvParams,
+                                        multifd_recv_state->count);
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        p->id = i;
+        qemu_sem_init(&p->sem_sync, 0);
+        p->packet_len = multifd_packet_len(multifd_recv_state->page_count);
+        p->packet = g_malloc0(p->packet_len);
+        p->iov = g_new0(struct iovec, multifd_recv_state->page_count);
+        p->name = g_strdup_printf("multifdrecv_%d", i);
+    }
+}
+
+int multifd_recv_new_channel(QIOChannel *ioc, Error **errp)
+{
+    MultiFDRecvParams *p;
+    int id;
+
+    id = multifd_recv_initial_packet(ioc, errp);
+    if (id < 0) {
+        return -1;
+    }
+
+    p = &multifd_recv_state->params[id];
+    if (p->c) {
+        error_setg(errp, "multifd: channel %d connected twice", id);
+        return -1;
+    }
+
+    qio_channel_set_blocking(ioc, true, NULL);
+    object_ref(OBJECT(ioc));
+    p->c = ioc;
+    multifd_recv_state->connected++;
+    qemu_thread_create(&p->thread, p->name, multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+
+    return 0;
+}
+
+bool multifd_recv_all_channels_created(void)
+{
+    return multifd_recv_state &&
+           multifd_recv_state->connected == multifd_recv_state->count;
+}
+
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (p->c) {
+            atomic_set(&p->quit, true);
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+            qemu_sem_post(&p->sem_sync);
+            qemu_thread_join(&p->thread);
+            object_unref(OBJECT(p->c));
+        }
+        qemu_sem_destroy(&p->sem_sync);
+        g_free(p->packet);
+        g_free(p->iov);
+        g_free(p->name);
+    }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
 /**
  * save_page_header: Write page header to wire
  *
@@ -569,6 +1366,34 @@ ram_addr_t migration_bitmap_find_dirty(RAMBlock *rb,
     return (next - base) << TARGET_PAGE_BITS;
 }
 
+/* Called with rcu_read_lock held */
+static void migration_bitmap_clear_chunk(ram_addr_t addr)
+{
+    unsigned long *clearmap = atomic_rcu_read(&migration_bitmap_rcu)->clearmap;
+    unsigned long chunk = addr >> CLEAR_BITMAP_BITS;
+    ram_addr_t start = (ram_addr_t)chunk << CLEAR_BITMAP_BITS;
+    ram_addr_t end = start + (1ULL << CLEAR_BITMAP_BITS);
+    RAMBlock *block;
+
+    if (!test_and_clear_bit(chunk, clearmap)) {
+        return;
+    }
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        ram_addr_t block_start = MAX(start, block->offset);
+        ram_addr_t block_end = MIN(end, block->offset + block->used_length);
+
+        if (block_start < block_end) {
+            trace_migration_bitmap_clear_chunk(block->idstr,
+                                               block_start - block->offset,
+                                               block_end - block_start);
+            memory_region_clear_dirty_bitmap(block->mr,
+                                             block_start - block->offset,
+                                             block_end - block_start);
+        }
+    }
+}
+
 static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
 {
     bool ret;
@@ -579,16 +1404,204 @@ static inline bool migration_bitmap_clear_dirty(ram_addr_t addr)
 
     if (ret) {
         migration_dirty_pages--;
+        /* The page is about to be read, so writes to it must be logged
+         * again from now on */
+        migration_bitmap_clear_chunk(addr);
     }
     return ret;
 }
 
+/* Postpone write-protecting the synced pages until they are sent */
+static void migration_bitmap_mark_clear(ram_addr_t start, ram_addr_t length)
+{
+    unsigned long *clearmap;
+    unsigned long first, last;
+
+    clearmap = atomic_rcu_read(&migration_bitmap_rcu)->clearmap;
+    if (length) {
+        first = start >> CLEAR_BITMAP_BITS;
+        last = (start + length - 1) >> CLEAR_BITMAP_BITS;
+        bitmap_set(clearmap, first, last - first + 1);
+    }
+}
+
 static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 {
     unsigned long *bitmap;
     bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
     migration_dirty_pages +=
         cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
+    migration_bitmap_mark_clear(start, length);
+}
+
+/* Bitmap sync threads
+ *
+ * For large guests, migration_bitmap_sync() splits guest memory into ranges
+ * of SYNC_RANGE_PAGES target pages (1GB with 4k pages) and syncs them from
+ * the migration thread and a few helper threads at the same time.  One
+ * helper is started for every SYNC_THREAD_PAGES of guest memory, up to
+ * SYNC_THREADS_MAX.
+ */
+#define SYNC_RANGE_PAGES (1UL << 18)
+#define SYNC_THREAD_PAGES (16 * SYNC_RANGE_PAGES)
+#define SYNC_THREADS_MAX 8
+
+typedef struct SyncRange {
+    ram_addr_t start;
+    ram_addr_t length;
+} SyncRange;
+
+typedef struct SyncParam {
+    QemuThread thread;
+    /* pages newly dirtied in the ranges synced by this thread */
+    uint64_t num_dirty;
+} SyncParam;
+
+static struct SyncState {
+    SyncParam *params;
+    int nr_threads;
+    bool quit;
+    /* posted once per helper to start a sync */
+    QemuSemaphore sem;
+    /* posted by each helper once there are no ranges left */
+    QemuSemaphore sem_done;
+    /* work for the current sync, set up by the migration thread */
+    unsigned long *bitmap;
+    SyncRange *ranges;
+    int nr_ranges;
+    int allocated_ranges;
+    int next_range;
+} *sync_state;
+
+static uint64_t migration_bitmap_sync_work(void)
+{
+    uint64_t num_dirty = 0;
+    SyncRange *range;
+    int i;
+
+    while ((i = atomic_fetch_inc(&sync_state->next_range)) <
+           sync_state->nr_ranges) {
+        range = &sync_state->ranges[i];
+        num_dirty += cpu_physical_memory_sync_dirty_bitmap(sync_state->bitmap,
+                                                           range->start,
+                                                           range->length);
+    }
+    return num_dirty;
+}
+
+static void *migration_bitmap_sync_thread(void *opaque)
+{
+    SyncParam *p = opaque;
+
+    rcu_register_thread();
+    for (;;) {
+        qemu_sem_wait(&sync_state->sem);
+        if (atomic_read(&sync_state->quit)) {
+            break;
+        }
+        p->num_dirty = migration_bitmap_sync_work();
+        qemu_sem_post(&sync_state->sem_done);
+    }
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static void migration_bitmap_sync_threads_create(unsigned long ram_pages)
+{
+    int i, nr_threads = MIN(ram_pages / SYNC_THREAD_PAGES, SYNC_THREADS_MAX);
+
+    if (!nr_threads) {
+        return;
+    }
+
+    sync_state = g_new0(struct SyncState, 1);
+    sync_state->params = g_new0(SyncParam, nr_threads);
+    sync_state->nr_threads = nr_threads;
+    qemu_sem_init(&sync_state->sem, 0);
+    qemu_sem_init(&sync_state->sem_done, 0);
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_create(&sync_state->params[i].thread, "bitmapsync",
+                           migration_bitmap_sync_thread,
+                           &sync_state->params[i], QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void migration_bitmap_sync_threads_join(void)
+{
+    int i;
+
+    if (!sync_state) {
+        return;
+    }
+
+    atomic_set(&sync_state->quit, true);
+    for (i = 0; i < sync_state->nr_threads; i++) {
+        qemu_sem_post(&sync_state->sem);
+    }
+    for (i = 0; i < sync_state->nr_threads; i++) {
+        qemu_thread_join(&sync_state->params[i].thread);
+    }
+    qemu_sem_destroy(&sync_state->sem);
+    qemu_sem_destroy(&sync_state->sem_done);
+    g_free(sync_state->params);
+    g_free(sync_state->ranges);
+    g_free(sync_state);
+    sync_state = NULL;
+}
+
+/* Split @block at multiples of SYNC_RANGE_PAGES, so that ranges only share
+ * bitmap words at block boundaries */
+static void migration_bitmap_sync_add_ranges(RAMBlock *block)
+{
+    ram_addr_t range_size = (ram_addr_t)SYNC_RANGE_PAGES << TARGET_PAGE_BITS;
+    ram_addr_t start = block->offset;
+    ram_addr_t end = block->offset + block->used_length;
+    ram_addr_t next;
+
+    while (start < end) {
+        next = MIN(QEMU_ALIGN_UP(start + 1, range_size), end);
+        if (sync_state->nr_ranges == sync_state->allocated_ranges) {
+            sync_state->allocated_ranges =
+                MAX(sync_state->allocated_ranges * 2, 16);
+            sync_state->ranges = g_renew(SyncRange, sync_state->ranges,
+                                         sync_state->allocated_ranges);
+        }
+        sync_state->ranges[sync_state->nr_ranges++] = (SyncRange) {
+            .start = start,
+            .length = next - start,
+        };
+        start = next;
+    }
+}
+
+/* Called with rcu_read_lock and migration_bitmap_mutex held */
+static void migration_bitmap_sync_parallel(void)
+{
+    RAMBlock *block;
+    int i;
+
+    sync_state->bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    sync_state->nr_ranges = 0;
+    sync_state->next_range = 0;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        migration_bitmap_sync_add_ranges(block);
+    }
+
+    for (i = 0; i < sync_state->nr_threads; i++) {
+        qemu_sem_post(&sync_state->sem);
+    }
+    migration_dirty_pages += migration_bitmap_sync_work();
+    for (i = 0; i < sync_state->nr_threads; i++) {
+        qemu_sem_wait(&sync_state->sem_done);
+    }
+    for (i = 0; i < sync_state->nr_threads; i++) {
+        migration_dirty_pages += sync_state->params[i].num_dirty;
+    }
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        migration_bitmap_mark_clear(block->offset, block->used_length);
+    }
 }
 
 /* Fix me: there are too many global variables used in migration process. */
@@ -612,6 +1625,7 @@ static void migration_bitmap_sync(void)
     RAMBlock *block;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
+    int64_t sync_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     int64_t end_time;
     int64_t bytes_xfer_now;
 
@@ -630,14 +1644,20 @@ static void migration_bitmap_sync(void)
 
     qemu_mutex_lock(&migration_bitmap_mutex);
     rcu_read_lock();
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->offset, block->used_length);
+    if (sync_state) {
+        migration_bitmap_sync_parallel();
+    } else {
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            migration_bitmap_sync_range(block->offset, block->used_length);
+        }
     }
     rcu_read_unlock();
     qemu_mutex_unlock(&migration_bitmap_mutex);
 
+    s->dirty_sync_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - sync_start;
     trace_migration_bitmap_sync_end(migration_dirty_pages
-                                    - num_dirty_pages_init);
+                                    - num_dirty_pages_init,
+                                    s->dirty_sync_time);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -671,6 +1691,10 @@ static void migration_bitmap_sync(void)
             }
             iterations_prev = acct_info.iterations;
             xbzrle_cache_miss_prev = acct_info.xbzrle_cache_miss;
+
+            XBZRLE_cache_lock();
+            xbzrle_cache_collect_stats();
+            XBZRLE_cache_unlock();
         }
         s->dirty_pages_rate = num_dirty_pages_period * 1000
             / (end_time - start_time);
@@ -802,6 +1826,46 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     return pages;
 }
 
+/**
+ * ram_save_multifd_page: Send the given page over the multifd channels
+ *
+ * Zero pages still go through the main stream, everything else is
+ * queued for one of the multifd send threads.
+ *
+ * Returns: Number of pages written, or < 0 on error.
+ *
+ * @f: QEMUFile where to send the data
+ * @pss: data about the page we want to send
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_multifd_page(QEMUFile *f, PageSearchStatus *pss,
+                                 uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->offset;
+    int pages;
+
+    if (block == last_sent_block) {
+        offset |= RAM_SAVE_FLAG_CONTINUE;
+    }
+    pages = save_zero_page(f, block, offset, block->host + pss->offset,
+                           bytes_transferred);
+    if (pages > 0) {
+        last_sent_block = block;
+        return pages;
+    }
+
+    if (multifd_queue_page(f, block, pss->offset) < 0) {
+        error_report("multifd: sending RAM pages failed");
+        qemu_file_set_error(f, -EIO);
+        return -EIO;
+    }
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    acct_info.norm_pages++;
+
+    return 1;
+}
+
 static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
                                 ram_addr_t offset)
 {
@@ -1024,23 +2088,95 @@ static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
     }
 }
 
+/* Prefetch windows kept around the most recent postcopy faults */
+#define POSTCOPY_PREFETCH_MAX_WINDOWS 8
+
+/*
+ * Drop the prefetch windows at the head of the queue whose pages were all
+ * sent already, and move the first remaining one up to its first unsent
+ * page.  Sent pages are skipped a bitmap word at a time.
+ * Called with src_page_req_mutex and rcu_read_lock held.
+ *
+ * Returns:      the first window with a page left to send, or NULL
+ */
+static struct MigrationSrcPageRequest *first_prefetch(MigrationState *ms)
+{
+    struct MigrationSrcPageRequest *entry;
+    unsigned long *bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+
+    while ((entry = QSIMPLEQ_FIRST(&ms->src_page_prefetch))) {
+        unsigned long first = (entry->rb->offset + entry->offset) >>
+                              TARGET_PAGE_BITS;
+        unsigned long end = first + (entry->len >> TARGET_PAGE_BITS);
+        unsigned long next = find_next_bit(bitmap, end, first);
+
+        if (next < end) {
+            entry->offset += (ram_addr_t)(next - first) << TARGET_PAGE_BITS;
+            entry->len -= (ram_addr_t)(next - first) << TARGET_PAGE_BITS;
+            return entry;
+        }
+        memory_region_unref(entry->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&ms->src_page_prefetch, next_req);
+        g_free(entry);
+    }
+    return NULL;
+}
+
+/*
+ * Put a new prefetch window at the head of the queue, so the area around
+ * the latest fault is sent first.  Older windows of the same RAMBlock that
+ * overlap it are superseded, and the oldest windows beyond
+ * POSTCOPY_PREFETCH_MAX_WINDOWS are dropped; the background search still
+ * sends their pages eventually.
+ * Called with src_page_req_mutex held.
+ */
+static void queue_prefetch(MigrationState *ms,
+                           struct MigrationSrcPageRequest *prefetch)
+{
+    struct MigrationSrcPageRequest *entry, *next_entry;
+    unsigned int n = 1;
+
+    QSIMPLEQ_INSERT_HEAD(&ms->src_page_prefetch, prefetch, next_req);
+    entry = prefetch;
+    while ((next_entry = QSIMPLEQ_NEXT(entry, next_req))) {
+        if (n >= POSTCOPY_PREFETCH_MAX_WINDOWS ||
+            (next_entry->rb == prefetch->rb &&
+             next_entry->offset < prefetch->offset + prefetch->len &&
+             prefetch->offset < next_entry->offset + next_entry->len)) {
+            QSIMPLEQ_REMOVE(&ms->src_page_prefetch, next_entry,
+                            MigrationSrcPageRequest, next_req);
+            memory_region_unref(next_entry->rb->mr);
+            g_free(next_entry);
+            continue;
+        }
+        entry = next_entry;
+        n++;
+    }
+}
+
 /*
- * Helper for 'get_queued_page' - gets a page off the queue
+ * Helper for 'get_queued_page' - gets a page off the queues; pages the
+ * destination asked for come before the pages prefetched around them
  *      ms:      MigrationState in
  * *offset:      Used to return the offset within the RAMBlock
  * ram_addr_abs: global offset in the dirty/sent bitmaps
+ * *urgent:      Set if the destination is waiting for the page
  *
  * Returns:      block (or NULL if none available)
  */
 static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
-                              ram_addr_t *ram_addr_abs)
+                              ram_addr_t *ram_addr_abs, bool *urgent)
 {
+    struct MigrationSrcPageRequest *entry;
     RAMBlock *block = NULL;
 
     qemu_mutex_lock(&ms->src_page_req_mutex);
-    if (!QSIMPLEQ_EMPTY(&ms->src_page_requests)) {
-        struct MigrationSrcPageRequest *entry =
-                                QSIMPLEQ_FIRST(&ms->src_page_requests);
+    entry = QSIMPLEQ_FIRST(&ms->src_page_requests);
+    *urgent = !!entry;
+    if (!entry) {
+        entry = first_prefetch(ms);
+    }
+    if (entry) {
         block = entry->rb;
         *offset = entry->offset;
         *ram_addr_abs = (entry->offset + entry->rb->offset) &
@@ -1051,7 +2187,11 @@ static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
             entry->offset += TARGET_PAGE_SIZE;
         } else {
             memory_region_unref(block->mr);
-            QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
+            if (*urgent) {
+                QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
+            } else {
+                QSIMPLEQ_REMOVE_HEAD(&ms->src_page_prefetch, next_req);
+            }
             g_free(entry);
         }
     }
@@ -1067,18 +2207,19 @@ static RAMBlock *unqueue_page(MigrationState *ms, ram_addr_t *offset,
  *      ms:      MigrationState in
  *     pss:      PageSearchStatus structure updated with found block/offset
  * ram_addr_abs: global offset in the dirty/sent bitmaps
+ *  *urgent:     Set if the destination is waiting for the page
  *
  * Returns:      true if a queued page is found
  */
 static bool get_queued_page(MigrationState *ms, PageSearchStatus *pss,
-                            ram_addr_t *ram_addr_abs)
+                            ram_addr_t *ram_addr_abs, bool *urgent)
 {
     RAMBlock  *block;
     ram_addr_t offset;
     bool dirty;
 
     do {
-        block = unqueue_page(ms, &offset, ram_addr_abs);
+        block = unqueue_page(ms, &offset, ram_addr_abs, urgent);
         /*
          * We're sending this page, and since it's postcopy nothing else
          * will dirty it, and we must make sure it doesn't get sent again
@@ -1144,6 +2285,11 @@ void flush_page_queue(MigrationState *ms)
         QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
         g_free(mspr);
     }
+    QSIMPLEQ_FOREACH_SAFE(mspr, &ms->src_page_prefetch, next_req, next_mspr) {
+        memory_region_unref(mspr->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&ms->src_page_prefetch, next_req);
+        g_free(mspr);
+    }
     rcu_read_unlock();
 }
 
@@ -1159,6 +2305,8 @@ int ram_save_queue_pages(MigrationState *ms, const char *rbname,
                          ram_addr_t start, ram_addr_t len)
 {
     RAMBlock *ramblock;
+    struct MigrationSrcPageRequest *prefetch = NULL;
+    ram_addr_t window;
 
     ms->postcopy_requests++;
     rcu_read_lock();
@@ -1198,9 +2346,34 @@ int ram_save_queue_pages(MigrationState *ms, const char *rbname,
     new_entry->offset = start;
     new_entry->len = len;
 
+    /*
+     * The guest is likely to touch the pages around this one next; queue
+     * them behind all the pages the destination is already waiting for.
+     * Those that were sent in the meantime are skipped by first_prefetch.
+     */
+    window = (ram_addr_t)migrate_postcopy_prefetch_window() * TARGET_PAGE_SIZE;
+    if (window) {
+        ram_addr_t pstart = start > window / 2 ? start - window / 2 : 0;
+        ram_addr_t pend = MIN(start + len + window / 2,
+                              ramblock->used_length);
+
+        pstart &= qemu_host_page_mask;
+        pend = HOST_PAGE_ALIGN(pend);
+        trace_ram_save_queue_prefetch(ramblock->idstr, pstart, pend - pstart);
+
+        prefetch = g_malloc0(sizeof(struct MigrationSrcPageRequest));
+        prefetch->rb = ramblock;
+        prefetch->offset = pstart;
+        prefetch->len = pend - pstart;
+        memory_region_ref(ramblock->mr);
+    }
+
     memory_region_ref(ramblock->mr);
     qemu_mutex_lock(&ms->src_page_req_mutex);
     QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
+    if (prefetch) {
+        queue_prefetch(ms, prefetch);
+    }
     qemu_mutex_unlock(&ms->src_page_req_mutex);
     rcu_read_unlock();
 
@@ -1239,6 +2412,8 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
             res = ram_save_compressed_page(f, pss,
                                            last_stage,
                                            bytes_transferred);
+        } else if (multifd_send_state) {
+            res = ram_save_multifd_page(f, pss, bytes_transferred);
         } else {
             res = ram_save_page(f, pss, last_stage,
                                 bytes_transferred);
@@ -1253,9 +2428,10 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
         }
         /* Only update last_sent_block if a block was actually sent; xbzrle
          * might have decided the page was identical so didn't bother writing
-         * to the stream.
+         * to the stream.  Pages sent over multifd have no header in the
+         * main stream, so ram_save_multifd_page() keeps track itself.
          */
-        if (res > 0) {
+        if (res > 0 && !multifd_send_state) {
             last_sent_block = pss->block;
         }
     }
@@ -1329,6 +2505,7 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
     bool again, found;
     ram_addr_t dirty_ram_abs; /* Address of the start of the dirty page in
                                  ram_addr_t space */
+    bool urgent = false;
 
     pss.block = last_seen_block;
     pss.offset = last_offset;
@@ -1340,7 +2517,7 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
 
     do {
         again = true;
-        found = get_queued_page(ms, &pss, &dirty_ram_abs);
+        found = get_queued_page(ms, &pss, &dirty_ram_abs, &urgent);
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
@@ -1354,6 +2531,12 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
         }
     } while (!pages && again);
 
+    /* A vCPU on the destination is stalled until this page arrives, don't
+     * leave it in the buffer behind the background stream */
+    if (pages && urgent) {
+        qemu_fflush(f);
+    }
+
     last_seen_block = pss.block;
     last_offset = pss.offset;
 
@@ -1409,6 +2592,7 @@ static void migration_bitmap_free(struct BitmapRcu *bmap)
 {
     g_free(bmap->bmap);
     g_free(bmap->unsentmap);
+    g_free(bmap->clearmap);
     g_free(bmap);
 }
 
@@ -1423,9 +2607,11 @@ static void ram_migration_cleanup(void *opaque)
         memory_global_dirty_log_stop();
         call_rcu(bitmap, migration_bitmap_free, rcu);
     }
+    migration_bitmap_sync_threads_join();
 
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
+        xbzrle_cache_collect_stats();
         cache_fini(XBZRLE.cache);
         g_free(XBZRLE.encoded_buf);
         g_free(XBZRLE.current_buf);
@@ -1456,6 +2642,7 @@ void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
         struct BitmapRcu *old_bitmap = migration_bitmap_rcu, *bitmap;
         bitmap = g_new(struct BitmapRcu, 1);
         bitmap->bmap = bitmap_new(new);
+        bitmap->clearmap = bitmap_new(clear_bitmap_chunks(new));
 
         /* prevent migration_bitmap content from being set bit
          * by migration_bitmap_sync_range() at the same time.
@@ -1465,6 +2652,7 @@ void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
         qemu_mutex_lock(&migration_bitmap_mutex);
         bitmap_copy(bitmap->bmap, old_bitmap->bmap, old);
         bitmap_set(bitmap->bmap, old, new - old);
+        bitmap_set(bitmap->clearmap, 0, clear_bitmap_chunks(new));
 
         /* We don't have a way to safely extend the sentmap
          * with RCU; so mark it as missing, entry to postcopy
@@ -1927,6 +3115,8 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     migration_bitmap_rcu = g_new0(struct BitmapRcu, 1);
     migration_bitmap_rcu->bmap = bitmap_new(ram_bitmap_pages);
     bitmap_set(migration_bitmap_rcu->bmap, 0, ram_bitmap_pages);
+    migration_bitmap_rcu->clearmap =
+        bitmap_new(clear_bitmap_chunks(ram_bitmap_pages));
 
     if (migrate_postcopy_ram()) {
         migration_bitmap_rcu->unsentmap = bitmap_new(ram_bitmap_pages);
@@ -1939,6 +3129,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
      */
     migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
 
+    migration_bitmap_sync_threads_create(ram_bitmap_pages);
     memory_global_dirty_log_start();
     migration_bitmap_sync();
     qemu_mutex_unlock_ramlist();
@@ -1957,6 +3148,11 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
+    /* Hold the destination's multifd threads back until it has set up
+     * the RAM blocks.
+     */
+    multifd_send_sync_main(f);
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     return 0;
@@ -2008,6 +3204,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    multifd_send_sync_main(f);
     rcu_read_unlock();
 
     /*
@@ -2052,6 +3249,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    multifd_send_sync_main(f);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
@@ -2554,6 +3752,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -55,6 +55,27 @@ static SocketAddress *unix_build_address(const char *path)
 }
 
 
+/* Destination of the current outgoing migration, for extra channels */
+static SocketAddress *outgoing_saddr;
+
+QIOChannel *socket_send_channel_create(Error **errp)
+{
+    QIOChannelSocket *sioc;
+
+    if (!outgoing_saddr) {
+        error_setg(errp, "No outgoing socket migration in progress");
+        return NULL;
+    }
+
+    sioc = qio_channel_socket_new();
+    if (qio_channel_socket_connect_sync(sioc, outgoing_saddr, errp) < 0) {
+        object_unref(OBJECT(sioc));
+        return NULL;
+    }
+    return QIO_CHANNEL(sioc);
+}
+
+
 struct SocketConnectData {
     MigrationState *s;
     char *hostname;
@@ -105,7 +126,8 @@ static void socket_start_outgoing_migration(MigrationState *s,
                                      socket_outgoing_migration,
                                      data,
                                      socket_connect_data_free);
-    qapi_free_SocketAddress(saddr);
+    qapi_free_SocketAddress(outgoing_saddr);
+    outgoing_saddr = saddr;
 }
 
 void tcp_start_outgoing_migration(MigrationState *s,
@@ -142,8 +164,11 @@ static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
 
     trace_migration_socket_incoming_accepted();
 
-    migration_channel_process_incoming(migrate_get_current(),
-                                       QIO_CHANNEL(sioc));
+    if (!migration_socket_channel_incoming(QIO_CHANNEL(sioc))) {
+        /* Wait for the remaining multifd channels */
+        object_unref(OBJECT(sioc));
+        return TRUE;
+    }
     object_unref(OBJECT(sioc));
 
 out:
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
 /*
@@ -24,8 +25,9 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+#ifndef __SSE2__
+static int xbzrle_encode_buffer_long(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -125,6 +127,275 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
     return d;
 }
+#endif
+
+/*
+ * Vectorized encoders.  These share one encoding loop and only differ in
+ * the functions that find the end of a zero run (the first byte that
+ * differs) and of a non-zero run (the first byte that is unchanged).
+ * Both return the index of that byte, or @slen if there is none.
+ */
+typedef int XbzrleFindFn(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen);
+
+static inline int xbzrle_find_diff_tail(const uint8_t *old_buf,
+                                        const uint8_t *new_buf,
+                                        int i, int slen)
+{
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static inline int xbzrle_find_same_tail(const uint8_t *old_buf,
+                                        const uint8_t *new_buf,
+                                        int i, int slen)
+{
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static inline int xbzrle_encode_buffer_vec(uint8_t *old_buf, uint8_t *new_buf,
+                                           int slen, uint8_t *dst, int dlen,
+                                           XbzrleFindFn *find_diff,
+                                           XbzrleFindFn *find_same)
+{
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, start;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        start = i;
+        i = find_diff(old_buf, new_buf, i, slen);
+        zrun_len = i - start;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        start = i;
+        i = find_same(old_buf, new_buf, i, slen);
+        nzrun_len = i - start;
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + start, nzrun_len);
+        d += nzrun_len;
+    }
+
+    return d;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static inline int xbzrle_find_diff_sse2(const uint8_t *old_buf,
+                                        const uint8_t *new_buf,
+                                        int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffff;
+
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    return xbzrle_find_diff_tail(old_buf, new_buf, i, slen);
+}
+
+static inline int xbzrle_find_same_sse2(const uint8_t *old_buf,
+                                        const uint8_t *new_buf,
+                                        int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    return xbzrle_find_same_tail(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_buffer_sse2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_vec(old_buf, new_buf, slen, dst, dlen,
+                                    xbzrle_find_diff_sse2,
+                                    xbzrle_find_same_sse2);
+}
+
+#define xbzrle_encode_buffer_default xbzrle_encode_buffer_sse2
+#else
+#define xbzrle_encode_buffer_default xbzrle_encode_buffer_long
+#endif
+
+#if defined CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <cpuid.h>
+#include <immintrin.h>
+
+static inline int xbzrle_find_diff_avx2(const uint8_t *old_buf,
+                                        const uint8_t *new_buf,
+                                        int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t mask = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    return xbzrle_find_diff_tail(old_buf, new_buf, i, slen);
+}
+
+static inline int xbzrle_find_same_avx2(const uint8_t *old_buf,
+                                        const uint8_t *new_buf,
+                                        int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    return xbzrle_find_same_tail(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_vec(old_buf, new_buf, slen, dst, dlen,
+                                    xbzrle_find_diff_avx2,
+                                    xbzrle_find_same_avx2);
+}
+#pragma GCC pop_options
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+
+static inline int xbzrle_find_diff_avx512(const uint8_t *old_buf,
+                                          const uint8_t *new_buf,
+                                          int i, int slen)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m512i a = _mm512_loadu_si512(old_buf + i);
+        __m512i b = _mm512_loadu_si512(new_buf + i);
+        uint64_t mask = _mm512_cmpneq_epi8_mask(a, b);
+
+        if (mask) {
+            return i + ctz64(mask);
+        }
+    }
+    return xbzrle_find_diff_avx2(old_buf, new_buf, i, slen);
+}
+
+static inline int xbzrle_find_same_avx512(const uint8_t *old_buf,
+                                          const uint8_t *new_buf,
+                                          int i, int slen)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m512i a = _mm512_loadu_si512(old_buf + i);
+        __m512i b = _mm512_loadu_si512(new_buf + i);
+        uint64_t mask = _mm512_cmpeq_epi8_mask(a, b);
+
+        if (mask) {
+            return i + ctz64(mask);
+        }
+    }
+    return xbzrle_find_same_avx2(old_buf, new_buf, i, slen);
+}
+
+static int xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_vec(old_buf, new_buf, slen, dst, dlen,
+                                    xbzrle_find_diff_avx512,
+                                    xbzrle_find_same_avx512);
+}
+#pragma GCC pop_options
+#endif
+
+/* AVX2 and AVX-512 need the OS to save the wider registers, too */
+static bool xbzrle_xsave_ok(uint32_t xcr0_mask)
+{
+    unsigned a, b, c, d;
+    uint32_t xcr0_lo, xcr0_hi;
+
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE)) {
+        return false;
+    }
+    asm("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    return (xcr0_lo & xcr0_mask) == xcr0_mask;
+}
+
+static void *xbzrle_encode_buffer_ifunc(void)
+{
+    unsigned a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return xbzrle_encode_buffer_default;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+
+#ifdef CONFIG_AVX512BW_OPT
+    /* XCR0: SSE, AVX, opmask, ZMM0-15 upper halves and ZMM16-31 */
+    if ((b & bit_AVX512BW) && xbzrle_xsave_ok(0xe6)) {
+        return xbzrle_encode_buffer_avx512;
+    }
+#endif
+    /* XCR0: SSE and AVX state */
+    if ((b & bit_AVX2) && xbzrle_xsave_ok(0x6)) {
+        return xbzrle_encode_buffer_avx2;
+    }
+    return xbzrle_encode_buffer_default;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+         __attribute__ ((ifunc("xbzrle_encode_buffer_ifunc")));
+#else
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_default(old_buf, new_buf, slen, dst, dlen);
+}
+#endif
 
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
@@ -20,7 +20,7 @@
 #include "qapi/error.h"
 #include "nbd-internal.h"
 
-static int nbd_errno_to_system_errno(int err)
+int nbd_errno_to_system_errno(int err)
 {
     switch (err) {
     case NBD_SUCCESS:
@@ -309,6 +309,178 @@ static int nbd_receive_query_exports(QIOChannel *ioc,
     return 0;
 }
 
+/* Ask the server to use structured replies.  Return 1 if it agreed, 0 if it
+ * does not support them, or -1 with errp set on failure.
+ */
+static int nbd_request_structured_reply(QIOChannel *ioc, Error **errp)
+{
+    uint64_t magic = cpu_to_be64(NBD_OPTS_MAGIC);
+    uint32_t opt = cpu_to_be32(NBD_OPT_STRUCTURED_REPLY);
+    uint32_t length = 0;
+    uint32_t type;
+    int ret;
+
+    TRACE("Requesting structured replies");
+    if (write_sync(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "Failed to send structured reply option magic");
+        return -1;
+    }
+    if (write_sync(ioc, &opt, sizeof(opt)) != sizeof(opt)) {
+        error_setg(errp, "Failed to send structured reply option number");
+        return -1;
+    }
+    if (write_sync(ioc, &length, sizeof(length)) != sizeof(length)) {
+        error_setg(errp, "Failed to send structured reply option length");
+        return -1;
+    }
+
+    if (read_sync(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
+        error_setg(errp, "Failed to read structured reply option magic");
+        return -1;
+    }
+    if (be64_to_cpu(magic) != NBD_REP_MAGIC) {
+        error_setg(errp, "Unexpected structured reply option magic");
+        return -1;
+    }
+    if (read_sync(ioc, &opt, sizeof(opt)) != sizeof(opt)) {
+        error_setg(errp, "Failed to read structured reply option");
+        return -1;
+    }
+    opt = be32_to_cpu(opt);
+    if (opt != NBD_OPT_STRUCTURED_REPLY) {
+        error_setg(errp, "Unexpected option type %" PRIx32 " expected %x",
+                   opt, NBD_OPT_STRUCTURED_REPLY);
+        return -1;
+    }
+    if (read_sync(ioc, &type, sizeof(type)) != sizeof(type)) {
+        error_setg(errp, "Failed to read structured reply option type");
+        return -1;
+    }
+    type = be32_to_cpu(type);
+    ret = nbd_handle_reply_err(ioc, opt, type, errp);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    if (read_sync(ioc, &length, sizeof(length)) != sizeof(length)) {
+        error_setg(errp, "Failed to read structured reply option length");
+        return -1;
+    }
+    if (type != NBD_REP_ACK || length != 0) {
+        error_setg(errp, "Unexpected reply type %" PRIx32 " for structured "
+                   "reply option", type);
+        return -1;
+    }
+
+    TRACE("Server uses structured replies");
+    return 1;
+}
+
+/* Ask the server to select the metadata context info->meta_context of
+ * export @name for NBD_CMD_BLOCK_STATUS.  On success, info->has_meta_context
+ * tells whether the server knows the context; return 0, or -1 with errp set
+ * on failure.
+ */
+static int nbd_request_meta_context(QIOChannel *ioc, const char *name,
+                                    NBDExportInfo *info, Error **errp)
+{
+    uint64_t magic = cpu_to_be64(NBD_OPTS_MAGIC);
+    uint32_t opt = cpu_to_be32(NBD_OPT_SET_META_CONTEXT);
+    uint32_t name_len = strlen(name);
+    uint32_t context_len = strlen(info->meta_context);
+    uint32_t length = sizeof(name_len) + name_len + sizeof(uint32_t) +
+                      sizeof(context_len) + context_len;
+    char *buf, *p;
+    uint32_t type;
+    int ret;
+
+    TRACE("Requesting metadata context '%s'", info->meta_context);
+    p = buf = g_malloc(length);
+    stl_be_p(p, name_len);
+    memcpy(p += sizeof(name_len), name, name_len);
+    stl_be_p(p += name_len, 1);
+    stl_be_p(p += sizeof(uint32_t), context_len);
+    memcpy(p += sizeof(context_len), info->meta_context, context_len);
+
+    length = cpu_to_be32(length);
+    if (write_sync(ioc, &magic, sizeof(magic)) != sizeof(magic) ||
+        write_sync(ioc, &opt, sizeof(opt)) != sizeof(opt) ||
+        write_sync(ioc, &length, sizeof(length)) != sizeof(length) ||
+        write_sync(ioc, buf, be32_to_cpu(length)) != be32_to_cpu(length)) {
+        error_setg(errp, "Failed to send metadata context option");
+        g_free(buf);
+        return -1;
+    }
+    g_free(buf);
+
+    info->has_meta_context = false;
+    while (1) {
+        uint32_t id;
+
+        if (read_sync(ioc, &magic, sizeof(magic)) != sizeof(magic) ||
+            read_sync(ioc, &opt, sizeof(opt)) != sizeof(opt) ||
+            read_sync(ioc, &type, sizeof(type)) != sizeof(type)) {
+            error_setg(errp, "Failed to read metadata context reply");
+            return -1;
+        }
+        if (be64_to_cpu(magic) != NBD_REP_MAGIC) {
+            error_setg(errp, "Unexpected metadata context option magic");
+            return -1;
+        }
+        opt = be32_to_cpu(opt);
+        if (opt != NBD_OPT_SET_META_CONTEXT) {
+            error_setg(errp, "Unexpected option type %" PRIx32 " expected %x",
+                       opt, NBD_OPT_SET_META_CONTEXT);
+            return -1;
+        }
+        type = be32_to_cpu(type);
+        ret = nbd_handle_reply_err(ioc, opt, type, errp);
+        if (ret <= 0) {
+            return ret;
+        }
+
+        if (read_sync(ioc, &length, sizeof(length)) != sizeof(length)) {
+            error_setg(errp, "Failed to read metadata context reply length");
+            return -1;
+        }
+        length = be32_to_cpu(length);
+        if (type == NBD_REP_ACK) {
+            if (length != 0) {
+                error_setg(errp, "length too long for option end");
+                return -1;
+            }
+            break;
+        }
+        if (type != NBD_REP_META_CONTEXT ||
+            length != sizeof(id) + context_len) {
+            error_setg(errp, "Unexpected reply type %" PRIx32 " length %"
+                       PRIu32 " for metadata context option", type, length);
+            return -1;
+        }
+
+        buf = g_malloc(context_len);
+        if (read_sync(ioc, &id, sizeof(id)) != sizeof(id) ||
+            read_sync(ioc, buf, context_len) != context_len) {
+            error_setg(errp, "Failed to read metadata context");
+            g_free(buf);
+            return -1;
+        }
+        if (memcmp(buf, info->meta_context, context_len) != 0 ||
+            info->has_meta_context) {
+            error_setg(errp, "Server selected unexpected metadata context");
+            g_free(buf);
+            return -1;
+        }
+        g_free(buf);
+        info->has_meta_context = true;
+        info->meta_context_id = be32_to_cpu(id);
+        TRACE("Metadata context '%s' has id %" PRIu32,
+              info->meta_context, info->meta_context_id);
+    }
+
+    return 0;
+}
+
 static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
                                         QCryptoTLSCreds *tlscreds,
                                         const char *hostname, Error **errp)
@@ -408,10 +580,10 @@ static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
 }
 
 
-int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
+int nbd_receive_negotiate(QIOChannel *ioc, const char *name,
                           QCryptoTLSCreds *tlscreds, const char *hostname,
-                          QIOChannel **outioc,
-                          off_t *size, Error **errp)
+                          QIOChannel **outioc, NBDExportInfo *info,
+                          Error **errp)
 {
     char buf[256];
     uint64_t magic, s;
@@ -425,6 +597,8 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
     if (outioc) {
         *outioc = NULL;
     }
+    info->structured_reply = false;
+    info->has_meta_context = false;
     if (tlscreds && !outioc) {
         error_setg(errp, "Output I/O channel required for TLS");
         goto fail;
@@ -515,6 +689,17 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
             if (nbd_receive_query_exports(ioc, name, errp) < 0) {
                 goto fail;
             }
+            if (info->request_structured) {
+                int ret = nbd_request_structured_reply(ioc, errp);
+                if (ret < 0) {
+                    goto fail;
+                }
+                info->structured_reply = ret;
+            }
+            if (info->structured_reply && info->meta_context &&
+                nbd_request_meta_context(ioc, name, info, errp) < 0) {
+                goto fail;
+            }
         }
         /* write the export name */
         magic = cpu_to_be64(magic);
@@ -542,13 +727,14 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
             error_setg(errp, "Failed to read export length");
             goto fail;
         }
-        *size = be64_to_cpu(s);
+        info->size = be64_to_cpu(s);
 
-        if (read_sync(ioc, flags, sizeof(*flags)) != sizeof(*flags)) {
+        if (read_sync(ioc, &info->flags, sizeof(info->flags)) !=
+            sizeof(info->flags)) {
             error_setg(errp, "Failed to read export flags");
             goto fail;
         }
-        be16_to_cpus(flags);
+        be16_to_cpus(&info->flags);
     } else if (magic == NBD_CLIENT_MAGIC) {
         uint32_t oldflags;
 
@@ -565,8 +751,8 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
             error_setg(errp, "Failed to read export length");
             goto fail;
         }
-        *size = be64_to_cpu(s);
-        TRACE("Size is %" PRIu64, *size);
+        info->size = be64_to_cpu(s);
+        TRACE("Size is %" PRIu64, (uint64_t)info->size);
 
         if (read_sync(ioc, &oldflags, sizeof(oldflags)) != sizeof(oldflags)) {
             error_setg(errp, "Failed to read export flags");
@@ -577,13 +763,14 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name, uint16_t *flags,
             error_setg(errp, "Unexpected export flags %0x" PRIx32, oldflags);
             goto fail;
         }
-        *flags = oldflags;
+        info->flags = oldflags;
     } else {
         error_setg(errp, "Bad magic received");
         goto fail;
     }
 
-    TRACE("Size is %" PRIu64 ", export flags %" PRIx16, *size, *flags);
+    TRACE("Size is %" PRIu64 ", export flags %" PRIx16,
+          (uint64_t)info->size, info->flags);
     if (read_sync(ioc, &buf, 124) != 124) {
         error_setg(errp, "Failed to read reserved block");
         goto fail;
@@ -736,16 +923,16 @@ ssize_t nbd_send_request(QIOChannel *ioc, struct nbd_request *request)
 
 ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
     uint32_t magic;
     ssize_t ret;
 
-    ret = read_sync(ioc, buf, sizeof(buf));
+    ret = read_sync(ioc, buf, NBD_REPLY_SIZE);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret != sizeof(buf)) {
+    if (ret != NBD_REPLY_SIZE) {
         LOG("read failed");
         return -EINVAL;
     }
@@ -757,9 +944,44 @@ ssize_t nbd_receive_reply(QIOChannel *ioc, struct nbd_reply *reply)
      */
 
     magic = ldl_be_p(buf);
+    reply->structured = false;
     reply->error  = ldl_be_p(buf + 4);
     reply->handle = ldq_be_p(buf + 8);
 
+    if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+        /* Structured reply chunk
+           [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+           [ 4 ..  5]    flags
+           [ 6 ..  7]    type
+           [ 8 .. 15]    handle
+           [16 .. 19]    length of the payload
+         */
+        do {
+            /* Part of the header has already been consumed, so wait
+             * for the rest rather than returning -EAGAIN.  */
+            ret = read_sync(ioc, buf + NBD_REPLY_SIZE,
+                            NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE);
+            if (ret == -EAGAIN) {
+                qio_channel_wait(ioc, G_IO_IN);
+            }
+        } while (ret == -EAGAIN);
+        if (ret != NBD_STRUCTURED_REPLY_SIZE - NBD_REPLY_SIZE) {
+            LOG("read failed");
+            return -EINVAL;
+        }
+
+        reply->structured = true;
+        reply->error  = 0;
+        reply->flags  = lduw_be_p(buf + 4);
+        reply->type   = lduw_be_p(buf + 6);
+        reply->length = ldl_be_p(buf + 16);
+
+        TRACE("Got chunk: { .flags = %" PRIx16 ", .type = %" PRIu16
+              ", handle = %" PRIu64 ", .length = %" PRIu32 " }",
+              reply->flags, reply->type, reply->handle, reply->length);
+        return 0;
+    }
+
     reply->error = nbd_errno_to_system_errno(reply->error);
 
     TRACE("Got reply: { magic = 0x%" PRIx32 ", .error = % " PRId32
@@ -18,6 +18,7 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "block/dirty-bitmap.h"
 #include "nbd-internal.h"
 
 static int system_errno_to_nbd_errno(int err)
@@ -71,10 +72,30 @@ struct NBDExport {
 
     BlockBackend *eject_notifier_blk;
     Notifier eject_notifier;
+
+    char *bitmap;               /* Dirty bitmap exposed to clients, if any */
+    char *bitmap_ctx;           /* Metadata context name of that bitmap */
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
 
+/* Metadata context ids, as announced in NBD_REP_META_CONTEXT */
+#define NBD_META_ID_BASE_ALLOCATION 0
+#define NBD_META_ID_DIRTY_BITMAP    1
+
+/* Largest NBD_OPT_{LIST,SET}_META_CONTEXT payload that we accept */
+#define NBD_MAX_META_OPTION_SIZE    65536
+
+/* Maximum number of extents in one NBD_REPLY_TYPE_BLOCK_STATUS chunk */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS 8192
+
+typedef struct NBDExportMetaContexts {
+    NBDExport *exp;             /* Export the contexts were selected for */
+    bool valid;                 /* NBD_OPT_SET_META_CONTEXT succeeded */
+    bool base_allocation;       /* NBD_META_BASE_ALLOCATION */
+    bool bitmap;                /* The export's dirty bitmap */
+} NBDExportMetaContexts;
+
 struct NBDClient {
     int refcount;
     void (*close)(NBDClient *client);
@@ -91,6 +112,8 @@ struct NBDClient {
     Coroutine *send_coroutine;
 
     bool can_read;
+    bool structured_reply;
+    NBDExportMetaContexts meta;
 
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
@@ -193,12 +216,13 @@ static ssize_t nbd_negotiate_drop_sync(QIOChannel *ioc, size_t size)
 
 */
 
-static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
+static int nbd_negotiate_send_rep_len(QIOChannel *ioc, uint32_t type,
+                                      uint32_t opt, uint32_t len)
 {
     uint64_t magic;
-    uint32_t len;
 
-    TRACE("Reply opt=%" PRIx32 " type=%" PRIx32, type, opt);
+    TRACE("Reply opt=%" PRIx32 " type=%" PRIx32 " len=%" PRIu32,
+          type, opt, len);
 
     magic = cpu_to_be64(NBD_REP_MAGIC);
     if (nbd_negotiate_write(ioc, &magic, sizeof(magic)) != sizeof(magic)) {
@@ -215,7 +239,7 @@ static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
         LOG("write failed (rep type)");
         return -EINVAL;
     }
-    len = cpu_to_be32(0);
+    len = cpu_to_be32(len);
     if (nbd_negotiate_write(ioc, &len, sizeof(len)) != sizeof(len)) {
         LOG("write failed (rep data length)");
         return -EINVAL;
@@ -223,6 +247,11 @@ static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
     return 0;
 }
 
+static int nbd_negotiate_send_rep(QIOChannel *ioc, uint32_t type, uint32_t opt)
+{
+    return nbd_negotiate_send_rep_len(ioc, type, opt, 0);
+}
+
 static int nbd_negotiate_send_rep_list(QIOChannel *ioc, NBDExport *exp)
 {
     uint64_t magic, name_len;
@@ -313,12 +342,185 @@ static int nbd_negotiate_handle_export_name(NBDClient *client, uint32_t length)
 
     QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
     nbd_export_get(client->exp);
+
+    /* Metadata contexts only apply to the export they were selected for */
+    if (client->meta.exp != client->exp) {
+        memset(&client->meta, 0, sizeof(client->meta));
+    }
     rc = 0;
 fail:
     return rc;
 }
 
 
+static int nbd_negotiate_handle_structured_reply(NBDClient *client,
+                                                 uint32_t length)
+{
+    TRACE("Enabling structured replies");
+    if (length) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID,
+                                      NBD_OPT_STRUCTURED_REPLY);
+    }
+
+    client->structured_reply = true;
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK,
+                                  NBD_OPT_STRUCTURED_REPLY);
+}
+
+/* With NBD_OPT_LIST_META_CONTEXT, a query may also name a whole namespace
+ * or a leading part of a context name, up to and including a colon.  */
+static bool nbd_meta_query_matches(const uint8_t *query, uint32_t len,
+                                   const char *context, bool list)
+{
+    size_t context_len = strlen(context);
+
+    if (len == context_len) {
+        return !memcmp(query, context, len);
+    }
+    return list && len > 0 && len < context_len && query[len - 1] == ':' &&
+           !memcmp(query, context, len);
+}
+
+static int nbd_negotiate_send_meta_context(NBDClient *client, uint32_t opt,
+                                           uint32_t id, const char *name)
+{
+    uint32_t len = strlen(name);
+    int ret;
+
+    TRACE("Announcing metadata context %" PRIu32 " '%s'", id, name);
+    ret = nbd_negotiate_send_rep_len(client->ioc, NBD_REP_META_CONTEXT, opt,
+                                     sizeof(id) + len);
+    if (ret < 0) {
+        return ret;
+    }
+
+    id = cpu_to_be32(id);
+    if (nbd_negotiate_write(client->ioc, &id, sizeof(id)) != sizeof(id) ||
+        nbd_negotiate_write(client->ioc, (char *)name, len) != len) {
+        LOG("write failed (meta context)");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int nbd_negotiate_meta_contexts(NBDClient *client, uint32_t opt,
+                                       uint32_t length)
+{
+    NBDExportMetaContexts meta = { 0 };
+    bool list = opt == NBD_OPT_LIST_META_CONTEXT;
+    char name[NBD_MAX_NAME_SIZE + 1];
+    uint32_t namelen, nb_queries, i;
+    uint8_t *buf, *p, *end;
+    int ret;
+
+    /* Client sends:
+        [ 0 ..   3]   export name length
+        [ 4 ..  xx]   export name
+        [xx .. +3 ]   number of queries
+        followed by, for each query:
+        [ 0 ..   3]   query length
+        [ 4 ..  xx]   query
+     */
+    if (!list) {
+        /* A new selection replaces the previous one, even if it fails */
+        memset(&client->meta, 0, sizeof(client->meta));
+    }
+    if ((!list && !client->structured_reply) ||
+        length < 8 || length > NBD_MAX_META_OPTION_SIZE) {
+        if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID, opt);
+    }
+
+    buf = g_malloc(length);
+    if (nbd_negotiate_read(client->ioc, buf, length) != length) {
+        LOG("read failed");
+        g_free(buf);
+        return -EIO;
+    }
+    p = buf;
+    end = buf + length;
+
+    namelen = ldl_be_p(p);
+    p += 4;
+    if (namelen > NBD_MAX_NAME_SIZE || namelen > end - p - 4) {
+        goto invalid;
+    }
+    memcpy(name, p, namelen);
+    name[namelen] = '\0';
+    p += namelen;
+    nb_queries = ldl_be_p(p);
+    p += 4;
+
+    meta.exp = nbd_export_find(name);
+    if (!meta.exp) {
+        TRACE("export '%s' not found", name);
+        g_free(buf);
+        return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_UNKNOWN, opt);
+    }
+
+    if (list && nb_queries == 0) {
+        meta.base_allocation = true;
+        meta.bitmap = meta.exp->bitmap != NULL;
+    }
+    for (i = 0; i < nb_queries; i++) {
+        uint32_t len;
+
+        if (end - p < 4) {
+            goto invalid;
+        }
+        len = ldl_be_p(p);
+        p += 4;
+        if (len > end - p) {
+            goto invalid;
+        }
+
+        if (nbd_meta_query_matches(p, len, NBD_META_BASE_ALLOCATION, list)) {
+            meta.base_allocation = true;
+        }
+        if (meta.exp->bitmap_ctx &&
+            nbd_meta_query_matches(p, len, meta.exp->bitmap_ctx, list)) {
+            meta.bitmap = true;
+        }
+        p += len;
+    }
+    if (p != end) {
+        goto invalid;
+    }
+    g_free(buf);
+
+    if (meta.base_allocation) {
+        ret = nbd_negotiate_send_meta_context(client, opt,
+                                              NBD_META_ID_BASE_ALLOCATION,
+                                              NBD_META_BASE_ALLOCATION);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (meta.bitmap) {
+        ret = nbd_negotiate_send_meta_context(client, opt,
+                                              NBD_META_ID_DIRTY_BITMAP,
+                                              meta.exp->bitmap_ctx);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (!list) {
+        meta.valid = meta.base_allocation || meta.bitmap;
+        client->meta = meta;
+    }
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK, opt);
+
+invalid:
+    g_free(buf);
+    return nbd_negotiate_send_rep(client->ioc, NBD_REP_ERR_INVALID, opt);
+}
+
 static QIOChannel *nbd_negotiate_handle_starttls(NBDClient *client,
                                                  uint32_t length)
 {
@@ -506,6 +708,22 @@ static int nbd_negotiate_options(NBDClient *client)
                     return ret;
                 }
                 break;
+
+            case NBD_OPT_STRUCTURED_REPLY:
+                ret = nbd_negotiate_handle_structured_reply(client, length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
+            case NBD_OPT_LIST_META_CONTEXT:
+            case NBD_OPT_SET_META_CONTEXT:
+                ret = nbd_negotiate_meta_contexts(client, clientflags, length);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
             default:
                 TRACE("Unsupported option 0x%" PRIx32, clientflags);
                 if (nbd_negotiate_drop_sync(client->ioc, length) != length) {
@@ -545,8 +763,8 @@ static coroutine_fn int nbd_negotiate(NBDClientNewData *data)
     NBDClient *client = data->client;
     char buf[8 + 8 + 8 + 128];
     int rc;
-    const uint16_t myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
-                              NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
+    uint16_t myflags = (NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_TRIM |
+                        NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA);
     bool oldStyle;
 
     /* Old style negotiation header without options
@@ -605,6 +823,9 @@ static coroutine_fn int nbd_negotiate(NBDClientNewData *data)
             LOG("option negotiation failed");
             goto fail;
         }
+        if (client->structured_reply) {
+            myflags |= NBD_FLAG_SEND_DF;
+        }
 
         TRACE("advertising size %" PRIu64 " and flags %x",
               client->exp->size, client->exp->nbdflags | myflags);
@@ -664,11 +885,8 @@ static ssize_t nbd_receive_request(QIOChannel *ioc, struct nbd_request *request)
     return 0;
 }
 
-static ssize_t nbd_send_reply(QIOChannel *ioc, struct nbd_reply *reply)
+static void set_be_simple_reply(uint8_t *buf, struct nbd_reply *reply)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
-    ssize_t ret;
-
     reply->error = system_errno_to_nbd_errno(reply->error);
 
     TRACE("Sending response to client: { .error = %" PRId32
@@ -683,17 +901,27 @@ static ssize_t nbd_send_reply(QIOChannel *ioc, struct nbd_reply *reply)
     stl_be_p(buf, NBD_REPLY_MAGIC);
     stl_be_p(buf + 4, reply->error);
     stq_be_p(buf + 8, reply->handle);
+}
 
-    ret = write_sync(ioc, buf, sizeof(buf));
-    if (ret < 0) {
-        return ret;
-    }
-
-    if (ret != sizeof(buf)) {
-        LOG("writing to socket failed");
-        return -EINVAL;
-    }
-    return 0;
+static void set_be_chunk(uint8_t *buf, uint16_t flags, uint16_t type,
+                         uint64_t handle, uint32_t length)
+{
+    TRACE("Sending chunk to client: { .flags = %" PRIx16 ", .type = %" PRIu16
+          ", handle = %" PRIu64 ", .length = %" PRIu32 " }",
+          flags, type, handle, length);
+
+    /* Structured reply chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags   (NBD_REPLY_FLAG_DONE for the last chunk)
+       [ 6 ..  7]    type    (NBD_REPLY_TYPE_*)
+       [ 8 .. 15]    handle
+       [16 .. 19]    length of the payload that follows
+     */
+    stl_be_p(buf, NBD_STRUCTURED_REPLY_MAGIC);
+    stw_be_p(buf + 4, flags);
+    stw_be_p(buf + 6, type);
+    stq_be_p(buf + 8, handle);
+    stl_be_p(buf + 16, length);
 }
 
 #define MAX_NBD_REQUESTS 16
@@ -811,10 +1039,17 @@ static void nbd_eject_notifier(Notifier *n, void *data)
 NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset, off_t size,
                           uint16_t nbdflags, void (*close)(NBDExport *),
                           bool writethrough, BlockBackend *on_eject_blk,
-                          Error **errp)
+                          const char *bitmap, Error **errp)
 {
     BlockBackend *blk;
-    NBDExport *exp = g_malloc0(sizeof(NBDExport));
+    NBDExport *exp;
+
+    if (bitmap && !bdrv_find_dirty_bitmap(bs, bitmap)) {
+        error_setg(errp, "Bitmap '%s' not found", bitmap);
+        return NULL;
+    }
+
+    exp = g_malloc0(sizeof(NBDExport));
 
     blk = blk_new();
     blk_insert_bs(blk, bs);
@@ -833,6 +1068,12 @@ NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset, off_t size,
     }
     exp->size -= exp->size % BDRV_SECTOR_SIZE;
 
+    if (bitmap) {
+        exp->bitmap = g_strdup(bitmap);
+        exp->bitmap_ctx = g_strdup_printf(NBD_META_QEMU_DIRTY_BITMAP "%s",
+                                          bitmap);
+    }
+
     exp->close = close;
     exp->ctx = blk_get_aio_context(blk);
     blk_add_aio_context_notifier(blk, blk_aio_attached, blk_aio_detach, exp);
@@ -936,6 +1177,8 @@ void nbd_export_put(NBDExport *exp)
             exp->blk = NULL;
         }
 
+        g_free(exp->bitmap);
+        g_free(exp->bitmap_ctx);
         g_free(exp);
     }
 }
@@ -954,35 +1197,405 @@ void nbd_export_close_all(void)
     }
 }
 
-static ssize_t nbd_co_send_reply(NBDRequest *req, struct nbd_reply *reply,
-                                 int len)
+/* Send a reply header together with its payload.  Everything goes out
+ * in a single vectored write, straight from the request buffer, so there
+ * is no need to cork the channel or to copy the data anywhere else.
+ */
+static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
+                                        unsigned niov)
 {
-    NBDClient *client = req->client;
-    ssize_t rc, ret;
+    size_t len = iov_size(iov, niov);
+    ssize_t ret;
 
     g_assert(qemu_in_coroutine());
     qemu_co_mutex_lock(&client->send_lock);
     client->send_coroutine = qemu_coroutine_self();
     nbd_set_handlers(client);
 
-    if (!len) {
-        rc = nbd_send_reply(client->ioc, reply);
-    } else {
-        qio_channel_set_cork(client->ioc, true);
-        rc = nbd_send_reply(client->ioc, reply);
-        if (rc >= 0) {
-            ret = write_sync(client->ioc, req->data, len);
-            if (ret != len) {
-                rc = -EIO;
-            }
-        }
-        qio_channel_set_cork(client->ioc, false);
-    }
+    ret = nbd_wr_syncv(client->ioc, iov, niov, len, false);
 
     client->send_coroutine = NULL;
     nbd_set_handlers(client);
     qemu_co_mutex_unlock(&client->send_lock);
-    return rc;
+
+    if (ret != len) {
+        LOG("writing to socket failed");
+        return -EIO;
+    }
+    return 0;
+}
+
+static int coroutine_fn nbd_co_send_reply(NBDRequest *req,
+                                          struct nbd_reply *reply, int len)
+{
+    uint8_t buf[NBD_REPLY_SIZE];
+    struct iovec iov[] = {
+        { .iov_base = buf, .iov_len = sizeof(buf) },
+        { .iov_base = req->data, .iov_len = len },
+    };
+
+    set_be_simple_reply(buf, reply);
+    return nbd_co_send_iov(req->client, iov, len ? 2 : 1);
+}
+
+static int coroutine_fn nbd_co_send_structured_done(NBDClient *client,
+                                                    uint64_t handle)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+
+    set_be_chunk(buf, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE, handle, 0);
+    return nbd_co_send_iov(client, &iov, 1);
+}
+
+static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
+                                                     uint64_t handle,
+                                                     int error)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE + 4 + 2];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+
+    /* Error chunk payload
+       [ 0 ..  3]    error
+       [ 4 ..  5]    message length (we never send a message)
+     */
+    assert(error);
+    set_be_chunk(buf, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR, handle, 6);
+    stl_be_p(buf + NBD_STRUCTURED_REPLY_SIZE,
+             system_errno_to_nbd_errno(error));
+    stw_be_p(buf + NBD_STRUCTURED_REPLY_SIZE + 4, 0);
+    return nbd_co_send_iov(client, &iov, 1);
+}
+
+/* Append an extent, merging it into the previous one if the flags match.
+ * Return false if there is no room left.
+ */
+static bool nbd_extent_add(NBDExtent *extents, unsigned *nb_extents,
+                           unsigned max_extents, uint32_t length,
+                           uint32_t flags)
+{
+    if (*nb_extents && extents[*nb_extents - 1].flags == flags) {
+        extents[*nb_extents - 1].length += length;
+        return true;
+    }
+    if (*nb_extents == max_extents) {
+        return false;
+    }
+    extents[(*nb_extents)++] = (NBDExtent) {
+        .length = length,
+        .flags = flags,
+    };
+    return true;
+}
+
+/* Describe the allocation status of @length bytes at @offset in @extents.
+ * Return the number of extents, or a negative errno.  The extents may
+ * cover less than @length bytes if @max_extents is not enough.
+ */
+static int coroutine_fn nbd_co_allocation_extents(NBDExport *exp,
+                                                  uint64_t offset,
+                                                  uint32_t length,
+                                                  NBDExtent *extents,
+                                                  unsigned max_extents)
+{
+    BlockDriverState *bs = blk_bs(exp->blk);
+    uint64_t start = offset + exp->dev_offset;
+    uint64_t end = start + length;
+    uint64_t pos = start;
+    unsigned nb_extents = 0;
+
+    if (!bs) {
+        return -ENOMEDIUM;
+    }
+
+    while (pos < end) {
+        int64_t sector_num = pos >> BDRV_SECTOR_BITS;
+        int nb_sectors = DIV_ROUND_UP(end, BDRV_SECTOR_SIZE) - sector_num;
+        BlockDriverState *file;
+        uint64_t next;
+        uint32_t flags;
+        int64_t ret;
+        int pnum;
+
+        ret = bdrv_get_block_status_above(bs, NULL, sector_num, nb_sectors,
+                                          &pnum, &file);
+        if (ret < 0) {
+            return ret;
+        }
+        if (pnum == 0) {
+            ret = BDRV_BLOCK_ALLOCATED | BDRV_BLOCK_DATA;
+            pnum = nb_sectors;
+        }
+
+        flags = (ret & BDRV_BLOCK_ALLOCATED ? 0 : NBD_STATE_HOLE) |
+                (ret & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+        next = MIN(end, (uint64_t)(sector_num + pnum) << BDRV_SECTOR_BITS);
+        if (!nbd_extent_add(extents, &nb_extents, max_extents,
+                            next - pos, flags)) {
+            break;
+        }
+        pos = next;
+    }
+
+    return nb_extents;
+}
+
+/* Like nbd_co_allocation_extents(), but for the export's dirty bitmap */
+static int nbd_dirty_bitmap_extents(NBDExport *exp, uint64_t offset,
+                                    uint32_t length, NBDExtent *extents,
+                                    unsigned max_extents)
+{
+    BlockDriverState *bs = blk_bs(exp->blk);
+    BdrvDirtyBitmap *bitmap;
+    uint64_t start = offset + exp->dev_offset;
+    uint64_t end = start + length;
+    uint64_t pos = start;
+    unsigned nb_extents = 0;
+
+    /* Look the bitmap up by name every time, it may have been removed */
+    bitmap = bs ? bdrv_find_dirty_bitmap(bs, exp->bitmap) : NULL;
+    if (!bitmap) {
+        return -ENOENT;
+    }
+
+    while (pos < end) {
+        int64_t sector_num = pos >> BDRV_SECTOR_BITS;
+        int64_t nb_sectors = DIV_ROUND_UP(end, BDRV_SECTOR_SIZE) - sector_num;
+        uint64_t next;
+        int64_t n;
+        bool dirty;
+
+        n = bdrv_dirty_bitmap_extent(bitmap, sector_num, nb_sectors, &dirty);
+        next = MIN(end, (uint64_t)(sector_num + n) << BDRV_SECTOR_BITS);
+        if (!nbd_extent_add(extents, &nb_extents, max_extents,
+                            next - pos, dirty ? NBD_STATE_DIRTY : 0)) {
+            break;
+        }
+        pos = next;
+    }
+
+    return nb_extents;
+}
+
+static int coroutine_fn nbd_co_send_extents(NBDClient *client,
+                                            uint64_t handle,
+                                            uint32_t context_id,
+                                            NBDExtent *extents,
+                                            unsigned nb_extents, bool last)
+{
+    uint8_t buf[NBD_STRUCTURED_REPLY_SIZE + 4];
+    struct iovec iov[] = {
+        { .iov_base = buf, .iov_len = sizeof(buf) },
+        { .iov_base = extents, .iov_len = nb_extents * sizeof(extents[0]) },
+    };
+    unsigned i;
+
+    /* Block status chunk payload
+       [ 0 ..  3]    metadata context id
+       followed by, for each extent:
+       [ 0 ..  3]    length
+       [ 4 ..  7]    flags
+     */
+    for (i = 0; i < nb_extents; i++) {
+        extents[i].length = cpu_to_be32(extents[i].length);
+        extents[i].flags = cpu_to_be32(extents[i].flags);
+    }
+    set_be_chunk(buf, last ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_BLOCK_STATUS, handle, 4 + iov[1].iov_len);
+    stl_be_p(buf + NBD_STRUCTURED_REPLY_SIZE, context_id);
+    return nbd_co_send_iov(client, iov, 2);
+}
+
+/* Answer NBD_CMD_BLOCK_STATUS with one chunk for each selected metadata
+ * context.  As for reads, a negative return value means that the
+ * connection must be dropped.
+ */
+static int coroutine_fn nbd_co_send_block_status(NBDClient *client,
+                                                 struct nbd_request *request)
+{
+    NBDExport *exp = client->exp;
+    unsigned max_extents = request->type & NBD_CMD_FLAG_REQ_ONE ?
+                           1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+    NBDExtent *extents = g_new(NBDExtent, max_extents);
+    int ret = 0;
+
+    if (client->meta.base_allocation) {
+        ret = nbd_co_allocation_extents(exp, request->from, request->len,
+                                        extents, max_extents);
+        if (ret < 0) {
+            LOG("block status failed");
+            ret = nbd_co_send_structured_error(client, request->handle, -ret);
+            goto out;
+        }
+        ret = nbd_co_send_extents(client, request->handle,
+                                  NBD_META_ID_BASE_ALLOCATION, extents, ret,
+                                  !client->meta.bitmap);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    if (client->meta.bitmap) {
+        ret = nbd_dirty_bitmap_extents(exp, request->from, request->len,
+                                       extents, max_extents);
+        if (ret < 0) {
+            LOG("dirty bitmap '%s' not found", exp->bitmap);
+            ret = nbd_co_send_structured_error(client, request->handle, -ret);
+            goto out;
+        }
+        ret = nbd_co_send_extents(client, request->handle,
+                                  NBD_META_ID_DIRTY_BITMAP, extents, ret,
+                                  true);
+    }
+
+out:
+    g_free(extents);
+    return ret;
+}
+
+static int coroutine_fn nbd_co_read(NBDExport *exp, uint64_t offset,
+                                    uint8_t *buf, uint32_t len)
+{
+    QEMUIOVector qiov;
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    return blk_co_preadv(exp->blk, offset + exp->dev_offset, len, &qiov, 0);
+}
+
+/* Return the number of bytes, starting at @offset and at most @bytes, that
+ * all read either as zeroes or as data, and set *@zero accordingly.
+ * Returns a negative errno on failure.
+ */
+static int64_t coroutine_fn nbd_co_extent(NBDExport *exp, uint64_t offset,
+                                          uint64_t bytes, bool *zero)
+{
+    BlockDriverState *bs = blk_bs(exp->blk);
+    uint64_t start = offset + exp->dev_offset;
+    uint64_t end = start + bytes;
+    uint64_t pos = start;
+
+    *zero = false;
+    if (!bs) {
+        return -ENOMEDIUM;
+    }
+
+    while (pos < end) {
+        int64_t sector_num = pos >> BDRV_SECTOR_BITS;
+        int nb_sectors = DIV_ROUND_UP(end, BDRV_SECTOR_SIZE) - sector_num;
+        BlockDriverState *file;
+        int64_t ret;
+        bool is_zero;
+        int pnum;
+
+        ret = bdrv_get_block_status_above(bs, NULL, sector_num, nb_sectors,
+                                          &pnum, &file);
+        if (ret < 0) {
+            return ret;
+        }
+        if (pnum == 0) {
+            /* Past the end of the image; let the read sort it out */
+            ret = 0;
+            pnum = nb_sectors;
+        }
+
+        is_zero = ret & BDRV_BLOCK_ZERO;
+        if (pos == start) {
+            *zero = is_zero;
+        } else if (is_zero != *zero) {
+            break;
+        }
+        pos = MIN(end, (uint64_t)(sector_num + pnum) << BDRV_SECTOR_BITS);
+    }
+
+    return pos - start;
+}
+
+/* Answer NBD_CMD_READ with structured reply chunks.  Ranges that read as
+ * zeroes are sent as NBD_REPLY_TYPE_OFFSET_HOLE chunks, which carry no
+ * payload, and only the remaining ranges are read from the export and
+ * sent as NBD_REPLY_TYPE_OFFSET_DATA.  With NBD_CMD_FLAG_DF the whole
+ * range goes out as a single data chunk.
+ *
+ * I/O errors are reported to the client as an error chunk; a negative
+ * return value means the reply could not be sent and the connection must
+ * be dropped.
+ */
+static int coroutine_fn nbd_co_send_sparse_read(NBDRequest *req,
+                                                struct nbd_request *request)
+{
+    NBDClient *client = req->client;
+    NBDExport *exp = client->exp;
+    uint64_t progress = 0;
+
+    if (request->len == 0) {
+        return nbd_co_send_structured_done(client, request->handle);
+    }
+
+    while (progress < request->len) {
+        uint8_t buf[NBD_STRUCTURED_REPLY_SIZE + 8 + 4];
+        uint64_t offset = request->from + progress;
+        uint32_t remaining = request->len - progress;
+        struct iovec iov[2];
+        uint16_t flags;
+        int64_t n;
+        bool zero;
+        int ret;
+
+        if (request->type & NBD_CMD_FLAG_DF) {
+            n = remaining;
+            zero = false;
+        } else {
+            n = nbd_co_extent(exp, offset, remaining, &zero);
+            if (n < 0) {
+                LOG("block status failed");
+                return nbd_co_send_structured_error(client, request->handle,
+                                                    -n);
+            }
+        }
+
+        flags = n == remaining ? NBD_REPLY_FLAG_DONE : 0;
+        iov[0].iov_base = buf;
+
+        if (zero) {
+            /* Hole chunk payload
+               [ 0 ..  7]    offset
+               [ 8 .. 11]    hole size
+             */
+            set_be_chunk(buf, flags, NBD_REPLY_TYPE_OFFSET_HOLE,
+                         request->handle, 8 + 4);
+            stq_be_p(buf + NBD_STRUCTURED_REPLY_SIZE, offset);
+            stl_be_p(buf + NBD_STRUCTURED_REPLY_SIZE + 8, n);
+            iov[0].iov_len = NBD_STRUCTURED_REPLY_SIZE + 8 + 4;
+            ret = nbd_co_send_iov(client, iov, 1);
+        } else {
+            ret = nbd_co_read(exp, offset, req->data + progress, n);
+            if (ret < 0) {
+                LOG("reading from file failed");
+                return nbd_co_send_structured_error(client, request->handle,
+                                                    -ret);
+            }
+
+            /* Data chunk payload
+               [ 0 ..  7]    offset
+               [ 8 ..  n]    data
+             */
+            set_be_chunk(buf, flags, NBD_REPLY_TYPE_OFFSET_DATA,
+                         request->handle, 8 + n);
+            stq_be_p(buf + NBD_STRUCTURED_REPLY_SIZE, offset);
+            iov[0].iov_len = NBD_STRUCTURED_REPLY_SIZE + 8;
+            iov[1].iov_base = req->data + progress;
+            iov[1].iov_len = n;
+            ret = nbd_co_send_iov(client, iov, 2);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        progress += n;
+    }
+
+    return 0;
 }
 
 /* Collect a client request.  Return 0 if request looks valid, -EAGAIN
@@ -994,7 +1607,7 @@ static ssize_t nbd_co_receive_request(NBDRequest *req,
                                       struct nbd_request *request)
 {
     NBDClient *client = req->client;
-    uint32_t command;
+    uint32_t command, valid_flags;
     ssize_t rc;
 
     g_assert(qemu_in_coroutine());
@@ -1067,7 +1680,14 @@ static ssize_t nbd_co_receive_request(NBDRequest *req,
         rc = command == NBD_CMD_WRITE ? -ENOSPC : -EINVAL;
         goto out;
     }
-    if (request->type & ~NBD_CMD_MASK_COMMAND & ~NBD_CMD_FLAG_FUA) {
+    valid_flags = NBD_CMD_FLAG_FUA;
+    if (command == NBD_CMD_READ && client->structured_reply) {
+        valid_flags |= NBD_CMD_FLAG_DF;
+    }
+    if (command == NBD_CMD_BLOCK_STATUS) {
+        valid_flags |= NBD_CMD_FLAG_REQ_ONE;
+    }
+    if (request->type & ~NBD_CMD_MASK_COMMAND & ~valid_flags) {
         LOG("unsupported flags (got 0x%x)",
             request->type & ~NBD_CMD_MASK_COMMAND);
         rc = -EINVAL;
@@ -1090,6 +1710,8 @@ static void nbd_trip(void *opaque)
     NBDRequest *req;
     struct nbd_request request;
     struct nbd_reply reply;
+    QEMUIOVector qiov;
+    struct iovec iov;
     ssize_t ret;
     uint32_t command;
     int flags;
@@ -1138,8 +1760,14 @@ static void nbd_trip(void *opaque)
             }
         }
 
-        ret = blk_pread(exp->blk, request.from + exp->dev_offset,
-                        req->data, request.len);
+        if (client->structured_reply) {
+            if (nbd_co_send_sparse_read(req, &request) < 0) {
+                goto out;
+            }
+            break;
+        }
+
+        ret = nbd_co_read(exp, request.from, req->data, request.len);
         if (ret < 0) {
             LOG("reading from file failed");
             reply.error = -ret;
@@ -1165,8 +1793,11 @@ static void nbd_trip(void *opaque)
         if (request.type & NBD_CMD_FLAG_FUA) {
             flags |= BDRV_REQ_FUA;
         }
-        ret = blk_pwrite(exp->blk, request.from + exp->dev_offset,
-                         req->data, request.len, flags);
+        iov.iov_base = req->data;
+        iov.iov_len = request.len;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = blk_co_pwritev(exp->blk, request.from + exp->dev_offset,
+                             request.len, &qiov, flags);
         if (ret < 0) {
             LOG("writing to file failed");
             reply.error = -ret;
@@ -1206,6 +1837,16 @@ static void nbd_trip(void *opaque)
             goto out;
         }
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        TRACE("Request type is BLOCK_STATUS");
+        if (!client->meta.valid || request.len == 0) {
+            reply.error = EINVAL;
+            goto error_reply;
+        }
+        if (nbd_co_send_block_status(client, &request) < 0) {
+            goto out;
+        }
+        break;
     default:
         LOG("invalid request type (%" PRIu32 ") received", request.type);
         reply.error = EINVAL;
@@ -1213,7 +1854,15 @@ static void nbd_trip(void *opaque)
         /* We must disconnect after NBD_CMD_WRITE if we did not
          * read the payload.
          */
-        if (nbd_co_send_reply(req, &reply, 0) < 0 || !req->complete) {
+        if (client->structured_reply &&
+            ((request.type & NBD_CMD_MASK_COMMAND) == NBD_CMD_READ ||
+             (request.type & NBD_CMD_MASK_COMMAND) == NBD_CMD_BLOCK_STATUS)) {
+            ret = nbd_co_send_structured_error(client, request.handle,
+                                               reply.error);
+        } else {
+            ret = nbd_co_send_reply(req, &reply, 0);
+        }
+        if (ret < 0 || !req->complete) {
             goto out;
         }
         break;
@@ -1255,7 +1904,7 @@ static void nbd_set_handlers(NBDClient *client)
                            true,
                            client->can_read ? nbd_read : NULL,
                            client->send_coroutine ? nbd_restart_write : NULL,
-                           client);
+                           NULL, client);
     }
 }
 
@@ -1263,7 +1912,7 @@ static void nbd_unset_handlers(NBDClient *client)
 {
     if (client->exp && client->exp->ctx) {
         aio_set_fd_handler(client->exp->ctx, client->sioc->fd,
-                           true, NULL, NULL, NULL);
+                           true, NULL, NULL, NULL, NULL);
     }
 }
 
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -29,20 +29,38 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* number of entries a page can be stored in */
+#define CACHE_WAYS 8
+
+/* saturation value of the per-entry hit counter */
+#define CACHE_MAX_HITS 255
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
     uint8_t *it_data;
+    unsigned int it_hits;
 };
 
+/*
+ * Pages are hashed to a set of CACHE_WAYS consecutive entries and may live
+ * in any of them.  When a set is full, the victim is the entry with the
+ * fewest recent hits among those not touched during the last
+ * CACHED_PAGE_LIFETIME bitmap generations, so pages that keep being
+ * re-dirtied stay cached even when other pages collide with them.  The
+ * hit counter is halved for every generation the entry was not touched.
+ */
 struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    int64_t num_sets;
+    unsigned int ways;
+    PageCacheStats stats;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
@@ -71,6 +89,9 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->ways;
+    memset(&cache->stats, 0, sizeof(cache->stats));
 
     DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
 
@@ -87,6 +108,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
+        cache->page_cache[i].it_hits = 0;
     }
 
     return cache;
@@ -108,45 +130,96 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t addr)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    uint64_t page = addr / cache->page_size;
+    size_t set;
+
+    g_assert(cache);
+    g_assert(cache->page_cache);
+
+    /* fold in the high bits so that large strided guests spread out */
+    set = (page ^ (page >> ctz64(cache->num_sets | (1ULL << 32)))) &
+          (cache->num_sets - 1);
+
+    return &cache->page_cache[set * cache->ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set = cache_get_set(cache, addr);
+    unsigned int i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+/* Decay the hit count by one half per generation without a hit */
+static unsigned int cache_item_hits(const CacheItem *it, uint64_t current_age)
+{
+    uint64_t idle = current_age - it->it_age;
 
-    return &cache->page_cache[pos];
+    return idle >= 32 ? 0 : it->it_hits >> idle;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age)
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age)
 {
     CacheItem *it;
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
+        it->it_hits = MIN(cache_item_hits(it, current_age) + 1,
+                          CACHE_MAX_HITS);
         it->it_age = current_age;
+        cache->stats.hits++;
         return true;
     }
+    cache->stats.misses++;
     return false;
 }
 
+/* Pick the entry of addr's set that a new page for addr should go to, or
+ * NULL if every entry holds a page that is still fresh */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr,
+                                   uint64_t current_age)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *victim = NULL;
+    unsigned int i, hits, victim_hits = 0;
+
+    for (i = 0; i < cache->ways; i++) {
+        CacheItem *it = &set[i];
+
+        if (it->it_addr == addr || !it->it_data) {
+            return it;
+        }
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            /* the cache page is fresh, don't replace it */
+            continue;
+        }
+        hits = cache_item_hits(it, current_age);
+        if (!victim || hits < victim_hits ||
+            (hits == victim_hits && it->it_age < victim->it_age)) {
+            victim = it;
+            victim_hits = hits;
+        }
+    }
+    return victim;
+}
+
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
@@ -154,13 +227,11 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     CacheItem *it;
 
     /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
+    it = cache_get_victim(cache, addr, current_age);
+    if (!it) {
         return -1;
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -171,6 +242,13 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
         cache->num_items++;
     }
 
+    if (it->it_addr != addr) {
+        if (it->it_addr != -1) {
+            cache->stats.evictions++;
+        }
+        it->it_hits = 0;
+    }
+
     memcpy(it->it_data, pdata, cache->page_size);
 
     it->it_age = current_age;
@@ -179,6 +257,14 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     return 0;
 }
 
+void cache_get_stats(PageCache *cache, PageCacheStats *stats, bool reset)
+{
+    *stats = cache->stats;
+    if (reset) {
+        memset(&cache->stats, 0, sizeof(cache->stats));
+    }
+}
+
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
@@ -208,8 +294,21 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
+            /* take a free entry, or else replace the LRU page of the set
+             * if it is older than this one */
+            CacheItem *set = cache_get_set(new_cache, old_it->it_addr);
+            unsigned int j;
+
+            new_it = &set[0];
+            for (j = 0; j < new_cache->ways; j++) {
+                if (!set[j].it_data) {
+                    new_it = &set[j];
+                    break;
+                }
+                if (set[j].it_age < new_it->it_age) {
+                    new_it = &set[j];
+                }
+            }
             if (new_it->it_data && new_it->it_age >= old_it->it_age) {
                 /* keep the MRU page */
                 g_free(old_it->it_data);
@@ -221,6 +320,7 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
                 new_it->it_data = old_it->it_data;
                 new_it->it_age = old_it->it_age;
                 new_it->it_addr = old_it->it_addr;
+                new_it->it_hits = old_it->it_hits;
             }
         }
     }
@@ -229,6 +329,8 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
+    cache->num_sets = new_cache->num_sets;
+    cache->ways = new_cache->ways;
 
     g_free(new_cache);
 
@@ -1441,7 +1441,7 @@ EQMP
 
     {
         .name       = "block-dirty-bitmap-add",
-        .args_type  = "node:B,name:s,granularity:i?",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
         .mhandler.cmd_new = qmp_marshal_block_dirty_bitmap_add,
     },
 
@@ -1458,6 +1458,9 @@ Arguments:
 - "node": device/node on which to create dirty bitmap (json-string)
 - "name": name of the new dirty bitmap (json-string)
 - "granularity": granularity to track writes with (int, optional)
+- "persistent": bitmap will be saved to the corresponding block device image
+                file on its close (json-bool, optional, default false,
+                since 2.8)
 
 Example:
 
@@ -1480,7 +1483,8 @@ block-dirty-bitmap-remove
 Since 2.4
 
 Stop write tracking and remove the dirty bitmap that was created with
-block-dirty-bitmap-add.
+block-dirty-bitmap-add.  If the bitmap is persistent, it is removed from the
+image file as well.
 
 Arguments:
 
@@ -1674,7 +1678,7 @@ EQMP
         .args_type  = "job-id:s?,sync:s,device:B,target:s,speed:i?,mode:s?,"
                       "format:s?,node-name:s?,replaces:s?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "unmap:b?,"
+                      "unmap:b?,copy-mode:s?,"
                       "granularity:i?,buf-size:i?",
         .mhandler.cmd_new = qmp_marshal_drive_mirror,
     },
@@ -1719,6 +1723,8 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "unmap": whether the target sectors should be discarded where source has only
   zeroes. (json-bool, optional, default true)
+- "copy-mode": "write-blocking" to mirror guest writes synchronously once the
+  job is ready (MirrorCopyMode, optional, default 'background')
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -1740,7 +1746,7 @@ EQMP
         .name       = "blockdev-mirror",
         .args_type  = "job-id:s?,sync:s,device:B,target:B,replaces:s?,speed:i?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "granularity:i?,buf-size:i?",
+                      "granularity:i?,buf-size:i?,copy-mode:s?",
         .mhandler.cmd_new = qmp_marshal_blockdev_mirror,
     },
 
@@ -1773,6 +1779,8 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "on-target-error": the action to take on an error on the target
   (BlockdevOnError, default 'report')
+- "copy-mode": "write-blocking" to mirror guest writes synchronously once the
+  job is ready (MirrorCopyMode, optional, default 'background')
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -2082,7 +2090,7 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,bps_max_length:l?,bps_rd_max_length:l?,bps_wr_max_length:l?,iops_max_length:l?,iops_rd_max_length:l?,iops_wr_max_length:l?,iops_size:l?,group:s?",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,bps_max_length:l?,bps_rd_max_length:l?,bps_wr_max_length:l?,iops_max_length:l?,iops_rd_max_length:l?,iops_wr_max_length:l?,iops_size:l?,group:s?,group_weight:l?",
         .mhandler.cmd_new = qmp_marshal_block_set_io_throttle,
     },
 
@@ -2115,6 +2123,7 @@ Arguments:
 - "iops_wr_max_length": maximum length of the @iops_wr_max burst period, in seconds (json-int, optional)
 - "iops_size":  I/O size in bytes when limiting (json-int, optional)
 - "group": throttle group name (json-string, optional)
+- "group_weight": share of the throttle group (json-int, optional)
 
 Example:
 
@@ -2951,6 +2960,12 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum polling time in ns, 0 if disabled (json-int)
+- "poll-grow": polling time growth factor, 0 if default (json-int)
+- "poll-shrink": polling time shrink factor, 0 if default (json-int)
+
+The polling time adapts itself between 0 and poll-max-ns depending on how
+long the iothread usually waits for new events.
 
 Example:
 
@@ -2959,11 +2974,17 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0
          }
       ]
    }
@@ -3586,6 +3607,8 @@ The main json-object contains the following:
             but this way upper levels don't need to care about page
             size (json-int)
          - "dirty-sync-count": times that dirty ram was synchronized (json-int)
+         - "dirty-sync-time": time in microseconds that the last
+            synchronization of dirty ram took (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3602,6 +3625,17 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+         - "cache-hit": number of XBZRLE page cache hits
+         - "cache-evictions": number of pages evicted from the XBZRLE
+           page cache to make room for other pages
+- "postcopy-fault-latency": only present on the destination of a postcopy
+  migration once the guest faulted on pages still on the source.
+  It is a json-object with the following information:
+         - "faults": number of resolved faults (json-int)
+         - "average": average latency in microseconds (json-int)
+         - "max": highest latency in microseconds (json-int)
+         - "histogram": number of faults per power of two latency range
+           in microseconds, starting below 1 microsecond (json-array)
 
 Examples:
 
@@ -3707,7 +3741,9 @@ Examples:
             "pages":2444343,
             "cache-miss":2244,
             "cache-miss-rate":0.123,
-            "overflow":34434
+            "overflow":34434,
+            "cache-hit":2442099,
+            "cache-evictions":1022
          }
       }
    }
@@ -3733,6 +3769,7 @@ Enable/Disable migration capabilities
 - "compress": use multiple compression threads to accelerate live migration
 - "events": generate events for each migration state change
 - "postcopy-ram": postcopy mode for live migration
+- "x-multifd": send RAM pages over multiple connections
 
 Arguments:
 
@@ -3763,6 +3800,7 @@ Query current migration capabilities
          - "compress": Multiple compression threads state (json-bool)
          - "events": Migration state change event state (json-bool)
          - "postcopy-ram": postcopy ram state (json-bool)
+         - "x-multifd": multiple connections state (json-bool)
 
 Arguments:
 
@@ -3776,7 +3814,8 @@ Example:
      {"state": false, "capability": "zero-blocks"},
      {"state": false, "capability": "compress"},
      {"state": true, "capability": "events"},
-     {"state": false, "capability": "postcopy-ram"}
+     {"state": false, "capability": "postcopy-ram"},
+     {"state": false, "capability": "x-multifd"}
    ]}
 
 EQMP
@@ -3800,6 +3839,12 @@ Set migration parameters
                           throttled for auto-converge (json-int)
 - "cpu-throttle-increment": set throttle increasing percentage for
                             auto-converge (json-int)
+- "x-multifd-channels": set number of connections used by multifd
+                        migration (json-int)
+- "x-multifd-page-count": set number of pages sent in each multifd
+                          packet (json-int)
+- "postcopy-prefetch-window": set number of pages sent around each page
+                              requested during postcopy (json-int)
 
 Arguments:
 
@@ -3830,6 +3875,12 @@ Query current migration parameters
                                     throttled (json-int)
          - "cpu-throttle-increment" : throttle increasing percentage for
                                       auto-converge (json-int)
+         - "x-multifd-channels" : number of multifd connections (json-int)
+         - "x-multifd-page-count" : number of pages per multifd packet
+                                    (json-int)
+         - "postcopy-prefetch-window" : number of pages sent around each
+                                        page requested during postcopy
+                                        (json-int)
 
 Arguments:
 
@@ -3842,7 +3893,10 @@ Example:
          "cpu-throttle-increment": 10,
          "compress-threads": 8,
          "compress-level": 1,
-         "cpu-throttle-initial": 20
+         "cpu-throttle-initial": 20,
+         "x-multifd-channels": 2,
+         "x-multifd-page-count": 16,
+         "postcopy-prefetch-window": 64
       }
    }
 
@@ -3913,7 +3967,7 @@ EQMP
     },
     {
         .name       = "nbd-server-add",
-        .args_type  = "device:B,writable:b?",
+        .args_type  = "device:B,writable:b?,bitmap:s?",
         .mhandler.cmd_new = qmp_marshal_nbd_server_add,
     },
     {
@@ -31,6 +31,12 @@
 
 #define CPUArchState struct CPUARMState
 
+/* ARM processors have a weak memory model */
+#define TCG_GUEST_DEFAULT_MO      (0)
+
+/* Exclusive stores and SWP fall back to EXCP_ATOMIC under MTTCG */
+#define TARGET_SUPPORTS_MTTCG
+
 #include "qemu-common.h"
 #include "cpu-qom.h"
 #include "exec/cpu-defs.h"
@@ -22,6 +22,7 @@
 #include "internals.h"
 #include "exec/exec-all.h"
 #include "exec/cpu_ldst.h"
+#include "qemu/main-loop.h"
 
 #define SIGNBIT (uint32_t)0x80000000
 #define SIGNBIT64 ((uint64_t)1 << 63)
@@ -723,32 +724,65 @@ void HELPER(access_check_cp_reg)(CPUARMState *env, void *rip, uint32_t syndrome,
     raise_exception(env, EXCP_UDEF, syndrome, target_el);
 }
 
+/* ARM_CP_IO registers are backed by device state (timers, GIC) and
+ * must be accessed with the BQL held.  With MTTCG the vCPU does not
+ * hold it while executing guest code.
+ */
+static bool cp_reg_lock_iothread(const ARMCPRegInfo *ri)
+{
+    if ((ri->type & ARM_CP_IO) && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        return true;
+    }
+    return false;
+}
+
 void HELPER(set_cp_reg)(CPUARMState *env, void *rip, uint32_t value)
 {
     const ARMCPRegInfo *ri = rip;
+    bool locked = cp_reg_lock_iothread(ri);
 
     ri->writefn(env, ri, value);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 uint32_t HELPER(get_cp_reg)(CPUARMState *env, void *rip)
 {
     const ARMCPRegInfo *ri = rip;
+    bool locked = cp_reg_lock_iothread(ri);
+    uint32_t res;
 
-    return ri->readfn(env, ri);
+    res = ri->readfn(env, ri);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return res;
 }
 
 void HELPER(set_cp_reg64)(CPUARMState *env, void *rip, uint64_t value)
 {
     const ARMCPRegInfo *ri = rip;
+    bool locked = cp_reg_lock_iothread(ri);
 
     ri->writefn(env, ri, value);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 
 uint64_t HELPER(get_cp_reg64)(CPUARMState *env, void *rip)
 {
     const ARMCPRegInfo *ri = rip;
+    bool locked = cp_reg_lock_iothread(ri);
+    uint64_t res;
 
-    return ri->readfn(env, ri);
+    res = ri->readfn(env, ri);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return res;
 }
 
 void HELPER(msr_i_pstate)(CPUARMState *env, uint32_t op, uint32_t imm)
@@ -21,6 +21,7 @@
 #include "cpu.h"
 #include "exec/exec-all.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "qemu/log.h"
 #include "arm_ldst.h"
 #include "translate.h"
@@ -302,7 +303,7 @@ static inline void gen_goto_tb(DisasContext *s, int n, uint64_t dest)
         } else if (s->singlestep_enabled) {
             gen_exception_internal(EXCP_DEBUG);
         } else {
-            tcg_gen_exit_tb(0);
+            tcg_gen_lookup_and_goto_ptr();
             s->is_jmp = DISAS_TB_JUMP;
         }
     }
@@ -495,6 +496,23 @@ static inline int fp_reg_hi_offset(DisasContext *s, int regno)
     return offsetof(CPUARMState, vfp.regs[regno * 2 + 1]);
 }
 
+/* Offset of the whole of vector Qn, for use with the generic vector
+ * expanders in tcg-op-gvec.h.
+ */
+static inline int vec_full_reg_offset(DisasContext *s, int regno)
+{
+    assert_fp_access_checked(s);
+    return offsetof(CPUARMState, vfp.regs[regno * 2]);
+}
+
+/* Byte size of a vector register; non-quad gvec operations clear the
+ * bytes above the operation size up to this.
+ */
+static inline int vec_full_reg_size(DisasContext *s)
+{
+    return 16;
+}
+
 /* Convenience accessors for reading and writing single and double
  * FP registers. Writing clears the upper parts of the associated
  * 128 bit vector register, as required by the architecture.
@@ -1704,7 +1722,7 @@ static void disas_uncond_b_reg(DisasContext *s, uint32_t insn)
             return;
         }
         gen_helper_exception_return(cpu_env);
-        s->is_jmp = DISAS_JUMP;
+        s->is_jmp = DISAS_EXIT;
         return;
     case 5: /* DRPS */
         if (rn != 0x1f) {
@@ -1824,6 +1842,15 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     TCGv_i64 addr = tcg_temp_local_new_i64();
     TCGv_i64 tmp;
 
+    if (parallel_cpus) {
+        /* The sequence below is not atomic with respect to other vCPUs;
+         * redo the instruction with all of them stopped.
+         */
+        tcg_temp_free_i64(addr);
+        gen_helper_exit_atomic(cpu_env);
+        return;
+    }
+
     /* Copy input into a local temp so it is not trashed when the
      * basic block ends at the branch insn.
      */
@@ -8977,12 +9004,36 @@ static void disas_simd_3same_logic(DisasContext *s, uint32_t insn)
     bool is_u = extract32(insn, 29, 1);
     bool is_q = extract32(insn, 30, 1);
     TCGv_i64 tcg_op1, tcg_op2, tcg_res[2];
+    void (*gvec_op)(unsigned, uint32_t, uint32_t, uint32_t,
+                    uint32_t, uint32_t);
     int pass;
 
     if (!fp_access_check(s)) {
         return;
     }
 
+    switch (size + 4 * is_u) {
+    case 0: /* AND */
+        gvec_op = tcg_gen_gvec_and;
+        goto do_gvec;
+    case 1: /* BIC */
+        gvec_op = tcg_gen_gvec_andc;
+        goto do_gvec;
+    case 2: /* ORR */
+        gvec_op = tcg_gen_gvec_or;
+        goto do_gvec;
+    case 3: /* ORN */
+        gvec_op = tcg_gen_gvec_orc;
+        goto do_gvec;
+    case 4: /* EOR */
+        gvec_op = tcg_gen_gvec_xor;
+    do_gvec:
+        gvec_op(MO_64, vec_full_reg_offset(s, rd), vec_full_reg_offset(s, rn),
+                vec_full_reg_offset(s, rm), is_q ? 16 : 8,
+                vec_full_reg_size(s));
+        return;
+    }
+
     tcg_op1 = tcg_temp_new_i64();
     tcg_op2 = tcg_temp_new_i64();
     tcg_res[0] = tcg_temp_new_i64();
@@ -8992,47 +9043,25 @@ static void disas_simd_3same_logic(DisasContext *s, uint32_t insn)
         read_vec_element(s, tcg_op1, rn, pass, MO_64);
         read_vec_element(s, tcg_op2, rm, pass, MO_64);
 
-        if (!is_u) {
-            switch (size) {
-            case 0: /* AND */
-                tcg_gen_and_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            case 1: /* BIC */
-                tcg_gen_andc_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            case 2: /* ORR */
-                tcg_gen_or_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            case 3: /* ORN */
-                tcg_gen_orc_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            }
-        } else {
-            if (size != 0) {
-                /* B* ops need res loaded to operate on */
-                read_vec_element(s, tcg_res[pass], rd, pass, MO_64);
-            }
+        /* B* ops need res loaded to operate on */
+        read_vec_element(s, tcg_res[pass], rd, pass, MO_64);
 
-            switch (size) {
-            case 0: /* EOR */
-                tcg_gen_xor_i64(tcg_res[pass], tcg_op1, tcg_op2);
-                break;
-            case 1: /* BSL bitwise select */
-                tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_op2);
-                tcg_gen_and_i64(tcg_op1, tcg_op1, tcg_res[pass]);
-                tcg_gen_xor_i64(tcg_res[pass], tcg_op2, tcg_op1);
-                break;
-            case 2: /* BIT, bitwise insert if true */
-                tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_res[pass]);
-                tcg_gen_and_i64(tcg_op1, tcg_op1, tcg_op2);
-                tcg_gen_xor_i64(tcg_res[pass], tcg_res[pass], tcg_op1);
-                break;
-            case 3: /* BIF, bitwise insert if false */
-                tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_res[pass]);
-                tcg_gen_andc_i64(tcg_op1, tcg_op1, tcg_op2);
-                tcg_gen_xor_i64(tcg_res[pass], tcg_res[pass], tcg_op1);
-                break;
-            }
+        switch (size) {
+        case 1: /* BSL bitwise select */
+            tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_op2);
+            tcg_gen_and_i64(tcg_op1, tcg_op1, tcg_res[pass]);
+            tcg_gen_xor_i64(tcg_res[pass], tcg_op2, tcg_op1);
+            break;
+        case 2: /* BIT, bitwise insert if true */
+            tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_res[pass]);
+            tcg_gen_and_i64(tcg_op1, tcg_op1, tcg_op2);
+            tcg_gen_xor_i64(tcg_res[pass], tcg_res[pass], tcg_op1);
+            break;
+        case 3: /* BIF, bitwise insert if false */
+            tcg_gen_xor_i64(tcg_op1, tcg_op1, tcg_res[pass]);
+            tcg_gen_andc_i64(tcg_op1, tcg_op1, tcg_op2);
+            tcg_gen_xor_i64(tcg_res[pass], tcg_res[pass], tcg_op1);
+            break;
         }
     }
 
@@ -9345,6 +9374,45 @@ static void disas_simd_3same_int(DisasContext *s, uint32_t insn)
         return;
     }
 
+    switch (opcode) {
+    case 0x10: /* ADD, SUB */
+        if (u) {
+            tcg_gen_gvec_sub(size, vec_full_reg_offset(s, rd),
+                             vec_full_reg_offset(s, rn),
+                             vec_full_reg_offset(s, rm),
+                             is_q ? 16 : 8, vec_full_reg_size(s));
+        } else {
+            tcg_gen_gvec_add(size, vec_full_reg_offset(s, rd),
+                             vec_full_reg_offset(s, rn),
+                             vec_full_reg_offset(s, rm),
+                             is_q ? 16 : 8, vec_full_reg_size(s));
+        }
+        return;
+    case 0x6: /* CMGT, CMHI */
+    case 0x7: /* CMGE, CMHS */
+    {
+        static const TCGCond conds[2][2] = {
+            { TCG_COND_GT, TCG_COND_GTU },
+            { TCG_COND_GE, TCG_COND_GEU },
+        };
+        tcg_gen_gvec_cmp(conds[opcode & 1][u], size,
+                         vec_full_reg_offset(s, rd),
+                         vec_full_reg_offset(s, rn),
+                         vec_full_reg_offset(s, rm),
+                         is_q ? 16 : 8, vec_full_reg_size(s));
+        return;
+    }
+    case 0x11: /* CMTST, CMEQ */
+        if (u) {
+            tcg_gen_gvec_cmp(TCG_COND_EQ, size, vec_full_reg_offset(s, rd),
+                             vec_full_reg_offset(s, rn),
+                             vec_full_reg_offset(s, rm),
+                             is_q ? 16 : 8, vec_full_reg_size(s));
+            return;
+        }
+        break;
+    }
+
     if (size == 3) {
         assert(is_q);
         for (pass = 0; pass < 2; pass++) {
@@ -11278,8 +11346,13 @@ void gen_intermediate_code_a64(ARMCPU *cpu, TranslationBlock *tb)
          * (and thus a tb-jump is not possible when singlestepping).
          */
         assert(dc->is_jmp != DISAS_TB_JUMP);
-        if (dc->is_jmp != DISAS_JUMP) {
+        switch (dc->is_jmp) {
+        case DISAS_JUMP:
+        case DISAS_EXIT:
+            break;
+        default:
             gen_a64_set_pc_im(dc->pc);
+            break;
         }
         if (cs->singlestep_enabled) {
             gen_exception_internal(EXCP_DEBUG);
@@ -11295,10 +11368,16 @@ void gen_intermediate_code_a64(ARMCPU *cpu, TranslationBlock *tb)
         case DISAS_UPDATE:
             gen_a64_set_pc_im(dc->pc);
             /* fall through */
-        case DISAS_JUMP:
+        case DISAS_EXIT:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
             break;
+        case DISAS_JUMP:
+            /* indirect branch: look up the next TB without leaving
+             * generated code
+             */
+            tcg_gen_lookup_and_goto_ptr();
+            break;
         case DISAS_TB_JUMP:
         case DISAS_EXC:
         case DISAS_SWI:
@@ -1136,7 +1136,7 @@ static void gen_exception_insn(DisasContext *s, int offset, int excp,
 static inline void gen_lookup_tb(DisasContext *s)
 {
     tcg_gen_movi_i32(cpu_R[15], s->pc & ~1);
-    s->is_jmp = DISAS_JUMP;
+    s->is_jmp = DISAS_EXIT;
 }
 
 static inline void gen_add_data_offset(DisasContext *s, unsigned int insn,
@@ -4069,7 +4069,7 @@ static inline void gen_goto_tb(DisasContext *s, int n, target_ulong dest)
         tcg_gen_exit_tb((uintptr_t)s->tb + n);
     } else {
         gen_set_pc_im(s, dest);
-        tcg_gen_exit_tb(0);
+        tcg_gen_lookup_and_goto_ptr();
     }
 }
 
@@ -4366,7 +4366,7 @@ static void gen_exception_return(DisasContext *s, TCGv_i32 pc)
     tmp = load_cpu_field(spsr);
     gen_helper_cpsr_write_eret(cpu_env, tmp);
     tcg_temp_free_i32(tmp);
-    s->is_jmp = DISAS_JUMP;
+    s->is_jmp = DISAS_EXIT;
 }
 
 /* Generate a v6 exception return.  Marks both values as dead.  */
@@ -4375,7 +4375,7 @@ static void gen_rfe(DisasContext *s, TCGv_i32 pc, TCGv_i32 cpsr)
     gen_helper_cpsr_write_eret(cpu_env, cpsr);
     tcg_temp_free_i32(cpsr);
     store_reg(s, 15, pc);
-    s->is_jmp = DISAS_JUMP;
+    s->is_jmp = DISAS_EXIT;
 }
 
 static void gen_nop_hint(DisasContext *s, int val)
@@ -7786,6 +7786,14 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     TCGLabel *done_label;
     TCGLabel *fail_label;
 
+    if (parallel_cpus) {
+        /* The sequence below is not atomic with respect to other vCPUs;
+         * redo the instruction with all of them stopped.
+         */
+        gen_helper_exit_atomic(cpu_env);
+        return;
+    }
+
     /* if (env->exclusive_addr == addr && env->exclusive_val == [addr]) {
          [addr] = {Rt};
          {Rd} = 0;
@@ -8835,22 +8843,26 @@ static void disas_arm_insn(DisasContext *s, unsigned int insn)
                         /* SWP instruction */
                         rm = (insn) & 0xf;
 
-                        /* ??? This is not really atomic.  However we know
-                           we never have multiple CPUs running in parallel,
-                           so it is good enough.  */
-                        addr = load_reg(s, rn);
-                        tmp = load_reg(s, rm);
-                        tmp2 = tcg_temp_new_i32();
-                        if (insn & (1 << 22)) {
-                            gen_aa32_ld8u(s, tmp2, addr, get_mem_index(s));
-                            gen_aa32_st8(s, tmp, addr, get_mem_index(s));
+                        /* ??? This is not really atomic.  When vCPUs run
+                           in parallel, redo it with all others stopped.  */
+                        if (parallel_cpus) {
+                            gen_helper_exit_atomic(cpu_env);
                         } else {
-                            gen_aa32_ld32u(s, tmp2, addr, get_mem_index(s));
-                            gen_aa32_st32(s, tmp, addr, get_mem_index(s));
+                            addr = load_reg(s, rn);
+                            tmp = load_reg(s, rm);
+                            tmp2 = tcg_temp_new_i32();
+                            if (insn & (1 << 22)) {
+                                gen_aa32_ld8u(s, tmp2, addr, get_mem_index(s));
+                                gen_aa32_st8(s, tmp, addr, get_mem_index(s));
+                            } else {
+                                gen_aa32_ld32u(s, tmp2, addr,
+                                               get_mem_index(s));
+                                gen_aa32_st32(s, tmp, addr, get_mem_index(s));
+                            }
+                            tcg_temp_free_i32(tmp);
+                            tcg_temp_free_i32(addr);
+                            store_reg(s, rd, tmp2);
                         }
-                        tcg_temp_free_i32(tmp);
-                        tcg_temp_free_i32(addr);
-                        store_reg(s, rd, tmp2);
                     }
                 }
             } else {
@@ -9419,7 +9431,7 @@ static void disas_arm_insn(DisasContext *s, unsigned int insn)
                     tmp = load_cpu_field(spsr);
                     gen_helper_cpsr_write_eret(cpu_env, tmp);
                     tcg_temp_free_i32(tmp);
-                    s->is_jmp = DISAS_JUMP;
+                    s->is_jmp = DISAS_EXIT;
                 }
             }
             break;
@@ -11949,10 +11961,15 @@ void gen_intermediate_code(CPUARMState *env, TranslationBlock *tb)
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
+        case DISAS_JUMP:
+            /* indirect branch: look up the next TB without leaving
+             * generated code
+             */
+            tcg_gen_lookup_and_goto_ptr();
+            break;
         case DISAS_UPDATE:
             gen_set_pc_im(dc, dc->pc);
             /* fall through */
-        case DISAS_JUMP:
         default:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
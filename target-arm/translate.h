@@ -122,6 +122,12 @@ static inline int default_exception_el(DisasContext *s)
 #define DISAS_HVC 8
 #define DISAS_SMC 9
 #define DISAS_YIELD 10
+/* The instruction changed CPU state (e.g. an exception return or a CPSR
+ * write) that may affect interrupt delivery or the TB flags, so we must
+ * go back to the main loop rather than looking up the next TB directly.
+ * The PC has already been written.
+ */
+#define DISAS_EXIT 11
 
 #ifdef TARGET_AARCH64
 void a64_translate_init(void);
@@ -37,6 +37,12 @@
    close to the modifying instruction */
 #define TARGET_HAS_PRECISE_SMC
 
+/* The x86 has a strong memory model with some store-after-load re-ordering */
+#define TCG_GUEST_DEFAULT_MO      (TCG_MO_ALL & ~TCG_MO_ST_LD)
+
+/* Locked instructions fall back to EXCP_ATOMIC under MTTCG */
+#define TARGET_SUPPORTS_MTTCG
+
 #ifdef TARGET_X86_64
 #define I386_ELF_MACHINE  EM_X86_64
 #define ELF_MACHINE_UNAME "x86_64"
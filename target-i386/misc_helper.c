@@ -23,6 +23,7 @@
 #include "exec/exec-all.h"
 #include "exec/cpu_ldst.h"
 #include "exec/address-spaces.h"
+#include "qemu/main-loop.h"
 
 void helper_outb(CPUX86State *env, uint32_t port, uint32_t data)
 {
@@ -132,7 +133,16 @@ target_ulong helper_read_crN(CPUX86State *env, int reg)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            /* The APIC is a device: take the BQL, MTTCG does not hold it */
+            bool release_lock = !qemu_mutex_iothread_locked();
+
+            if (release_lock) {
+                qemu_mutex_lock_iothread();
+            }
             val = cpu_get_apic_tpr(x86_env_get_cpu(env)->apic_state);
+            if (release_lock) {
+                qemu_mutex_unlock_iothread();
+            }
         } else {
             val = env->v_tpr;
         }
@@ -156,7 +166,15 @@ void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool release_lock = !qemu_mutex_iothread_locked();
+
+            if (release_lock) {
+                qemu_mutex_lock_iothread();
+            }
             cpu_set_apic_tpr(x86_env_get_cpu(env)->apic_state, t0);
+            if (release_lock) {
+                qemu_mutex_unlock_iothread();
+            }
         }
         env->v_tpr = t0 & 0x0f;
         break;
@@ -244,7 +262,17 @@ void helper_wrmsr(CPUX86State *env)
         env->sysenter_eip = val;
         break;
     case MSR_IA32_APICBASE:
-        cpu_set_apic_base(x86_env_get_cpu(env)->apic_state, val);
+        {
+            bool release_lock = !qemu_mutex_iothread_locked();
+
+            if (release_lock) {
+                qemu_mutex_lock_iothread();
+            }
+            cpu_set_apic_base(x86_env_get_cpu(env)->apic_state, val);
+            if (release_lock) {
+                qemu_mutex_unlock_iothread();
+            }
+        }
         break;
     case MSR_EFER:
         {
@@ -401,7 +429,17 @@ void helper_rdmsr(CPUX86State *env)
         val = env->sysenter_eip;
         break;
     case MSR_IA32_APICBASE:
-        val = cpu_get_apic_base(x86_env_get_cpu(env)->apic_state);
+        {
+            bool release_lock = !qemu_mutex_iothread_locked();
+
+            if (release_lock) {
+                qemu_mutex_lock_iothread();
+            }
+            val = cpu_get_apic_base(x86_env_get_cpu(env)->apic_state);
+            if (release_lock) {
+                qemu_mutex_unlock_iothread();
+            }
+        }
         break;
     case MSR_EFER:
         val = env->efer;
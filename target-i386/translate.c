@@ -23,6 +23,7 @@
 #include "disas/disas.h"
 #include "exec/exec-all.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "exec/cpu_ldst.h"
 
 #include "exec/helper-proto.h"
@@ -2457,8 +2458,11 @@ static void gen_bnd_jmp(DisasContext *s)
 }
 
 /* Generate an end of block. Trace exception is also generated if needed.
-   If IIM, set HF_INHIBIT_IRQ_MASK if it isn't already set.  */
-static void gen_eob_inhibit_irq(DisasContext *s, bool inhibit)
+   If INHIBIT, set HF_INHIBIT_IRQ_MASK if it isn't already set.
+   If JR, the block ends with an indirect jump whose target eip has
+   already been stored; look up the next TB directly from generated code
+   instead of returning to the main loop.  */
+static void do_gen_eob_worker(DisasContext *s, bool inhibit, bool jr)
 {
     gen_update_cc_op(s);
 
@@ -2476,16 +2480,31 @@ static void gen_eob_inhibit_irq(DisasContext *s, bool inhibit)
         gen_helper_debug(cpu_env);
     } else if (s->tf) {
         gen_helper_single_step(cpu_env);
+    } else if (jr) {
+        tcg_gen_lookup_and_goto_ptr();
     } else {
         tcg_gen_exit_tb(0);
     }
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+/* End of block.  If INHIBIT, set HF_INHIBIT_IRQ_MASK if it isn't
+   already set.  */
+static void gen_eob_inhibit_irq(DisasContext *s, bool inhibit)
+{
+    do_gen_eob_worker(s, inhibit, false);
+}
+
 /* End of block, resetting the inhibit irq flag.  */
 static void gen_eob(DisasContext *s)
 {
-    gen_eob_inhibit_irq(s, false);
+    do_gen_eob_worker(s, false, false);
+}
+
+/* Jump to the eip already stored in env, via a TB lookup.  */
+static void gen_jr(DisasContext *s)
+{
+    do_gen_eob_worker(s, false, true);
 }
 
 /* generate a jump to eip. No segment change must happen before as a
@@ -4321,6 +4340,47 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt = (SSEFunc_0_eppt)sse_fn_epp;
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
+
+        /* Integer operations that map directly onto generic vector ops.
+           Neither the MMX nor the legacy SSE forms modify any bytes above
+           the operand, so OPRSZ == MAXSZ.  */
+        case 0xdb: /* pand */
+            tcg_gen_gvec_and(MO_64, op1_offset, op1_offset, op2_offset,
+                             is_xmm ? 16 : 8, is_xmm ? 16 : 8);
+            break;
+        case 0xdf: /* pandn */
+            tcg_gen_gvec_andc(MO_64, op1_offset, op2_offset, op1_offset,
+                              is_xmm ? 16 : 8, is_xmm ? 16 : 8);
+            break;
+        case 0xeb: /* por */
+            tcg_gen_gvec_or(MO_64, op1_offset, op1_offset, op2_offset,
+                            is_xmm ? 16 : 8, is_xmm ? 16 : 8);
+            break;
+        case 0xef: /* pxor */
+            tcg_gen_gvec_xor(MO_64, op1_offset, op1_offset, op2_offset,
+                             is_xmm ? 16 : 8, is_xmm ? 16 : 8);
+            break;
+        case 0xfc ... 0xfe: /* paddb, paddw, paddd */
+            tcg_gen_gvec_add(b - 0xfc, op1_offset, op1_offset, op2_offset,
+                             is_xmm ? 16 : 8, is_xmm ? 16 : 8);
+            break;
+        case 0xd4: /* paddq */
+            tcg_gen_gvec_add(MO_64, op1_offset, op1_offset, op2_offset,
+                             is_xmm ? 16 : 8, is_xmm ? 16 : 8);
+            break;
+        case 0xf8 ... 0xfb: /* psubb, psubw, psubd, psubq */
+            tcg_gen_gvec_sub(b - 0xf8, op1_offset, op1_offset, op2_offset,
+                             is_xmm ? 16 : 8, is_xmm ? 16 : 8);
+            break;
+        case 0x74 ... 0x76: /* pcmpeqb, pcmpeqw, pcmpeqd */
+            tcg_gen_gvec_cmp(TCG_COND_EQ, b - 0x74, op1_offset, op1_offset,
+                             op2_offset, is_xmm ? 16 : 8, is_xmm ? 16 : 8);
+            break;
+        case 0x64 ... 0x66: /* pcmpgtb, pcmpgtw, pcmpgtd */
+            tcg_gen_gvec_cmp(TCG_COND_GT, b - 0x64, op1_offset, op1_offset,
+                             op2_offset, is_xmm ? 16 : 8, is_xmm ? 16 : 8);
+            break;
+
         default:
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
@@ -4496,8 +4556,16 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     s->dflag = dflag;
 
     /* lock generation */
-    if (prefixes & PREFIX_LOCK)
+    if (prefixes & PREFIX_LOCK) {
+        if (parallel_cpus) {
+            /* helper_lock only serialises this vCPU's thread; emulate
+               the instruction again with all other vCPUs stopped.  */
+            gen_helper_exit_atomic(cpu_env);
+            s->is_jmp = DISAS_TB_JUMP;
+            return s->pc;
+        }
         gen_helper_lock();
+    }
 
     /* now check op code */
  reswitch:
@@ -4867,7 +4935,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_push_v(s, cpu_T1);
             gen_op_jmp_v(cpu_T0);
             gen_bnd_jmp(s);
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 3: /* lcall Ev */
             gen_op_ld_v(s, ot, cpu_T1, cpu_A0);
@@ -4893,7 +4961,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             }
             gen_op_jmp_v(cpu_T0);
             gen_bnd_jmp(s);
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 5: /* ljmp Ev */
             gen_op_ld_v(s, ot, cpu_T1, cpu_A0);
@@ -5460,6 +5528,10 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_op_mov_v_reg(ot, cpu_T1, rm);
             gen_op_mov_reg_v(ot, rm, cpu_T0);
             gen_op_mov_reg_v(ot, reg, cpu_T1);
+        } else if (parallel_cpus) {
+            /* for xchg, lock is implicit; see the lock prefix above */
+            gen_helper_exit_atomic(cpu_env);
+            s->is_jmp = DISAS_TB_JUMP;
         } else {
             gen_lea_modrm(env, s, modrm);
             gen_op_mov_v_reg(ot, cpu_T0, reg);
@@ -6273,7 +6345,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         /* Note that gen_pop_T0 uses a zero-extending load.  */
         gen_op_jmp_v(cpu_T0);
         gen_bnd_jmp(s);
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xc3: /* ret */
         ot = gen_pop_T0(s);
@@ -6281,7 +6353,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         /* Note that gen_pop_T0 uses a zero-extending load.  */
         gen_op_jmp_v(cpu_T0);
         gen_bnd_jmp(s);
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xca: /* lret im */
         val = cpu_ldsw_code(env, s->pc);
@@ -0,0 +1,200 @@
+/*
+ * Generic vectorized operation runtime
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "cpu.h"
+#include "exec/helper-proto.h"
+#include "tcg-gvec-desc.h"
+
+
+/* Use GCC's generic vector extension with 8-byte vectors.  The compiler
+ * lowers these to host SIMD where it can, and to plain integer operations
+ * otherwise, which is simpler and more reliable than hoping that the loops
+ * below get autovectorized.  tcg-op-gvec.c asserts that all sizes are a
+ * multiple of 8, so no operand ever ends in a partial vector.
+ */
+typedef uint8_t vec8 __attribute__((vector_size(8)));
+typedef uint16_t vec16 __attribute__((vector_size(8)));
+typedef uint32_t vec32 __attribute__((vector_size(8)));
+typedef uint64_t vec64 __attribute__((vector_size(8)));
+
+typedef int8_t svec8 __attribute__((vector_size(8)));
+typedef int16_t svec16 __attribute__((vector_size(8)));
+typedef int32_t svec32 __attribute__((vector_size(8)));
+typedef int64_t svec64 __attribute__((vector_size(8)));
+
+static inline void clear_high(void *d, intptr_t oprsz, uint32_t desc)
+{
+    intptr_t maxsz = simd_maxsz(desc);
+    intptr_t i;
+
+    if (unlikely(maxsz > oprsz)) {
+        for (i = oprsz; i < maxsz; i += sizeof(uint64_t)) {
+            *(uint64_t *)(d + i) = 0;
+        }
+    }
+}
+
+void HELPER(gvec_mov)(void *d, void *a, uint32_t desc)
+{
+    intptr_t oprsz = simd_oprsz(desc);
+
+    memmove(d, a, oprsz);
+    clear_high(d, oprsz, desc);
+}
+
+#define DO_3(NAME, TYPE, OP)                                            \
+void HELPER(NAME)(void *d, void *a, void *b, uint32_t desc)             \
+{                                                                       \
+    intptr_t oprsz = simd_oprsz(desc);                                  \
+    intptr_t i;                                                         \
+                                                                        \
+    for (i = 0; i < oprsz; i += sizeof(TYPE)) {                         \
+        *(TYPE *)(d + i) = *(TYPE *)(a + i) OP *(TYPE *)(b + i);        \
+    }                                                                   \
+    clear_high(d, oprsz, desc);                                         \
+}
+
+DO_3(gvec_add8, vec8, +)
+DO_3(gvec_add16, vec16, +)
+DO_3(gvec_add32, vec32, +)
+DO_3(gvec_add64, vec64, +)
+
+DO_3(gvec_sub8, vec8, -)
+DO_3(gvec_sub16, vec16, -)
+DO_3(gvec_sub32, vec32, -)
+DO_3(gvec_sub64, vec64, -)
+
+DO_3(gvec_and, vec64, &)
+DO_3(gvec_or, vec64, |)
+DO_3(gvec_xor, vec64, ^)
+
+#undef DO_3
+
+#define DO_NEG(NAME, TYPE)                                              \
+void HELPER(NAME)(void *d, void *a, uint32_t desc)                      \
+{                                                                       \
+    intptr_t oprsz = simd_oprsz(desc);                                  \
+    intptr_t i;                                                         \
+                                                                        \
+    for (i = 0; i < oprsz; i += sizeof(TYPE)) {                         \
+        *(TYPE *)(d + i) = -*(TYPE *)(a + i);                           \
+    }                                                                   \
+    clear_high(d, oprsz, desc);                                         \
+}
+
+DO_NEG(gvec_neg8, vec8)
+DO_NEG(gvec_neg16, vec16)
+DO_NEG(gvec_neg32, vec32)
+DO_NEG(gvec_neg64, vec64)
+
+#undef DO_NEG
+
+void HELPER(gvec_not)(void *d, void *a, uint32_t desc)
+{
+    intptr_t oprsz = simd_oprsz(desc);
+    intptr_t i;
+
+    for (i = 0; i < oprsz; i += sizeof(vec64)) {
+        *(vec64 *)(d + i) = ~*(vec64 *)(a + i);
+    }
+    clear_high(d, oprsz, desc);
+}
+
+void HELPER(gvec_andc)(void *d, void *a, void *b, uint32_t desc)
+{
+    intptr_t oprsz = simd_oprsz(desc);
+    intptr_t i;
+
+    for (i = 0; i < oprsz; i += sizeof(vec64)) {
+        *(vec64 *)(d + i) = *(vec64 *)(a + i) &~ *(vec64 *)(b + i);
+    }
+    clear_high(d, oprsz, desc);
+}
+
+void HELPER(gvec_orc)(void *d, void *a, void *b, uint32_t desc)
+{
+    intptr_t oprsz = simd_oprsz(desc);
+    intptr_t i;
+
+    for (i = 0; i < oprsz; i += sizeof(vec64)) {
+        *(vec64 *)(d + i) = *(vec64 *)(a + i) |~ *(vec64 *)(b + i);
+    }
+    clear_high(d, oprsz, desc);
+}
+
+/* The shift count is carried in the descriptor data field.  */
+#define DO_SHIFTI(NAME, TYPE, OP)                                       \
+void HELPER(NAME)(void *d, void *a, uint32_t desc)                      \
+{                                                                       \
+    intptr_t oprsz = simd_oprsz(desc);                                  \
+    int shift = simd_data(desc);                                        \
+    intptr_t i;                                                         \
+                                                                        \
+    for (i = 0; i < oprsz; i += sizeof(TYPE)) {                         \
+        *(TYPE *)(d + i) = *(TYPE *)(a + i) OP shift;                   \
+    }                                                                   \
+    clear_high(d, oprsz, desc);                                         \
+}
+
+DO_SHIFTI(gvec_shl8i, vec8, <<)
+DO_SHIFTI(gvec_shl16i, vec16, <<)
+DO_SHIFTI(gvec_shl32i, vec32, <<)
+DO_SHIFTI(gvec_shl64i, vec64, <<)
+
+DO_SHIFTI(gvec_shr8i, vec8, >>)
+DO_SHIFTI(gvec_shr16i, vec16, >>)
+DO_SHIFTI(gvec_shr32i, vec32, >>)
+DO_SHIFTI(gvec_shr64i, vec64, >>)
+
+DO_SHIFTI(gvec_sar8i, svec8, >>)
+DO_SHIFTI(gvec_sar16i, svec16, >>)
+DO_SHIFTI(gvec_sar32i, svec32, >>)
+DO_SHIFTI(gvec_sar64i, svec64, >>)
+
+#undef DO_SHIFTI
+
+/* Vector comparisons produce -1 for true, which is exactly the
+   all-ones element that the guest expects.  */
+#define DO_CMP1(NAME, TYPE, OP)                                            \
+void HELPER(NAME)(void *d, void *a, void *b, uint32_t desc)                \
+{                                                                          \
+    intptr_t oprsz = simd_oprsz(desc);                                     \
+    intptr_t i;                                                            \
+                                                                           \
+    for (i = 0; i < oprsz; i += sizeof(TYPE)) {                            \
+        *(TYPE *)(d + i) = (TYPE)(*(TYPE *)(a + i) OP *(TYPE *)(b + i));   \
+    }                                                                      \
+    clear_high(d, oprsz, desc);                                            \
+}
+
+#define DO_CMP2(SZ) \
+    DO_CMP1(gvec_eq##SZ, vec##SZ, ==)    \
+    DO_CMP1(gvec_ne##SZ, vec##SZ, !=)    \
+    DO_CMP1(gvec_lt##SZ, svec##SZ, <)    \
+    DO_CMP1(gvec_le##SZ, svec##SZ, <=)   \
+    DO_CMP1(gvec_ltu##SZ, vec##SZ, <)    \
+    DO_CMP1(gvec_leu##SZ, vec##SZ, <=)
+
+DO_CMP2(8)
+DO_CMP2(16)
+DO_CMP2(32)
+DO_CMP2(64)
+
+#undef DO_CMP1
+#undef DO_CMP2
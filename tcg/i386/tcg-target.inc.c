@@ -29,6 +29,9 @@ static const char * const tcg_target_reg_names[TCG_TARGET_NB_REGS] = {
 #if TCG_TARGET_REG_BITS == 64
     "%rax", "%rcx", "%rdx", "%rbx", "%rsp", "%rbp", "%rsi", "%rdi",
     "%r8",  "%r9",  "%r10", "%r11", "%r12", "%r13", "%r14", "%r15",
+    "%xmm0", "%xmm1", "%xmm2", "%xmm3", "%xmm4", "%xmm5", "%xmm6", "%xmm7",
+    "%xmm8", "%xmm9", "%xmm10", "%xmm11",
+    "%xmm12", "%xmm13", "%xmm14", "%xmm15",
 #else
     "%eax", "%ecx", "%edx", "%ebx", "%esp", "%ebp", "%esi", "%edi",
 #endif
@@ -52,6 +55,26 @@ static const int tcg_target_reg_alloc_order[] = {
     TCG_REG_RSI,
     TCG_REG_RDI,
     TCG_REG_RAX,
+    TCG_REG_XMM0,
+    TCG_REG_XMM1,
+    TCG_REG_XMM2,
+    TCG_REG_XMM3,
+    TCG_REG_XMM4,
+    TCG_REG_XMM5,
+#ifndef _WIN64
+    /* The Win64 ABI has xmm6-xmm15 as callee-saves, and we do not save
+       any of them.  Therefore only allow xmm0-xmm5 to be allocated.  */
+    TCG_REG_XMM6,
+    TCG_REG_XMM7,
+    TCG_REG_XMM8,
+    TCG_REG_XMM9,
+    TCG_REG_XMM10,
+    TCG_REG_XMM11,
+    TCG_REG_XMM12,
+    TCG_REG_XMM13,
+    TCG_REG_XMM14,
+    TCG_REG_XMM15,
+#endif
 #else
     TCG_REG_EBX,
     TCG_REG_ESI,
@@ -139,6 +162,22 @@ static bool have_bmi2;
 # define have_bmi2 0
 #endif
 
+/* SSE4.1 and SSE4.2 provide the 64-bit element compares; AVX provides
+   the three-operand VEX encoding, and AVX2 the 256-bit integer forms.
+   As with have_bmi1, have_avx2 is needed by tcg-target.h.  */
+bool have_avx2;
+
+#if defined(CONFIG_CPUID_H) && defined(bit_SSE4_2) && defined(bit_OSXSAVE) \
+    && defined(bit_AVX)
+static bool have_sse41;
+static bool have_sse42;
+static bool have_avx1;
+#else
+# define have_sse41 0
+# define have_sse42 0
+# define have_avx1 0
+#endif
+
 static tcg_insn_unit *tb_ret_addr;
 
 static void patch_reloc(tcg_insn_unit *code_ptr, int type,
@@ -238,6 +277,12 @@ static int target_parse_constraint(TCGArgConstraint *ct, const char **pct_str)
         tcg_regset_reset_reg(ct->u.regs, TCG_REG_L1);
         break;
 
+        /* vector register */
+    case 'x':
+        ct->ct |= TCG_CT_REG;
+        tcg_regset_set32(ct->u.regs, 0, 0xffff0000);
+        break;
+
     case 'e':
         ct->ct |= TCG_CT_CONST_S32;
         break;
@@ -300,6 +345,7 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #endif
 #define P_SIMDF3        0x10000         /* 0xf3 opcode prefix */
 #define P_SIMDF2        0x20000         /* 0xf2 opcode prefix */
+#define P_VEXL          0x40000         /* Set VEX.L = 1 */
 
 #define OPC_ARITH_EvIz	(0x81)
 #define OPC_ARITH_EvIb	(0x83)
@@ -333,6 +379,43 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_MOVSLQ	(0x63 | P_REXW)
 #define OPC_MOVZBL	(0xb6 | P_EXT)
 #define OPC_MOVZWL	(0xb7 | P_EXT)
+#define OPC_MOVD_VyEy   (0x6e | P_EXT | P_DATA16)
+#define OPC_MOVDQU_VxWx (0x6f | P_EXT | P_SIMDF3)
+#define OPC_MOVDQU_WxVx (0x7f | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_VqWq   (0x7e | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_WqVq   (0xd6 | P_EXT | P_DATA16)
+#define OPC_PADDB       (0xfc | P_EXT | P_DATA16)
+#define OPC_PADDW       (0xfd | P_EXT | P_DATA16)
+#define OPC_PADDD       (0xfe | P_EXT | P_DATA16)
+#define OPC_PADDQ       (0xd4 | P_EXT | P_DATA16)
+#define OPC_PAND        (0xdb | P_EXT | P_DATA16)
+#define OPC_PANDN       (0xdf | P_EXT | P_DATA16)
+#define OPC_PCMPEQB     (0x74 | P_EXT | P_DATA16)
+#define OPC_PCMPEQW     (0x75 | P_EXT | P_DATA16)
+#define OPC_PCMPEQD     (0x76 | P_EXT | P_DATA16)
+#define OPC_PCMPEQQ     (0x29 | P_EXT38 | P_DATA16)
+#define OPC_PCMPGTB     (0x64 | P_EXT | P_DATA16)
+#define OPC_PCMPGTW     (0x65 | P_EXT | P_DATA16)
+#define OPC_PCMPGTD     (0x66 | P_EXT | P_DATA16)
+#define OPC_PCMPGTQ     (0x37 | P_EXT38 | P_DATA16)
+#define OPC_POR         (0xeb | P_EXT | P_DATA16)
+#define OPC_PSHUFD      (0x70 | P_EXT | P_DATA16)
+#define OPC_PSHUFLW     (0x70 | P_EXT | P_SIMDF2)
+#define OPC_PSHIFTW_Ib  (0x71 | P_EXT | P_DATA16) /* /2 /6 /4 */
+#define OPC_PSHIFTD_Ib  (0x72 | P_EXT | P_DATA16) /* /2 /6 /4 */
+#define OPC_PSHIFTQ_Ib  (0x73 | P_EXT | P_DATA16) /* /2 /6 */
+#define OPC_PSUBB       (0xf8 | P_EXT | P_DATA16)
+#define OPC_PSUBW       (0xf9 | P_EXT | P_DATA16)
+#define OPC_PSUBD       (0xfa | P_EXT | P_DATA16)
+#define OPC_PSUBQ       (0xfb | P_EXT | P_DATA16)
+#define OPC_PUNPCKLBW   (0x60 | P_EXT | P_DATA16)
+#define OPC_PUNPCKLQDQ  (0x6c | P_EXT | P_DATA16)
+#define OPC_PXOR        (0xef | P_EXT | P_DATA16)
+#define OPC_VPBROADCASTB (0x78 | P_EXT38 | P_DATA16)
+#define OPC_VPBROADCASTW (0x79 | P_EXT38 | P_DATA16)
+#define OPC_VPBROADCASTD (0x58 | P_EXT38 | P_DATA16)
+#define OPC_VPBROADCASTQ (0x59 | P_EXT38 | P_DATA16)
+#define OPC_VZEROUPPER  (0x77 | P_EXT)
 #define OPC_POP_r32	(0x58)
 #define OPC_PUSH_r32	(0x50)
 #define OPC_PUSH_Iv	(0x68)
@@ -369,6 +452,11 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define SHIFT_SHR 5
 #define SHIFT_SAR 7
 
+/* Group 12-14 opcode extensions for 0x71-0x73.  */
+#define PSHIFT_SRL 2
+#define PSHIFT_SRA 4
+#define PSHIFT_SLL 6
+
 /* Group 3 opcode extensions for 0xf6, 0xf7.  To be used with OPC_GRP3.  */
 #define EXT3_NOT   2
 #define EXT3_NEG   3
@@ -424,13 +512,19 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
         tcg_out8(s, 0x65);
     }
     if (opc & P_DATA16) {
-        /* We should never be asking for both 16 and 64-bit operation.  */
-        tcg_debug_assert((opc & P_REXW) == 0);
+        /* We should never be asking for both 16 and 64-bit operation,
+           except that 0x66 is a mandatory prefix for some SSE insns.  */
+        tcg_debug_assert((opc & P_REXW) == 0 || (opc & (P_EXT | P_EXT38)));
         tcg_out8(s, 0x66);
     }
     if (opc & P_ADDR32) {
         tcg_out8(s, 0x67);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    } else if (opc & P_SIMDF2) {
+        tcg_out8(s, 0xf2);
+    }
 
     rex = 0;
     rex |= (opc & P_REXW) ? 0x8 : 0x0;  /* REX.W */
@@ -465,6 +559,11 @@ static void tcg_out_opc(TCGContext *s, int opc)
     if (opc & P_DATA16) {
         tcg_out8(s, 0x66);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    } else if (opc & P_SIMDF2) {
+        tcg_out8(s, 0xf2);
+    }
     if (opc & (P_EXT | P_EXT38)) {
         tcg_out8(s, 0x0f);
         if (opc & P_EXT38) {
@@ -485,11 +584,20 @@ static void tcg_out_modrm(TCGContext *s, int opc, int r, int rm)
     tcg_out8(s, 0xc0 | (LOWREGMASK(r) << 3) | LOWREGMASK(rm));
 }
 
-static void tcg_out_vex_modrm(TCGContext *s, int opc, int r, int v, int rm)
+static void tcg_out_vex_opc(TCGContext *s, int opc, int r, int v,
+                            int rm, int index)
 {
     int tmp;
 
-    if ((opc & (P_REXW | P_EXT | P_EXT38)) || (rm & 8)) {
+    /* Use the two byte form if possible, which cannot encode
+       VEX.W, VEX.B, VEX.X, or an m-mmmm field other than P_EXT.  */
+    if ((opc & (P_EXT | P_EXT38 | P_REXW)) == P_EXT
+        && ((rm | index) & 8) == 0) {
+        /* Two byte VEX prefix.  */
+        tcg_out8(s, 0xc5);
+
+        tmp = (r & 8 ? 0 : 0x80);          /* VEX.R */
+    } else {
         /* Three byte VEX prefix.  */
         tcg_out8(s, 0xc4);
 
@@ -501,18 +609,15 @@ static void tcg_out_vex_modrm(TCGContext *s, int opc, int r, int v, int rm)
         } else {
             tcg_abort();
         }
-        tmp |= 0x40;                       /* VEX.X */
         tmp |= (r & 8 ? 0 : 0x80);         /* VEX.R */
+        tmp |= (index & 8 ? 0 : 0x40);     /* VEX.X */
         tmp |= (rm & 8 ? 0 : 0x20);        /* VEX.B */
         tcg_out8(s, tmp);
 
         tmp = (opc & P_REXW ? 0x80 : 0);   /* VEX.W */
-    } else {
-        /* Two byte VEX prefix.  */
-        tcg_out8(s, 0xc5);
-
-        tmp = (r & 8 ? 0 : 0x80);          /* VEX.R */
     }
+
+    tmp |= (opc & P_VEXL ? 0x04 : 0);      /* VEX.L */
     /* VEX.pp */
     if (opc & P_DATA16) {
         tmp |= 1;                          /* 0x66 */
@@ -524,6 +629,11 @@ static void tcg_out_vex_modrm(TCGContext *s, int opc, int r, int v, int rm)
     tmp |= (~v & 15) << 3;                 /* VEX.vvvv */
     tcg_out8(s, tmp);
     tcg_out8(s, opc);
+}
+
+static void tcg_out_vex_modrm(TCGContext *s, int opc, int r, int v, int rm)
+{
+    tcg_out_vex_opc(s, opc, r, v, rm, 0);
     tcg_out8(s, 0xc0 | (LOWREGMASK(r) << 3) | LOWREGMASK(rm));
 }
 
@@ -532,8 +642,8 @@ static void tcg_out_vex_modrm(TCGContext *s, int opc, int r, int v, int rm)
    mode for absolute addresses, ~RM is the size of the immediate operand
    that will follow the instruction.  */
 
-static void tcg_out_modrm_sib_offset(TCGContext *s, int opc, int r, int rm,
-                                     int index, int shift, intptr_t offset)
+static void tcg_out_sib_offset(TCGContext *s, int r, int rm, int index,
+                               int shift, intptr_t offset)
 {
     int mod, len;
 
@@ -544,7 +654,6 @@ static void tcg_out_modrm_sib_offset(TCGContext *s, int opc, int r, int rm,
             intptr_t pc = (intptr_t)s->code_ptr + 5 + ~rm;
             intptr_t disp = offset - pc;
             if (disp == (int32_t)disp) {
-                tcg_out_opc(s, opc, r, 0, 0);
                 tcg_out8(s, (LOWREGMASK(r) << 3) | 5);
                 tcg_out32(s, disp);
                 return;
@@ -554,7 +663,6 @@ static void tcg_out_modrm_sib_offset(TCGContext *s, int opc, int r, int rm,
                use of the MODRM+SIB encoding and is therefore larger than
                rip-relative addressing.  */
             if (offset == (int32_t)offset) {
-                tcg_out_opc(s, opc, r, 0, 0);
                 tcg_out8(s, (LOWREGMASK(r) << 3) | 4);
                 tcg_out8(s, (4 << 3) | 5);
                 tcg_out32(s, offset);
@@ -565,7 +673,6 @@ static void tcg_out_modrm_sib_offset(TCGContext *s, int opc, int r, int rm,
             tcg_abort();
         } else {
             /* Absolute address.  */
-            tcg_out_opc(s, opc, r, 0, 0);
             tcg_out8(s, (r << 3) | 5);
             tcg_out32(s, offset);
             return;
@@ -588,7 +695,6 @@ static void tcg_out_modrm_sib_offset(TCGContext *s, int opc, int r, int rm,
        that would be used for %esp is the escape to the two byte form.  */
     if (index < 0 && LOWREGMASK(rm) != TCG_REG_ESP) {
         /* Single byte MODRM format.  */
-        tcg_out_opc(s, opc, r, rm, 0);
         tcg_out8(s, mod | (LOWREGMASK(r) << 3) | LOWREGMASK(rm));
     } else {
         /* Two byte MODRM+SIB format.  */
@@ -602,7 +708,6 @@ static void tcg_out_modrm_sib_offset(TCGContext *s, int opc, int r, int rm,
             tcg_debug_assert(index != TCG_REG_ESP);
         }
 
-        tcg_out_opc(s, opc, r, rm, index);
         tcg_out8(s, mod | (LOWREGMASK(r) << 3) | 4);
         tcg_out8(s, (shift << 6) | (LOWREGMASK(index) << 3) | LOWREGMASK(rm));
     }
@@ -614,6 +719,21 @@ static void tcg_out_modrm_sib_offset(TCGContext *s, int opc, int r, int rm,
     }
 }
 
+static void tcg_out_modrm_sib_offset(TCGContext *s, int opc, int r, int rm,
+                                     int index, int shift, intptr_t offset)
+{
+    tcg_out_opc(s, opc, r, rm < 0 ? 0 : rm, index < 0 ? 0 : index);
+    tcg_out_sib_offset(s, r, rm, index, shift, offset);
+}
+
+static void tcg_out_vex_modrm_sib_offset(TCGContext *s, int opc, int r, int v,
+                                         int rm, int index, int shift,
+                                         intptr_t offset)
+{
+    tcg_out_vex_opc(s, opc, r, v, rm < 0 ? 0 : rm, index < 0 ? 0 : index);
+    tcg_out_sib_offset(s, r, rm, index, shift, offset);
+}
+
 /* A simplification of the above with no index or shift.  */
 static inline void tcg_out_modrm_offset(TCGContext *s, int opc, int r,
                                         int rm, intptr_t offset)
@@ -621,6 +741,12 @@ static inline void tcg_out_modrm_offset(TCGContext *s, int opc, int r,
     tcg_out_modrm_sib_offset(s, opc, r, rm, -1, 0, offset);
 }
 
+static inline void tcg_out_vex_modrm_offset(TCGContext *s, int opc, int r,
+                                            int v, int rm, intptr_t offset)
+{
+    tcg_out_vex_modrm_sib_offset(s, opc, r, v, rm, -1, 0, offset);
+}
+
 /* Generate dest op= src.  Uses the same ARITH_* codes as tgen_arithi.  */
 static inline void tgen_arithr(TCGContext *s, int subop, int dest, int src)
 {
@@ -631,12 +757,51 @@ static inline void tgen_arithr(TCGContext *s, int subop, int dest, int src)
     tcg_out_modrm(s, OPC_ARITH_GvEv + (subop << 3) + ext, dest, src);
 }
 
+/* Output a vector insn on registers.  With AVX this uses the VEX
+   three-operand form R = V op RM; without, the legacy SSE form R op= RM,
+   for which V must be either R or unused.  */
+static void tcg_out_vec_modrm(TCGContext *s, int opc, int r, int v, int rm)
+{
+    if (have_avx1) {
+        tcg_out_vex_modrm(s, opc, r, v, rm);
+    } else {
+        tcg_debug_assert((opc & P_VEXL) == 0);
+        tcg_out_modrm(s, opc, r, rm);
+    }
+}
+
+static void tcg_out_vec_modrm_offset(TCGContext *s, int opc, int r,
+                                     int rm, intptr_t offset)
+{
+    if (have_avx1) {
+        tcg_out_vex_modrm_offset(s, opc, r, 0, rm, offset);
+    } else {
+        tcg_debug_assert((opc & P_VEXL) == 0);
+        tcg_out_modrm_offset(s, opc, r, rm, offset);
+    }
+}
+
 static inline void tcg_out_mov(TCGContext *s, TCGType type,
                                TCGReg ret, TCGReg arg)
 {
-    if (arg != ret) {
-        int opc = OPC_MOVL_GvEv + (type == TCG_TYPE_I64 ? P_REXW : 0);
-        tcg_out_modrm(s, opc, ret, arg);
+    if (arg == ret) {
+        return;
+    }
+    switch (type) {
+    case TCG_TYPE_I32:
+    case TCG_TYPE_I64:
+        tcg_out_modrm(s, OPC_MOVL_GvEv + (type == TCG_TYPE_I64 ? P_REXW : 0),
+                      ret, arg);
+        break;
+    case TCG_TYPE_V64:
+    case TCG_TYPE_V128:
+        tcg_out_vec_modrm(s, OPC_MOVDQU_VxWx, ret, 0, arg);
+        break;
+    case TCG_TYPE_V256:
+        tcg_out_vex_modrm(s, OPC_MOVDQU_VxWx | P_VEXL, ret, 0, arg);
+        break;
+    default:
+        g_assert_not_reached();
     }
 }
 
@@ -699,15 +864,51 @@ static inline void tcg_out_pop(TCGContext *s, int reg)
 static inline void tcg_out_ld(TCGContext *s, TCGType type, TCGReg ret,
                               TCGReg arg1, intptr_t arg2)
 {
-    int opc = OPC_MOVL_GvEv + (type == TCG_TYPE_I64 ? P_REXW : 0);
-    tcg_out_modrm_offset(s, opc, ret, arg1, arg2);
+    switch (type) {
+    case TCG_TYPE_I32:
+    case TCG_TYPE_I64:
+        tcg_out_modrm_offset(s, OPC_MOVL_GvEv
+                             + (type == TCG_TYPE_I64 ? P_REXW : 0),
+                             ret, arg1, arg2);
+        break;
+    case TCG_TYPE_V64:
+        tcg_out_vec_modrm_offset(s, OPC_MOVQ_VqWq, ret, arg1, arg2);
+        break;
+    case TCG_TYPE_V128:
+        tcg_out_vec_modrm_offset(s, OPC_MOVDQU_VxWx, ret, arg1, arg2);
+        break;
+    case TCG_TYPE_V256:
+        tcg_out_vex_modrm_offset(s, OPC_MOVDQU_VxWx | P_VEXL,
+                                 ret, 0, arg1, arg2);
+        break;
+    default:
+        g_assert_not_reached();
+    }
 }
 
 static inline void tcg_out_st(TCGContext *s, TCGType type, TCGReg arg,
                               TCGReg arg1, intptr_t arg2)
 {
-    int opc = OPC_MOVL_EvGv + (type == TCG_TYPE_I64 ? P_REXW : 0);
-    tcg_out_modrm_offset(s, opc, arg, arg1, arg2);
+    switch (type) {
+    case TCG_TYPE_I32:
+    case TCG_TYPE_I64:
+        tcg_out_modrm_offset(s, OPC_MOVL_EvGv
+                             + (type == TCG_TYPE_I64 ? P_REXW : 0),
+                             arg, arg1, arg2);
+        break;
+    case TCG_TYPE_V64:
+        tcg_out_vec_modrm_offset(s, OPC_MOVQ_WqVq, arg, arg1, arg2);
+        break;
+    case TCG_TYPE_V128:
+        tcg_out_vec_modrm_offset(s, OPC_MOVDQU_WxVx, arg, arg1, arg2);
+        break;
+    case TCG_TYPE_V256:
+        tcg_out_vex_modrm_offset(s, OPC_MOVDQU_WxVx | P_VEXL,
+                                 arg, 0, arg1, arg2);
+        break;
+    default:
+        g_assert_not_reached();
+    }
 }
 
 static bool tcg_out_sti(TCGContext *s, TCGType type, TCGArg val,
@@ -1820,6 +2021,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         s->tb_jmp_reset_offset[args[0]] = tcg_current_code_size(s);
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp to the given host address (could be epilogue) */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, args[0]);
+        break;
     case INDEX_op_br:
         tcg_out_jxx(s, JCC_JMP, arg_label(args[0]), 0);
         break;
@@ -2142,9 +2347,207 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 #undef OP_32_64
 }
 
+#if TCG_TARGET_MAYBE_vec
+static void tcg_out_dupi_vec(TCGContext *s, TCGType type,
+                             TCGReg ret, tcg_target_long arg)
+{
+    int vex_l = (type == TCG_TYPE_V256 ? P_VEXL : 0);
+
+    if (arg == 0) {
+        tcg_out_vec_modrm(s, OPC_PXOR | vex_l, ret, ret, ret);
+    } else if (arg == -1) {
+        tcg_out_vec_modrm(s, OPC_PCMPEQB | vex_l, ret, ret, ret);
+    } else {
+        /* Other constants are loaded via dup_vec by tcg_gen_dupi_vec.  */
+        tcg_abort();
+    }
+}
+
+static void tcg_out_dup_vec(TCGContext *s, TCGType type, unsigned vece,
+                            TCGReg r, TCGReg a)
+{
+    static const int vpbroadcast_insn[4] = {
+        OPC_VPBROADCASTB, OPC_VPBROADCASTW,
+        OPC_VPBROADCASTD, OPC_VPBROADCASTQ
+    };
+
+    /* Move the scalar into the low element of the vector.  */
+    tcg_out_vec_modrm(s, OPC_MOVD_VyEy + (vece == MO_64 ? P_REXW : 0),
+                      r, 0, a);
+
+    if (have_avx2) {
+        int vex_l = (type == TCG_TYPE_V256 ? P_VEXL : 0);
+        tcg_out_vex_modrm(s, vpbroadcast_insn[vece] | vex_l, r, 0, r);
+        return;
+    }
+
+    /* Without AVX2 there are no 256-bit vectors; replicate the element
+       across the low 128 bits with interleaves and shuffles.  */
+    switch (vece) {
+    case MO_8:
+        tcg_out_vec_modrm(s, OPC_PUNPCKLBW, r, r, r);
+        /* fall through */
+    case MO_16:
+        tcg_out_vec_modrm(s, OPC_PSHUFLW, r, 0, r);
+        tcg_out8(s, 0);
+        /* fall through */
+    case MO_32:
+        tcg_out_vec_modrm(s, OPC_PSHUFD, r, 0, r);
+        tcg_out8(s, 0);
+        break;
+    case MO_64:
+        tcg_out_vec_modrm(s, OPC_PUNPCKLQDQ, r, r, r);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void tcg_out_vec_op(TCGContext *s, TCGOpcode opc,
+                           unsigned vecl, unsigned vece,
+                           const TCGArg *args, const int *const_args)
+{
+    static const int add_insn[4] = {
+        OPC_PADDB, OPC_PADDW, OPC_PADDD, OPC_PADDQ
+    };
+    static const int sub_insn[4] = {
+        OPC_PSUBB, OPC_PSUBW, OPC_PSUBD, OPC_PSUBQ
+    };
+    static const int cmpeq_insn[4] = {
+        OPC_PCMPEQB, OPC_PCMPEQW, OPC_PCMPEQD, OPC_PCMPEQQ
+    };
+    static const int cmpgt_insn[4] = {
+        OPC_PCMPGTB, OPC_PCMPGTW, OPC_PCMPGTD, OPC_PCMPGTQ
+    };
+    static const int shift_imm_insn[4] = {
+        -1, OPC_PSHIFTW_Ib, OPC_PSHIFTD_Ib, OPC_PSHIFTQ_Ib
+    };
+
+    TCGType type = vecl + TCG_TYPE_V64;
+    int insn, sub;
+    TCGArg a0, a1, a2;
+
+    a0 = args[0];
+    a1 = args[1];
+    a2 = args[2];
+
+    switch (opc) {
+    case INDEX_op_add_vec:
+        insn = add_insn[vece];
+        goto gen_simd;
+    case INDEX_op_sub_vec:
+        insn = sub_insn[vece];
+        goto gen_simd;
+    case INDEX_op_and_vec:
+        insn = OPC_PAND;
+        goto gen_simd;
+    case INDEX_op_or_vec:
+        insn = OPC_POR;
+        goto gen_simd;
+    case INDEX_op_xor_vec:
+        insn = OPC_PXOR;
+        goto gen_simd;
+    case INDEX_op_andc_vec:
+        /* PANDN computes ~first & second; the constraints have
+           placed the inverted operand in the output.  */
+        insn = OPC_PANDN;
+        a1 = args[2];
+        a2 = args[1];
+        goto gen_simd;
+    case INDEX_op_cmp_vec:
+        /* Only EQ and GT are native; see tcg_gen_cmp_vec.  */
+        if (args[3] == TCG_COND_EQ) {
+            insn = cmpeq_insn[vece];
+        } else if (args[3] == TCG_COND_GT) {
+            insn = cmpgt_insn[vece];
+        } else {
+            g_assert_not_reached();
+        }
+        goto gen_simd;
+    gen_simd:
+        if (type == TCG_TYPE_V256) {
+            insn |= P_VEXL;
+        }
+        tcg_out_vec_modrm(s, insn, a0, a1, a2);
+        break;
+
+    case INDEX_op_shli_vec:
+        sub = PSHIFT_SLL;
+        goto gen_shift;
+    case INDEX_op_shri_vec:
+        sub = PSHIFT_SRL;
+        goto gen_shift;
+    case INDEX_op_sari_vec:
+        sub = PSHIFT_SRA;
+        goto gen_shift;
+    gen_shift:
+        insn = shift_imm_insn[vece];
+        tcg_debug_assert(insn != -1);
+        if (type == TCG_TYPE_V256) {
+            insn |= P_VEXL;
+        }
+        /* The destination is VEX.vvvv, or the R/M of the legacy form.  */
+        if (have_avx1) {
+            tcg_out_vex_modrm(s, insn, sub, a0, a1);
+        } else {
+            tcg_debug_assert(a0 == a1);
+            tcg_out_modrm(s, insn, sub, a0);
+        }
+        tcg_out8(s, a2);
+        break;
+
+    case INDEX_op_ld_vec:
+        tcg_out_ld(s, type, a0, a1, a2);
+        break;
+    case INDEX_op_st_vec:
+        tcg_out_st(s, type, a0, a1, a2);
+        break;
+    case INDEX_op_dupi_vec:
+        tcg_out_dupi_vec(s, type, a0, a1);
+        break;
+    case INDEX_op_dup_vec:
+        tcg_out_dup_vec(s, type, vece, a0, a1);
+        break;
+
+    case INDEX_op_mov_vec:  /* Always emitted via tcg_out_mov.  */
+    default:
+        g_assert_not_reached();
+    }
+}
+
+bool tcg_can_emit_vec_op(TCGOpcode opc, TCGType type, unsigned vece)
+{
+    switch (opc) {
+    case INDEX_op_add_vec:
+    case INDEX_op_sub_vec:
+    case INDEX_op_and_vec:
+    case INDEX_op_or_vec:
+    case INDEX_op_xor_vec:
+    case INDEX_op_andc_vec:
+        return true;
+
+    case INDEX_op_shli_vec:
+    case INDEX_op_shri_vec:
+        /* There are no byte shifts.  */
+        return vece != MO_8;
+    case INDEX_op_sari_vec:
+        /* Nor a 64-bit arithmetic shift.  */
+        return vece == MO_16 || vece == MO_32;
+
+    case INDEX_op_cmp_vec:
+        /* PCMPEQQ is SSE4.1 and PCMPGTQ is SSE4.2.  */
+        return vece != MO_64 || (have_sse41 && have_sse42);
+
+    default:
+        return false;
+    }
+}
+#endif /* TCG_TARGET_MAYBE_vec */
+
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
     { INDEX_op_br, { } },
     { INDEX_op_ld8u_i32, { "r", "r" } },
     { INDEX_op_ld8s_i32, { "r", "r" } },
@@ -2271,6 +2674,23 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_qemu_ld_i64, { "r", "r", "L", "L" } },
     { INDEX_op_qemu_st_i64, { "L", "L", "L", "L" } },
 #endif
+
+#if TCG_TARGET_MAYBE_vec
+    { INDEX_op_ld_vec, { "x", "r" } },
+    { INDEX_op_st_vec, { "x", "r" } },
+    { INDEX_op_dup_vec, { "x", "r" } },
+    { INDEX_op_dupi_vec, { "x" } },
+    { INDEX_op_add_vec, { "x", "0", "x" } },
+    { INDEX_op_sub_vec, { "x", "0", "x" } },
+    { INDEX_op_and_vec, { "x", "0", "x" } },
+    { INDEX_op_or_vec, { "x", "0", "x" } },
+    { INDEX_op_xor_vec, { "x", "0", "x" } },
+    { INDEX_op_andc_vec, { "x", "x", "0" } },
+    { INDEX_op_shli_vec, { "x", "0" } },
+    { INDEX_op_shri_vec, { "x", "0" } },
+    { INDEX_op_sari_vec, { "x", "0" } },
+    { INDEX_op_cmp_vec, { "x", "0", "x" } },
+#endif
     { -1 },
 };
 
@@ -2340,11 +2760,22 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 #endif
 
+    /*
+     * Return path for goto_ptr. Set return value to 0, a-la exit_tb,
+     * and fall through to the rest of the epilogue.
+     */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_REG, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
     tcg_out_addi(s, TCG_REG_CALL_STACK, stack_addend);
 
+    if (have_avx2) {
+        /* Avoid AVX-SSE transition penalties in the caller.  */
+        tcg_out_vex_opc(s, OPC_VZEROUPPER, 0, 0, 0, 0);
+    }
     for (i = ARRAY_SIZE(tcg_target_callee_save_regs) - 1; i >= 0; i--) {
         tcg_out_pop(s, tcg_target_callee_save_regs[i]);
     }
@@ -2376,6 +2807,18 @@ static void tcg_target_init(TCGContext *s)
         /* MOVBE is only available on Intel Atom and Haswell CPUs, so we
            need to probe for it.  */
         have_movbe = (c & bit_MOVBE) != 0;
+#endif
+#ifndef have_avx1
+        have_sse41 = (c & bit_SSE4_1) != 0;
+        have_sse42 = (c & bit_SSE4_2) != 0;
+        /* AVX additionally requires that the OS saves the YMM state.  */
+        if (c & bit_OSXSAVE) {
+            unsigned xcrl, xcrh;
+            asm ("xgetbv" : "=a" (xcrl), "=d" (xcrh) : "c" (0));
+            if ((xcrl & 6) == 6) {
+                have_avx1 = (c & bit_AVX) != 0;
+            }
+        }
 #endif
     }
 
@@ -2387,6 +2830,9 @@ static void tcg_target_init(TCGContext *s)
 #endif
 #ifndef have_bmi2
         have_bmi2 = (b & bit_BMI2) != 0;
+#endif
+#ifdef bit_AVX2
+        have_avx2 = have_avx1 && (b & bit_AVX2) != 0;
 #endif
     }
 #endif
@@ -2394,6 +2840,14 @@ static void tcg_target_init(TCGContext *s)
     if (TCG_TARGET_REG_BITS == 64) {
         tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I32], 0, 0xffff);
         tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I64], 0, 0xffff);
+        tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_V64],
+                         0, 0xffff0000);
+        tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_V128],
+                         0, 0xffff0000);
+        if (have_avx2) {
+            tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_V256],
+                             0, 0xffff0000);
+        }
     } else {
         tcg_regset_set32(tcg_target_available_regs[TCG_TYPE_I32], 0, 0xff);
     }
@@ -2411,6 +2865,11 @@ static void tcg_target_init(TCGContext *s)
         tcg_regset_set_reg(tcg_target_call_clobber_regs, TCG_REG_R9);
         tcg_regset_set_reg(tcg_target_call_clobber_regs, TCG_REG_R10);
         tcg_regset_set_reg(tcg_target_call_clobber_regs, TCG_REG_R11);
+#if defined(_WIN64)
+        tcg_regset_set32(tcg_target_call_clobber_regs, 0, 0x003f0000);
+#else
+        tcg_regset_set32(tcg_target_call_clobber_regs, 0, 0xffff0000);
+#endif
     }
 
     tcg_regset_clear(s->reserved_regs);
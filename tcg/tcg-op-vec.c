@@ -0,0 +1,328 @@
+/*
+ * Tiny Code Generator for QEMU: host vector operations
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "tcg.h"
+#include "tcg-op.h"
+
+/* Reduce the number of ifdefs below.  This assumes that all uses of
+   TCGV_HIGH and TCGV_LOW are properly protected by a conditional that
+   the compiler can eliminate.  */
+#if TCG_TARGET_REG_BITS == 64
+extern TCGv_i32 TCGV_LOW_link_error(TCGv_i64);
+extern TCGv_i32 TCGV_HIGH_link_error(TCGv_i64);
+#define TCGV_LOW  TCGV_LOW_link_error
+#define TCGV_HIGH TCGV_HIGH_link_error
+#endif
+
+static inline TCGType vec_type(TCGv_vec v)
+{
+    return tcg_ctx.temps[GET_TCGV_VEC(v)].base_type;
+}
+
+/* Emit a vector opcode, recording the vector length and element size
+   in the op itself.  The type is taken from the (first) output.  */
+static void vec_gen_2(TCGOpcode opc, TCGType type, unsigned vece,
+                      TCGArg r, TCGArg a)
+{
+    TCGOp *op;
+
+    tcg_gen_op2(&tcg_ctx, opc, r, a);
+    op = &tcg_ctx.gen_op_buf[tcg_ctx.gen_op_buf[0].prev];
+    TCGOP_VECL(op) = type - TCG_TYPE_V64;
+    TCGOP_VECE(op) = vece;
+}
+
+static void vec_gen_3(TCGOpcode opc, TCGType type, unsigned vece,
+                      TCGArg r, TCGArg a, TCGArg b)
+{
+    TCGOp *op;
+
+    tcg_gen_op3(&tcg_ctx, opc, r, a, b);
+    op = &tcg_ctx.gen_op_buf[tcg_ctx.gen_op_buf[0].prev];
+    TCGOP_VECL(op) = type - TCG_TYPE_V64;
+    TCGOP_VECE(op) = vece;
+}
+
+static void vec_gen_4(TCGOpcode opc, TCGType type, unsigned vece,
+                      TCGArg r, TCGArg a, TCGArg b, TCGArg c)
+{
+    TCGOp *op;
+
+    tcg_gen_op4(&tcg_ctx, opc, r, a, b, c);
+    op = &tcg_ctx.gen_op_buf[tcg_ctx.gen_op_buf[0].prev];
+    TCGOP_VECL(op) = type - TCG_TYPE_V64;
+    TCGOP_VECE(op) = vece;
+}
+
+static void vec_gen_op2(TCGOpcode opc, unsigned vece, TCGv_vec r, TCGv_vec a)
+{
+    TCGType type = vec_type(r);
+
+    tcg_debug_assert(vec_type(a) == type);
+    vec_gen_2(opc, type, vece, GET_TCGV_VEC(r), GET_TCGV_VEC(a));
+}
+
+static void vec_gen_op3(TCGOpcode opc, unsigned vece,
+                        TCGv_vec r, TCGv_vec a, TCGv_vec b)
+{
+    TCGType type = vec_type(r);
+
+    tcg_debug_assert(vec_type(a) == type);
+    tcg_debug_assert(vec_type(b) == type);
+    vec_gen_3(opc, type, vece, GET_TCGV_VEC(r),
+              GET_TCGV_VEC(a), GET_TCGV_VEC(b));
+}
+
+void tcg_gen_mov_vec(TCGv_vec r, TCGv_vec a)
+{
+    if (!TCGV_EQUAL_VEC(r, a)) {
+        vec_gen_op2(INDEX_op_mov_vec, 0, r, a);
+    }
+}
+
+void tcg_gen_dupi_vec(unsigned vece, TCGv_vec r, uint64_t a)
+{
+    TCGType type = vec_type(r);
+
+    a = dup_const(vece, a);
+    if (a == 0 || a == -1) {
+        /* All-zeros and all-ones are directly representable.  */
+        vec_gen_2(INDEX_op_dupi_vec, type, MO_64, GET_TCGV_VEC(r), a);
+    } else if (TCG_TARGET_REG_BITS == 64) {
+        TCGv_i64 t = tcg_const_i64(a);
+        tcg_gen_dup_i64_vec(MO_64, r, t);
+        tcg_temp_free_i64(t);
+    } else if (a == dup_const(MO_32, a)) {
+        TCGv_i32 t = tcg_const_i32(a);
+        tcg_gen_dup_i32_vec(MO_32, r, t);
+        tcg_temp_free_i32(t);
+    } else {
+        /* No 32-bit host implements host vectors.  */
+        g_assert_not_reached();
+    }
+}
+
+void tcg_gen_dup_i64_vec(unsigned vece, TCGv_vec r, TCGv_i64 a)
+{
+    TCGType type = vec_type(r);
+
+    if (TCG_TARGET_REG_BITS == 64) {
+        vec_gen_2(INDEX_op_dup_vec, type, vece,
+                  GET_TCGV_VEC(r), GET_TCGV_I64(a));
+    } else {
+        tcg_debug_assert(vece < MO_64);
+        vec_gen_2(INDEX_op_dup_vec, type, vece,
+                  GET_TCGV_VEC(r), GET_TCGV_I32(TCGV_LOW(a)));
+    }
+}
+
+void tcg_gen_dup_i32_vec(unsigned vece, TCGv_vec r, TCGv_i32 a)
+{
+    tcg_debug_assert(vece <= MO_32);
+    vec_gen_2(INDEX_op_dup_vec, vec_type(r), vece,
+              GET_TCGV_VEC(r), GET_TCGV_I32(a));
+}
+
+void tcg_gen_ld_vec(TCGv_vec r, TCGv_ptr b, TCGArg o)
+{
+    vec_gen_3(INDEX_op_ld_vec, vec_type(r), 0,
+              GET_TCGV_VEC(r), GET_TCGV_PTR(b), o);
+}
+
+void tcg_gen_st_vec(TCGv_vec r, TCGv_ptr b, TCGArg o)
+{
+    vec_gen_3(INDEX_op_st_vec, vec_type(r), 0,
+              GET_TCGV_VEC(r), GET_TCGV_PTR(b), o);
+}
+
+void tcg_gen_add_vec(unsigned vece, TCGv_vec r, TCGv_vec a, TCGv_vec b)
+{
+    vec_gen_op3(INDEX_op_add_vec, vece, r, a, b);
+}
+
+void tcg_gen_sub_vec(unsigned vece, TCGv_vec r, TCGv_vec a, TCGv_vec b)
+{
+    vec_gen_op3(INDEX_op_sub_vec, vece, r, a, b);
+}
+
+void tcg_gen_and_vec(unsigned vece, TCGv_vec r, TCGv_vec a, TCGv_vec b)
+{
+    vec_gen_op3(INDEX_op_and_vec, 0, r, a, b);
+}
+
+void tcg_gen_or_vec(unsigned vece, TCGv_vec r, TCGv_vec a, TCGv_vec b)
+{
+    vec_gen_op3(INDEX_op_or_vec, 0, r, a, b);
+}
+
+void tcg_gen_xor_vec(unsigned vece, TCGv_vec r, TCGv_vec a, TCGv_vec b)
+{
+    vec_gen_op3(INDEX_op_xor_vec, 0, r, a, b);
+}
+
+void tcg_gen_andc_vec(unsigned vece, TCGv_vec r, TCGv_vec a, TCGv_vec b)
+{
+    if (TCG_TARGET_HAS_andc_vec) {
+        vec_gen_op3(INDEX_op_andc_vec, 0, r, a, b);
+    } else {
+        TCGv_vec t = tcg_temp_new_vec_matching(r);
+        tcg_gen_not_vec(0, t, b);
+        tcg_gen_and_vec(0, r, a, t);
+        tcg_temp_free_vec(t);
+    }
+}
+
+void tcg_gen_orc_vec(unsigned vece, TCGv_vec r, TCGv_vec a, TCGv_vec b)
+{
+    if (TCG_TARGET_HAS_orc_vec) {
+        vec_gen_op3(INDEX_op_orc_vec, 0, r, a, b);
+    } else {
+        TCGv_vec t = tcg_temp_new_vec_matching(r);
+        tcg_gen_not_vec(0, t, b);
+        tcg_gen_or_vec(0, r, a, t);
+        tcg_temp_free_vec(t);
+    }
+}
+
+void tcg_gen_not_vec(unsigned vece, TCGv_vec r, TCGv_vec a)
+{
+    if (TCG_TARGET_HAS_not_vec) {
+        vec_gen_op2(INDEX_op_not_vec, 0, r, a);
+    } else {
+        TCGv_vec t = tcg_temp_new_vec_matching(r);
+        tcg_gen_dupi_vec(MO_64, t, -1);
+        tcg_gen_xor_vec(0, r, a, t);
+        tcg_temp_free_vec(t);
+    }
+}
+
+void tcg_gen_neg_vec(unsigned vece, TCGv_vec r, TCGv_vec a)
+{
+    if (TCG_TARGET_HAS_neg_vec) {
+        vec_gen_op2(INDEX_op_neg_vec, vece, r, a);
+    } else {
+        TCGv_vec t = tcg_temp_new_vec_matching(r);
+        tcg_gen_dupi_vec(MO_64, t, 0);
+        tcg_gen_sub_vec(vece, r, t, a);
+        tcg_temp_free_vec(t);
+    }
+}
+
+/* Shifts by immediate are only available for the element sizes for
+   which tcg_can_emit_vec_op returns true; the caller must check.  */
+static void do_shifti(TCGOpcode opc, unsigned vece,
+                      TCGv_vec r, TCGv_vec a, int64_t i)
+{
+    TCGType type = vec_type(r);
+
+    tcg_debug_assert(vec_type(a) == type);
+    tcg_debug_assert(i >= 0 && i < (8 << vece));
+    tcg_debug_assert(tcg_can_emit_vec_op(opc, type, vece));
+
+    if (i == 0) {
+        tcg_gen_mov_vec(r, a);
+        return;
+    }
+    vec_gen_3(opc, type, vece, GET_TCGV_VEC(r), GET_TCGV_VEC(a), i);
+}
+
+void tcg_gen_shli_vec(unsigned vece, TCGv_vec r, TCGv_vec a, int64_t i)
+{
+    do_shifti(INDEX_op_shli_vec, vece, r, a, i);
+}
+
+void tcg_gen_shri_vec(unsigned vece, TCGv_vec r, TCGv_vec a, int64_t i)
+{
+    do_shifti(INDEX_op_shri_vec, vece, r, a, i);
+}
+
+void tcg_gen_sari_vec(unsigned vece, TCGv_vec r, TCGv_vec a, int64_t i)
+{
+    do_shifti(INDEX_op_sari_vec, vece, r, a, i);
+}
+
+/* Backends are only required to implement TCG_COND_EQ and TCG_COND_GT;
+   every other condition is derived from those by swapping operands,
+   inverting the result, or biasing the inputs for unsigned compares.  */
+void tcg_gen_cmp_vec(TCGCond cond, unsigned vece,
+                     TCGv_vec r, TCGv_vec a, TCGv_vec b)
+{
+    TCGType type = vec_type(r);
+    TCGv_vec t1, t2;
+    bool inv = false;
+
+    TCGV_UNUSED_VEC(t1);
+
+    tcg_debug_assert(vec_type(a) == type);
+    tcg_debug_assert(vec_type(b) == type);
+    tcg_debug_assert(tcg_can_emit_vec_op(INDEX_op_cmp_vec, type, vece));
+
+    switch (cond) {
+    case TCG_COND_NEVER:
+    case TCG_COND_ALWAYS:
+        tcg_gen_dupi_vec(MO_64, r, cond == TCG_COND_ALWAYS ? -1 : 0);
+        return;
+    case TCG_COND_NE:
+        inv = true;
+        cond = TCG_COND_EQ;
+        break;
+    case TCG_COND_LE:
+    case TCG_COND_LEU:
+        inv = true;
+        cond = tcg_invert_cond(cond);
+        break;
+    case TCG_COND_GE:
+    case TCG_COND_GEU:
+        inv = true;
+        /* fall through */
+    case TCG_COND_LT:
+    case TCG_COND_LTU:
+        t2 = a, a = b, b = t2;
+        cond = (cond == TCG_COND_LT || cond == TCG_COND_GE
+                ? TCG_COND_GT : TCG_COND_GTU);
+        break;
+    default:
+        break;
+    }
+
+    if (cond == TCG_COND_GTU) {
+        /* Flip the sign bit of each element so that a signed compare
+           produces the unsigned result.  */
+        t1 = tcg_temp_new_vec(type);
+        t2 = tcg_temp_new_vec(type);
+        tcg_gen_dupi_vec(vece, t2, 1ull << ((8 << vece) - 1));
+        tcg_gen_xor_vec(vece, t1, a, t2);
+        tcg_gen_xor_vec(vece, t2, b, t2);
+        a = t1, b = t2;
+        cond = TCG_COND_GT;
+    }
+
+    vec_gen_4(INDEX_op_cmp_vec, type, vece, GET_TCGV_VEC(r),
+              GET_TCGV_VEC(a), GET_TCGV_VEC(b), cond);
+
+    if (!TCGV_IS_UNUSED_VEC(t1)) {
+        tcg_temp_free_vec(t1);
+        tcg_temp_free_vec(t2);
+    }
+    if (inv) {
+        tcg_gen_not_vec(vece, r, r);
+    }
+}
@@ -9,24 +9,699 @@
 
 #include "qemu/osdep.h"
 #include "libqtest.h"
+#include "qemu/bswap.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+#include "hw/pci/pci_ids.h"
+#include "block/nvme.h"
+
+#define TEST_IMAGE_SIZE         (1024 * 1024)
+#define TEST_QUEUE_SIZE         8
+#define TEST_LBA_SIZE           512
+#define TEST_TIMEOUT_US         (5 * 1000 * 1000)
+
+#define NVME_DEVICE_ID          0x5845
+#define NVME_REG_DBS            0x1000
+
+typedef struct TestQueue {
+    uint64_t addr;
+    uint16_t size;
+    uint16_t head;
+    uint16_t tail;
+    bool phase;
+} TestQueue;
+
+typedef struct TestNvme {
+    QPCIBus *bus;
+    QPCIDevice *dev;
+    QGuestAllocator *alloc;
+    void *bar;
+    TestQueue sq[3];
+    TestQueue cq[3];
+    uint16_t cid;
+    /* Shadow doorbell and EventIdx pages, 0 before Doorbell Buffer Config */
+    uint64_t dbs;
+    uint64_t eis;
+    /* Only update the shadow completion queue head doorbell */
+    bool shadow_cq_only;
+} TestNvme;
+
+static char *test_image;
+
+static uint32_t nvme_readl(TestNvme *t, uint32_t reg)
+{
+    return qpci_io_readl(t->dev, t->bar + reg);
+}
+
+static void nvme_writel(TestNvme *t, uint32_t reg, uint32_t val)
+{
+    qpci_io_writel(t->dev, t->bar + reg, val);
+}
+
+static void nvme_writeq(TestNvme *t, uint32_t reg, uint64_t val)
+{
+    nvme_writel(t, reg, val);
+    nvme_writel(t, reg + 4, val >> 32);
+}
+
+static void nvme_found(QPCIDevice *dev, int devfn, void *data)
+{
+    *(QPCIDevice **)data = dev;
+}
+
+/* Set up a queue at @addr, or in freshly allocated guest memory if 0 */
+static void nvme_init_queue(TestNvme *t, TestQueue *q, uint64_t addr,
+                            uint16_t size, size_t entry_size)
+{
+    q->size = size;
+    q->head = q->tail = 0;
+    q->phase = true;
+    q->addr = addr ? addr : guest_alloc(t->alloc, size * entry_size);
+    qmemset(q->addr, 0, size * entry_size);
+}
+
+/* Put a command in a submission queue without ringing the doorbell */
+static void nvme_push(TestNvme *t, int qid, NvmeCmd *cmd)
+{
+    TestQueue *sq = &t->sq[qid];
+
+    cmd->cid = cpu_to_le16(t->cid++);
+    memwrite(sq->addr + sq->tail * sizeof(*cmd), cmd, sizeof(*cmd));
+    sq->tail = (sq->tail + 1) % sq->size;
+}
+
+/* Same check as a guest driver does before writing a doorbell whose
+ * shadow copy was just updated from @old to @new. */
+static bool nvme_need_event(uint16_t event_idx, uint16_t new, uint16_t old)
+{
+    return (uint16_t)(new - event_idx - 1) < (uint16_t)(new - old);
+}
+
+static void nvme_ring_sq(TestNvme *t, int qid, uint16_t old_tail)
+{
+    TestQueue *sq = &t->sq[qid];
+
+    if (t->dbs && qid) {
+        writel(t->dbs + qid * 8, sq->tail);
+        if (!nvme_need_event(readl(t->eis + qid * 8), sq->tail, old_tail)) {
+            return;
+        }
+    }
+    nvme_writel(t, NVME_REG_DBS + qid * 8, sq->tail);
+}
+
+static void nvme_ring_cq(TestNvme *t, int qid, uint16_t old_head)
+{
+    TestQueue *cq = &t->cq[qid];
+
+    if (t->dbs && qid) {
+        writel(t->dbs + qid * 8 + 4, cq->head);
+        if (t->shadow_cq_only ||
+            !nvme_need_event(readl(t->eis + qid * 8 + 4), cq->head,
+                             old_head)) {
+            return;
+        }
+    }
+    nvme_writel(t, NVME_REG_DBS + qid * 8 + 4, cq->head);
+}
+
+/* Wait for the next completion on @qid and return its status field */
+static uint16_t nvme_wait(TestNvme *t, int qid)
+{
+    TestQueue *cq = &t->cq[qid];
+    gint64 end_time = g_get_monotonic_time() + TEST_TIMEOUT_US;
+    uint16_t old_head = cq->head;
+    NvmeCqe cqe;
+
+    for (;;) {
+        memread(cq->addr + cq->head * sizeof(cqe), &cqe, sizeof(cqe));
+        if ((le16_to_cpu(cqe.status) & 1) == cq->phase) {
+            break;
+        }
+        g_assert(g_get_monotonic_time() < end_time);
+        clock_step(100);
+    }
+
+    if (++cq->head == cq->size) {
+        cq->head = 0;
+        cq->phase = !cq->phase;
+    }
+    nvme_ring_cq(t, qid, old_head);
+    return le16_to_cpu(cqe.status) >> 1;
+}
+
+static uint16_t nvme_submit(TestNvme *t, int qid, NvmeCmd *cmd)
+{
+    uint16_t old_tail = t->sq[qid].tail;
+
+    nvme_push(t, qid, cmd);
+    nvme_ring_sq(t, qid, old_tail);
+    return nvme_wait(t, qid);
+}
+
+static void nvme_enable(TestNvme *t)
+{
+    nvme_init_queue(t, &t->sq[0], 0, TEST_QUEUE_SIZE, sizeof(NvmeCmd));
+    nvme_init_queue(t, &t->cq[0], 0, TEST_QUEUE_SIZE, sizeof(NvmeCqe));
+    nvme_writel(t, offsetof(NvmeBar, aqa),
+                (TEST_QUEUE_SIZE - 1) << AQA_ACQS_SHIFT |
+                (TEST_QUEUE_SIZE - 1) << AQA_ASQS_SHIFT);
+    nvme_writeq(t, offsetof(NvmeBar, asq), t->sq[0].addr);
+    nvme_writeq(t, offsetof(NvmeBar, acq), t->cq[0].addr);
+    nvme_writel(t, offsetof(NvmeBar, cc),
+                1 << CC_EN_SHIFT | 6 << CC_IOSQES_SHIFT |
+                4 << CC_IOCQES_SHIFT);
+    g_assert_cmphex(nvme_readl(t, offsetof(NvmeBar, csts)), ==,
+                    NVME_CSTS_READY);
+}
+
+static void nvme_disable(TestNvme *t)
+{
+    nvme_writel(t, offsetof(NvmeBar, cc), 0);
+    g_assert_cmphex(nvme_readl(t, offsetof(NvmeBar, csts)), ==, 0);
+    t->dbs = t->eis = 0;
+}
+
+static void nvme_start(TestNvme *t, const char *extra_opts)
+{
+    char *cmdline;
+
+    cmdline = g_strdup_printf("-drive id=drv0,if=none,file=%s,format=raw "
+                              "-device nvme,drive=drv0,serial=foo%s",
+                              test_image, extra_opts ? extra_opts : "");
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    memset(t, 0, sizeof(*t));
+    t->bus = qpci_init_pc();
+    qpci_device_foreach(t->bus, PCI_VENDOR_ID_INTEL, NVME_DEVICE_ID,
+                        nvme_found, &t->dev);
+    g_assert(t->dev != NULL);
+    qpci_device_enable(t->dev);
+    t->bar = qpci_iomap(t->dev, 0, NULL);
+    t->alloc = pc_alloc_init();
+
+    nvme_enable(t);
+}
+
+static void nvme_stop(TestNvme *t)
+{
+    qpci_iounmap(t->dev, t->bar);
+    g_free(t->dev);
+    pc_alloc_uninit(t->alloc);
+    qpci_free_pc(t->bus);
+    qtest_end();
+}
+
+/* Create I/O queue pair @qid, with the submission queue at @sq_addr
+ * or in guest memory if 0 */
+static void nvme_create_io_queues_at(TestNvme *t, int qid, uint16_t size,
+                                     uint64_t sq_addr)
+{
+    NvmeCmd cmd;
+    NvmeCreateCq *ccq = (NvmeCreateCq *)&cmd;
+    NvmeCreateSq *csq = (NvmeCreateSq *)&cmd;
+
+    nvme_init_queue(t, &t->cq[qid], 0, size, sizeof(NvmeCqe));
+    memset(&cmd, 0, sizeof(cmd));
+    ccq->opcode = NVME_ADM_CMD_CREATE_CQ;
+    ccq->prp1 = cpu_to_le64(t->cq[qid].addr);
+    ccq->cqid = cpu_to_le16(qid);
+    ccq->qsize = cpu_to_le16(size - 1);
+    ccq->cq_flags = cpu_to_le16(NVME_Q_PC);
+    g_assert_cmphex(nvme_submit(t, 0, &cmd), ==, NVME_SUCCESS);
+
+    nvme_init_queue(t, &t->sq[qid], sq_addr, size, sizeof(NvmeCmd));
+    memset(&cmd, 0, sizeof(cmd));
+    csq->opcode = NVME_ADM_CMD_CREATE_SQ;
+    csq->prp1 = cpu_to_le64(t->sq[qid].addr);
+    csq->sqid = cpu_to_le16(qid);
+    csq->cqid = cpu_to_le16(qid);
+    csq->qsize = cpu_to_le16(size - 1);
+    csq->sq_flags = cpu_to_le16(NVME_Q_PC);
+    g_assert_cmphex(nvme_submit(t, 0, &cmd), ==, NVME_SUCCESS);
+}
+
+static void nvme_create_io_queues(TestNvme *t, int qid, uint16_t size)
+{
+    nvme_create_io_queues_at(t, qid, size, 0);
+}
+
+static void nvme_delete_io_queues(TestNvme *t, int qid)
+{
+    NvmeCmd cmd;
+    NvmeDeleteQ *c = (NvmeDeleteQ *)&cmd;
+
+    memset(&cmd, 0, sizeof(cmd));
+    c->opcode = NVME_ADM_CMD_DELETE_SQ;
+    c->qid = cpu_to_le16(qid);
+    g_assert_cmphex(nvme_submit(t, 0, &cmd), ==, NVME_SUCCESS);
+    c->opcode = NVME_ADM_CMD_DELETE_CQ;
+    g_assert_cmphex(nvme_submit(t, 0, &cmd), ==, NVME_SUCCESS);
+}
+
+static void nvme_identify_ctrl(TestNvme *t, NvmeIdCtrl *id)
+{
+    uint64_t buf = guest_alloc(t->alloc, sizeof(*id));
+    NvmeCmd cmd;
+    NvmeIdentify *c = (NvmeIdentify *)&cmd;
+
+    memset(&cmd, 0, sizeof(cmd));
+    c->opcode = NVME_ADM_CMD_IDENTIFY;
+    c->prp1 = cpu_to_le64(buf);
+    c->cns = cpu_to_le32(1);
+    g_assert_cmphex(nvme_submit(t, 0, &cmd), ==, NVME_SUCCESS);
+    memread(buf, id, sizeof(*id));
+    guest_free(t->alloc, buf);
+}
+
+static void nvme_rw_cmd(NvmeCmd *cmd, uint8_t opcode, uint64_t slba,
+                        uint16_t nblocks)
+{
+    NvmeRwCmd *rw = (NvmeRwCmd *)cmd;
+
+    memset(cmd, 0, sizeof(*cmd));
+    rw->opcode = opcode;
+    rw->nsid = cpu_to_le32(1);
+    rw->slba = cpu_to_le64(slba);
+    rw->nlb = cpu_to_le16(nblocks - 1);
+}
+
+/* Read @nblocks blocks at @slba through PRPs, @buf must be page aligned */
+static uint16_t nvme_read_prp(TestNvme *t, int qid, uint64_t slba,
+                              uint16_t nblocks, uint64_t buf)
+{
+    NvmeCmd cmd;
+
+    g_assert_cmpint(nblocks * TEST_LBA_SIZE, <=, 2 * 4096);
+    nvme_rw_cmd(&cmd, NVME_CMD_READ, slba, nblocks);
+    cmd.prp1 = cpu_to_le64(buf);
+    cmd.prp2 = cpu_to_le64(buf + 4096);
+    return nvme_submit(t, qid, &cmd);
+}
+
+static uint16_t nvme_rw_sgl(TestNvme *t, int qid, uint8_t opcode,
+                            uint64_t slba, uint16_t nblocks,
+                            NvmeSglDescriptor *sgl)
+{
+    NvmeCmd cmd;
+
+    nvme_rw_cmd(&cmd, opcode, slba, nblocks);
+    cmd.fuse = NVME_PSDT_SGL_MPTR_CONTIG << 6;
+    memcpy(&cmd.prp1, sgl, sizeof(*sgl));
+    return nvme_submit(t, qid, &cmd);
+}
+
+static void nvme_sgl_desc(NvmeSglDescriptor *desc, uint8_t type,
+                          uint64_t addr, uint32_t len)
+{
+    memset(desc, 0, sizeof(*desc));
+    desc->addr = cpu_to_le64(addr);
+    desc->len = cpu_to_le32(len);
+    desc->type = type << 4;
+}
+
+static void fill_pattern(uint8_t *buf, size_t len, uint8_t seed)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = seed + i * 7;
+    }
+}
+
+/* Check that the @len bytes at @lba read back as @expected */
+static void nvme_check_data(TestNvme *t, int qid, uint64_t slba,
+                            const uint8_t *expected, size_t len)
+{
+    uint64_t buf = guest_alloc(t->alloc, 2 * 4096);
+    uint8_t *data = g_malloc(len);
+
+    g_assert_cmphex(nvme_read_prp(t, qid, slba, len / TEST_LBA_SIZE, buf),
+                    ==, NVME_SUCCESS);
+    memread(buf, data, len);
+    g_assert(memcmp(data, expected, len) == 0);
+    g_free(data);
+    guest_free(t->alloc, buf);
+}
 
-/* Tests only initialization so far. TODO: Replace with functional tests */
 static void nop(void)
 {
+    TestNvme t;
+
+    nvme_start(&t, NULL);
+    nvme_stop(&t);
+}
+
+static void test_sgl_data_block(void)
+{
+    TestNvme t;
+    NvmeIdCtrl id;
+    NvmeSglDescriptor sgl;
+    uint8_t data[3 * TEST_LBA_SIZE], readback[3 * TEST_LBA_SIZE];
+    uint64_t buf;
+
+    nvme_start(&t, NULL);
+    nvme_identify_ctrl(&t, &id);
+    g_assert(le32_to_cpu(id.sgls) & NVME_SGLS_SUPPORTED);
+    nvme_create_io_queues(&t, 1, TEST_QUEUE_SIZE);
+
+    /* A single data block descriptor, not page aligned */
+    buf = guest_alloc(t.alloc, sizeof(data) + 100);
+    fill_pattern(data, sizeof(data), 1);
+    memwrite(buf + 100, data, sizeof(data));
+    nvme_sgl_desc(&sgl, NVME_SGL_DESCR_TYPE_DATA_BLOCK, buf + 100,
+                  sizeof(data));
+    g_assert_cmphex(nvme_rw_sgl(&t, 1, NVME_CMD_WRITE, 4, 3, &sgl), ==,
+                    NVME_SUCCESS);
+    nvme_check_data(&t, 1, 4, data, sizeof(data));
+
+    /* And the other way round */
+    qmemset(buf, 0, sizeof(data) + 100);
+    g_assert_cmphex(nvme_rw_sgl(&t, 1, NVME_CMD_READ, 4, 3, &sgl), ==,
+                    NVME_SUCCESS);
+    memread(buf + 100, readback, sizeof(readback));
+    g_assert(memcmp(readback, data, sizeof(data)) == 0);
+
+    guest_free(t.alloc, buf);
+    nvme_stop(&t);
+}
+
+static void test_sgl_segments(void)
+{
+    TestNvme t;
+    NvmeSglDescriptor sgl, seg1[3], seg2[2];
+    uint8_t data[4 * TEST_LBA_SIZE];
+    uint64_t bufs[4], seg1_addr, seg2_addr;
+    int i;
+
+    nvme_start(&t, NULL);
+    nvme_create_io_queues(&t, 1, TEST_QUEUE_SIZE);
+
+    fill_pattern(data, sizeof(data), 2);
+    for (i = 0; i < ARRAY_SIZE(bufs); i++) {
+        bufs[i] = guest_alloc(t.alloc, TEST_LBA_SIZE);
+        memwrite(bufs[i], data + i * TEST_LBA_SIZE, TEST_LBA_SIZE);
+    }
+
+    /* Two data blocks, then a pointer to the last segment with two more.
+     * The first block is split in two descriptors of unequal size. */
+    seg1_addr = guest_alloc(t.alloc, sizeof(seg1));
+    seg2_addr = guest_alloc(t.alloc, sizeof(seg2));
+    nvme_sgl_desc(&seg1[0], NVME_SGL_DESCR_TYPE_DATA_BLOCK, bufs[0], 100);
+    nvme_sgl_desc(&seg1[1], NVME_SGL_DESCR_TYPE_DATA_BLOCK, bufs[0] + 100,
+                  TEST_LBA_SIZE - 100);
+    nvme_sgl_desc(&seg1[2], NVME_SGL_DESCR_TYPE_LAST_SEGMENT, seg2_addr,
+                  sizeof(seg2));
+    nvme_sgl_desc(&seg2[0], NVME_SGL_DESCR_TYPE_DATA_BLOCK, bufs[1],
+                  TEST_LBA_SIZE);
+    nvme_sgl_desc(&seg2[1], NVME_SGL_DESCR_TYPE_DATA_BLOCK, bufs[2],
+                  TEST_LBA_SIZE);
+    memwrite(seg1_addr, seg1, sizeof(seg1));
+    memwrite(seg2_addr, seg2, sizeof(seg2));
+
+    nvme_sgl_desc(&sgl, NVME_SGL_DESCR_TYPE_SEGMENT, seg1_addr, sizeof(seg1));
+    g_assert_cmphex(nvme_rw_sgl(&t, 1, NVME_CMD_WRITE, 16, 3, &sgl), ==,
+                    NVME_SUCCESS);
+    nvme_check_data(&t, 1, 16, data, 3 * TEST_LBA_SIZE);
+
+    /* A last segment straight in the command */
+    nvme_sgl_desc(&seg2[0], NVME_SGL_DESCR_TYPE_DATA_BLOCK, bufs[3],
+                  TEST_LBA_SIZE);
+    nvme_sgl_desc(&seg2[1], NVME_SGL_DESCR_TYPE_DATA_BLOCK, bufs[0],
+                  TEST_LBA_SIZE);
+    memwrite(seg2_addr, seg2, sizeof(seg2));
+    nvme_sgl_desc(&sgl, NVME_SGL_DESCR_TYPE_LAST_SEGMENT, seg2_addr,
+                  sizeof(seg2));
+    g_assert_cmphex(nvme_rw_sgl(&t, 1, NVME_CMD_WRITE, 32, 2, &sgl), ==,
+                    NVME_SUCCESS);
+    memcpy(data + TEST_LBA_SIZE, data, TEST_LBA_SIZE);
+    memcpy(data, data + 3 * TEST_LBA_SIZE, TEST_LBA_SIZE);
+    nvme_check_data(&t, 1, 32, data, 2 * TEST_LBA_SIZE);
+
+    nvme_stop(&t);
+}
+
+static void test_sgl_invalid(void)
+{
+    TestNvme t;
+    NvmeSglDescriptor sgl, seg[2];
+    uint64_t buf, seg_addr;
+
+    nvme_start(&t, NULL);
+    nvme_create_io_queues(&t, 1, TEST_QUEUE_SIZE);
+    buf = guest_alloc(t.alloc, 2 * TEST_LBA_SIZE);
+    seg_addr = guest_alloc(t.alloc, sizeof(seg));
+
+    /* Descriptors shorter or longer than the transfer */
+    nvme_sgl_desc(&sgl, NVME_SGL_DESCR_TYPE_DATA_BLOCK, buf,
+                  TEST_LBA_SIZE - 1);
+    g_assert_cmphex(nvme_rw_sgl(&t, 1, NVME_CMD_READ, 0, 1, &sgl), ==,
+                    NVME_DATA_SGL_LEN_INVALID | NVME_DNR);
+    nvme_sgl_desc(&sgl, NVME_SGL_DESCR_TYPE_DATA_BLOCK, buf,
+                  2 * TEST_LBA_SIZE);
+    g_assert_cmphex(nvme_rw_sgl(&t, 1, NVME_CMD_READ, 0, 1, &sgl), ==,
+                    NVME_DATA_SGL_LEN_INVALID | NVME_DNR);
+
+    /* Bit buckets are not supported */
+    nvme_sgl_desc(&sgl, NVME_SGL_DESCR_TYPE_BIT_BUCKET, 0, TEST_LBA_SIZE);
+    g_assert_cmphex(nvme_rw_sgl(&t, 1, NVME_CMD_READ, 0, 1, &sgl), ==,
+                    NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR);
+
+    /* A segment that only points to itself must not loop forever */
+    nvme_sgl_desc(&seg[0], NVME_SGL_DESCR_TYPE_SEGMENT, seg_addr,
+                  sizeof(seg[0]));
+    memwrite(seg_addr, seg, sizeof(seg[0]));
+    nvme_sgl_desc(&sgl, NVME_SGL_DESCR_TYPE_SEGMENT, seg_addr, sizeof(seg[0]));
+    g_assert_cmphex(nvme_rw_sgl(&t, 1, NVME_CMD_READ, 0, 1, &sgl), ==,
+                    NVME_INVALID_SGL_SEG_DESCR | NVME_DNR);
+
+    /* A segment must end in a pointer to the next one */
+    nvme_sgl_desc(&seg[0], NVME_SGL_DESCR_TYPE_DATA_BLOCK, buf,
+                  TEST_LBA_SIZE);
+    nvme_sgl_desc(&seg[1], NVME_SGL_DESCR_TYPE_DATA_BLOCK, buf,
+                  TEST_LBA_SIZE);
+    memwrite(seg_addr, seg, sizeof(seg));
+    nvme_sgl_desc(&sgl, NVME_SGL_DESCR_TYPE_SEGMENT, seg_addr, sizeof(seg));
+    g_assert_cmphex(nvme_rw_sgl(&t, 1, NVME_CMD_READ, 0, 2, &sgl), ==,
+                    NVME_INVALID_SGL_SEG_DESCR | NVME_DNR);
+
+    /* Segment lengths must be a multiple of the descriptor size */
+    nvme_sgl_desc(&sgl, NVME_SGL_DESCR_TYPE_LAST_SEGMENT, seg_addr,
+                  sizeof(seg) - 1);
+    g_assert_cmphex(nvme_rw_sgl(&t, 1, NVME_CMD_READ, 0, 2, &sgl), ==,
+                    NVME_INVALID_SGL_SEG_DESCR | NVME_DNR);
+
+    /* The queue still works afterwards */
+    nvme_sgl_desc(&sgl, NVME_SGL_DESCR_TYPE_LAST_SEGMENT, seg_addr,
+                  sizeof(seg));
+    g_assert_cmphex(nvme_rw_sgl(&t, 1, NVME_CMD_READ, 0, 2, &sgl), ==,
+                    NVME_SUCCESS);
+
+    nvme_stop(&t);
+}
+
+static uint16_t nvme_dbbuf_config(TestNvme *t, uint64_t dbs, uint64_t eis)
+{
+    NvmeCmd cmd;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_DBBUF_CONFIG;
+    cmd.prp1 = cpu_to_le64(dbs);
+    cmd.prp2 = cpu_to_le64(eis);
+    return nvme_submit(t, 0, &cmd);
+}
+
+static void nvme_setup_dbbuf(TestNvme *t)
+{
+    uint64_t dbs = guest_alloc(t->alloc, 4096);
+    uint64_t eis = guest_alloc(t->alloc, 4096);
+
+    qmemset(dbs, 0, 4096);
+    qmemset(eis, 0, 4096);
+    g_assert_cmphex(nvme_dbbuf_config(t, dbs + 8, eis), ==,
+                    NVME_INVALID_FIELD | NVME_DNR);
+    g_assert_cmphex(nvme_dbbuf_config(t, dbs, 0), ==,
+                    NVME_INVALID_FIELD | NVME_DNR);
+    g_assert_cmphex(nvme_dbbuf_config(t, dbs, eis), ==, NVME_SUCCESS);
+    t->dbs = dbs;
+    t->eis = eis;
+}
+
+/* Run enough single commands through @qid to wrap both of its queues */
+static void nvme_dbbuf_traffic(TestNvme *t, int qid)
+{
+    uint64_t buf = guest_alloc(t->alloc, 2 * 4096);
+    int i;
+
+    for (i = 0; i < 3 * TEST_QUEUE_SIZE; i++) {
+        g_assert_cmphex(nvme_read_prp(t, qid, i, 1, buf), ==, NVME_SUCCESS);
+        /* The controller publishes the tail it has consumed */
+        g_assert_cmpint(readl(t->eis + qid * 8), ==, t->sq[qid].tail);
+    }
+
+    /* Without ever seeing the head through MMIO, the controller must pick
+     * it up from the shadow doorbell or the queue fills up */
+    t->shadow_cq_only = true;
+    for (i = 0; i < 3 * TEST_QUEUE_SIZE; i++) {
+        g_assert_cmphex(nvme_read_prp(t, qid, i, 1, buf), ==, NVME_SUCCESS);
+    }
+    t->shadow_cq_only = false;
+    guest_free(t->alloc, buf);
+}
+
+static void test_dbbuf(gconstpointer opaque)
+{
+    const char *opts = opaque;
+    TestNvme t;
+    NvmeIdCtrl id;
+    NvmeCmd cmd;
+    uint16_t old_tail;
+    uint64_t buf;
+
+    nvme_start(&t, opts);
+    nvme_identify_ctrl(&t, &id);
+    g_assert(le16_to_cpu(id.oacs) & NVME_OACS_DBBUF);
+
+    /* Queue 1 exists before the buffers are configured, queue 2 after */
+    nvme_create_io_queues(&t, 1, TEST_QUEUE_SIZE);
+    nvme_setup_dbbuf(&t);
+    nvme_create_io_queues(&t, 2, TEST_QUEUE_SIZE);
+    nvme_dbbuf_traffic(&t, 1);
+    nvme_dbbuf_traffic(&t, 2);
+
+    /* Only the shadow tail counts, even if the MMIO doorbell is stale */
+    buf = guest_alloc(t.alloc, 4096);
+    nvme_rw_cmd(&cmd, NVME_CMD_READ, 0, 1);
+    cmd.prp1 = cpu_to_le64(buf);
+    old_tail = t.sq[1].tail;
+    nvme_push(&t, 1, &cmd);
+    writel(t.dbs + 8, t.sq[1].tail);
+    nvme_writel(&t, NVME_REG_DBS + 8, old_tail);
+    g_assert_cmphex(nvme_wait(&t, 1), ==, NVME_SUCCESS);
+
+    /* Queues created again after a delete pick the buffers up as well */
+    nvme_delete_io_queues(&t, 2);
+    nvme_create_io_queues(&t, 2, TEST_QUEUE_SIZE);
+    nvme_dbbuf_traffic(&t, 2);
+
+    /* A reset drops the buffers along with the queues */
+    nvme_disable(&t);
+    nvme_enable(&t);
+    nvme_create_io_queues(&t, 1, TEST_QUEUE_SIZE);
+    g_assert_cmphex(nvme_read_prp(&t, 1, 0, 1, buf), ==, NVME_SUCCESS);
+    nvme_setup_dbbuf(&t);
+    nvme_dbbuf_traffic(&t, 1);
+
+    guest_free(t.alloc, buf);
+    nvme_stop(&t);
+}
+
+static void test_cmb(void)
+{
+    TestNvme t;
+    NvmeCmd cmd;
+    NvmeSglDescriptor sgl, seg[2];
+    uint8_t data[4 * 4096], readback[4 * 4096];
+    uint64_t size, cmb, prp_list[3], buf;
+    uint32_t cmbloc, cmbsz;
+    int i;
+
+    nvme_start(&t, ",cmb_size_mb=1");
+
+    cmbloc = nvme_readl(&t, offsetof(NvmeBar, cmbloc));
+    cmbsz = nvme_readl(&t, offsetof(NvmeBar, cmbsz));
+    g_assert_cmpint(NVME_CMBLOC_BIR(cmbloc), ==, 2);
+    g_assert_cmpint(NVME_CMBLOC_OFST(cmbloc), ==, 0);
+    g_assert(NVME_CMBSZ_SQS(cmbsz));
+    g_assert(!NVME_CMBSZ_CQS(cmbsz));
+    g_assert(NVME_CMBSZ_LISTS(cmbsz));
+    g_assert(NVME_CMBSZ_RDS(cmbsz));
+    g_assert(NVME_CMBSZ_WDS(cmbsz));
+    g_assert_cmphex(NVME_CMBSZ_GETSIZE(cmbsz), ==, 1024 * 1024);
+    cmb = (uintptr_t)qpci_iomap(t.dev, 2, &size);
+    g_assert_cmphex(size, ==, NVME_CMBSZ_GETSIZE(cmbsz));
+
+    /* Submission queue at the start of the buffer, a PRP list in the
+     * second page and four data pages after it */
+    nvme_create_io_queues_at(&t, 1, TEST_QUEUE_SIZE, cmb);
+    fill_pattern(data, sizeof(data), 3);
+    memwrite(cmb + 2 * 4096, data, sizeof(data));
+    for (i = 0; i < ARRAY_SIZE(prp_list); i++) {
+        prp_list[i] = cpu_to_le64(cmb + (3 + i) * 4096);
+    }
+    memwrite(cmb + 4096, prp_list, sizeof(prp_list));
+
+    nvme_rw_cmd(&cmd, NVME_CMD_WRITE, 64, sizeof(data) / TEST_LBA_SIZE);
+    cmd.prp1 = cpu_to_le64(cmb + 2 * 4096);
+    cmd.prp2 = cpu_to_le64(cmb + 4096);
+    g_assert_cmphex(nvme_submit(&t, 1, &cmd), ==, NVME_SUCCESS);
+    nvme_check_data(&t, 1, 64, data, 2 * 4096);
+    nvme_check_data(&t, 1, 64 + 16, data + 2 * 4096, 2 * 4096);
+
+    /* Read it back into the buffer through the same PRP list */
+    qmemset(cmb + 2 * 4096, 0, sizeof(data));
+    cmd.opcode = NVME_CMD_READ;
+    g_assert_cmphex(nvme_submit(&t, 1, &cmd), ==, NVME_SUCCESS);
+    memread(cmb + 2 * 4096, readback, sizeof(readback));
+    g_assert(memcmp(readback, data, sizeof(data)) == 0);
+
+    /* An SGL segment in the buffer pointing at host memory */
+    buf = guest_alloc(t.alloc, 2 * TEST_LBA_SIZE);
+    fill_pattern(data, 2 * TEST_LBA_SIZE, 4);
+    memwrite(buf, data, 2 * TEST_LBA_SIZE);
+    nvme_sgl_desc(&seg[0], NVME_SGL_DESCR_TYPE_DATA_BLOCK,
+                  buf + TEST_LBA_SIZE, TEST_LBA_SIZE);
+    nvme_sgl_desc(&seg[1], NVME_SGL_DESCR_TYPE_DATA_BLOCK, buf,
+                  TEST_LBA_SIZE);
+    memwrite(cmb + 4096, seg, sizeof(seg));
+    nvme_sgl_desc(&sgl, NVME_SGL_DESCR_TYPE_LAST_SEGMENT, cmb + 4096,
+                  sizeof(seg));
+    g_assert_cmphex(nvme_rw_sgl(&t, 1, NVME_CMD_WRITE, 128, 2, &sgl), ==,
+                    NVME_SUCCESS);
+    memcpy(readback, data + TEST_LBA_SIZE, TEST_LBA_SIZE);
+    memcpy(readback + TEST_LBA_SIZE, data, TEST_LBA_SIZE);
+    nvme_check_data(&t, 1, 128, readback, 2 * TEST_LBA_SIZE);
+
+    guest_free(t.alloc, buf);
+    nvme_stop(&t);
 }
 
 int main(int argc, char **argv)
 {
-    int ret;
+    int fd, ret;
 
     g_test_init(&argc, &argv, NULL);
+
+    test_image = g_strdup("/tmp/qtest.XXXXXX");
+    fd = mkstemp(test_image);
+    g_assert(fd >= 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert(ret == 0);
+    close(fd);
+
     qtest_add_func("/nvme/nop", nop);
+    qtest_add_func("/nvme/sgl/data-block", test_sgl_data_block);
+    qtest_add_func("/nvme/sgl/segments", test_sgl_segments);
+    qtest_add_func("/nvme/sgl/invalid", test_sgl_invalid);
+    qtest_add_data_func("/nvme/dbbuf/mmio", ",ioeventfd=off", test_dbbuf);
+    qtest_add_data_func("/nvme/dbbuf/ioeventfd", ",ioeventfd=on", test_dbbuf);
+    /* Queue 1 shares the drive's IOThread, queue 2 has its own */
+    qtest_add_data_func("/nvme/iothreads/mmio",
+                        ",ioeventfd=off,queue-iothreads=io0:io1 "
+                        "-object iothread,id=io0 -object iothread,id=io1",
+                        test_dbbuf);
+    /* The drive in an IOThread of its own, the queues in two others */
+    qtest_add_data_func("/nvme/iothreads/ioeventfd",
+                        ",ioeventfd=on,iothread=io0,queue-iothreads=io1:io2 "
+                        "-object iothread,id=io0 -object iothread,id=io1 "
+                        "-object iothread,id=io2",
+                        test_dbbuf);
+    qtest_add_func("/nvme/cmb", test_cmb);
 
-    qtest_start("-drive id=drv0,if=none,file=/dev/null,format=raw "
-                "-device nvme,drive=drv0,serial=foo");
     ret = g_test_run();
 
-    qtest_end();
-
+    unlink(test_image);
+    g_free(test_image);
     return ret;
 }
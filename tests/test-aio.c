@@ -122,7 +122,7 @@ static void *test_acquire_thread(void *opaque)
 static void set_event_notifier(AioContext *ctx, EventNotifier *notifier,
                                EventNotifierHandler *handler)
 {
-    aio_set_event_notifier(ctx, notifier, false, handler);
+    aio_set_event_notifier(ctx, notifier, false, handler, NULL);
 }
 
 static void dummy_notifier_read(EventNotifier *unused)
@@ -382,7 +382,7 @@ static void test_aio_external_client(void)
     for (i = 1; i < 3; i++) {
         EventNotifierTestData data = { .n = 0, .active = 10, .auto_set = true };
         event_notifier_init(&data.e, false);
-        aio_set_event_notifier(ctx, &data.e, true, event_ready_cb);
+        aio_set_event_notifier(ctx, &data.e, true, event_ready_cb, NULL);
         event_notifier_set(&data.e);
         for (j = 0; j < i; j++) {
             aio_disable_external(ctx);
@@ -399,6 +399,48 @@ static void test_aio_external_client(void)
     }
 }
 
+static bool poll_ready_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    EventNotifierTestData *data = container_of(e, EventNotifierTestData, e);
+
+    if (!data->active) {
+        return false;
+    }
+    data->n++;
+    data->active--;
+    return true;
+}
+
+static void test_poll_event_notifier(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 0 };
+
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, false, event_ready_cb, poll_ready_cb);
+    aio_context_set_poll_params(ctx, NANOSECONDS_PER_SECOND, 0, 0,
+                                &error_abort);
+
+    /* The first event is dispatched through the file descriptor, and
+     * arrives quickly enough for the polling time to grow.  */
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(ctx->poll_ns, >, 0);
+
+    /* Now work is picked up by busy polling, without the notifier.  */
+    data.active = 2;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 2);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 3);
+    g_assert_cmpint(data.active, ==, 0);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+    set_event_notifier(ctx, &data.e, NULL);
+    event_notifier_cleanup(&data.e);
+}
+
 static void test_wait_event_notifier_noflush(void)
 {
     EventNotifierTestData data = { .n = 0 };
@@ -856,6 +898,7 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
@@ -413,6 +413,67 @@ static void test_hbitmap_granularity(TestHBitmapData *data,
     g_assert_cmpint(hbitmap_count(data->hb), ==, 2);
 }
 
+static void test_hbitmap_next_zero(TestHBitmapData *data,
+                                   const void *unused)
+{
+    hbitmap_test_init(data, L2 * 2, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2 * 2), ==, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L2 + 5, L2), ==, L2 + 5);
+
+    hbitmap_test_set(data, L1 - 1, L2);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2 * 2), ==, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1 - 1, L2 * 2), ==,
+                    L1 - 1 + L2);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1 + 3, L2 * 2), ==,
+                    L1 - 1 + L2);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1 - 1 + L2, L2), ==,
+                    L1 - 1 + L2);
+
+    hbitmap_test_set(data, L1 - 1 + L2, L2 - L1 + 1);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1, L2 * 2), <, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L2 * 2 - 1, 1), <, 0);
+
+    hbitmap_test_reset(data, L2 * 2 - 1, 1);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1, L2 * 2), ==, L2 * 2 - 1);
+}
+
+static void test_hbitmap_next_zero_bounded(TestHBitmapData *data,
+                                           const void *unused)
+{
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_test_set(data, 0, L3);
+
+    /* A fully set bitmap has no zero anywhere in the searched range */
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L3), <, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, 1), <, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L2 + 3, L1 * 3), <, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L3 - 1, 1), <, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1, 0), <, 0);
+
+    /* A range that stops short of the only zero bit does not find it */
+    hbitmap_test_reset(data, L2, 1);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2), <, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1 + 1, L2 - L1 - 1), <, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2 + 1), ==, L2);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L2, 1), ==, L2);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L2 + 1, L3 - L2 - 1), <, 0);
+
+    /* The range is clamped to the end of the bitmap */
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L2 + 1, UINT64_MAX), <, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1, UINT64_MAX), ==, L2);
+}
+
+static void test_hbitmap_next_zero_granularity(TestHBitmapData *data,
+                                               const void *unused)
+{
+    hbitmap_test_init(data, L2, 4);
+    hbitmap_test_set(data, 20, L1);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2), ==, 0);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 17, L2), ==, 96);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 83, L2), ==, 96);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 101, L2), ==, 101);
+}
+
 static void test_hbitmap_iter_granularity(TestHBitmapData *data,
                                           const void *unused)
 {
@@ -634,6 +695,87 @@ static void test_hbitmap_truncate_shrink_large(TestHBitmapData *data,
     hbitmap_test_truncate(data, size, -diff, 0);
 }
 
+static void test_hbitmap_serialize_granularity(TestHBitmapData *data,
+                                               const void *unused)
+{
+    hbitmap_test_init(data, L3 * 2, 3);
+    g_assert_cmpint(hbitmap_serialization_granularity(data->hb), ==, 64 << 3);
+}
+
+/* Serialize the whole bitmap, check the result bit by bit against the shadow
+ * bitmap, and deserialize it in @chunk sized parts into a new bitmap.
+ */
+static void hbitmap_test_serialize_roundtrip(TestHBitmapData *data,
+                                             uint64_t chunk)
+{
+    uint64_t size = data->size;
+    uint64_t buf_size = hbitmap_serialization_size(data->hb, 0, size);
+    uint8_t *buf = g_malloc0(buf_size);
+    uint64_t i, start, count;
+
+    hbitmap_serialize_part(data->hb, buf, 0, size);
+    for (i = 0; i < size; i++) {
+        size_t pos = i >> LOG_BITS_PER_LONG;
+        int bit = i & (BITS_PER_LONG - 1);
+        bool shadow = data->bits[pos] & (1UL << bit);
+
+        g_assert_cmpint(!!(buf[i / 8] & (1 << (i % 8))), ==, shadow);
+    }
+
+    hbitmap_free(data->hb);
+    data->hb = hbitmap_alloc(size, 0);
+    for (start = 0; start < size; start += chunk) {
+        count = MIN(chunk, size - start);
+        hbitmap_deserialize_part(data->hb,
+                                 buf + hbitmap_serialization_size(data->hb,
+                                                                  0, start),
+                                 start, count, false);
+    }
+    hbitmap_deserialize_finish(data->hb);
+
+    hbitmap_test_check(data, 0);
+    hbitmap_test_check_get(data);
+    g_free(buf);
+}
+
+static void test_hbitmap_serialize_roundtrip(TestHBitmapData *data,
+                                             const void *unused)
+{
+    hbitmap_test_init(data, L3 + 23, 0);
+    hbitmap_test_set(data, 0, 1);
+    hbitmap_test_set(data, L1 - 1, 2);
+    hbitmap_test_set(data, L2 + 5, L1 * 3);
+    hbitmap_test_set(data, L3 - 7, 30);
+
+    hbitmap_test_serialize_roundtrip(data, L3 + 23);
+    hbitmap_test_serialize_roundtrip(data, L2);
+    hbitmap_test_serialize_roundtrip(data,
+                                     hbitmap_serialization_granularity(
+                                         data->hb));
+}
+
+static void test_hbitmap_serialize_zeroes_ones(TestHBitmapData *data,
+                                               const void *unused)
+{
+    hbitmap_test_init(data, L3 + 23, 0);
+    hbitmap_test_set(data, 0, L3 + 23);
+
+    hbitmap_deserialize_zeroes(data->hb, L2, L2, true);
+    hbitmap_test_reset(data, L2, L2);
+    hbitmap_test_check_get(data);
+
+    hbitmap_test_reset_all(data);
+    /* The last chunk is partial; no bits past the end may become set */
+    hbitmap_deserialize_ones(data->hb, L3, 23, true);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 23);
+    hbitmap_test_set(data, L3, 23);
+    hbitmap_test_check_get(data);
+
+    hbitmap_deserialize_ones(data->hb, 0, L3 + 23, true);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, L3 + 23);
+    hbitmap_test_set(data, 0, L3 + 23);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -661,6 +803,11 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/reset/all", test_hbitmap_reset_all);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/next_zero/general", test_hbitmap_next_zero);
+    hbitmap_test_add("/hbitmap/next_zero/granularity",
+                     test_hbitmap_next_zero_granularity);
+    hbitmap_test_add("/hbitmap/next_zero/bounded",
+                     test_hbitmap_next_zero_bounded);
 
     hbitmap_test_add("/hbitmap/truncate/nop", test_hbitmap_truncate_nop);
     hbitmap_test_add("/hbitmap/truncate/grow/negligible",
@@ -683,6 +830,13 @@ int main(int argc, char **argv)
                      test_hbitmap_truncate_grow_large);
     hbitmap_test_add("/hbitmap/truncate/shrink/large",
                      test_hbitmap_truncate_shrink_large);
+
+    hbitmap_test_add("/hbitmap/serialize/granularity",
+                     test_hbitmap_serialize_granularity);
+    hbitmap_test_add("/hbitmap/serialize/roundtrip",
+                     test_hbitmap_serialize_roundtrip);
+    hbitmap_test_add("/hbitmap/serialize/zeroes-ones",
+                     test_hbitmap_serialize_zeroes_ones);
     g_test_run();
 
     return 0;
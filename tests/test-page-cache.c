@@ -0,0 +1,194 @@
+/*
+ * Page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+#define NUM_PAGES 64
+
+static uint8_t page[PAGE_SIZE];
+
+static void test_insert_lookup(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    PageCacheStats stats;
+    uint64_t addr;
+
+    g_assert(cache);
+
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(!cache_is_cached(cache, addr, 1));
+        memset(page, addr / PAGE_SIZE, PAGE_SIZE);
+        g_assert(cache_insert(cache, addr, page, 1) == 0);
+    }
+
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr, 1));
+        g_assert(get_cached_data(cache, addr)[0] == addr / PAGE_SIZE);
+    }
+    g_assert(get_cached_data(cache, NUM_PAGES * PAGE_SIZE) == NULL);
+
+    cache_get_stats(cache, &stats, true);
+    g_assert_cmpint(stats.hits, ==, NUM_PAGES);
+    g_assert_cmpint(stats.misses, ==, NUM_PAGES);
+    g_assert_cmpint(stats.evictions, ==, 0);
+
+    cache_get_stats(cache, &stats, false);
+    g_assert_cmpint(stats.hits, ==, 0);
+
+    cache_fini(cache);
+}
+
+/* Pages that map to the same set must not evict each other while there
+ * are free ways, and fresh pages must not be evicted at all */
+static void test_collisions(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    PageCacheStats stats;
+    uint64_t stride = NUM_PAGES * PAGE_SIZE;
+    uint64_t i;
+
+    for (i = 0; i < 4; i++) {
+        g_assert(cache_insert(cache, i * stride, page, 1) == 0);
+    }
+    for (i = 0; i < 4; i++) {
+        g_assert(cache_is_cached(cache, i * stride, 1));
+    }
+
+    /* Fill every slot with pages that are still fresh */
+    for (i = 0; i < NUM_PAGES * 4; i++) {
+        cache_insert(cache, i * PAGE_SIZE + 4 * stride, page, 1);
+    }
+    for (i = 0; i < 4; i++) {
+        g_assert(cache_is_cached(cache, i * stride, 1));
+    }
+    cache_get_stats(cache, &stats, true);
+    g_assert_cmpint(stats.evictions, ==, 0);
+
+    cache_fini(cache);
+}
+
+/* Once pages go stale, the ones that were hit recently survive */
+static void test_replacement(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    PageCacheStats stats;
+    uint64_t addr, hot = 0;
+    uint64_t age = 1;
+
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_insert(cache, addr, page, age) == 0);
+    }
+
+    /* Keep page 0 hot over several generations */
+    for (age = 2; age < 6; age++) {
+        g_assert(cache_is_cached(cache, hot, age));
+    }
+
+    /* Everything else is stale by now; a new set of pages replaces them */
+    for (addr = NUM_PAGES * PAGE_SIZE; addr < 2 * NUM_PAGES * PAGE_SIZE;
+         addr += PAGE_SIZE) {
+        cache_insert(cache, addr, page, age);
+    }
+    g_assert(cache_is_cached(cache, hot, age));
+
+    cache_get_stats(cache, &stats, false);
+    g_assert_cmpint(stats.evictions, ==, NUM_PAGES - 1);
+
+    cache_fini(cache);
+}
+
+/* Within one set, the stale way with the fewest decayed hits is replaced,
+ * the oldest one on a tie, and fresh ways never are */
+static void test_replacement_set(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    PageCacheStats stats;
+    /* All multiples of the stride land in the same set of 8 ways */
+    uint64_t stride = NUM_PAGES * PAGE_SIZE;
+    uint64_t i, j;
+
+    for (i = 0; i < 8; i++) {
+        g_assert(cache_insert(cache, i * stride, page, 1) == 0);
+    }
+    /* Way i is hit 4 * (i + 1) times, except for way 5 */
+    for (i = 0; i < 8; i++) {
+        for (j = 0; i != 5 && j < 4 * (i + 1); j++) {
+            g_assert(cache_is_cached(cache, i * stride, 1));
+        }
+    }
+
+    /* Everything is stale two generations later; way 5 has no hits */
+    g_assert(cache_insert(cache, 8 * stride, page, 3) == 0);
+    g_assert(get_cached_data(cache, 5 * stride) == NULL);
+    for (i = 0; i < 9; i++) {
+        g_assert(i == 5 || get_cached_data(cache, i * stride) != NULL);
+    }
+
+    /* By age 6 the hits have decayed to nothing but for page 7.  Page 0 is
+     * hit again and stays, the oldest page without hits goes: page 1. */
+    g_assert(cache_is_cached(cache, 0, 6));
+    g_assert(cache_insert(cache, 9 * stride, page, 6) == 0);
+    g_assert(get_cached_data(cache, 1 * stride) == NULL);
+    g_assert(get_cached_data(cache, 0) != NULL);
+    g_assert(get_cached_data(cache, 7 * stride) != NULL);
+    g_assert(get_cached_data(cache, 8 * stride) != NULL);
+    g_assert(get_cached_data(cache, 9 * stride) != NULL);
+
+    /* With every way fresh, a new page for the set is not cached at all */
+    for (i = 0; i < 10; i++) {
+        if (get_cached_data(cache, i * stride)) {
+            g_assert(cache_is_cached(cache, i * stride, 6));
+        }
+    }
+    g_assert(cache_insert(cache, 10 * stride, page, 6) == -1);
+    g_assert(get_cached_data(cache, 10 * stride) == NULL);
+
+    cache_get_stats(cache, &stats, false);
+    g_assert_cmpint(stats.evictions, ==, 2);
+
+    cache_fini(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    uint64_t addr;
+
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        memset(page, addr / PAGE_SIZE, PAGE_SIZE);
+        g_assert(cache_insert(cache, addr, page, 1) == 0);
+    }
+
+    g_assert_cmpint(cache_resize(cache, NUM_PAGES * 2), ==, NUM_PAGES * 2);
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr, 1));
+        g_assert(get_cached_data(cache, addr)[0] == addr / PAGE_SIZE);
+    }
+
+    g_assert_cmpint(cache_resize(cache, 4), ==, 4);
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        if (cache_is_cached(cache, addr, 1)) {
+            g_assert(get_cached_data(cache, addr)[0] == addr / PAGE_SIZE);
+        }
+    }
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/insert_lookup", test_insert_lookup);
+    g_test_add_func("/page-cache/collisions", test_collisions);
+    g_test_add_func("/page-cache/replacement", test_replacement);
+    g_test_add_func("/page-cache/replacement_set", test_replacement_set);
+    g_test_add_func("/page-cache/resize", test_resize);
+
+    return g_test_run();
+}
@@ -587,6 +587,30 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_coalesce_deadline(void)
+{
+    int64_t now = 1000000007;
+    int64_t deadline, ret;
+
+    /* short waits are left alone */
+    g_assert(throttle_coalesce_deadline(now, now) == now);
+    g_assert(throttle_coalesce_deadline(now, now + 15) == now + 15);
+
+    /* the slack is a power of two no larger than an eighth of the wait */
+    deadline = now + 80000;
+    ret = throttle_coalesce_deadline(now, deadline);
+    g_assert(ret >= deadline);
+    g_assert(ret - deadline < 8192);
+    g_assert(ret % 8192 == 0);
+
+    /* ... and never larger than about a millisecond */
+    deadline = now + 10 * NANOSECONDS_PER_SECOND;
+    ret = throttle_coalesce_deadline(now, deadline);
+    g_assert(ret >= deadline);
+    g_assert(ret - deadline < (1 << 20));
+    g_assert(ret % (1 << 20) == 0);
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -617,6 +641,22 @@ static void test_groups(void)
     g_assert(!strcmp(throttle_group_get_name(blk2), "foo"));
     g_assert(blkp1->throttle_state == blkp3->throttle_state);
 
+    /* Weights are per member and survive a change of group */
+    g_assert(throttle_group_get_weight(blk1) == THROTTLE_GROUP_WEIGHT_DEFAULT);
+    throttle_group_set_weight(blk1, 4);
+    g_assert(throttle_group_get_weight(blk1) == 4);
+    g_assert(throttle_group_get_weight(blk3) == THROTTLE_GROUP_WEIGHT_DEFAULT);
+    throttle_group_unregister_blk(blk1);
+    throttle_group_register_blk(blk1, "foo");
+    g_assert(!strcmp(throttle_group_get_name(blk1), "foo"));
+    g_assert(blkp1->throttle_state == blkp2->throttle_state);
+    g_assert(throttle_group_get_weight(blk1) == 4);
+    g_assert(throttle_group_get_weight(blk2) == THROTTLE_GROUP_WEIGHT_DEFAULT);
+    throttle_group_unregister_blk(blk1);
+    throttle_group_register_blk(blk1, "bar");
+    g_assert(blkp1->throttle_state == blkp3->throttle_state);
+    g_assert(throttle_group_get_weight(blk1) == 4);
+
     /* Setting the config of a group member affects the whole group */
     throttle_config_init(&cfg1);
     cfg1.buckets[THROTTLE_BPS_READ].avg  = 500000;
@@ -672,6 +712,7 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/coalesce_deadline",  test_coalesce_deadline);
     g_test_add_func("/throttle/groups",             test_groups);
     return g_test_run();
 }
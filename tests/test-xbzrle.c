@@ -174,6 +174,48 @@ static void test_encode_decode(void)
     }
 }
 
+/* Runs starting and ending at every offset exercise the tails of the
+ * vectorized run-finding loops */
+static void test_encode_decode_random(void)
+{
+    uint8_t *buffer = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *test = g_malloc(PAGE_SIZE);
+    int i, j, rc, dlen;
+
+    for (i = 0; i < 10000; i++) {
+        int nchanges = g_test_rand_int_range(1, 64);
+
+        for (j = 0; j < PAGE_SIZE; j++) {
+            buffer[j] = g_test_rand_int();
+        }
+        memcpy(test, buffer, PAGE_SIZE);
+        for (j = 0; j < nchanges; j++) {
+            int off = g_test_rand_int_range(0, PAGE_SIZE);
+            int len = g_test_rand_int_range(1, MIN(PAGE_SIZE - off, 100) + 1);
+
+            while (len--) {
+                test[off++] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+
+        dlen = xbzrle_encode_buffer(buffer, test, PAGE_SIZE, compressed,
+                                    PAGE_SIZE);
+        if (dlen == -1) {
+            continue;
+        }
+        g_assert(dlen > 0);
+
+        rc = xbzrle_decode_buffer(compressed, dlen, buffer, PAGE_SIZE);
+        g_assert(rc > 0 && rc <= PAGE_SIZE);
+        g_assert(memcmp(test, buffer, PAGE_SIZE) == 0);
+    }
+
+    g_free(buffer);
+    g_free(compressed);
+    g_free(test);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +228,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_random", test_encode_decode_random);
 
     return g_test_run();
 }
@@ -0,0 +1,140 @@
+/*
+ * Xor Based Zero Run Length Encoding micro-benchmark
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
+#include "include/migration/migration.h"
+
+#define PAGE_SIZE 4096
+#define N_PAGES 256
+
+static unsigned int duration = 1;
+static unsigned int seed = 1;
+
+static const char commands_string[] =
+    " -d = duration of each run, in seconds\n"
+    " -s = random seed\n";
+
+static void usage_complete(int argc, char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+/* Same layout as encode_decode_range() in test-xbzrle.c: one long run of
+ * modified bytes plus two isolated ones after it */
+static void fill_range(uint8_t *old_buf, uint8_t *new_buf)
+{
+    int diff_len = rand() % (PAGE_SIZE - 1006);
+    int i;
+
+    for (i = diff_len; i > 0; i--) {
+        old_buf[1000 + i] = i;
+        new_buf[1000 + i] = i + 4;
+    }
+    old_buf[1000 + diff_len + 3] = 103;
+    new_buf[1000 + diff_len + 3] = 107;
+    old_buf[1000 + diff_len + 5] = 105;
+    new_buf[1000 + diff_len + 5] = 109;
+}
+
+/* A few scattered words changed, the typical case for XBZRLE */
+static void fill_sparse(uint8_t *old_buf, uint8_t *new_buf)
+{
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        int off = rand() % (PAGE_SIZE - 8);
+
+        stq_he_p(new_buf + off, ldq_he_p(old_buf + off) + rand() + 1);
+    }
+}
+
+/* Nothing changed at all */
+static void fill_unchanged(uint8_t *old_buf, uint8_t *new_buf)
+{
+}
+
+static void run(const char *name,
+                void (*fill)(uint8_t *old_buf, uint8_t *new_buf))
+{
+    uint8_t *old_buf = g_malloc0(N_PAGES * PAGE_SIZE);
+    uint8_t *new_buf = g_malloc0(N_PAGES * PAGE_SIZE);
+    uint8_t *dst = g_malloc(PAGE_SIZE);
+    uint64_t pages = 0, encoded = 0;
+    int64_t start, end, now;
+    int i;
+
+    for (i = 0; i < N_PAGES * PAGE_SIZE; i++) {
+        old_buf[i] = rand();
+    }
+    memcpy(new_buf, old_buf, N_PAGES * PAGE_SIZE);
+    for (i = 0; i < N_PAGES; i++) {
+        fill(old_buf + i * PAGE_SIZE, new_buf + i * PAGE_SIZE);
+    }
+
+    start = get_clock_realtime();
+    end = start + duration * NANOSECONDS_PER_SECOND;
+    do {
+        for (i = 0; i < N_PAGES; i++) {
+            int ret = xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                           new_buf + i * PAGE_SIZE,
+                                           PAGE_SIZE, dst, PAGE_SIZE);
+            encoded += MAX(ret, 0);
+        }
+        pages += N_PAGES;
+        now = get_clock_realtime();
+    } while (now < end);
+
+    printf("%-10s %10.2f MB/s %12.2f pages/s %8.1f bytes/page\n", name,
+           (double)pages * PAGE_SIZE / (now - start) *
+           NANOSECONDS_PER_SECOND / (1024 * 1024),
+           (double)pages / (now - start) * NANOSECONDS_PER_SECOND,
+           (double)encoded / pages);
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(dst);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "d:hs:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'h':
+            usage_complete(argc, argv);
+            exit(0);
+        case 's':
+            seed = atoi(optarg);
+            break;
+        default:
+            usage_complete(argc, argv);
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    parse_args(argc, argv);
+    srand(seed);
+
+    run("range", fill_range);
+    run("sparse", fill_sparse);
+    run("unchanged", fill_unchanged);
+    return 0;
+}
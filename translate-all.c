@@ -119,38 +119,31 @@ static void *l1_map[V_L1_SIZE];
 
 /* code generation context */
 TCGContext tcg_ctx;
+bool parallel_cpus;
 
 /* translation block context */
-#ifdef CONFIG_USER_ONLY
 __thread int have_tb_lock;
-#endif
 
 void tb_lock(void)
 {
-#ifdef CONFIG_USER_ONLY
     assert(!have_tb_lock);
     qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
     have_tb_lock++;
-#endif
 }
 
 void tb_unlock(void)
 {
-#ifdef CONFIG_USER_ONLY
     assert(have_tb_lock);
     have_tb_lock--;
     qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
-#endif
 }
 
 void tb_lock_reset(void)
 {
-#ifdef CONFIG_USER_ONLY
     if (have_tb_lock) {
         qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
         have_tb_lock = 0;
     }
-#endif
 }
 
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
@@ -298,7 +291,15 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
 bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
 {
     TranslationBlock *tb;
+    bool locked = have_tb_lock;
+    bool r = false;
 
+    /* The TB array may be growing under our feet when other vCPUs are
+     * translating; some callers (SMC, I/O recompile) already hold the lock.
+     */
+    if (!locked) {
+        tb_lock();
+    }
     tb = tb_find_pc(retaddr);
     if (tb) {
         cpu_restore_state_from_tb(cpu, tb, retaddr);
@@ -307,9 +308,12 @@ bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
             tb_phys_invalidate(tb, -1);
             tb_free(tb);
         }
-        return true;
+        r = true;
     }
-    return false;
+    if (!locked) {
+        tb_unlock();
+    }
+    return r;
 }
 
 void page_size_init(void)
@@ -773,6 +777,7 @@ static TranslationBlock *tb_alloc(target_ulong pc)
     tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+    tb->invalid = false;
     return tb;
 }
 
@@ -830,13 +835,12 @@ static void page_flush_tb(void)
     }
 }
 
-/* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUState *cpu)
+/* flush all the translation blocks.  Callers must either hold tb_lock
+ * or otherwise guarantee that no other thread is translating or executing
+ * generated code.
+ */
+static void do_tb_flush(CPUState *cpu)
 {
-    if (!tcg_enabled()) {
-        return;
-    }
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
            (unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer),
@@ -861,7 +865,42 @@ void tb_flush(CPUState *cpu)
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
-    tcg_ctx.tb_ctx.tb_flush_count++;
+    atomic_mb_set(&tcg_ctx.tb_ctx.tb_flush_count,
+                  tcg_ctx.tb_ctx.tb_flush_count + 1);
+}
+
+#ifdef CONFIG_SOFTMMU
+/* Run from async_safe_run_on_cpu: all other vCPUs are outside cpu_exec.
+ * Several vCPUs may request a flush at the same time; only the first
+ * request for a given flush count does the work.
+ */
+static void do_tb_flush_safe(void *data)
+{
+    unsigned flush_count = (uintptr_t)data;
+
+    tb_lock();
+    if (tcg_ctx.tb_ctx.tb_flush_count == flush_count) {
+        do_tb_flush(first_cpu);
+    }
+    tb_unlock();
+}
+#endif
+
+void tb_flush(CPUState *cpu)
+{
+    if (!tcg_enabled()) {
+        return;
+    }
+#ifdef CONFIG_SOFTMMU
+    if (qemu_tcg_mttcg_enabled()) {
+        unsigned flush_count = atomic_mb_read(&tcg_ctx.tb_ctx.tb_flush_count);
+
+        async_safe_run_on_cpu(cpu ? cpu : first_cpu, do_tb_flush_safe,
+                              (void *)(uintptr_t)flush_count);
+        return;
+    }
+#endif
+    do_tb_flush(cpu);
 }
 
 #ifdef DEBUG_TB_CHECK
@@ -990,6 +1029,11 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     uint32_t h;
     tb_page_addr_t phys_pc;
 
+    /* Lock-free lookups may still find the TB until it is unlinked
+     * everywhere; make sure they reject it.
+     */
+    atomic_set(&tb->invalid, true);
+
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
     h = tb_hash_func(phys_pc, tb->pc, tb->flags);
@@ -1010,8 +1054,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
     CPU_FOREACH(cpu) {
-        if (cpu->tb_jmp_cache[h] == tb) {
-            cpu->tb_jmp_cache[h] = NULL;
+        if (atomic_read(&cpu->tb_jmp_cache[h]) == tb) {
+            atomic_set(&cpu->tb_jmp_cache[h], NULL);
         }
     }
 
@@ -1166,6 +1210,13 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
  buffer_overflow:
         /* flush must be done */
         tb_flush(cpu);
+        if (qemu_tcg_mttcg_enabled()) {
+            /* The flush is deferred until every vCPU has left its
+             * execution loop; go back there and retry the translation.
+             */
+            cpu->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(cpu);
+        }
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         assert(tb != NULL);
@@ -1551,7 +1602,9 @@ void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr)
         return;
     }
     ram_addr = memory_region_get_ram_addr(mr) + addr;
+    tb_lock();
     tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
+    tb_unlock();
     rcu_read_unlock();
 }
 #endif /* !defined(CONFIG_USER_ONLY) */
@@ -1592,6 +1645,7 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     target_ulong pc, cs_base;
     uint32_t flags;
 
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (!tb) {
         cpu_abort(cpu, "cpu_io_recompile: could not find TB for pc=%p",
@@ -1643,6 +1697,7 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     /* FIXME: In theory this could raise an exception.  In practice
        we have already translated the block once so it's probably ok.  */
     tb_gen_code(cpu, pc, cs_base, flags, cflags);
+    tb_unlock();
     /* TODO: If env->pc != tb->pc (i.e. the faulting instruction was not
        the first in the TB) then we end up generating a whole new TB and
        repeating the fault, which is horribly inefficient.
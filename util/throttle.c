@@ -26,8 +26,12 @@
 #include "qapi/error.h"
 #include "qemu/throttle.h"
 #include "qemu/timer.h"
+#include "qemu/host-utils.h"
 #include "block/aio.h"
 
+/* Upper bound for the slack added to throttling timers, about 1 ms */
+#define THROTTLE_TIMER_SLACK_MAX_NS (1LL << 20)
+
 /* This function make a bucket leak
  *
  * @bkt:   the bucket to make leak
@@ -424,6 +428,28 @@ void throttle_get_config(ThrottleState *ts, ThrottleConfig *cfg)
 }
 
 
+/* Round a timer deadline up to a multiple of a power-of-two slack so that
+ * the timers of many throttled devices tend to expire at the same instant
+ * and are serviced by a single event loop wakeup.  The slack is at most an
+ * eighth of the wait, so the configured rates are still met: the buckets
+ * simply leak a little more before the next request is let through.
+ *
+ * @now:      the current clock timestamp
+ * @deadline: the exact expiry time
+ * @ret:      the coalesced expiry time
+ */
+int64_t throttle_coalesce_deadline(int64_t now, int64_t deadline)
+{
+    int64_t slack = MIN((deadline - now) / 8, THROTTLE_TIMER_SLACK_MAX_NS);
+
+    if (slack <= 1) {
+        return deadline;
+    }
+
+    slack = pow2floor(slack);
+    return ROUND_UP(deadline, slack);
+}
+
 /* Schedule the read or write timer if needed
  *
  * NOTE: this function is not unit tested due to it's usage of timer_mod
@@ -456,7 +482,8 @@ bool throttle_schedule_timer(ThrottleState *ts,
     }
 
     /* request throttled and timer not pending -> arm timer */
-    timer_mod(tt->timers[is_write], next_timestamp);
+    timer_mod(tt->timers[is_write],
+              throttle_coalesce_deadline(now, next_timestamp));
     return true;
 }
 